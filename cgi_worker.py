@@ -0,0 +1,127 @@
+"""
+Warm Python worker for `cgi_pool` locations.
+
+webserv starts a few of these per location and hands each one end of a
+socketpair as fd 0. Requests come in over it as FastCGI records, one at a
+time. Each script runs in this interpreter with the same CGI environment a
+forked script would get (os.environ, stdin, stdout, exit status), so imports
+are paid once per worker instead of once per request. webserv closes the
+socket to retire a worker, which then exits.
+"""
+
+import io
+import os
+import runpy
+import socket
+import struct
+import sys
+import traceback
+
+BEGIN_REQUEST, ABORT_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT, STDERR = 1, 2, 3, 4, 5, 6, 7
+
+
+def record(kind, req_id, content=b""):
+    out = []
+    for off in range(0, max(len(content), 1), 65535):
+        chunk = content[off:off + 65535]
+        pad = -len(chunk) % 8
+        out.append(struct.pack("!BBHHBx", 1, kind, req_id, len(chunk), pad) + chunk + b"\0" * pad)
+    return b"".join(out)
+
+
+def pairs(data):
+    out, off = {}, 0
+    while off < len(data):
+        lengths = []
+        for _ in range(2):
+            if data[off] & 0x80:
+                lengths.append(struct.unpack("!I", data[off:off + 4])[0] & 0x7fffffff)
+                off += 4
+            else:
+                lengths.append(data[off])
+                off += 1
+        name = data[off:off + lengths[0]].decode("latin-1")
+        value = data[off + lengths[0]:off + lengths[0] + lengths[1]].decode("latin-1")
+        out[name] = value
+        off += lengths[0] + lengths[1]
+    return out
+
+
+class RecordWriter(io.RawIOBase):
+    """The script's stdout: what it writes goes out as STDOUT records."""
+
+    def __init__(self, sock, req_id):
+        super().__init__()
+        self.sock, self.req_id = sock, req_id
+
+    def writable(self):
+        return True
+
+    def write(self, b):
+        if b:
+            self.sock.sendall(record(STDOUT, self.req_id, bytes(b)))
+        return len(b)
+
+
+def run(sock, req_id, params, body):
+    environ, argv = dict(os.environ), sys.argv
+    raw = RecordWriter(sock, req_id)
+    stdout = io.TextIOWrapper(io.BufferedWriter(raw, 65536), write_through=False)
+    os.environ.clear()
+    os.environ.update(params)
+    script = params.get("SCRIPT_FILENAME", "")
+    sys.argv = [script]
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body))
+    sys.stdout = stdout
+    status = 0
+    try:
+        runpy.run_path(script, run_name="__main__")
+    except SystemExit as e:
+        status = e.code if isinstance(e.code, int) else (0 if e.code is None else 1)
+    except BaseException:  # pylint: disable=broad-except
+        sock.sendall(record(STDERR, req_id, traceback.format_exc().encode()))
+        status = 1
+    finally:
+        try:
+            stdout.flush()
+        except ValueError:
+            pass
+        sys.stdout, sys.stdin = sys.__stdout__, sys.__stdin__
+        sys.argv = argv
+        os.environ.clear()
+        os.environ.update(environ)
+    sock.sendall(record(STDOUT, req_id) + record(END_REQUEST, req_id, struct.pack("!IB3x", status, 0)))
+
+
+def main():
+    sock = socket.socket(fileno=0)
+    buf = b""
+    req_id, params, body = 0, b"", b""
+    while True:
+        data = sock.recv(65536)
+        if not data:
+            return
+        buf += data
+        while len(buf) >= 8:
+            _, kind, rid, length, pad = struct.unpack("!BBHHBx", buf[:8])
+            if len(buf) < 8 + length + pad:
+                break
+            content, buf = buf[8:8 + length], buf[8 + length + pad:]
+            if kind == BEGIN_REQUEST:
+                req_id, params, body = rid, b"", b""
+            elif rid != req_id:
+                continue
+            elif kind == PARAMS:
+                params += content
+            elif kind == STDIN and content:
+                body += content
+            elif kind == STDIN:
+                run(sock, req_id, pairs(params), body)
+                req_id = 0
+            elif kind == ABORT_REQUEST:
+                sock.sendall(record(END_REQUEST, req_id, struct.pack("!IB3x", 0, 0)))
+                req_id = 0
+
+
+if __name__ == "__main__":
+    main()
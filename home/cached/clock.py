@@ -0,0 +1,18 @@
+import os
+import sys
+import time
+
+print("Content-Type: text/plain")
+query = os.environ.get("QUERY_STRING", "")
+if "no-store" in query:
+    print("Cache-Control: no-store")
+if "no-cache" in query:
+    print("Cache-Control: no-cache")
+if "login" in query:
+    print(f"Set-Cookie: session={os.getpid()}")
+print()
+print(f"time={time.time():.6f}")
+print(f"pid={os.getpid()}")
+print(f"cookie={os.environ.get('HTTP_COOKIE', '')}")
+sys.stdout.flush()
+time.sleep(0.2)
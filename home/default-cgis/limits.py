@@ -0,0 +1,6 @@
+import resource
+
+print("Content-Type: text/plain")
+print()
+print(f"RLIMIT_AS={resource.getrlimit(resource.RLIMIT_AS)[0]}")
+print(f"RLIMIT_CPU={resource.getrlimit(resource.RLIMIT_CPU)[0]}")
@@ -0,0 +1,7 @@
+import os
+
+print("Content-Type: text/plain")
+print()
+print(f"REMOTE_ADDR={os.environ.get('REMOTE_ADDR', '')}")
+print(f"SERVER_PORT={os.environ.get('SERVER_PORT', '')}")
+print(f"HTTPS={os.environ.get('HTTPS', '')}")
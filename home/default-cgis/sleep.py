@@ -0,0 +1,7 @@
+import os
+import time
+
+time.sleep(float(os.environ.get("QUERY_STRING") or 1))
+print("Content-Type: text/plain")
+print()
+print(f"slept in {os.getpid()}")
@@ -0,0 +1,9 @@
+import signal
+import time
+
+# Ignores SIGTERM, only SIGKILL gets rid of it
+signal.signal(signal.SIGTERM, signal.SIG_IGN)
+time.sleep(60)
+print("Content-Type: text/plain")
+print()
+print("too late")
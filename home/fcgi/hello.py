@@ -0,0 +1,10 @@
+import os
+import sys
+
+body = sys.stdin.read()
+print("Content-Type: text/plain")
+print()
+print("Hello from FastCGI!")
+print(f"method={os.environ.get('REQUEST_METHOD', '')}")
+print(f"query={os.environ.get('QUERY_STRING', '')}")
+print(f"body={body}")
@@ -0,0 +1,6 @@
+import sys
+
+print("Content-Type: text/plain")
+print()
+for i in range(4096):
+    sys.stdout.write("x" * 1023 + "\n")
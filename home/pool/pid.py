@@ -0,0 +1,9 @@
+import os
+import sys
+
+body = sys.stdin.read()
+print("Content-Type: text/plain")
+print()
+print(f"pid={os.getpid()}")
+print(f"method={os.environ.get('REQUEST_METHOD', '')}")
+print(f"body={body}")
@@ -0,0 +1,25 @@
+#pragma once
+
+# include <string>
+# include <cstdint>
+
+/* cgi_cache: complete responses of GET scripts, kept in memory per
+ * location for a few seconds so a busy endpoint does not start an
+ * interpreter for every hit. Keyed by method, host, path and query;
+ * requests with credentials (Cookie, Authorization) are left alone.
+ * The script has the last word through Cache-Control (no-store,
+ * max-age, stale-while-revalidate). Each location's cache has a size
+ * cap, the least recently used responses go first. */
+
+class HttpConnectionHandler;
+
+constexpr uint64_t	CGI_CACHE_REFRESH_LEASE_MS = 5 * 1000; // A refresh that did not report back by then is retried
+constexpr size_t	CGI_CACHE_MAX_ENTRY_SHARE = 8; // One response takes at most 1/8 of its location's cache
+
+bool		cgiCacheServe(HttpConnectionHandler &handler);
+void		cgiCacheStore(HttpConnectionHandler &handler);
+void		cgiCacheRelease(HttpConnectionHandler &handler);
+void		cgiCacheFlush();
+std::string	cgiCacheStats();
+std::string	cgiRequestKey(const HttpConnectionHandler &handler);
+bool		cgiRequestIsPrivate(const HttpConnectionHandler &handler);
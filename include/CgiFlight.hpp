@@ -0,0 +1,40 @@
+#pragma once
+
+# include <string>
+# include <vector>
+# include <cstdint>
+
+/* cgi_coalesce: GET requests identical to one whose script is running
+ * (same key as cgi_cache) do not start the script again. They follow
+ * the running one instead, its leader, and get a copy of everything it
+ * sends: what was already framed when they joined, then the rest as it
+ * comes. Works with or without cgi_cache. Requests with Cookie or
+ * Authorization never share, and a response with Set-Cookie or
+ * Cache-Control: private or no-store is not shared either: its
+ * followers run their own script. */
+
+struct Endpoint;
+
+constexpr size_t	CGI_FLIGHT_HISTORY_MAX = 1 << 20; // Past this much output, late requests run their own script
+constexpr size_t	CGI_FLIGHT_LAG_MAX = 2 << 20; // A follower this far behind is dropped
+constexpr size_t	CGI_FLIGHT_PRIVATE_MAX = 1024; // Keys remembered as answered per client
+
+struct CgiFollower {
+	Endpoint	*client;
+	bool		started; // Part of the response went to it already
+};
+
+struct CgiFlight {
+	std::string					key;
+	Endpoint					*leader;
+	std::vector<CgiFollower>	followers;
+	std::string					pending; // Framed by the leader, not copied to followers yet
+	std::string					history; // All the leader framed, for late joiners
+	bool						open; // Still takes followers
+};
+
+bool		cgiFollow(Endpoint *client);
+void		cgiLead(Endpoint *client);
+void		cgiFlightForward(Endpoint *leader, int qfd);
+void		cgiFlightLand(Endpoint *client, int qfd, bool complete, int error);
+std::string	cgiFlightStats();
@@ -6,35 +6,39 @@
 #include <fcntl.h>
 #include <iostream>
 #include <cstdlib>
+#include "HandlerStatus.hpp"
 
 class HttpConnectionHandler;
 
+constexpr int CGI_PIPE_SIZE = 1 << 20; // Capped by /proc/sys/fs/pipe-max-size
+/* Script output waiting for a slow client: reading stops above the high
+ * mark, so the pipe fills up and the script blocks, and resumes below
+ * the low one. */
+constexpr size_t CGI_OUTPUT_HIGH_WATER = 256 * 1024;
+constexpr size_t CGI_OUTPUT_LOW_WATER = 64 * 1024;
+
 enum CgiTypes
 {
 	PYTHON,
 	PHP,
+	PROXY, // Everything in a proxy_pass location, see Proxy
 	NONE
 };
 
 class CgiHandler
 {
 	private:
+		/* Per request; the rest of the environment comes ready-made
+		 * from the location, see LocationBlock::cgiEnv */
 		std::string _contentLength;
 		std::string _contentType;
-		std::string _gatewayInterface;
 		std::string _pathInfo;
 		std::string _queryString;
-		std::string _remoteAddr;
 		std::string _requestMethod;
 		std::string _scriptFileName;
 		std::string	_scriptName;
-		std::string _redirectStatus;
-		std::string	_serverName;
-		std::string	_serverPort;
-		std::string _serverProtocol;
 		std::string _cookie;
-
-		std::string _pathToInterpreter;
+		std::string _remoteAddr;
 
 		char 		*_execveArgs[3] = {};
 		char 		*_execveEnv[16] = {};
@@ -43,7 +47,12 @@ class CgiHandler
 		int  		_pipeFromCgi[2];
 		std::string _postData;  // data to send to CGI process, if any
 		size_t		_postDataOffset = 0; // How many bytes have been written so far
+		bool		_postDataComplete = false; // The whole body has been handed over
 		int			_waitpidRes;
+		int			_pidfd = -1; // Readable once the child exited (Linux)
+		bool		_exited = false;
+		int			_exitStatus = 0;
+		const struct LocationBlock	*_location = nullptr; // Its limits, see CgiLimits
 
 	public:
 		std::string _pathToScript;
@@ -53,12 +62,29 @@ class CgiHandler
 		int*		getPipeFromCgi();
 		pid_t		getCgiPid();
 		std::string	getPostData();
+		void		appendPostData(const std::string &data);
+		void		endPostData() { _postDataComplete = true; }
+		bool		isPostDataComplete() const { return _postDataComplete; }
+		std::string	takePostData();
+		char *const	*getEnv() const { return _execveEnv; }
+		void		setContentLength(size_t length);
+		bool		hasPostDataPending() const { return _postDataOffset < _postData.size(); }
+		HandlerStatus	pumpPostData();
+		void		closeStdin();
+		void		closeStdout();
+		int			getPidfd() const { return _pidfd; }
+		void		closePidfd();
+		bool		reap(bool block);
+		bool		hasExited() const { return _exited; }
+		int			getExitStatus() const { return _exitStatus; }
 		size_t		getPostDataOffset();
 		int			getWaitpidRes();
 		CgiHandler(const HttpConnectionHandler &conn);
-		void executeCgi();
+		bool executeCgi();
 		void printCgiInfo();
 		bool		hasSentHeader;
     void CgiResetObject(void);
     void populate(const HttpConnectionHandler &conn);
 };
+
+int		spawnCgi(pid_t *pid, char *const argv[], char *const envp[], int in, int out);
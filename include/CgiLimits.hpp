@@ -0,0 +1,36 @@
+#pragma once
+
+# include <string>
+# include <vector>
+# include <cstdint>
+# include <sys/types.h>
+
+/* What a script may use, and how it is stopped when it is done or
+ * overdoes it. cgi_max_memory and cgi_max_cpu become rlimits of the
+ * script, set on Linux before the interpreter runs: spawnCgi() starts
+ * this binary again as a wrapper (CGI_LIMITS_ARG) that sets them and
+ * execs the interpreter. With cgi_cgroup, a cgroup v2 directory
+ * delegated to the server, the script also gets a leaf of its own in
+ * it with memory.max, joined by the wrapper. The server never moves
+ * itself into another cgroup. cgi_timeout and cgi_max_output are
+ * watched by the event loop. Scripts we stop get SIGTERM, then SIGKILL
+ * if still there after a grace period. */
+
+struct LocationBlock;
+
+constexpr uint64_t	CGI_KILL_GRACE_MS = 2 * 1000;
+constexpr char		CGI_LIMITS_ARG[] = "--cgi-limits"; // webserv --cgi-limits <as> <cpu> <leaf> <interpreter> [args]
+
+void		cgiCgroupStart(const std::string &dir);
+void		cgiCgroupStop();
+std::vector<std::string>	cgiLimitArgs(const LocationBlock *loc, std::string &leaf);
+void		applyCgiLimits(pid_t pid, const std::string &leaf);
+int			runLimited(int argc, char **argv);
+void		releaseCgiLimits(pid_t pid);
+void		terminateCgi(pid_t pid);
+void		reapKilledCgis();
+void		reapLater(pid_t pid);
+void		killCgisNow();
+void		countCgiTimeout();
+void		countCgiOutputLimit();
+std::string	cgiLimitStats();
@@ -0,0 +1,25 @@
+#pragma once
+
+# include <string>
+# include <cstdint>
+
+/* Caps how many scripts run at once: in the process (top-level
+ * `cgi_max_concurrent`), per server (the same in the server block) and
+ * per location. A request over a cap waits its turn in its server's
+ * bounded FIFO (`cgi_queue`, of which `cgi_queue` in a location caps
+ * that location's share); when that is full it gets a 503 with
+ * Retry-After right away, instead of one more interpreter slowing every
+ * other script down. */
+
+struct Endpoint;
+
+enum CgiSlot {
+	CGI_NO_SLOT,
+	CGI_RUNNING, // Counted against the limits until stopCgi()
+	CGI_WAITING, // Queued, cgiDispatch() starts it when there is room
+};
+
+CgiSlot		cgiAdmit(Endpoint *client, bool mayWait);
+void		cgiRelease(Endpoint *client);
+void		cgiDispatch(int qfd);
+std::string	cgiStats();
@@ -0,0 +1,38 @@
+#pragma once
+
+# include <string>
+# include <vector>
+
+/* The configuration file cut into directives in a single pass, before
+ * anything looks at what they mean. A directive is its words up to a
+ * `;`, or up to a `{`, followed then by the directives of its block:
+ *
+ *	server {
+ *		listen 8080;
+ *		location / { root home; }
+ *	}
+ *
+ * Words are separated by blanks and newlines, `#` comments out the rest
+ * of the line, and `;`, `{` and `}` end a word wherever they are. */
+
+struct ConfigDirective {
+	std::string						name;
+	std::vector<std::string>		args;
+	std::vector<ConfigDirective>	block;
+	bool							hasBlock = false;
+	int								line = 0; // Where its name is, for errors
+};
+
+std::vector<ConfigDirective>	readConfig(const char *data, size_t size);
+
+/* Throws "line N: `name` ..." */
+[[noreturn]] void	configError(const ConfigDirective &d, const std::string &why);
+/* Exactly min to max arguments */
+void				configArgs(const ConfigDirective &d, size_t min, size_t max);
+/* Up to `digits` digits followed by `unit` ("", "s", "M") */
+unsigned long		configNumber(const ConfigDirective &d, const std::string &arg,
+						const std::string &unit, size_t digits);
+/* "on" or "off" */
+bool				configFlag(const ConfigDirective &d);
+/* "unix:/path", "/path" or "host:port" */
+bool				configAddress(const std::string &arg);
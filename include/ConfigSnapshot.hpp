@@ -0,0 +1,50 @@
+#pragma once
+
+# include "Configuration.hpp"
+# include <cstdint>
+
+struct Config;
+
+/* The parsed configuration saved as one binary file, for restarts that
+ * do not read thousands of server blocks again:
+ *
+ *	webserv -c big.conf -o big.bin
+ *	webserv big.bin
+ *
+ * Loading maps the file and copies the fields out; what is derived from
+ * them (inherited settings, location lookups, virtual host tables) is
+ * rebuilt as after parsing. A snapshot is only read back by the same
+ * build of webserv on the same machine: fields are in native byte order
+ * and the header carries a format version. */
+
+class SnapshotWriter {
+	public:
+		void	number(uint64_t n);
+		void	string(const std::string &s);
+		void	strings(const std::vector<std::string> &list);
+		const std::string	&data() const { return _data; }
+
+	private:
+		std::string	_data;
+};
+
+/* Throws runtime_error if the file ends early */
+class SnapshotReader {
+	public:
+		SnapshotReader(const char *data, size_t size) : _p(data), _end(data + size) {}
+		uint64_t					number();
+		size_t						count();
+		std::string					string();
+		std::vector<std::string>	strings();
+		bool						atEnd() const { return _p == _end; }
+
+	private:
+		const char	*_p;
+		const char	*_end;
+
+		const char	*take(size_t n);
+};
+
+bool	isSnapshot(const std::string &fileName);
+void	saveSnapshot(const std::string &fileName, const Config &config);
+void	loadSnapshot(const std::string &fileName, Config &config);
@@ -7,6 +7,14 @@
 # include <vector>
 # include <regex>
 # include <sstream>
+# include <memory>
+# include <unordered_map>
+# include <set>
+# include "LocationTrie.hpp"
+# include "LocationRegex.hpp"
+# include "ConfigReader.hpp"
+# include "Socket.hpp"
+# include <openssl/types.h>
 
 # define G_CGI_PATH_PHP		"/usr/bin"
 # define G_CGI_PATH_PYTHON	"/usr/bin"
@@ -18,18 +26,66 @@ const std::vector<std::string> DEFAULT_METHODS = {"GET"};
 const std::string DEFAULT_LISTEN = "8080";
 const std::string DEFAULT_CGI_PYTHON = "/usr/bin";
 const std::string DEFAULT_CGI_PHP = "/usr/bin";
+const size_t DEFAULT_CGI_POOL_MAX_REQUESTS = 1000;
+const unsigned int DEFAULT_CGI_QUEUE_TIMEOUT = 10; // Seconds
+const size_t DEFAULT_CGI_CACHE_SIZE = 16; // Megabytes
+const unsigned int DEFAULT_CGI_CACHE_STALE = 10; // Seconds
+const size_t DEFAULT_UPSTREAM_KEEPALIVE = 8; // Idle connections per backend
+const unsigned int DEFAULT_UPSTREAM_MAX_FAILS = 1;
+const unsigned int DEFAULT_UPSTREAM_FAIL_TIMEOUT = 10; // Seconds
+const size_t DEFAULT_SSL_SESSION_CACHE = 20480; // Sessions, OpenSSL's default
+const unsigned int DEFAULT_SSL_SESSION_TIMEOUT = 300; // Seconds
 
+class SnapshotReader;
+class SnapshotWriter;
+
+/* Every field is also in the binary snapshot, see saveLocation() */
 struct LocationBlock {
-    std::string path;                   		// The location path (e.g. "/images/")
+    std::string path;                   		// The location path (e.g. "/images/"), or its regex
+    std::string modifier;               		// "" for a prefix, "=" exact, "^~" prefix that skips regexes, "~" regex, "~*" without case
     std::string root;                   		// The file system root for this location
     std::vector<std::string> methods;   		// Allowed methods, e.g. {"GET", "POST", "DELETE"}
     std::string cgiPathPHP;             		// Path for the PHP CGI interpreter (if provided)
     std::string cgiPathPython;          		// Path for the Python CGI interpreter (if provided)
+    std::string fastcgiPass;            		// FastCGI backend, "unix:/path" or "host:port" (optional)
+    std::string proxyPass;              		// Upstream block name, or one "unix:/path" or "host:port" backend (optional)
+    size_t cgiPoolSize = 0;             		// Warm Python workers kept for this location, 0 to fork per request
+    size_t cgiPoolMaxRequests = 0;      		// Requests before a worker is replaced
+    std::string cgiWorkerScript;        		// Absolute path of cgi_worker.py, found when cgi_pool is read
+    size_t cgiMaxConcurrent = 0;        		// Scripts running at once in this location, 0 for no limit
+    size_t cgiQueueSize = 0;            		// Of the server's cgi_queue this location may fill, 0 for all of it
+    bool stats = false;                 		// Answers with the server's counters instead of files
+    unsigned int cgiCacheValid = 0;     		// Seconds a GET script's response is reused, 0 for no cache
+    unsigned int cgiCacheStale = 0;     		// Seconds more it is served while one request refreshes it
+    size_t cgiCacheSize = 0;            		// Bytes of responses kept for this location
+    bool cgiCoalesce = false;           		// Identical GETs share one run of the script
+    unsigned int cgiTimeout = 0;        		// Seconds a script may run before it is stopped, 0 for no limit
+    size_t cgiMaxMemory = 0;            		// Bytes of memory per script, 0 for no limit
+    unsigned int cgiMaxCpu = 0;         		// Seconds of CPU time per script, 0 for no limit
+    size_t cgiMaxOutput = 0;            		// Bytes a script may write, 0 for no limit
     std::string uploadDir;              		// Upload directory (optional)
     int returnCode;                     		// HTTP status code for redirection (e.g. 307), default could be -1 or 0 if not set
     std::string returnURL;              		// URL to redirect to if a return directive is present
     bool dirListing;                    		// Directory listing flag (true for "on", false for "off")
     std::vector<LocationBlock> nestedLocations;	// For any nested location blocks
+    std::string cgiInterpreterPython;   		// cgiPathPython + "/python3", computed once at load
+    std::string cgiInterpreterPHP;      		// cgiPathPHP + "/php-cgi"
+    std::vector<std::string> cgiEnv;    		// CGI variables that are the same for every request here
+};
+
+/* One backend of an upstream block */
+struct UpstreamServer {
+    std::string address;                		// "host:port", "unix:/path" or "/path"
+    unsigned int maxFails = DEFAULT_UPSTREAM_MAX_FAILS;	// Failures in a row before it is taken out
+    unsigned int failTimeout = DEFAULT_UPSTREAM_FAIL_TIMEOUT;	// Seconds it stays out before another try
+};
+
+/* `upstream NAME { ... }` next to the server blocks, for proxy_pass */
+struct UpstreamBlock {
+    std::string name;
+    std::vector<UpstreamServer> servers;
+    std::string balance = "round_robin";	// round_robin, least_conn or hash (of the URI)
+    size_t keepalive = DEFAULT_UPSTREAM_KEEPALIVE;	// Idle connections kept per server
 };
 
 class Configuration {
@@ -40,19 +96,31 @@ class Configuration {
 		std::map<int, std::string>				_errorPages;				
 		std::string 							_host;	
 		std::string 							_port;
+		ListenOptions							_listenOptions;
 		std::string								_serverNames;
 		std::string								_index;	
 		unsigned int 							_maxClientBodySize;
 		unsigned int							_maxClientHeaderSize;
+		size_t									_cgiMaxConcurrent;
+		size_t									_cgiQueueSize;
+		unsigned int							_cgiQueueTimeout;
+		std::string								_sslCertificate;
+		std::string								_sslCertificateKey;
+		size_t									_sslSessionCache;
+		unsigned int							_sslSessionTimeout;
+		bool									_sslSessionTickets;
+		std::shared_ptr<SSL_CTX>				_tlsContext; // Built from the above by parser(), see Tls.hpp
 		std::vector<LocationBlock>				_locationBlocks;
 		std::map<std::string, LocationBlock>	_allPaths;
+		LocationTrie							_locationTrie; // Points into _locationBlocks, rebuilt on copy
+		std::unordered_map<std::string, LocationBlock*>	_exactLocations; // Same
+		std::vector<LocationBlock*>				_regexLocations; // Same, in the order of _regexSet's patterns
+		std::shared_ptr<const RegexSet>			_regexSet; // Holds no pointer, so copies share it
 
-		std::vector<std::string>				_rawBlock;
-		std::vector<std::string>				_rawServerBlock;
-
-		LocationBlock handleLocationBlock(std::vector<std::string>& locationBlock);
-		std::vector<std::string> generateLocationBlock(std::vector<std::string>::iterator& it, std::vector<std::string>::iterator end);
-		void populateMethodsPathsCgi(LocationBlock& locationBlock, std::vector<std::string> inheritedMethods, std::string inheritedCgiPathPython, std::string inheritedCgiPathPHP);
+		LocationBlock handleLocationBlock(const ConfigDirective& location);
+		void populateMethodsPathsCgi(LocationBlock& locationBlock, std::vector<std::string> inheritedMethods, std::string inheritedCgiPathPython, std::string inheritedCgiPathPHP, std::string inheritedFastcgiPass);
+		void indexLocations(std::vector<LocationBlock> &blocks, std::vector<std::pair<std::string, bool>> *patterns);
+		void buildLocationLookups(bool compileRegexes);
 
 		void createBarebonesBlock();
 	public:
@@ -60,8 +128,13 @@ class Configuration {
 		~Configuration();
 		Configuration(const Configuration& other);
 		Configuration& operator=(const Configuration& other);
+		// A moved vector keeps its buffer, so the lookups still point into it
+		Configuration(Configuration&& other) = default;
+		Configuration& operator=(Configuration&& other) = default;
 
-		Configuration(std::vector<std::string> servBlck);
+		explicit Configuration(const ConfigDirective& server);
+		explicit Configuration(SnapshotReader& in);
+		void save(SnapshotWriter& out) const;
 		void printServerBlock() const;
 		void printLocationBlock(LocationBlock loc, int level) const;
 
@@ -70,12 +143,28 @@ class Configuration {
 		std::string getGlobalCgiPathPython() const;
 		std::map<int, std::string> getErrorPages() const;
 		std::string getHost() const;
-		std::string getPort() const;
+		std::string getPort() const; // Or "unix:/path"
+		std::string getListenAddress() const;
+		bool isUnixSocket() const;
+		const ListenOptions& getListenOptions() const;
+		const std::string& getSslCertificate() const;
+		const std::string& getSslCertificateKey() const;
+		size_t getSslSessionCache() const;
+		unsigned int getSslSessionTimeout() const;
+		bool getSslSessionTickets() const;
+		const std::shared_ptr<SSL_CTX>& getTlsContext() const;
+		void setTlsContext(std::shared_ptr<SSL_CTX> context);
+		void setListenOptions(const ListenOptions& options);
 		std::string getServerNames() const;
 		std::string getIndex() const;
 		unsigned int getMaxClientBodySize() const;
 		unsigned int getMaxClientHeaderSize() const;
+		size_t getCgiMaxConcurrent() const;
+		size_t getCgiQueueSize() const;
+		unsigned int getCgiQueueTimeout() const;
 		std::vector<LocationBlock>& getLocationBlocks();
+		const std::vector<LocationBlock>& getLocationBlocks() const;
+		LocationBlock	*findLocation(const std::string &path) const;
 
 		std::string getRootViaLocation(std::string path) const;
 		void	printCompact() const;
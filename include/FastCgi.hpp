@@ -0,0 +1,69 @@
+#pragma once
+
+# include <string>
+# include <map>
+# include <memory>
+# include <cstdint>
+# include <sys/socket.h>
+
+/* FastCGI client: requests for locations with `fastcgi_pass` go to a
+ * long-running backend (php-fpm, an app server) over a pooled
+ * connection instead of forking an interpreter each time.
+ * Protocol reference: https://fastcgi-archives.github.io/FastCGI_Specification.html */
+
+struct Endpoint;
+struct LocationBlock;
+struct Config;
+
+constexpr size_t	FCGI_MAX_REQUESTS_PER_CONN = 32; // When the backend multiplexes
+constexpr size_t	FCGI_MAX_IDLE_CONNS = 8; // Per backend, more are closed once idle
+constexpr size_t	FCGI_READ_SIZE = 65536;
+constexpr char		CGI_WORKER_SCRIPT[] = "cgi_worker.py"; // From the working directory, resolved at load
+constexpr const char	*CGI_WORKER_ENV[] = { "PATH", "LANG", "LC_ALL", "TZ" }; // Passed on to workers, nothing else
+
+/* What we know about one `fastcgi_pass` address, or the `cgi_pool`
+ * workers of one location */
+struct FcgiBackend {
+	std::string				address;
+	const LocationBlock		*pool = nullptr; // Workers are spawned, not connected to
+	std::shared_ptr<const Config>	config; // pool's, kept alive as long as its workers
+	bool					retired = false; // pool is from before a reload, its workers go once idle
+	struct sockaddr_storage	addr;
+	socklen_t				addrlen = 0; // 0 until resolved
+	bool					probed = false; // FCGI_GET_VALUES was sent
+	bool					multiplexed = false; // It answered FCGI_MPXS_CONNS=1
+};
+
+struct FcgiRequest {
+	Endpoint	*client; // nullptr once aborted, the id stays taken until END_REQUEST
+	bool		stdinDone;
+};
+
+/* One connection to a backend, in an Endpoint slot of kind FcgiBackend.
+ * Requests on it are told apart by their id. */
+struct FcgiConn {
+	FcgiBackend							*backend = nullptr;
+	Endpoint							*slot = nullptr;
+	int									fd = -1;
+	pid_t								pid = 0; // cgi_pool worker at the other end
+	bool								connected = false; // connect() completed
+	bool								probe = false; // Only asks for FCGI_MPXS_CONNS
+	bool								paused = false; // A client is too far behind
+	bool								aborted = false; // Worker killed while its records were read, closed after
+	int									watching = 0; // Current queue_event_type
+	size_t								served = 0;
+	std::string							out;
+	size_t								outOffset = 0;
+	std::string							in;
+	std::map<uint16_t, FcgiRequest>		requests;
+};
+
+bool	fcgiStart(Endpoint *client, int qfd, const std::string &address);
+bool	fcgiStartPooled(Endpoint *client, int qfd, const LocationBlock *loc);
+void	fcgiStartPools(int qfd);
+void	fcgiReload(int qfd);
+void	fcgiSendBody(Endpoint *client, int qfd);
+void	fcgiAbort(Endpoint *client, int qfd);
+void	fcgiResume(Endpoint *client, int qfd);
+void	serveFcgiConn(Endpoint *slot, int qfd);
+void	fcgiCloseAll();
@@ -0,0 +1,9 @@
+#pragma once
+
+typedef enum {
+	S_Error,
+	S_Again,
+	S_Done,
+	S_ClosedConnection,
+	S_ReadBody,
+} HandlerStatus;
@@ -0,0 +1,26 @@
+#pragma once
+
+# include <string>
+# include <vector>
+# include <deque>
+# include <cstdint>
+
+/* HPACK (RFC 7541), the header compression of HTTP/2. Header blocks from
+ * clients are decoded with the static table, the connection's dynamic
+ * table and Huffman-coded strings. Ours are encoded as literals that do
+ * not go into the client's table: names from the static table where they
+ * are in it, strings as they are. */
+
+typedef std::pair<std::string, std::string>	HpackField;
+
+struct HpackTable {
+	std::deque<HpackField>	entries; // Newest first
+	size_t					size = 0; // Strings plus 32 per entry, as the RFC counts
+	size_t					maxSize = 4096; // Set by the client, up to limit
+	size_t					limit = 4096; // Our SETTINGS_HEADER_TABLE_SIZE, the default
+};
+
+bool	hpackDecode(HpackTable &table, const std::string &block,
+			std::vector<HpackField> &fields, size_t maxListSize);
+void	hpackEncode(std::string &out, const std::string &name, const std::string &value);
+void	hpackEncodeStatus(std::string &out, int status);
@@ -0,0 +1,96 @@
+#pragma once
+
+# include "Hpack.hpp"
+# include <map>
+# include <string>
+# include <cstdint>
+# include <sys/types.h>
+
+/* HTTP/2 over cleartext (h2c), started either way a client can:
+ *
+ *	curl --http2-prior-knowledge http://host/	(the connection preface)
+ *	curl --http2 http://host/			(Upgrade: h2c, answered 101)
+ *
+ * It sits under the handler, in place of the socket: h2Recv() hands it
+ * each stream's request written out as HTTP/1.1, and h2Send() turns the
+ * HTTP/1.1 response it writes back into HEADERS and DATA frames, within
+ * the client's flow control windows. So files, CGI, proxy_pass and the
+ * rest work on streams unchanged, and a page's requests share one
+ * connection and one Endpoint slot. Streams are answered one at a time,
+ * in the order they were opened (RFC 9113 deprecated the priority tree,
+ * PRIORITY frames are read and ignored); up to H2_MAX_STREAMS of them
+ * wait their turn, more are refused for the client to send again.
+ * There is no interleaving: a stream waiting on a script or upstream
+ * holds up the ones behind it, see the README. */
+
+constexpr char		H2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr size_t	H2_PREFACE_LEN = sizeof(H2_PREFACE) - 1;
+constexpr uint32_t	H2_MAX_STREAMS = 32; // Open at once, our SETTINGS_MAX_CONCURRENT_STREAMS
+constexpr size_t	H2_MAX_HEADER_LIST = 64 * 1024; // Decoded, of one request
+constexpr size_t	H2_OUT_MAX = 64 * 1024; // Framed and not sent: past it h2Send() takes no more
+
+struct H2Stream {
+	uint32_t	id = 0;
+	std::string	request; // As HTTP/1.1, what the handler has not read yet
+	bool		chunked = false; // No content-length: DATA goes to the handler as chunks
+	bool		ended = false; // END_STREAM from the client
+	bool		reset = false; // By either side, while it was the current one
+	int64_t		sendWindow = 0;
+	int64_t		recvWindow = 0;
+	uint32_t	credit = 0; // DATA the handler took, not given back in WINDOW_UPDATE yet
+};
+
+/* The response of the current stream, as the handler writes it */
+enum H2Body {
+	H2B_HEAD, /* Until the blank line */
+	H2B_RAW,
+	H2B_CHUNK_SIZE,
+	H2B_CHUNK,
+	H2B_CHUNK_END, /* CRLF after a chunk */
+	H2B_TRAILERS,
+	H2B_DONE,
+};
+
+struct H2Conn {
+	int							fd = -1;
+	std::string					in;
+	size_t						inOffset = 0;
+	std::string					out;
+	size_t						outOffset = 0;
+	bool						prefaceSeen = false;
+	HpackTable					decoder;
+	std::map<uint32_t, H2Stream>	streams; // Not answered yet, by id: in the order they were opened
+	uint32_t					current = 0; // Stream the handler works on, 0 between them
+	uint32_t					lastStream = 0; // Highest opened by the client
+	uint32_t					lastAnswered = 0;
+	uint32_t					continuing = 0; // Stream of a header block awaiting CONTINUATION
+	std::string					headerBlock;
+	bool						headerEndsStream = false;
+	int64_t						sendWindow = 65535; // The connection's
+	int64_t						recvWindow = 65535;
+	uint32_t					recvCredit = 0;
+	uint32_t					peerInitialWindow = 65535;
+	uint32_t					peerMaxFrame = 16384;
+	H2Body						body = H2B_HEAD;
+	std::string					head; // Or the chunk size line, or a trailer line
+	size_t						chunkLeft = 0;
+	bool						headSent = false;
+	bool						blocked = false; // h2Send() stopped by a window, not by the socket
+	bool						peerClosed = false; // EOF or GOAWAY
+	bool						dead = false; // Protocol or socket error, GOAWAY sent if it could be
+};
+
+H2Conn		*h2Start(int fd, const std::string &early);
+H2Conn		*h2Upgrade(int fd, const std::string &settings, const std::string &early);
+ssize_t		h2Recv(H2Conn *c, void *buf, size_t len);
+ssize_t		h2Send(H2Conn *c, const void *buf, size_t len);
+bool		h2HasInput(const H2Conn *c);
+bool		h2Pending(const H2Conn *c);
+bool		h2Blocked(const H2Conn *c);
+bool		h2Behind(const H2Conn *c);
+bool		h2Flush(H2Conn *c);
+bool		h2Pump(H2Conn *c);
+bool		h2StreamDone(H2Conn *c);
+void		h2Close(H2Conn *c);
+bool		isH2Preface(const std::string &data);
+std::string	h2Stats();
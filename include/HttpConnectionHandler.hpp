@@ -6,27 +6,36 @@
 #include <filesystem>
 #include <regex>
 #include <map>
+#include <memory>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <ctime>
+#include "HandlerStatus.hpp"
+#include "OutQueue.hpp"
 #include "CgiHandler.hpp"
 #include "Configuration.hpp"
 
-extern std::vector<Configuration> serverMap;
+struct Config;
+struct H2Conn;
 using std::string;
 
 #define MAX_URI_LENGTH 1024
-
-typedef enum {
-	S_Error,
-	S_Again,
-	S_Done,
-	S_ClosedConnection,
-	S_ReadBody,
-} HandlerStatus;
+#define MAX_CGI_HEADER 8192
+#define RETRY_AFTER_S 1 // Seconds, sent with a 503
 
 typedef std::map<string, string> HeadersMap;
 
+/* The script's response as it goes out, for cgi_cache to keep */
+struct CgiCapture {
+	string	key; // Set while capturing, see cgiCacheServe()
+	bool	keep = false; // Cleared once it cannot be kept after all
+	size_t	limit = 0; // Longest body worth keeping
+	string	status; // "200 OK"
+	string	headers; // Header lines as sent, without Date and framing
+	string	cacheControl; // What the script said about caching
+	string	body;
+};
+
 struct ParsedPartInfo
 {
     bool		isFile = false;
@@ -52,26 +61,48 @@ class HttpConnectionHandler
 		string							originalPath;
 		string							httpVersion;
 		string							body;
+		size_t							bodyTaken; // Body bytes already handed to CGI
 		std::map<string, string>				headers;
 		std::string						chunkRemainder;
 		int							clientSocket;
+		SSL							*tls; // On an ssl address, owned like clientSocket, see Tls.hpp
+		H2Conn						*h2; // Once the client spoke HTTP/2, owned the same way, see Http2.hpp
 
 		string							filePath; // Everything in URI before the question mark
 		string							queryString; // Everything in URI after the question mark
 		string							extension;
 		CgiTypes						cgiType;
 
-		Configuration						*conf;
+		std::shared_ptr<const Config>		config; // Generation the request started on, see Reload.hpp
+		const Configuration					*conf; // Its server block for this request
 		LocationBlock						*locBlock;
 
 		//response stuff
 		int							errorCode;
-		string							PORT;
-		string 							IP;
-
-		string							response;
-		bool							fileServ;
-		int							bSent;
+		string							address; // Listen address it came in on, "host:port" or "unix:/path"
+		string 							remoteAddr; // REMOTE_ADDR: the client's IP, or "unix:"
+
+		string							response; // Being written, see queueResponse()
+		size_t							responseSent; // Of response, by consumeResponse()
+		bool							fileServ; // The file at path follows the response
+		size_t							fileLength; // Of it, as the response announced
+		std::shared_ptr<const string>		sharedBody; // Or a body kept by cgi_cache does
+		OutQueue						outQueue; // What is left to send
+
+		// Body of a request that was answered before it arrived
+		bool							bodyDiscarded;
+		size_t							discardLeft; // npos when the length is unknown
+		size_t							bDrained;
+
+		// Script output before its header block is complete
+		string							cgiHeaderBuf;
+		bool							cgiHeadersParsed;
+		bool							cgiChunked;
+		size_t							cgiBodyLeft; // npos unless the script set Content-Length
+		size_t							cgiOutputBytes; // All the script wrote, for cgi_max_output
+		CgiCapture						cgiCapture;
+		string							*cgiTee; // Also gets the framed output, see CgiFlight
+		bool							cgiPrivate; // Set-Cookie or Cache-Control: private, no-store: not for other clients
 
 		//Parsing
 		bool		getMethodPathVersion(std::istringstream &requestStream);
@@ -81,6 +112,10 @@ class HttpConnectionHandler
 		HandlerStatus	handleFirstChunks(std::string &chunkData);
 		bool		hexStringToSizeT(const std::string& hexStr, size_t& out);
 		bool		stringPercentDecoding(const std::string &original,std::string &decoded);
+		bool		parseCgiHeaders();
+		void		appendCgiBody(const char *data, size_t n);
+		void		emitCgi(const char *data, size_t n);
+		void		emitCgi(const string &data);
 
 		//Creating HTTP response
 		string	getDefaultErrorPage500();
@@ -102,10 +137,8 @@ class HttpConnectionHandler
 		FileUploadResult uploadFile(ParsedPartInfo partInfo);
 
 
-		int			matchServerName(const std::string& pattern, const std::string& host);
 		void		findConfig();
 		bool		isMethodAllowed(LocationBlock *block, string &method);
-		LocationBlock	*findLocationBlock(std::vector<LocationBlock> &blocks, LocationBlock *current);
 
 		
 	public:
@@ -114,6 +147,12 @@ class HttpConnectionHandler
 		~HttpConnectionHandler();
 		HttpConnectionHandler(const HttpConnectionHandler&) = delete;
 		void resetObject();
+		void dropConfig() { conf = nullptr; config.reset(); }
+		bool hasRequestStarted() const { return !rawRequest.empty(); }
+		ssize_t	receive(void *buf, size_t len);
+		ssize_t	transmit(const void *buf, size_t len);
+		bool	hasBufferedInput() const;
+		bool	canSendDirectly() const;
 
 		void		findInitialConfig();
 
@@ -121,10 +160,29 @@ class HttpConnectionHandler
 
 		HandlerStatus	parseRequest();
 		HandlerStatus	readBody();
+		string		takeBody();
+		void		discardBody();
+		HandlerStatus	drainBody();
+		bool		hasPendingBody() const { return bodyDiscarded && discardLeft != 0; }
+		bool		canKeepAlive() const { return errorCode == 0 && discardLeft != std::string::npos; }
 		void	handleRequest();
 		bool		checkLocation();
 		CgiTypes		checkCgi();
-		HandlerStatus	serveCgi(CgiHandler &cgiHandler);
+		HandlerStatus	readCgiOutput(CgiHandler &cgiHandler);
+		void		feedCgiOutput(const char *data, size_t n);
+		HandlerStatus	finishCgiResponse(bool failed);
+		bool		cgiResponseStarted() const { return cgiHeadersParsed; }
+		bool		cgiResponsePrivate() const { return cgiPrivate; }
+		size_t		getCgiOutputBytes() const { return cgiOutputBytes; }
+		void		captureCgiResponse(const string &key, size_t limit);
+		CgiCapture	&getCgiCapture() { return cgiCapture; }
+		void		teeCgiOutput(string *tee) { cgiTee = tee; }
+		void		replayCgiResponse(const string &status, const string &cachedHeaders,
+						const std::shared_ptr<const string> &cachedBody, uint64_t age_s);
+#ifdef __linux__
+		bool		canRelayCgiOutput() const;
+		ssize_t		relayCgiOutput(CgiHandler &cgiHandler);
+#endif
 
 		//creating HTTP response
 		string	createHttpErrorResponse(int error);
@@ -133,7 +191,9 @@ class HttpConnectionHandler
 		string	createHttpRedirectResponse(int statusCode, const string &location);
 		HeadersMap createDefaultHeaders();
 		string getErrorPageBody(int error);
-		HandlerStatus serveFile();
+		bool		queueResponse();
+		HandlerStatus	sendOutput();
+		bool		hasOutput() const { return !outQueue.segments.empty(); }
 
 		/* Will calculate and append Content-Length header with the right value. */
 		string serializeResponse(int status, HeadersMap& headers, const string& body);
@@ -141,29 +201,35 @@ class HttpConnectionHandler
 		// Getters
 		int						getErrorCode() const { return errorCode; }
 		int						getClientSocket() const { return clientSocket; }
-		int						getBSent() const { return bSent; }
+		SSL						*getTls() const { return tls; }
+		H2Conn					*getH2() const { return h2; }
 		const string				&getMethod() const { return method; }
 		const string				&getPath() const { return path; }
 		const string				&getOriginalPath() const { return originalPath; }
 		const string				&getHttpVersion() const { return httpVersion; }
 		const string				&getBody() const { return body; }
 		const Configuration 				*getConf() const { return conf; }
+		const std::shared_ptr<const Config>	&getConfig() const { return config; }
 		const LocationBlock				*getLocationBlock() const { return locBlock;}
 		const string				&getFilePath() const { return filePath; }
 		const string				&getQueryString() const { return queryString; }
+		const string				&getRemoteAddr() const { return remoteAddr; }
 		const string				&getExtension() const { return extension; }
-		const string				&getResponse() const { return response; }
+		std::string_view			getResponse() const { return std::string_view(response).substr(responseSent); } // What is left to send
 		bool				getFileServ() const { return fileServ; }
 		CgiTypes					getCgiType() const { return cgiType; }
 		const std::map<string, string>	&getHeaders() const { return headers; }
 
 		// Setters
-		void	setResponse(std::string newResponse) {response = newResponse;}
+		void	setResponse(std::string newResponse) {response = newResponse; responseSent = 0;}
+		void	consumeResponse(size_t n);
+		void	appendResponse(const string &data) { response += data; }
 		void	setClientSocket(int socket) { clientSocket = socket; }
+		void	setTls(SSL *ssl) { tls = ssl; }
+		void	setH2(H2Conn *conn) { h2 = conn; }
 		void	setErrorCode(int err) { errorCode = err; }
-		void	setConfig(Configuration *config) { conf = config; }
-		void	setIP(string ip) { IP = ip; }
-		void	setPORT(string port) { PORT = port; }
+		void	setAddress(string listenAddress) { address = listenAddress; }
+		void	setRemoteAddr(string ip) { remoteAddr = ip; }
 
 };
 
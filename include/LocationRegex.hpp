@@ -0,0 +1,31 @@
+#pragma once
+
+# include <string>
+# include <vector>
+# include <cstdint>
+
+/* The `location ~ regex` and `location ~* regex` blocks of a server,
+ * compiled together into one DFA at load. Matching a URI is a single
+ * pass over it, whatever the number of rules, and tells which of them
+ * matched; like nginx the first declared of those wins.
+ *
+ * Syntax: literals, `.`, [classes] with ranges and negation, \d \w \s
+ * and their negations, escapes, (groups) and (?:groups), `|`, `*`, `+`,
+ * `?`, and the anchors `^` and `$`. No {m,n}: braces would confuse the
+ * configuration reader. A match may start anywhere unless anchored. */
+
+constexpr size_t	REGEX_LOCATIONS_MAX = 64; // One bit each while matching
+constexpr size_t	REGEX_DFA_STATES_MAX = 8192;
+
+class RegexSet {
+	public:
+		void	compile(const std::vector<std::pair<std::string, bool>> &patterns); // Pattern, ignore case
+		int		match(const char *s, size_t len) const; // Index of the first matching pattern, -1 if none
+		bool	empty() const { return _hits.empty(); }
+
+	private:
+		uint16_t				_classes[258] = {}; // Byte, then BEGIN and END, to symbol class
+		size_t					_classCount = 0;
+		std::vector<uint32_t>	_next; // _classCount entries per state
+		std::vector<uint64_t>	_hits; // Patterns that matched once a state is reached
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+# include <string>
+# include <vector>
+# include <cstdint>
+
+/* Prefix locations of a server compiled into a radix trie, nested ones
+ * included under their own full path. A lookup walks the request path
+ * once, comparing edge labels in place, and returns the longest location
+ * that is a prefix of it. On equal paths the more deeply nested block
+ * wins, then the first declared. */
+
+struct LocationBlock;
+
+class LocationTrie {
+	public:
+		void			build(std::vector<LocationBlock> &blocks);
+		LocationBlock	*match(const char *path, size_t len) const;
+
+	private:
+		struct Node {
+			std::string									label; // Edge from the parent
+			LocationBlock								*location = nullptr;
+			int											depth = -1; // Nesting level of location
+			std::vector<std::pair<unsigned char, uint32_t>>	children; // By first byte of label, sorted
+		};
+		std::vector<Node>	_nodes;
+
+		void		add(std::vector<LocationBlock> &blocks, int depth);
+		void		insert(const std::string &path, LocationBlock *location, int depth);
+		uint32_t	child(uint32_t node, unsigned char c) const;
+};
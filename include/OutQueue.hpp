@@ -0,0 +1,45 @@
+#pragma once
+
+# include <deque>
+# include <memory>
+# include <string>
+# include <sys/types.h>
+# include "HandlerStatus.hpp"
+
+/* What is left to send of a response, as a chain of segments: strings
+ * it owns, blobs shared with cgi_cache, and ranges of files. A cursor
+ * into the first segment says how much of it is out, so a partial write
+ * only moves it. On a plain socket the strings go out together in one
+ * sendmsg() and files with sendfile(); see HttpConnectionHandler::sendOutput()
+ * for TLS and HTTP/2, where every byte goes through transmit(). */
+
+constexpr size_t	OUT_IOV_MAX = 64; // Segments in one sendmsg()
+constexpr size_t	OUT_FILE_CHUNK = 8192; // Read at a time where sendfile() cannot be used
+
+enum OutKind {
+	OUT_STRING,
+	OUT_SHARED,
+	OUT_FILE,
+};
+
+struct OutSegment {
+	OutKind								kind = OUT_STRING;
+	std::string							data;
+	std::shared_ptr<const std::string>	shared;
+	int									fd = -1; // Owned, closed once sent or dropped
+	off_t								offset = 0; // Of the range in the file
+	size_t								size = 0; // Of the range
+};
+
+struct OutQueue {
+	std::deque<OutSegment>	segments;
+	size_t					cursor = 0; // Sent of the first segment
+};
+
+void			outPush(OutQueue &q, std::string data);
+void			outPushShared(OutQueue &q, std::shared_ptr<const std::string> blob);
+bool			outPushFile(OutQueue &q, const std::string &path, size_t size);
+size_t			outPeek(const OutQueue &q, const char *&data, char *buf, size_t bufSize);
+void			outConsume(OutQueue &q, size_t n);
+HandlerStatus	outSend(OutQueue &q, int sockfd);
+void			outClear(OutQueue &q);
@@ -1,7 +1,26 @@
 #pragma once
 
 # include "Configuration.hpp"
+# include "Vhosts.hpp"
+# include <memory>
 
-extern std::vector<Configuration> serverMap;
+/* Everything read from one configuration file, never changed once
+ * published. A request holds on to the one it started with, so a reload
+ * can publish the next one while older requests finish on theirs: the
+ * last of them to let go frees it. */
+struct Config {
+	std::string					source; // File it was read from, read again on reload
+	uint64_t					generation = 0; // 1 for the first, then +1 per reload
+	std::vector<Configuration>	servers;
+	std::vector<UpstreamBlock>	upstreams;
+	unsigned int				shutdownTimeout = 30; // Seconds for open connections to finish, see Server.cpp
+	size_t						cgiMaxConcurrent = 0; // Scripts running at once in the process, 0 for no limit
+	std::string					cgiCgroup; // Delegated cgroup v2 directory for scripts, see CgiLimits.hpp
+	VhostIndex					vhosts;
+};
 
-std::vector<Configuration> parser(std::string fileName);
\ No newline at end of file
+std::shared_ptr<Config>			parser(const std::string &fileName);
+std::shared_ptr<const Config>	currentConfig();
+void							publishConfig(std::shared_ptr<Config> config);
+const Configuration				*findVhost(const Config &config, const std::string &address,
+									const std::string &host);
@@ -0,0 +1,85 @@
+#pragma once
+
+# include <string>
+# include <vector>
+# include <cstdint>
+# include <sys/socket.h>
+
+/* Reverse proxy: requests for locations with `proxy_pass` are sent on to
+ * an HTTP backend, or one of an `upstream` group of them, over pooled
+ * keep-alive connections. The answer is handed to the client the same
+ * way a script's output is, so it gets the CGI limits, cache and flow
+ * control for free. */
+
+struct Endpoint;
+struct UpstreamBlock;
+
+constexpr size_t	PROXY_READ_SIZE = 65536;
+constexpr size_t	PROXY_MAX_HEADER = 64 * 1024; // Of the backend's answer
+constexpr size_t	PROXY_REPLAY_MAX = 64 * 1024; // Request kept for a retry on another server
+constexpr int		PROXY_HASH_POINTS = 160; // Per server on the hash ring
+
+/* One server of a group */
+struct ProxyPeer {
+	std::string				address;
+	struct sockaddr_storage	addr;
+	socklen_t				addrlen = 0; // 0 until resolved
+	unsigned int			maxFails = 1;
+	unsigned int			failTimeout = 10; // Seconds
+	unsigned int			fails = 0; // In a row
+	uint64_t				downUntil_ms = 0; // Not picked before then
+	size_t					active = 0; // Requests on it now, for least_conn
+};
+
+/* An `upstream` block, or the lone backend of a `proxy_pass host:port` */
+struct ProxyGroup {
+	std::string								name;
+	std::string								balance = "round_robin";
+	size_t									keepalive = 8;
+	std::vector<ProxyPeer>					peers;
+	size_t									next = 0; // round_robin position
+	std::vector<std::pair<uint32_t, size_t>>	ring; // hash: point, peer index
+	bool									retired = false; // From before a reload, its connections are not pooled
+};
+
+enum ProxyBody {
+	PB_NONE, /* 204, 304 */
+	PB_LENGTH,
+	PB_CHUNKED, /* At a chunk size line */
+	PB_CHUNK, /* Inside a chunk */
+	PB_TRAILERS, /* After the last chunk */
+	PB_CLOSE, /* Until the backend hangs up */
+};
+
+/* One connection to a backend, in an Endpoint slot of kind Upstream.
+ * At most one request at a time: idle between them, in the pool. */
+struct ProxyConn {
+	ProxyGroup		*group = nullptr;
+	ProxyPeer		*peer = nullptr;
+	Endpoint		*slot = nullptr;
+	int				fd = -1;
+	Endpoint		*client = nullptr; // nullptr while idle
+	bool			connected = false; // connect() completed
+	bool			reused = false; // Kept from an earlier request
+	bool			paused = false; // The client is too far behind
+	int				watching = 0; // Current queue_event_type
+	std::string		out;
+	size_t			outOffset = 0;
+	std::string		replay; // What was sent, while it fits in PROXY_REPLAY_MAX
+	bool			replayable = true;
+	std::string		in;
+	bool			answered = false; // Some of the response came in
+	bool			headerDone = false;
+	ProxyBody		body = PB_NONE;
+	size_t			bodyLeft = 0; // Of the Content-Length, or of the chunk
+	bool			keepAlive = false;
+};
+
+bool		proxyStart(Endpoint *client, int qfd, const std::string &target);
+void		proxySendBody(Endpoint *client, int qfd);
+void		proxyAbort(Endpoint *client, int qfd);
+void		proxyResume(Endpoint *client, int qfd);
+void		serveProxyConn(Endpoint *slot, int qfd);
+void		proxyReload(int qfd);
+void		proxyCloseAll();
+std::string	proxyStats();
@@ -18,6 +18,8 @@ constexpr int QUEUE_MAX_EVENTS = 64;
 enum queue_event_type {
 	READABLE,
 	WRITABLE,
+	IDLE, /* Stay registered, report nothing but errors */
+	READWRITE, /* Both, for fds that talk both ways at once */
 };
 
 int		queue_create(void);
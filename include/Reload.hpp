@@ -0,0 +1,17 @@
+#pragma once
+
+/* `kill -HUP` reads the configuration file again without stopping:
+ *
+ *	- the file is parsed on a thread of its own, the event loop keeps
+ *	  serving meanwhile and only picks up the result;
+ *	- a file that does not parse, or a listen address that cannot be
+ *	  opened, is logged and the running configuration stays;
+ *	- otherwise new listeners are opened, dropped ones closed, and the
+ *	  new configuration is published for the requests that start from
+ *	  then on. Those already under way finish on the one they had.
+ *
+ * FastCGI pools, proxy groups and the CGI cache of the old configuration
+ * are retired as their connections go idle. */
+
+void	reloadPoll(int qfd);
+void	reloadStop();
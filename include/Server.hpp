@@ -6,8 +6,16 @@
 # include "Queue.hpp"
 # include "HttpConnectionHandler.hpp"
 # include "Timeout.hpp"
+# include "FastCgi.hpp"
+# include "CgiQueue.hpp"
+# include "CgiCache.hpp"
+# include "CgiFlight.hpp"
+# include "CgiLimits.hpp"
+# include "Proxy.hpp"
 # include <csignal>
 
+struct Config;
+
 #ifdef DEBUG
 constexpr uint64_t	CLIENT_TIMEOUT_THRESHOLD_MS = 15 * 1000; // Fifteen (15) seconds
 constexpr uint64_t	RECV_HEADER_TIMEOUT_MS = 1 * 1000; // One (1) second
@@ -15,46 +23,83 @@ constexpr uint64_t	RECV_HEADER_TIMEOUT_MS = 1 * 1000; // One (1) second
 constexpr uint64_t	CLIENT_TIMEOUT_THRESHOLD_MS = 60 * 1000; // One minute, like Nginx
 constexpr uint64_t	RECV_HEADER_TIMEOUT_MS = 1 * 1000; // One (1) second
 #endif
+constexpr uint64_t	LINGER_TIMEOUT_MS = 5 * 1000; // Five (5) seconds, like Nginx
 
 constexpr int MAXCONNS = 1000;
 static_assert(MAXCONNS <= 1000, "cf. `ulimit -a`");
-constexpr int MAX_SERVERS = 100;
-static_assert(MAX_SERVERS < MAXCONNS, "have to leave room for client FDs!");
+constexpr int MAX_LISTENERS = 100; // Distinct host:port pairs, any number of servers may share one
+static_assert(MAX_LISTENERS < MAXCONNS, "have to leave room for client FDs!");
 
 enum Kind {
 	Client,
 	Server,
+	CgiStdin, /* Write end of a CGI's stdin, owned by a client */
+	CgiStdout, /* Read end of a CGI's stdout, owned by a client */
+	CgiExit, /* pidfd of a CGI, readable once it exited */
+	Fcgi, /* Connection to a FastCGI backend, shared by clients */
+	Upstream, /* Connection to a proxy_pass server, one client at a time */
   None
 };
 
 enum ConnectionState {
 	C_DISCONNECTED,
+	C_TLS_HANDSHAKE, /* On an ssl address, before the first request */
 	C_RECV_HEADER,
 	C_SEND_RESPONSE,
-	C_FILE_SERVE,
 	C_RECV_BODY,
 	C_TIMED_OUT,
 	C_EXEC_CGI,
+	C_CGI_QUEUED, /* Whole request in, waiting for a CGI slot */
+	C_FOLLOW_CGI, /* Gets a copy of an identical request's script output */
+	C_DRAIN_BODY,
   C_MARKED_FOR_DISCONNECTION
 };
 
-constexpr int 		PORT_STRLEN = 12;
-typedef struct {
+typedef struct Endpoint {
 		enum Kind			kind;
 		int						sockfd;
-		char					IP[INET6_ADDRSTRLEN];
-		char					port[PORT_STRLEN];
+		char					address[LISTEN_ADDRSTRLEN]; // Server and Client: "host:port" or "unix:/path" it listens on
+		char					IP[INET6_ADDRSTRLEN]; // Client-only: the peer's, "unix:" on a unix socket
 		ConnectionState			state;
+		ListenOptions			listen; // Server-only: its `listen` options, for the clients it accepts
 		uint64_t				began_sending_header_ms; // Client-only
 		uint64_t				last_heard_from_ms; // Client-only
 		HttpConnectionHandler	handler; // Client-only
 		CgiHandler				cgiHandler;
+		struct Endpoint			*owner; // CGI pipes only: the client it works for
+		struct Endpoint			*cgiStdin; // Client-only
+		struct Endpoint			*cgiStdout; // Client-only
+		struct Endpoint			*cgiExit; // Client-only
+		struct FcgiConn			*fcgi; // FastCGI connection, of a client's request or of the slot
+		uint16_t				fcgiId; // Client-only: request id on that connection
+		struct ProxyConn		*proxy; // proxy_pass connection, of a client's request or of the slot
+		enum CgiSlot			cgiSlot; // Client-only
+		struct CgiFlight		*flight; // Client-only: the identical requests it leads or follows
+		uint64_t				cgi_deadline_ms; // Client-only: cgi_timeout, 0 for none
 } Endpoint;
 
-extern int	run(const std::vector<Configuration> config);
+extern int	run();
+bool		updateListeners(const Config &next, int qfd);
+std::vector<int>	listeningSockets();
+void		stopAccepting(int qfd);
+bool		isDraining();
 extern void	serveConnection(Endpoint *conn, int qfd, queue_event_type event_type);
 void		receiveHeader(Endpoint *client, int qfd);
 void		receiveBody(Endpoint *client, int qfd);
+void		drainBody(Endpoint *client, int qfd);
 void		disconnectClient(Endpoint *client, int qfd);
 bool		isLiveClient(Endpoint *conn);
 int			watch(int qfd, Endpoint *conn, enum queue_event_type t);
+Endpoint	*claimEndpoint(int qfd, enum Kind kind, int fd, Endpoint *owner,
+				enum queue_event_type t);
+void		releaseEndpoint(int qfd, Endpoint *conn);
+void		feedCgi(Endpoint *pipe, int qfd);
+void		drainCgi(Endpoint *pipe, int qfd);
+void		reapCgi(Endpoint *pidfd, int qfd);
+void		stopCgi(Endpoint *client, int qfd);
+bool		hasCgiRunning(const Endpoint *client);
+bool		cgiProduced(Endpoint *client, int qfd);
+void		cgiFinished(Endpoint *client, int qfd, bool failed);
+void		cgiFailed(Endpoint *client, int qfd, int error);
+void		startQueuedCgi(Endpoint *client, int qfd);
+void		followedCgiDone(Endpoint *client, int qfd, bool complete, int error);
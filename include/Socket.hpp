@@ -9,8 +9,48 @@
 #include <fcntl.h>
 #include <cstdio>
 #include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 
-int		make_server_socket(const char *host, const char *port);
+/* "host:port", or "unix:/path" and its terminating '\0' */
+constexpr size_t	LISTEN_ADDRSTRLEN = sizeof("unix:") + sizeof(((struct sockaddr_un *)0)->sun_path);
+
+/* What follows the port of a `listen`, e.g.
+ *
+ *	listen 8080 backlog=511 reuseport deferred fastopen=256 rcvbuf=256k;
+ *	listen unix:/run/webserv.sock mode=0660;
+ *
+ * Servers sharing an address share its options: those that give some
+ * have to agree. The first six after ssl are for the listening socket,
+ * the last two for each accepted one. Those of TCP are refused for a unix
+ * socket. */
+struct ListenOptions {
+	bool	given = false; // Any of the below was in the file
+	bool	ssl = false; // TLS on every connection, see Tls.hpp
+	int		backlog = SOMAXCONN;
+	bool	reuseport = false; // SO_REUSEPORT, set before bind()
+	bool	deferred = false; // TCP_DEFER_ACCEPT: woken once the request arrives (Linux)
+	int		fastopen = 0; // TCP_FASTOPEN queue length, 0 for off
+	int		rcvbuf = 0; // Bytes, 0 for the system's
+	int		sndbuf = 0; // Same
+	int		busyPoll = 0; // SO_BUSY_POLL microseconds (Linux)
+	bool	tcpNodelay = true;
+	int		notsentLowat = 0; // TCP_NOTSENT_LOWAT bytes, 0 for the system's
+	int		mode = 0; // Unix sockets: permissions of the file, 0 to leave the umask's
+
+	bool	operator==(const ListenOptions &other) const = default;
+};
+
+/* `port` may be "unix:/path", `host` is then unused */
+int		make_server_socket(const char *host, const char *port,
+			const ListenOptions &options = ListenOptions());
+int		tune_listener(int sock, const ListenOptions &options);
+void	tune_client(int sock, const ListenOptions &options);
+void	peer_address(const struct sockaddr_storage &addr, char *ip);
 void	test_server_socket(int server);
 int		socket_set_nonblocking(int sock);
+bool	resolve_address(const std::string &address, struct sockaddr_storage *addr,
+			socklen_t *addrlen);
 void	connect_and_make_test_request(std::string host, std::string port);
@@ -0,0 +1,37 @@
+#pragma once
+
+# include "HandlerStatus.hpp"
+# include "Queue.hpp"
+# include <openssl/types.h>
+# include <memory>
+# include <string>
+# include <sys/types.h>
+
+/* HTTPS on a `listen 443 ssl` address, with OpenSSL:
+ *
+ *	listen 443 ssl;
+ *	ssl_certificate /etc/webserv/cert.pem;
+ *	ssl_certificate_key /etc/webserv/key.pem;
+ *
+ * Each server block on the address has its own certificate, picked by
+ * SNI. The handshake runs in the event loop like the rest, in the
+ * C_TLS_HANDSHAKE state, then the connection reads and writes through
+ * tlsRecv() and tlsSend(), which answer like recv() and send() on a
+ * non-blocking socket. Sessions are resumed from a cache or from a ticket
+ * (ssl_session_cache, ssl_session_tickets, ssl_session_timeout, those of
+ * the first server of the address). Where the kernel does TLS (the `tls`
+ * module on Linux) the socket encrypts by itself once the handshake is
+ * done: files then go out with sendfile() and CGI output with splice(),
+ * as on a plain connection. */
+
+class Configuration;
+
+std::shared_ptr<SSL_CTX>	tlsContext(const Configuration &server);
+SSL				*tlsAccept(int fd, const char *address);
+HandlerStatus	tlsHandshake(SSL *ssl, enum queue_event_type *wait);
+ssize_t			tlsRecv(SSL *ssl, void *buf, size_t len);
+ssize_t			tlsSend(SSL *ssl, const void *buf, size_t len);
+bool			tlsHasPending(SSL *ssl);
+bool			tlsKernelSend(SSL *ssl);
+void			tlsClose(SSL *ssl);
+std::string		tlsStats();
@@ -0,0 +1,25 @@
+#pragma once
+
+# include <string>
+
+/* Binary upgrade without closing the listening sockets:
+ *
+ *	kill -USR2 $(pgrep -x webserv)
+ *
+ * The running webserv starts its own executable again (argv[0]: install
+ * the new build at that path first) and hands it the listening sockets
+ * the way systemd socket activation does, as fds 3 and up, LISTEN_FDS of
+ * them, for the process LISTEN_PID. Once the new process listens, it says
+ * so on a pipe (WEBSERV_UPGRADE_FD), and the old one stops accepting and
+ * exits after its last connection. If the new one dies before that, the
+ * old one carries on as if nothing happened.
+ *
+ * Sockets handed over by a supervisor are adopted the same way at
+ * startup: each goes to the listen address it is bound to. */
+
+constexpr int	LISTEN_FDS_START = 3; // SD_LISTEN_FDS_START
+
+void	upgradeInit(char **argv);
+int		inheritedListener(const std::string &address);
+void	upgradeReady();
+void	upgradePoll(int qfd);
@@ -0,0 +1,47 @@
+#pragma once
+
+# include <string>
+# include <vector>
+# include <map>
+# include <unordered_map>
+# include <cstdint>
+
+/* Virtual hosts: which server block answers a Host header. Built once
+ * per configuration, per listening address:
+ * 1. exact names, in a hash map
+ * 2. leading wildcards ("*.example.com"), in a trie of reversed suffixes
+ * 3. trailing wildcards ("www.example.*"), in a trie of prefixes
+ * Within each kind the server declared first wins, and a name that
+ * matches nothing gets the first server of the address. A lone "*" is
+ * ambiguous and matches nothing. */
+
+class Configuration;
+
+struct VhostTrie {
+	struct Node {
+		std::map<char, uint32_t>	next;
+		size_t						server = SIZE_MAX; // First server whose pattern ends here
+	};
+	std::vector<Node>	nodes = std::vector<Node>(1);
+
+	void	insert(const std::string &key, size_t server);
+	size_t	match(const char *key, size_t len, int step) const;
+};
+
+struct VhostTable {
+	size_t									defaultServer;
+	std::unordered_map<std::string, size_t>	exact;
+	VhostTrie								suffixes; // Reversed
+	VhostTrie								prefixes;
+};
+
+/* The tables of one configuration, by listen address ("ip:port" or
+ * "unix:/path") */
+class VhostIndex {
+	public:
+		void	build(const std::vector<Configuration> &servers);
+		size_t	find(const std::string &address, const std::string &host) const;
+
+	private:
+		std::unordered_map<std::string, VhostTable>	_tables;
+};
@@ -24,6 +24,8 @@ Run tests with:
 
 import os
 from pathlib import Path
+import signal
+import struct
 import subprocess
 import time
 import requests
@@ -43,6 +45,7 @@ def start_server():
     yield proc
     print("=== Stopping server ===")
     proc.kill()
+    proc.wait()  # Its port is free once it is gone
 
 
 ########################################################################
@@ -128,6 +131,300 @@ def test_imagesREDIR():
     assert "/images/" in location
 
 
+def test_longest_location():
+    """
+    Test that the longest matching location wins, not the first declared:
+    /images/thumbs/ comes after /images/ in the config.
+    """
+    response = requests.get("http://127.0.0.1:8080/images/thumbs/a.png", allow_redirects=False)
+    assert response.status_code == 307
+    response = requests.get("http://127.0.0.1:8080/images/", allow_redirects=False)
+    assert response.status_code == 200
+
+
+def test_location_modifiers():
+    """
+    Test exact (=), regex (~*) and ^~ locations: the exact one answers
+    only for its own path, a regex wins over a plain prefix whatever the
+    case, but not over a ^~ prefix.
+    """
+    def status(path):
+        return requests.get("http://127.0.0.1:8080" + path, allow_redirects=False).status_code
+    assert status("/images") == 307
+    assert status("/images?page=2") == 307
+    assert status("/imagesX") == 404
+    assert status("/newDir/notes.BAK") == 307
+    assert status("/newDir/notes.bak?v=1") == 307
+    assert status("/newDir/notes.bakery") == 404
+    assert status("/images/notes.bak") == 404
+
+
+def test_config_snapshot(tmp_path):
+    """
+    Test that a configuration compiles to a binary snapshot that loads back
+    to the same configuration, that a corrupt one is refused without
+    allocating what it claims, and that config errors name their line.
+    """
+    first, second = tmp_path / "first.bin", tmp_path / "second.bin"
+    subprocess.run(["./webserv", "-c", "complete.conf", "-o", str(first)], check=True)
+    subprocess.run(["./webserv", "-c", str(first), "-o", str(second)], check=True)
+    assert first.read_bytes() == second.read_bytes()
+    corrupt = tmp_path / "corrupt.bin"
+    corrupt.write_bytes(first.read_bytes()[:16] + struct.pack("<4Q", 30, 0, 0, 1 << 40))
+    result = subprocess.run(["./webserv", str(corrupt)], capture_output=True, text=True)
+    assert result.returncode == 1, "Expected an error, not an abort"
+    assert "corrupt" in result.stderr
+    bad = tmp_path / "bad.conf"
+    bad.write_text("server\n{\n\tlisten 8080;\n\troot home;\n}\n")
+    result = subprocess.run(["./webserv", str(bad)], capture_output=True, text=True)
+    assert result.returncode != 0
+    assert "line 4" in result.stderr
+
+
+def test_config_reload(tmp_path):
+    """
+    Test that SIGHUP reads the configuration again: a new listen address
+    opens, the dropped one closes but its established connections keep
+    being served, and a broken file leaves the running configuration.
+    """
+    conf = tmp_path / "reload.conf"
+    def write(port):
+        conf.write_text("server\n{\n\tlisten %d;\n\thost 127.0.0.1;\n\tindex index.html;\n"
+                        "\tlocation /\n\t{\n\t\troot home/vhost;\n\t\tmethods GET;\n\t}\n"
+                        "\tlocation /status\n\t{\n\t\tmethods GET;\n\t\tstats on;\n\t}\n}\n" % port)
+    write(8180)
+    server = subprocess.Popen(["./webserv", str(conf)])
+    try:
+        time.sleep(0.5)
+        session = requests.Session()
+        assert "config_generation 1\n" in session.get("http://127.0.0.1:8180/status", timeout=5).text
+        write(8181)
+        server.send_signal(signal.SIGHUP)
+        time.sleep(1.5)
+        assert "config_generation 2\n" in requests.get("http://127.0.0.1:8181/status", timeout=5).text
+        with pytest.raises(requests.exceptions.ConnectionError):
+            requests.get("http://127.0.0.1:8180/", timeout=5)
+        assert "wildcard vhost" in session.get("http://127.0.0.1:8180/", timeout=5).text
+        conf.write_text("server {\n")
+        server.send_signal(signal.SIGHUP)
+        time.sleep(1.5)
+        assert server.poll() is None
+        assert "config_generation 2\n" in requests.get("http://127.0.0.1:8181/status", timeout=5).text
+    finally:
+        server.kill()
+        server.wait()
+
+
+def test_binary_upgrade(tmp_path):
+    """
+    Test that SIGUSR2 starts a new webserv on the same listening socket:
+    requests keep being answered throughout, and the old process exits
+    once its connections are done.
+    """
+    conf = tmp_path / "upgrade.conf"
+    conf.write_text("server\n{\n\tlisten 8280;\n\thost 127.0.0.1;\n\tindex index.html;\n"
+                    "\tlocation /\n\t{\n\t\troot home/vhost;\n\t\tmethods GET;\n\t}\n}\n")
+    old = subprocess.Popen(["./webserv", str(conf)])
+    try:
+        time.sleep(0.5)
+        old.send_signal(signal.SIGUSR2)
+        deadline = time.time() + 3
+        while time.time() < deadline:
+            assert requests.get("http://127.0.0.1:8280/", timeout=5).status_code == 200
+        assert old.wait(timeout=5) == 0, "The old process should have handed over and exited"
+        assert requests.get("http://127.0.0.1:8280/", timeout=5).status_code == 200
+    finally:
+        old.kill()
+        subprocess.run(["pkill", "-f", str(conf)])
+
+
+def test_listen_options(tmp_path):
+    """
+    Test that the options of a listen directive are applied to its socket,
+    and that two servers on one address cannot both give some.
+    """
+    server = ("server\n{{\n\tlisten 8290{};\n\thost 127.0.0.1;\n"
+              "\tlocation /\n\t{{\n\t\troot home/vhost;\n\t\tmethods GET;\n\t}}\n}}\n")
+    conf = tmp_path / "listen.conf"
+    conf.write_text(server.format(" backlog=7 reuseport deferred fastopen=16 rcvbuf=64k"
+                                  " tcp_nodelay=on notsent_lowat=16k") + server.format(""))
+    proc = subprocess.Popen(["./webserv", str(conf)])
+    try:
+        time.sleep(0.5)
+        assert requests.get("http://127.0.0.1:8290/", timeout=5).status_code == 200
+        listening = subprocess.run(["ss", "-ltnH", "sport = :8290"], capture_output=True, text=True).stdout
+        assert listening.split()[2] == "7", "The backlog is the Send-Q of a listening socket"
+    finally:
+        proc.kill()
+        proc.wait()
+    conf.write_text(server.format(" backlog=7") + server.format(" reuseport"))
+    assert subprocess.run(["./webserv", str(conf)], timeout=5).returncode != 0
+
+
+def test_unix_socket_listener(tmp_path):
+    """
+    Test that a server listens on a unix socket with the given mode, picks
+    its virtual host by the Host header there, and gives CGI scripts
+    REMOTE_ADDR=unix: where there is no client address.
+    """
+    import http.client
+    import socket
+    import stat
+    path = tmp_path / "webserv.sock"
+    conf = tmp_path / "unix.conf"
+    conf.write_text(
+        f"server\n{{\n\tlisten unix:{path} mode=0660;\n\tindex index.html;\n"
+        "\tlocation /\n\t{\n\t\troot home;\n\t\tmethods GET;\n\t\tcgi_path_python /usr/bin;\n\t}\n}\n"
+        f"server\n{{\n\tlisten unix:{path};\n\tserver_name *.example.com;\n\tindex index.html;\n"
+        "\tlocation /\n\t{\n\t\troot home/vhost;\n\t\tmethods GET;\n\t}\n}\n")
+
+    class UnixConnection(http.client.HTTPConnection):
+        def connect(self):
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.settimeout(5)
+            self.sock.connect(str(path))
+
+    def get(target, host):
+        connection = UnixConnection("localhost")
+        connection.request("GET", target, headers={"Host": host})
+        response = connection.getresponse()
+        assert response.status == 200
+        body = response.read().decode()
+        connection.close()
+        return body
+
+    proc = subprocess.Popen(["./webserv", str(conf)])
+    try:
+        time.sleep(0.5)
+        assert stat.S_IMODE(os.stat(path).st_mode) == 0o660
+        assert "wildcard vhost" in get("/", "www.example.com")
+        assert "wildcard vhost" not in get("/", "localhost")
+        script = get("/default-cgis/remote_addr.py", "localhost")
+        assert "REMOTE_ADDR=unix:\n" in script and "SERVER_PORT=\n" in script
+    finally:
+        proc.kill()
+        proc.wait()
+
+
+def test_tls(tmp_path):
+    """
+    Test that a `listen ssl` server answers over TLS with its certificate,
+    sends a whole file and CGI output, and resumes a session. Scripts
+    see HTTPS=on and upstreams X-Forwarded-Proto: https.
+    """
+    import socket
+    import ssl
+    cert, key = tmp_path / "cert.pem", tmp_path / "key.pem"
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-subj", "/CN=localhost",
+                    "-days", "1", "-keyout", str(key), "-out", str(cert)], check=True, capture_output=True)
+    conf = tmp_path / "tls.conf"
+    conf.write_text(
+        f"server\n{{\n\tlisten 8443 ssl;\n\thost 127.0.0.1;\n\tssl_certificate {cert};\n"
+        f"\tssl_certificate_key {key};\n\tindex index.html;\n"
+        "\tlocation /\n\t{\n\t\troot home;\n\t\tmethods GET;\n\t\tcgi_path_python /usr/bin;\n\t}\n"
+        "\tlocation /proxy/\n\t{\n\t\tproxy_pass 127.0.0.1:9103;\n\t}\n}\n")
+    context = ssl.create_default_context(cafile=str(cert))
+    context.check_hostname = False
+    context.maximum_version = ssl.TLSVersion.TLSv1_2 # Sessions come with the handshake
+
+    def connect(session=None):
+        sock = socket.create_connection(("127.0.0.1", 8443), timeout=5)
+        return context.wrap_socket(sock, server_hostname="localhost", session=session)
+
+    proc = subprocess.Popen(["./webserv", str(conf)])
+    upstream = subprocess.Popen(["python3", "test/http_standin.py", "127.0.0.1:9103"])
+    try:
+        time.sleep(0.5)
+        response = requests.get("https://127.0.0.1:8443/images/upolat_intra.jpg", verify=False, timeout=5)
+        assert response.status_code == 200
+        with open("home/images/upolat_intra.jpg", "rb") as f:
+            assert response.content == f.read()
+        script = requests.get("https://127.0.0.1:8443/default-cgis/remote_addr.py", verify=False, timeout=5)
+        assert "SERVER_PORT=8443" in script.text
+        assert "HTTPS=on" in script.text
+        proxied = requests.get("https://127.0.0.1:8443/proxy/x", verify=False, timeout=5)
+        assert "proto https\n" in proxied.text
+        first = connect()
+        session = first.session
+        first.close()
+        second = connect(session)
+        assert second.session_reused
+        second.sendall(b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        assert second.recv(100).startswith(b"HTTP/1.1 200")
+        second.close()
+    finally:
+        upstream.kill()
+        proc.kill()
+        proc.wait()
+
+
+def test_http2(start_server, tmp_path):
+    """
+    Test that h2c is served both with prior knowledge and after an Upgrade,
+    a whole file through the flow control windows and later requests as
+    streams of the same connection. A client flooding PINGs without reading
+    the acks is read no further, and the server keeps serving the others.
+    """
+    out = tmp_path / "image.jpg"
+    result = subprocess.run(["curl", "-s", "--http2-prior-knowledge", "-o", str(out), "-w", "%{http_version} %{http_code}",
+                             "http://127.0.0.1:8080/images/upolat_intra.jpg"], capture_output=True, text=True, timeout=10)
+    assert result.stdout == "2 200"
+    with open("home/images/upolat_intra.jpg", "rb") as f:
+        assert out.read_bytes() == f.read()
+    # Over Upgrade: 101 then stream 1, the others reuse the connection
+    result = subprocess.run(["curl", "-s", "--http2", "-o", "/dev/null", "-o", "/dev/null", "-o", "/dev/null",
+                             "-w", "%{http_version} %{http_code} %{num_connects}\n",
+                             "http://127.0.0.1:8080/", "http://127.0.0.1:8080/nonexistent", "http://127.0.0.1:8080/"],
+                            capture_output=True, text=True, timeout=10)
+    assert result.stdout.splitlines() == ["2 200 1", "2 404 0", "2 200 0"]
+    import socket
+    flood = socket.create_connection(("127.0.0.1", 8080))
+    flood.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    flood.sendall(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n\0\0\0\4\0\0\0\0\0")
+    flood.settimeout(2)
+    sent = 0
+    with pytest.raises(socket.timeout):
+        while sent < 64 * 1024 * 1024:
+            flood.sendall(b"\0\0\x08\x06\0\0\0\0\0pingpong" * 1000)
+            sent += 17000
+    flood.close()
+    assert requests.get("http://127.0.0.1:8080/", timeout=5).status_code == 200
+
+
+def test_graceful_shutdown(start_server):
+    """
+    Test that SIGTERM stops accepting at once but lets a running request
+    finish, telling it Connection: close, before the server exits.
+    """
+    from concurrent.futures import ThreadPoolExecutor
+    with ThreadPoolExecutor() as pool:
+        slow = pool.submit(requests.get, "http://127.0.0.1:8080/default-cgis/sleep.py?1", timeout=5)
+        time.sleep(0.3)
+        start_server.send_signal(signal.SIGTERM)
+        time.sleep(0.3)
+        with pytest.raises(requests.exceptions.ConnectionError):
+            requests.get("http://127.0.0.1:8080/", timeout=5)
+        response = slow.result()
+    assert response.status_code == 200 and "slept" in response.text
+    assert response.headers.get("Connection") == "close"
+    assert start_server.wait(timeout=5) == 0
+
+
+def test_virtual_hosts():
+    """
+    Test that the Host header picks the server block: exact names first,
+    then wildcards, ignoring case, a port and a trailing dot, and the first
+    server of the address otherwise.
+    """
+    def page(host):
+        return requests.get("http://127.0.0.1:8080/", headers={"Host": host}).text
+    assert "wildcard vhost" not in page("test.com")
+    assert "wildcard vhost" in page("www.example.com")
+    assert "wildcard vhost" in page("WWW.Example.COM.:8080")
+    assert "wildcard vhost" not in page("example.com")
+    assert "wildcard vhost" not in page("unknown.org")
+
+
 def test_bad_http_request():
     """
     Test that sending a malformed HTTP request (bad header format) returns a 400 error.
@@ -192,6 +489,34 @@ def test_good_http_request():
     assert "200" in status_line, f"Expected a 200 OK response, got: {status_line}"
 
 
+def test_slow_reader():
+    """
+    Test that a client reading slowly, so that every send is partial, gets
+    the headers and the whole file, and that the connection serves the
+    next request after it.
+    """
+    import socket
+    with open("home/images/upolat_intra.jpg", "rb") as f:
+        expected = f.read()
+    sock = socket.socket()
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sock.settimeout(5)
+    sock.connect(("127.0.0.1", 8080))
+    with sock:
+        sock.sendall(b"GET /images/upolat_intra.jpg HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+        time.sleep(0.2) # Lets the socket fill up first
+        data = b""
+        while b"\r\n\r\n" not in data or len(data) < data.index(b"\r\n\r\n") + 4 + len(expected):
+            chunk = sock.recv(4096)
+            assert chunk, "Connection closed before the end of the file"
+            data += chunk
+        head, body = data.split(b"\r\n\r\n", 1)
+        assert head.startswith(b"HTTP/1.1 200") and b"Content-Length: %d" % len(expected) in head
+        assert body == expected
+        sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+        assert sock.recv(100).startswith(b"HTTP/1.1 200")
+
+
 
 def test_not_found_error():
     """
@@ -221,6 +546,253 @@ def test_client_body_size_exceeded():
     except Exception as e:
         print(f"Error sending payload: {e}")
     
+def test_rejected_before_body():
+    """
+    Test that a POST to a GET-only location is refused as soon as the headers
+    are in, without waiting for the body, and that the rest of the body is
+    skipped so the connection stays usable after a redirect.
+    """
+    import socket
+
+    with socket.create_connection(("127.0.0.1", 8080), timeout=2) as sock:
+        sock.sendall(b"POST /newDir/ HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                     b"Content-Length: 100000\r\n\r\n")
+        status_line = sock.recv(1024).decode(errors="ignore").splitlines()[0]
+    assert "405" in status_line, f"Expected 405 before the body, got: {status_line}"
+
+    with socket.create_connection(("127.0.0.1", 8080), timeout=2) as sock:
+        sock.sendall(b"POST /oldDir/ HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                     b"Content-Length: 10\r\n\r\n")
+        assert "307" in sock.recv(1024).decode(errors="ignore").splitlines()[0]
+        sock.sendall(b"0123456789GET /index.html HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+        status_line = sock.recv(1024).decode(errors="ignore").splitlines()[0]
+    assert "200" in status_line, f"Expected the next request to be served, got: {status_line}"
+
+def test_cgi_streamed():
+    """
+    Test that CGI output without a Content-Length is streamed with chunked
+    transfer encoding, and that the connection can be reused afterwards.
+    """
+    import requests
+
+    with requests.Session() as session:
+        response = session.get("http://127.0.0.1:8080/default-cgis/python_test.py", timeout=5)
+        assert response.status_code == 200, f"Unexpected status: {response.status_code}"
+        assert response.headers.get("Transfer-Encoding") == "chunked"
+        assert "Hello from Python CGI!" in response.text
+        response = session.get("http://127.0.0.1:8080/index.html", timeout=5)
+        assert response.status_code == 200
+
+def test_fastcgi_pass():
+    """
+    Test that a location with fastcgi_pass is served by a FastCGI backend,
+    here test/fcgi_standin.py, including request bodies and concurrent
+    requests sharing its connections.
+    """
+    standin = subprocess.Popen(["python3", "test/fcgi_standin.py", "127.0.0.1:9009"])
+    try:
+        time.sleep(0.3)
+        response = requests.get("http://127.0.0.1:8080/fcgi/hello.py?x=1", timeout=5)
+        assert response.status_code == 200, f"Unexpected status: {response.status_code}"
+        assert "Hello from FastCGI!" in response.text
+        assert "query=x=1" in response.text
+        response = requests.post("http://127.0.0.1:8080/fcgi/hello.py", data="a" * 100000, timeout=5)
+        assert "body=" + "a" * 100000 in response.text
+
+        async def fetch_all():
+            async with aiohttp.ClientSession() as session:
+                async def fetch(i):
+                    async with session.get(f"http://127.0.0.1:8080/fcgi/hello.py?i={i}") as r:
+                        return r.status, f"query=i={i}" in await r.text()
+                return await asyncio.gather(*[fetch(i) for i in range(20)])
+        assert set(asyncio.run(fetch_all())) == {(200, True)}
+    finally:
+        standin.kill()
+
+def test_cgi_pool(tmp_path):
+    """
+    Test that a cgi_pool location runs scripts in its warm workers, which
+    are reused across requests and retired after their share. Workers do
+    not inherit the server's environment, and a configuration read where
+    cgi_worker.py cannot be found is refused.
+    """
+    pids = set()
+    for i in range(60):
+        response = requests.post("http://127.0.0.1:8080/pool/pid.py", data=f"n={i}", timeout=5)
+        assert response.status_code == 200, f"Unexpected status: {response.status_code}"
+        assert f"body=n={i}" in response.text
+        pids.add(response.text.split("pid=")[1].split()[0])
+    assert 1 < len(pids) < 60, f"Expected a few reused workers, got {len(pids)}"
+    worker = response.text.split("pid=")[1].split()[0]
+    if os.path.exists(f"/proc/{worker}/environ"):
+        with open(f"/proc/{worker}/environ", "rb") as f:
+            names = {var.split(b"=")[0] for var in f.read().split(b"\0") if var}
+        assert names <= {b"PATH", b"LANG", b"LC_ALL", b"TZ"}, names
+    result = subprocess.run([os.path.abspath("webserv"), os.path.abspath("complete.conf")],
+                            cwd=tmp_path, capture_output=True, text=True, timeout=5)
+    assert result.returncode != 0
+    assert "cannot find cgi_worker.py" in result.stdout + result.stderr
+    # Past cgi_max_output the worker is killed and replaced, the server goes on
+    result = subprocess.run(["curl", "-s", "-o", "/dev/null", "-w", "%{size_download}",
+                             "http://127.0.0.1:8080/pool/big.py"], capture_output=True, text=True, timeout=10)
+    assert int(result.stdout) < 4 * 1024 * 1024
+    response = requests.post("http://127.0.0.1:8080/pool/pid.py", data="n=after", timeout=5)
+    assert "body=n=after" in response.text
+    assert "cgi_output_limits 1" in requests.get("http://127.0.0.1:8080/status", timeout=5).text
+
+def test_cgi_max_concurrent():
+    """
+    Test that a burst of scripts over the location's cgi_max_concurrent
+    waits in the CGI queue, and that what the location's share of the
+    queue cannot hold is turned away at once with 503 and Retry-After.
+    A script of another location meanwhile runs at once. The counters
+    show on /status.
+    """
+    async def burst():
+        async with aiohttp.ClientSession() as session:
+            async def fetch(i):
+                async with session.get("http://127.0.0.1:8080/default-cgis/sleep.py?0.3") as r:
+                    await r.read()
+                    return r.status, r.headers.get("Retry-After")
+            async def other():
+                await asyncio.sleep(0.1)
+                start = time.time()
+                async with session.get("http://127.0.0.1:8080/cached/clock.py?no-store") as r:
+                    await r.read()
+                    return r.status, time.time() - start
+            return await asyncio.gather(other(), *[fetch(i) for i in range(24)])
+    results = asyncio.run(burst())
+    status, elapsed = results.pop(0)
+    assert status == 200 and elapsed < 0.3, f"Another location waited {elapsed:.2f}s"
+    assert results.count((200, None)) == 16, f"Expected 4 running and 12 queued: {results}"
+    assert results.count((503, "1")) == 8
+    stats = requests.get("http://127.0.0.1:8080/status", timeout=5).text
+    assert "cgi_running 0" in stats
+    assert "cgi_queue_depth 0" in stats
+    assert "cgi_counts_tracked 0" in stats
+
+def test_cgi_timeout():
+    """
+    Test that a script running past cgi_timeout gets its client a 504,
+    and that one ignoring SIGTERM is killed after the grace period.
+    """
+    start = time.time()
+    response = requests.get("http://127.0.0.1:8080/default-cgis/stubborn.py", timeout=10)
+    assert response.status_code == 504
+    assert time.time() - start < 4
+    time.sleep(2.5)
+    stats = requests.get("http://127.0.0.1:8080/status", timeout=5).text
+    assert "cgi_timeouts 1" in stats
+    assert "cgi_terminated 1" in stats
+    assert "cgi_killed 1" in stats
+    assert "cgi_running 0" in stats
+
+def test_cgi_limits():
+    """
+    Test that cgi_max_memory and cgi_max_cpu are the script's rlimits
+    from its first instruction, set before the interpreter runs.
+    """
+    response = requests.get("http://127.0.0.1:8080/default-cgis/limits.py", timeout=5)
+    assert response.status_code == 200
+    assert f"RLIMIT_AS={512 * 1024 * 1024}" in response.text
+    assert "RLIMIT_CPU=10" in response.text
+
+def test_cgi_cache():
+    """
+    Test that a cgi_cache location answers repeated GETs from memory for
+    the time it is valid, and that a script saying no-store runs each time,
+    like every request with a cookie.
+    """
+    first = requests.get("http://127.0.0.1:8080/cached/clock.py?test", timeout=5)
+    assert first.status_code == 200
+    for _ in range(5):
+        again = requests.get("http://127.0.0.1:8080/cached/clock.py?test", timeout=5)
+        assert again.text == first.text, "Expected the cached response"
+        assert again.headers.get("Age") is not None
+    other = requests.get("http://127.0.0.1:8080/cached/clock.py?test-other", timeout=5)
+    assert other.text != first.text, "The query string is part of the key"
+    uncached = [requests.get("http://127.0.0.1:8080/cached/clock.py?no-store", timeout=5).text
+                for _ in range(2)]
+    assert uncached[0] != uncached[1], "no-store responses must not be cached"
+    alice = requests.get("http://127.0.0.1:8080/cached/clock.py?test", cookies={"user": "alice"}, timeout=5)
+    bob = requests.get("http://127.0.0.1:8080/cached/clock.py?test", cookies={"user": "bob"}, timeout=5)
+    assert "cookie=user=alice" in alice.text and "cookie=user=bob" in bob.text, "Requests with cookies reach the script"
+
+def test_cgi_coalesce():
+    """
+    Test that identical GETs arriving while a cgi_coalesce script runs all
+    get the output of that one run, joining before or during its output.
+    """
+    async def burst():
+        async with aiohttp.ClientSession() as session:
+            async def fetch(delay):
+                await asyncio.sleep(delay)
+                async with session.get("http://127.0.0.1:8080/cached/clock.py?no-cache") as r:
+                    return r.status, await r.text()
+            return await asyncio.gather(*[fetch(i * 0.02) for i in range(8)])
+    results = asyncio.run(burst())
+    assert all(status == 200 for status, _ in results), results
+    assert len({text for _, text in results}) == 1, f"Expected one run of the script: {results}"
+    stats = requests.get("http://127.0.0.1:8080/status", timeout=5).text
+    assert "coalesce_in_flight 0" in stats
+
+
+def test_cgi_coalesce_private():
+    """
+    Test that cgi_coalesce never hands one client's response to another:
+    requests with different cookies each run the script, and a response
+    that sets a cookie sends the requests waiting on it to their own run.
+    """
+    async def burst(query, cookies):
+        async with aiohttp.ClientSession() as session:
+            async def fetch(delay, cookie):
+                await asyncio.sleep(delay)
+                headers = {"Cookie": cookie} if cookie else {}
+                async with session.get("http://127.0.0.1:8080/cached/clock.py?" + query, headers=headers) as r:
+                    return r.status, r.headers.get("Set-Cookie"), await r.text()
+            return await asyncio.gather(*[fetch(i * 0.02, c) for i, c in enumerate(cookies)])
+    alice, bob = asyncio.run(burst("no-cache-who", ["user=alice", "user=bob"]))
+    assert "cookie=user=alice" in alice[2] and "cookie=user=bob" in bob[2]
+    results = asyncio.run(burst("login", [None] * 4))
+    assert all(status == 200 for status, _, _ in results), results
+    sessions = {cookie for _, cookie, _ in results}
+    assert len(sessions) == 4, f"Expected a session of its own for each client: {results}"
+    for _, cookie, text in results:
+        assert "pid=" + cookie.split("=")[1] in text
+    stats = requests.get("http://127.0.0.1:8080/status", timeout=5).text
+    assert "coalesce_in_flight 0" in stats
+
+def test_proxy_pass():
+    """
+    Test that a proxy_pass location spreads requests over its upstream
+    servers, here two test/http_standin.py, streams bodies both ways,
+    reuses connections, and fails over when one server goes away.
+    """
+    a = subprocess.Popen(["python3", "test/http_standin.py", "127.0.0.1:9101", "a"])
+    b = subprocess.Popen(["python3", "test/http_standin.py", "127.0.0.1:9102", "b"])
+    try:
+        time.sleep(0.5)
+        backends = [requests.get(f"http://127.0.0.1:8080/proxy/x?i={i}", timeout=5).text.split()[1]
+                    for i in range(4)]
+        assert sorted(backends) == ["a", "a", "b", "b"], backends
+        body = os.urandom(300000)
+        response = requests.post("http://127.0.0.1:8080/proxy/echo?chunked", data=body, timeout=5)
+        assert response.status_code == 200, f"Unexpected status: {response.status_code}"
+        assert "forwarded 127.0.0.1" in response.text
+        assert "proto http\n" in response.text
+        assert response.content.endswith(body)
+        b.kill()
+        b.wait()
+        for i in range(4):
+            response = requests.get(f"http://127.0.0.1:8080/proxy/y?i={i}", timeout=5)
+            assert response.status_code == 200 and "backend a" in response.text
+        stats = requests.get("http://127.0.0.1:8080/status", timeout=5).text
+        assert "upstream backends 127.0.0.1:9102 down" in stats
+        assert "proxy_reused 0" not in stats
+    finally:
+        a.kill()
+        b.kill()
+
 def test_file_upload_and_check():
     """
     Test that uploading a file through a POST request is successful and 
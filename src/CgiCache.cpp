@@ -0,0 +1,220 @@
+#include "HttpConnectionHandler.hpp"
+#include "CgiCache.hpp"
+#include "Timeout.hpp"
+#include "Parser.hpp"
+#include <list>
+#include <strings.h>
+#include <unordered_map>
+
+struct CacheEntry {
+	string		key;
+	string		status;
+	string		headers;
+	std::shared_ptr<const string>	body; // Also held by the responses sending it
+	uint64_t	stored_ms;
+	uint64_t	freshUntil_ms;
+	uint64_t	staleUntil_ms;
+	uint64_t	refreshUntil_ms; // A request is running the script again until then
+};
+
+/* Most recently used first */
+struct LocationCache {
+	std::list<CacheEntry>												entries;
+	std::unordered_map<string, std::list<CacheEntry>::iterator>		index;
+	size_t																bytes = 0;
+};
+
+static std::unordered_map<const LocationBlock *, LocationCache>	g_caches;
+
+/* Caches are per location of the running configuration: a request that
+ * started before a reload neither reads nor fills them. */
+static bool	isCurrent(const HttpConnectionHandler &handler)
+{
+	return (handler.getConfig() == currentConfig());
+}
+
+static struct {
+	uint64_t	hits;
+	uint64_t	staleHits;
+	uint64_t	misses;
+	uint64_t	stored;
+	uint64_t	evicted;
+} g_stats;
+
+static size_t	entrySize(const CacheEntry &e)
+{
+	return (e.key.size() + e.status.size() + e.headers.size() + e.body->size());
+}
+
+static void	evict(LocationCache &cache, std::list<CacheEntry>::iterator it)
+{
+	cache.bytes -= entrySize(*it);
+	cache.index.erase(it->key);
+	cache.entries.erase(it);
+}
+
+/* Also what identical requests are told apart by, see CgiFlight */
+string	cgiRequestKey(const HttpConnectionHandler &handler)
+{
+	const std::map<string, string> &headers = handler.getHeaders();
+	auto host = headers.find("Host");
+	return (handler.getMethod() + " "
+		+ (host != headers.end() ? host->second : "") + " "
+		+ handler.getFilePath() + "?" + handler.getQueryString());
+}
+
+/* Credentials the key does not hold: the response may be for this
+ * client only (RFC 9111 3.5). Also keeps it out of CgiFlight. */
+bool	cgiRequestIsPrivate(const HttpConnectionHandler &handler)
+{
+	for (const auto &header : handler.getHeaders())
+		if (strcasecmp(header.first.c_str(), "Cookie") == 0
+				|| strcasecmp(header.first.c_str(), "Authorization") == 0)
+			return (true);
+	return (false);
+}
+
+/* Answers a GET from the cache of its location when there is a fresh
+ * response, or a stale one that another request is already refreshing.
+ * Otherwise the script runs and its response is captured for
+ * cgiCacheStore(); the first request to find a response stale is the
+ * one that refreshes it, the others keep getting the stale copy.
+ * Returns true if the request was answered. */
+bool	cgiCacheServe(HttpConnectionHandler &handler)
+{
+	const LocationBlock *loc = handler.getLocationBlock();
+	if (loc->cgiCacheValid == 0 || handler.getMethod() != "GET" || !isCurrent(handler)
+			|| cgiRequestIsPrivate(handler))
+		return (false);
+	LocationCache &cache = g_caches[loc];
+	string key = cgiRequestKey(handler);
+	uint64_t now = now_ms();
+	auto found = cache.index.find(key);
+	if (found != cache.index.end())
+	{
+		std::list<CacheEntry>::iterator it = found->second;
+		bool fresh = now < it->freshUntil_ms;
+		if (fresh || (now < it->staleUntil_ms && now < it->refreshUntil_ms))
+		{
+			cache.entries.splice(cache.entries.begin(), cache.entries, it);
+			handler.replayCgiResponse(it->status, it->headers, it->body,
+				(now - it->stored_ms) / 1000);
+			fresh ? g_stats.hits++ : g_stats.staleHits++;
+			return (true);
+		}
+		if (now < it->staleUntil_ms)
+			it->refreshUntil_ms = now + CGI_CACHE_REFRESH_LEASE_MS;
+		else
+			evict(cache, it);
+	}
+	g_stats.misses++;
+	handler.captureCgiResponse(key, loc->cgiCacheSize / CGI_CACHE_MAX_ENTRY_SHARE);
+	return (false);
+}
+
+/* Seconds from a Cache-Control directive like max-age=N, or -1 */
+static long	directive(const string &cacheControl, const string &name)
+{
+	size_t at = cacheControl.find(name + "=");
+	if (at == string::npos)
+		return (-1);
+	return (std::strtol(cacheControl.c_str() + at + name.size() + 1, nullptr, 10));
+}
+
+static string	toLower(string s)
+{
+	for (char &c : s)
+		c = std::tolower(static_cast<unsigned char>(c));
+	return (s);
+}
+
+/* The script ran to completion: keep its response if it is a 200 that
+ * says nothing against it. Responses that set cookies are per client
+ * and never kept. */
+void	cgiCacheStore(HttpConnectionHandler &handler)
+{
+	CgiCapture &capture = handler.getCgiCapture();
+	if (!capture.keep || capture.status.compare(0, 3, "200") != 0 || !isCurrent(handler)
+			|| cgiRequestIsPrivate(handler))
+		return ;
+	string cacheControl = toLower(capture.cacheControl);
+	if (cacheControl.find("no-store") != string::npos
+			|| cacheControl.find("no-cache") != string::npos
+			|| cacheControl.find("private") != string::npos
+			|| toLower(capture.headers).find("set-cookie:") != string::npos)
+		return ;
+	const LocationBlock *loc = handler.getLocationBlock();
+	long valid = directive(cacheControl, "s-maxage");
+	if (valid < 0)
+		valid = directive(cacheControl, "max-age");
+	if (valid < 0)
+		valid = loc->cgiCacheValid;
+	long stale = directive(cacheControl, "stale-while-revalidate");
+	if (stale < 0)
+		stale = loc->cgiCacheStale;
+	if (valid == 0)
+		return ;
+
+	LocationCache &cache = g_caches[loc];
+	auto found = cache.index.find(capture.key);
+	if (found != cache.index.end())
+		evict(cache, found->second);
+	uint64_t now = now_ms();
+	cache.entries.push_front({ capture.key, capture.status, capture.headers,
+		std::make_shared<const string>(std::move(capture.body)),
+		now, now + valid * 1000, now + (valid + stale) * 1000, 0 });
+	cache.index[capture.key] = cache.entries.begin();
+	cache.bytes += entrySize(cache.entries.front());
+	g_stats.stored++;
+	while (cache.bytes > loc->cgiCacheSize)
+	{
+		evict(cache, std::prev(cache.entries.end()));
+		g_stats.evicted++;
+	}
+	capture.keep = false;
+}
+
+/* The request is done with its script: a refresh that did not make it
+ * to cgiCacheStore() lets the next request try again right away. */
+void	cgiCacheRelease(HttpConnectionHandler &handler)
+{
+	CgiCapture &capture = handler.getCgiCapture();
+	if (capture.key.empty())
+		return ;
+	if (!isCurrent(handler))
+	{
+		capture = CgiCapture();
+		return ;
+	}
+	LocationCache &cache = g_caches[handler.getLocationBlock()];
+	auto found = cache.index.find(capture.key);
+	if (found != cache.index.end() && capture.keep)
+		found->second->refreshUntil_ms = 0;
+	capture = CgiCapture();
+}
+
+/* On reload: the locations they belong to are going away */
+void	cgiCacheFlush()
+{
+	g_caches.clear();
+}
+
+std::string	cgiCacheStats()
+{
+	size_t entries = 0;
+	size_t bytes = 0;
+	for (const auto &[loc, cache] : g_caches)
+	{
+		entries += cache.entries.size();
+		bytes += cache.bytes;
+	}
+	std::ostringstream out;
+	out << "cache_hits " << g_stats.hits << "\n"
+		<< "cache_stale_hits " << g_stats.staleHits << "\n"
+		<< "cache_misses " << g_stats.misses << "\n"
+		<< "cache_stored " << g_stats.stored << "\n"
+		<< "cache_evicted " << g_stats.evicted << "\n"
+		<< "cache_entries " << entries << "\n"
+		<< "cache_bytes " << bytes << "\n";
+	return (out.str());
+}
@@ -0,0 +1,185 @@
+#include "Server.hpp"
+#include "CgiFlight.hpp"
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+/* Flights that still take followers, by request key */
+static std::unordered_map<string, CgiFlight *>	g_flights;
+
+/* Keys whose script answered for one client only, not led again */
+static std::unordered_set<string>	g_private;
+
+static struct {
+	uint64_t	led;
+	uint64_t	followed;
+	uint64_t	dropped; // Followers too slow to keep up
+	uint64_t	released; // Followers sent to run their own script
+} g_stats;
+
+/* A request with credentials may get an answer meant for its user only */
+static bool	canCoalesce(const Endpoint *client)
+{
+	const HttpConnectionHandler &handler = client->handler;
+	if (!handler.getLocationBlock()->cgiCoalesce
+			|| handler.getMethod() != "GET"
+			|| handler.getHeaders().count("Content-Length")
+			|| handler.getHeaders().count("Transfer-Encoding"))
+		return (false);
+	return (!cgiRequestIsPrivate(handler));
+}
+
+static void	closeFlight(CgiFlight *flight)
+{
+	if (!flight->open)
+		return ;
+	g_flights.erase(flight->key);
+	flight->open = false;
+	flight->history.clear();
+}
+
+/* Joins the script already running for an identical request, if any.
+ * The follower starts with a copy of what its leader framed so far. */
+bool	cgiFollow(Endpoint *client)
+{
+	if (!canCoalesce(client))
+		return (false);
+	auto found = g_flights.find(cgiRequestKey(client->handler));
+	if (found == g_flights.end() || g_private.count(found->first))
+		return (false);
+	CgiFlight *flight = found->second;
+	client->handler.getCgiCapture() = CgiCapture(); /* The leader stores it */
+	client->handler.setResponse(flight->history);
+	flight->followers.push_back({ client, !flight->history.empty() });
+	client->flight = flight;
+	g_stats.followed++;
+	logDebug("%d follows %d", client->sockfd, flight->leader->sockfd);
+	return (true);
+}
+
+/* The script was started: identical requests may follow it from now on */
+void	cgiLead(Endpoint *client)
+{
+	if (!canCoalesce(client))
+		return ;
+	string key = cgiRequestKey(client->handler);
+	if (g_flights.count(key) || g_private.count(key))
+		return ;
+	CgiFlight *flight = new CgiFlight{ key, client, {}, "", "", true };
+	g_flights[key] = flight;
+	client->flight = flight;
+	client->handler.teeCgiOutput(&flight->pending);
+	g_stats.led++;
+}
+
+/* The leader's response turned out to be for its client only: nothing
+ * of it was copied, and its followers start their own script instead */
+static void	releaseFollowers(CgiFlight *flight, int qfd)
+{
+	if (flight->open)
+	{
+		if (g_private.size() >= CGI_FLIGHT_PRIVATE_MAX)
+			g_private.clear();
+		g_private.insert(flight->key);
+		closeFlight(flight);
+	}
+	std::vector<CgiFollower> followers;
+	followers.swap(flight->followers);
+	for (CgiFollower &f : followers)
+	{
+		f.client->flight = nullptr;
+		if (f.client->state == C_MARKED_FOR_DISCONNECTION)
+			continue ;
+		logDebug("%d runs its own script, its leader's response is private", f.client->sockfd);
+		f.client->handler.setResponse("");
+		startQueuedCgi(f.client, qfd);
+		g_stats.released++;
+	}
+}
+
+/* The leader framed more output: copy it to every follower */
+void	cgiFlightForward(Endpoint *leader, int qfd)
+{
+	CgiFlight *flight = leader->flight;
+	if (flight == nullptr || flight->leader != leader)
+		return ;
+	if (leader->handler.cgiResponsePrivate())
+	{
+		releaseFollowers(flight, qfd);
+		return ;
+	}
+	if (flight->pending.empty())
+		return ;
+	std::vector<CgiFollower> keep;
+	for (CgiFollower &f : flight->followers)
+	{
+		if (f.client->state == C_MARKED_FOR_DISCONNECTION)
+			continue ;
+		f.client->handler.appendResponse(flight->pending);
+		f.started = true;
+		if (f.client->handler.getResponse().size() > CGI_FLIGHT_LAG_MAX)
+		{
+			logDebug("%d is too far behind its leader", f.client->sockfd);
+			f.client->flight = nullptr;
+			f.client->state = C_MARKED_FOR_DISCONNECTION;
+			g_stats.dropped++;
+			continue ;
+		}
+		if (f.client->state == C_FOLLOW_CGI)
+			watch(qfd, f.client, WRITABLE);
+		keep.push_back(f);
+	}
+	flight->followers.swap(keep);
+	if (flight->open)
+	{
+		flight->history += flight->pending;
+		if (flight->history.size() > CGI_FLIGHT_HISTORY_MAX)
+			closeFlight(flight);
+	}
+	flight->pending.clear();
+}
+
+/* The leader is done with its script, or a follower is leaving. A
+ * complete response has been copied whole to the followers; otherwise
+ * they fail with the leader: an error page if nothing went out yet,
+ * a cut connection if it did. */
+void	cgiFlightLand(Endpoint *client, int qfd, bool complete, int error)
+{
+	CgiFlight *flight = client->flight;
+	if (flight == nullptr)
+		return ;
+	if (flight->leader == client && complete)
+		cgiFlightForward(client, qfd);
+	client->flight = nullptr;
+	if (flight->leader != client)
+	{
+		std::erase_if(flight->followers, [client](const CgiFollower &f) {
+			return (f.client == client);
+		});
+		return ;
+	}
+	closeFlight(flight);
+	client->handler.teeCgiOutput(nullptr);
+	for (CgiFollower &f : flight->followers)
+	{
+		f.client->flight = nullptr;
+		if (f.client->state == C_MARKED_FOR_DISCONNECTION)
+			continue ;
+		if (!complete && f.started)
+			f.client->state = C_MARKED_FOR_DISCONNECTION;
+		else
+			followedCgiDone(f.client, qfd, complete, error);
+	}
+	delete flight;
+}
+
+std::string	cgiFlightStats()
+{
+	std::ostringstream out;
+	out << "coalesce_leaders " << g_stats.led << "\n"
+		<< "coalesce_followers " << g_stats.followed << "\n"
+		<< "coalesce_dropped " << g_stats.dropped << "\n"
+		<< "coalesce_released " << g_stats.released << "\n"
+		<< "coalesce_in_flight " << g_flights.size() << "\n";
+	return (out.str());
+}
@@ -2,8 +2,17 @@
 #include "HttpConnectionHandler.hpp"
 #include "Configuration.hpp"
 #include "Logger.hpp"
+#include "CgiLimits.hpp"
 #include <sys/wait.h>
 #include <signal.h>
+#include <spawn.h>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <vector>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
 
 int*		CgiHandler::getPipeToCgi() { return _pipeToCgi; };
 int*		CgiHandler::getPipeFromCgi() { return _pipeFromCgi; };
@@ -21,58 +30,9 @@ CgiHandler::CgiHandler() {
     cgiPid = 0;
 }
 
-CgiHandler::CgiHandler(const HttpConnectionHandler &conn) {
-	cgiPid = 0;
-	if (conn.getCgiType() == PYTHON)
-		_pathToInterpreter = conn.getLocationBlock()->cgiPathPython + "/python3";
-	else if (conn.getCgiType() == PHP)
-		_pathToInterpreter = conn.getLocationBlock()->cgiPathPHP + "/php-cgi";
-
-	std::string currentPath = std::filesystem::current_path();
-	std::string root = "/" + conn.getConf()->getRootViaLocation("/");
-	_pathToScript = currentPath + root + conn.getFilePath();
-
-	_execveArgs[0] = (char * )_pathToInterpreter.c_str();
-	_execveArgs[1] = (char * )_pathToScript.c_str();
-	_execveArgs[2] = NULL;
-
+CgiHandler::CgiHandler(const HttpConnectionHandler &conn) : CgiHandler() {
+	populate(conn);
 	_postData = conn.getBody();
-
-	const std::map<std::string, std::string>	&headerMap = conn.getHeaders();
-
-	_contentLength = "CONTENT_LENGTH=";
-	if (headerMap.find("Content-Length") != headerMap.end())
-		_contentLength += headerMap.at("Content-Length");
-	_contentType = "CONTENT_TYPE=";
-	if (headerMap.find("Content-Type") != headerMap.end())
-		_contentType += headerMap.at("Content-Type");
-	_queryString = "QUERY_STRING=" + conn.getQueryString();
-	_pathInfo = "PATH_INFO=" + _pathToScript;
-	_requestMethod = "REQUEST_METHOD=" + conn.getMethod();
-	//_scriptFileName = "SCRIPT_FILENAME=" + _pathToScript.substr(_pathToScript.find_last_of('/') + 1);
-	_scriptFileName = "SCRIPT_FILENAME=" + _pathToScript;
-	_scriptName = "SCRIPT_NAME=" + root + conn.getFilePath();
-	_redirectStatus = "REDIRECT_STATUS=200";
-	_serverProtocol = "SERVER_PROTOCOL=HTTP/1.1";
-	_gatewayInterface = "GATEWAY_INTERFACE=CGI/1.1";
-	_remoteAddr = "REMOTE_ADDR=" + conn.getConf()->getHost();
-	_serverName = "SERVER_NAME=" + conn.getConf()->getServerNames();
-	_serverPort = "SERVER_PORT=" + conn.getConf()->getPort();
-	
-	_execveEnv[0] = (char *) _contentLength.c_str();
-	_execveEnv[1] = (char *) _contentType.c_str();
-	_execveEnv[2] = (char *) _queryString.c_str();
-	_execveEnv[3] = (char *) _serverProtocol.c_str();
-	_execveEnv[4] = (char *) _gatewayInterface.c_str();
-	_execveEnv[5] = (char *) _pathInfo.c_str();
-	_execveEnv[6] = (char *) _requestMethod.c_str();
-	_execveEnv[7] = (char *) _scriptFileName.c_str();
-	_execveEnv[8] = (char *) _redirectStatus.c_str();
-	_execveEnv[9] = (char *) _scriptName.c_str();
-	_execveEnv[10] = (char *) _remoteAddr.c_str();
-	_execveEnv[11] = (char *) _serverName.c_str();
-	_execveEnv[12] = (char *) _serverPort.c_str();
-	_execveEnv[13] = NULL;
 }
 
 void CgiHandler::printCgiInfo() {
@@ -86,123 +46,207 @@ void CgiHandler::printCgiInfo() {
 	std::cout << BLUE << "------- END of CGI data summary-------------------" << DEFAULT_COLOR << std::endl;
 }
 
-void CgiHandler::executeCgi() {
+/* Close-on-exec pipes, so a script never inherits another one's pipes
+ * (and keeps it from seeing EOF). */
+static int openPipe(int fds[2])
+{
+#ifdef __linux__
+  return pipe2(fds, O_CLOEXEC);
+#else
+  if (pipe(fds) == -1)
+    return (-1);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return (0);
+#endif
+}
+
+/* Starts the interpreter with the pipes as its stdin and stdout.
+ * posix_spawn does not copy our page tables the way fork does (glibc
+ * uses CLONE_VM|CLONE_VFORK), so it costs the same however big the
+ * server grew. Nothing else leaks into the script: every fd past stderr
+ * is closed, whether or not it was opened close-on-exec, and signals get
+ * their default disposition back. Each one leads a process group, so
+ * stopping it stops what it started too. Returns 0 or an errno.
+ * Also starts the cgi_pool workers. */
+int spawnCgi(pid_t *pid, char *const argv[], char *const envp[], int in, int out)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t signals;
+  short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+  flags |= POSIX_SPAWN_CLOEXEC_DEFAULT; // macOS: only what the file actions set up survives
+#endif
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+  posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1); // close_range()
+#endif
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, flags);
+  posix_spawnattr_setpgroup(&attr, 0);
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigaddset(&signals, SIGPIPE);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+
+  int error = posix_spawn(pid, argv[0], &actions, &attr, argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  return (error);
+}
+
+bool CgiHandler::executeCgi() {
   // a pipe for sending data to CGI process (parent writes, child reads)
-  if (pipe(_pipeToCgi) == -1) {
+  if (openPipe(_pipeToCgi) == -1) {
     std::cerr << "Error creating pipe to CGI" << std::endl;
-    return;
+    return (false);
   }
 
   // a pipe for recieving data from the CGI process (child writes, parent reads)
-  if (pipe(_pipeFromCgi) == -1) {
+  if (openPipe(_pipeFromCgi) == -1) {
     std::cerr << "Error creating pipe from CGI" << std::endl;
     close(_pipeToCgi[0]);
     _pipeToCgi[0] = -1;
     close(_pipeToCgi[1]);
     _pipeToCgi[1] = -1;
-    return;
+    return (false);
   }
 
-  cgiPid = fork();
-  if (cgiPid < 0) {
-    std::cerr << "Error forking process" << std::endl;
-    close(_pipeToCgi[0]);
-    _pipeToCgi[0] = -1;
+  // the limits wrapper goes first where the location sets any
+  std::string leaf;
+  std::vector<std::string> wrapper = cgiLimitArgs(_location, leaf);
+  std::vector<char *> argv;
+  for (std::string &arg : wrapper)
+    argv.push_back(&arg[0]);
+  for (int i = 0; _execveArgs[i] != NULL; i++)
+    argv.push_back(_execveArgs[i]);
+  argv.push_back(NULL);
+  int error = spawnCgi(&cgiPid, argv.data(), _execveEnv, _pipeToCgi[0], _pipeFromCgi[1]);
+  applyCgiLimits(error == 0 ? cgiPid : 0, leaf);
+  close(_pipeToCgi[0]);   // the child has its own copies now
+  _pipeToCgi[0] = -1;
+  close(_pipeFromCgi[1]);
+  _pipeFromCgi[1] = -1;
+  if (error != 0) {
+    logError(std::string("Cannot start CGI: ") + strerror(error));
     close(_pipeToCgi[1]);
     _pipeToCgi[1] = -1;
     close(_pipeFromCgi[0]);
     _pipeFromCgi[0] = -1;
-    close(_pipeFromCgi[1]);
-    _pipeFromCgi[1] = -1;
-    return;
+    cgiPid = 0;
+    return (false);
   }
 
-  if (cgiPid == 0) {
-    close(_pipeToCgi[1]);   // child doesn't write to pipeToCgi.
-    _pipeToCgi[1] = -1;
-    close(_pipeFromCgi[0]); // child doesn't read from pipeFromCgi.
-    _pipeFromCgi[0] = -1;
+  // set the parent's pipe file descriptors to non-blocking mode.
+  // chatgpt says this is how you do it:
+  int flags = fcntl(_pipeToCgi[1], F_GETFL, 0);
+  if (flags == -1)
+    flags = 0;
+  fcntl(_pipeToCgi[1], F_SETFL, flags | O_NONBLOCK);
 
-    // redirect stdin to read from _pipeToCgi[0]
-    if (dup2(_pipeToCgi[0], STDIN_FILENO) == -1) {
-      std::cerr << "dup2 error for STDIN in child" << std::endl;
-      throw(EXIT_FAILURE);
-    }
-    // redirect stdout to write to _pipeFromCgi[1]
-    if (dup2(_pipeFromCgi[1], STDOUT_FILENO) == -1) {
-      std::cerr << "dup2 error for STDOUT in child" << std::endl;
-      throw(EXIT_FAILURE);
-    }
-    // we dupped them, so we can close them
-    close(_pipeToCgi[0]);
-    _pipeToCgi[0] = -1;
-    close(_pipeFromCgi[1]);
-    _pipeFromCgi[1] = -1;
-
-    execve(_execveArgs[0], _execveArgs, _execveEnv);
-    std::cerr << "execve error in child" << std::endl; // handle better
-    throw(EXIT_FAILURE);
-  } else {
-    close(_pipeToCgi[0]);   // parent does not read from pipeToCgi.
-    _pipeToCgi[0] = -1;
-    close(_pipeFromCgi[1]); // parent does not write to pipeFromCgi.
-    _pipeFromCgi[1] = -1;
-
-    // set the parent's pipe file descriptors to non-blocking mode.
-    // chatgpt says this is how you do it:
-    int flags = fcntl(_pipeToCgi[1], F_GETFL, 0);
-    if (flags == -1)
-      flags = 0;
-    fcntl(_pipeToCgi[1], F_SETFL, flags | O_NONBLOCK);
-
-    flags = fcntl(_pipeFromCgi[0], F_GETFL, 0);
-    if (flags == -1)
-      flags = 0;
-    fcntl(_pipeFromCgi[0], F_SETFL, flags | O_NONBLOCK);
-
-    // Attempt to write POST data (if any) to the CGI process in a non-blocking fashion.
-    if (!_postData.empty()) {
-      ssize_t written = write(_pipeToCgi[1],
-          _postData.c_str() + _postDataOffset,
-          _postData.size() - _postDataOffset);
-      if (written > 0) {
-        _postDataOffset += written;
-        if (_postDataOffset == _postData.size()) {
-          // all POST data has been written, close the write end to signal EOF.
-          close(_pipeToCgi[1]);
-          _pipeToCgi[1] = -1;
-        }
-      }
-      else {
-        // do something
-      }
-    } else {
-      // no POST data to send, close the write end.
-      close(_pipeToCgi[1]);
-      _pipeToCgi[1] = -1;
-    }
+  flags = fcntl(_pipeFromCgi[0], F_GETFL, 0);
+  if (flags == -1)
+    flags = 0;
+  fcntl(_pipeFromCgi[0], F_SETFL, flags | O_NONBLOCK);
+
+#ifdef F_SETPIPE_SZ
+  // Bigger pipes mean fewer wakeups per request body. Best effort: an
+  // unprivileged user over its pipe quota keeps the 64K default.
+  fcntl(_pipeToCgi[1], F_SETPIPE_SZ, CGI_PIPE_SIZE);
+  fcntl(_pipeFromCgi[0], F_SETPIPE_SZ, CGI_PIPE_SIZE);
+#endif
+
+  // The request body is fed by pumpPostData() as the pipe drains,
+  // stdin stays open until all of it went through.
 
-    /* int status; */
-    /* _waitpidRes = waitpid(cgiPid, &status, WNOHANG); */
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  // Lets the event loop tell us when the child exits. Without it
+  // (old kernels, BSD) we wait for it once its stdout is closed.
+  _pidfd = syscall(SYS_pidfd_open, cgiPid, 0);
+#endif
+  return (true);
+}
+
+/* Queues request body bytes for the CGI's stdin. Dropped if the
+ * script already closed its end, it didn't want them. */
+void CgiHandler::appendPostData(const std::string &data)
+{
+  if (_pipeToCgi[1] == -1 && cgiPid != 0)
+    return ;
+  if (_postDataOffset == _postData.size())
+  {
+    _postData.clear();
+    _postDataOffset = 0;
   }
+  _postData.append(data);
+}
+
+/* Hands over the queued body, for a backend that is not a pipe */
+std::string CgiHandler::takePostData()
+{
+  std::string data;
+  data.swap(_postData);
+  if (_postDataOffset != 0)
+    data.erase(0, _postDataOffset);
+  _postDataOffset = 0;
+  return (data);
+}
+
+/* Writes as much of the queued body as the pipe takes without blocking.
+ *
+ * @return HandlerStatus:
+ *   - S_Again: the pipe is full or we are waiting for more of the body
+ *   - S_Done: the whole body went through, time to close stdin
+ *   - S_Error: the script closed its stdin early, the rest is dropped
+ */
+HandlerStatus CgiHandler::pumpPostData()
+{
+  assert(_pipeToCgi[1] != -1);
+  while (_postDataOffset < _postData.size())
+  {
+    ssize_t written = write(_pipeToCgi[1],
+        _postData.data() + _postDataOffset,
+        _postData.size() - _postDataOffset);
+    if (written < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return S_Again;
+      logDebug("CGI %d stopped reading its stdin", cgiPid);
+      _postData.clear();
+      _postDataOffset = 0;
+      return S_Error;
+    }
+    _postDataOffset += written;
+  }
+  _postData.clear();
+  _postDataOffset = 0;
+  return _postDataComplete ? S_Done : S_Again;
+}
+
+void CgiHandler::closeStdin()
+{
+  if (_pipeToCgi[1] == -1)
+    return ;
+  close(_pipeToCgi[1]);
+  _pipeToCgi[1] = -1;
 }
 
 void CgiHandler::CgiResetObject(void)
 {
 		_contentLength.clear();
 		_contentType.clear();
-		_gatewayInterface.clear();
 		_pathInfo.clear();
 		_queryString.clear();
-		_remoteAddr.clear();
 		_requestMethod.clear();
 		_scriptFileName.clear();
 		_scriptName.clear();
-		_redirectStatus.clear();
-		_serverName.clear();
-		_serverPort.clear();
-		_serverProtocol.clear();
-		_pathToInterpreter.clear();
+		_cookie.clear();
 		_postData.clear();
 
     bzero(_execveArgs, sizeof(_execveArgs));
@@ -222,33 +266,35 @@ void CgiHandler::CgiResetObject(void)
       }
     }
 		_postDataOffset = 0; // How many bytes have been written so far
+		_postDataComplete = false;
 		_waitpidRes = 0;
     hasSentHeader = false;
-	if (cgiPid != 0)
-  {
-    kill(cgiPid, SIGKILL);
-    logDebug("Terminated CGI: %d", cgiPid);
-  }
+  closePidfd();
+	if (cgiPid != 0 && !reap(false))
+    terminateCgi(cgiPid);
   cgiPid = 0;
+  _exited = false;
+  _exitStatus = 0;
 }
 
 void CgiHandler::populate(const HttpConnectionHandler &conn) {
 	cgiPid = 0;
+	const LocationBlock *loc = conn.getLocationBlock();
+	_location = loc;
+	const std::string *interpreter = nullptr;
 	if (conn.getCgiType() == PYTHON)
-		_pathToInterpreter = conn.getLocationBlock()->cgiPathPython + "/python3";
+		interpreter = &loc->cgiInterpreterPython;
 	else if (conn.getCgiType() == PHP)
-		_pathToInterpreter = conn.getLocationBlock()->cgiPathPHP + "/php-cgi";
+		interpreter = &loc->cgiInterpreterPHP;
 
-	std::string currentPath = std::filesystem::current_path();
+	static const std::string currentPath = std::filesystem::current_path();
 	std::string root = "/" + conn.getConf()->getRootViaLocation("/");
 	_pathToScript = currentPath + root + conn.getFilePath();
 
-	_execveArgs[0] = (char * )_pathToInterpreter.c_str();
+	_execveArgs[0] = interpreter ? (char *) interpreter->c_str() : NULL;
 	_execveArgs[1] = (char * )_pathToScript.c_str();
 	_execveArgs[2] = NULL;
 
-	_postData = conn.getBody();
-
 	const std::map<std::string, std::string>	&headerMap = conn.getHeaders();
 
   _cookie = "HTTP_COOKIE=";
@@ -263,30 +309,64 @@ void CgiHandler::populate(const HttpConnectionHandler &conn) {
 	_queryString = "QUERY_STRING=" + conn.getQueryString();
 	_pathInfo = "PATH_INFO=" + _pathToScript;
 	_requestMethod = "REQUEST_METHOD=" + conn.getMethod();
-	//_scriptFileName = "SCRIPT_FILENAME=" + _pathToScript.substr(_pathToScript.find_last_of('/') + 1);
 	_scriptFileName = "SCRIPT_FILENAME=" + _pathToScript;
 	_scriptName = "SCRIPT_NAME=" + root + conn.getFilePath();
-	_redirectStatus = "REDIRECT_STATUS=200";
-	_serverProtocol = "SERVER_PROTOCOL=HTTP/1.1";
-	_gatewayInterface = "GATEWAY_INTERFACE=CGI/1.1";
-	_remoteAddr = "REMOTE_ADDR=" + conn.getConf()->getHost();
-	_serverName = "SERVER_NAME=" + conn.getConf()->getServerNames();
-	_serverPort = "SERVER_PORT=" + conn.getConf()->getPort();
+	_remoteAddr = "REMOTE_ADDR=" + conn.getRemoteAddr();
 	
   int iota = 0;
 	_execveEnv[iota++] = (char *) _contentLength.c_str();
 	_execveEnv[iota++] = (char *) _contentType.c_str();
 	_execveEnv[iota++] = (char *) _queryString.c_str();
-	_execveEnv[iota++] = (char *) _serverProtocol.c_str();
-	_execveEnv[iota++] = (char *) _gatewayInterface.c_str();
 	_execveEnv[iota++] = (char *) _pathInfo.c_str();
 	_execveEnv[iota++] = (char *) _requestMethod.c_str();
 	_execveEnv[iota++] = (char *) _scriptFileName.c_str();
-	_execveEnv[iota++] = (char *) _redirectStatus.c_str();
 	_execveEnv[iota++] = (char *) _scriptName.c_str();
-	_execveEnv[iota++] = (char *) _remoteAddr.c_str();
-	_execveEnv[iota++] = (char *) _serverName.c_str();
-	_execveEnv[iota++] = (char *) _serverPort.c_str();
   _execveEnv[iota++] = (char *) _cookie.c_str();
+	_execveEnv[iota++] = (char *) _remoteAddr.c_str();
+  if (conn.getTls() != nullptr)
+    _execveEnv[iota++] = (char *) "HTTPS=on";
+  assert(iota + loc->cgiEnv.size() < sizeof(_execveEnv) / sizeof(*_execveEnv));
+  for (const std::string &var : loc->cgiEnv)
+    _execveEnv[iota++] = (char *) var.c_str();
 	_execveEnv[iota++] = NULL;
 }
+
+void CgiHandler::closeStdout()
+{
+  if (_pipeFromCgi[0] == -1)
+    return ;
+  close(_pipeFromCgi[0]);
+  _pipeFromCgi[0] = -1;
+}
+
+void CgiHandler::closePidfd()
+{
+  if (_pidfd == -1)
+    return ;
+  close(_pidfd);
+  _pidfd = -1;
+}
+
+/* Collects the child's exit status. Returns true once it is gone. */
+bool CgiHandler::reap(bool block)
+{
+  if (_exited)
+    return (true);
+  if (cgiPid <= 0)
+    return (false);
+  int status = 0;
+  pid_t res = waitpid(cgiPid, &status, block ? 0 : WNOHANG);
+  if (res == 0)
+    return (false);
+  _exited = true;
+  _exitStatus = res == cgiPid ? status : 0;
+  releaseCgiLimits(cgiPid);
+  return (true);
+}
+
+/* Chunked bodies only know their length once they are all in */
+void CgiHandler::setContentLength(size_t length)
+{
+	_contentLength = "CONTENT_LENGTH=" + std::to_string(length);
+	_execveEnv[0] = (char *) _contentLength.c_str();
+}
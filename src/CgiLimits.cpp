@@ -0,0 +1,252 @@
+#include "CgiLimits.hpp"
+#include "Configuration.hpp"
+#include "Logger.hpp"
+#include "Timeout.hpp"
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+struct Dying {
+	pid_t		pid;
+	uint64_t	killAt_ms; // Then SIGKILL, UINT64_MAX once sent
+};
+
+/* Scripts we stopped, or other children we are done with, that have
+ * not been waited for yet */
+static std::vector<Dying>			g_dying;
+static std::string					g_cgroup; // cgi_cgroup once set up, empty without one
+static std::unordered_map<pid_t, std::string>	g_leaves; // Of the scripts running in one
+static uint64_t						g_leafCount;
+
+static struct {
+	uint64_t	terminated; // SIGTERM sent
+	uint64_t	killed; // Still there after the grace period
+	uint64_t	timeouts;
+	uint64_t	outputLimits;
+	uint64_t	cgroupLeaves;
+} g_stats;
+
+static bool	writeFile(const std::string &path, const std::string &value)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (false);
+	bool ok = write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+	close(fd);
+	return (ok);
+}
+
+/* At startup, and on a reload that changes cgi_cgroup. The directory
+ * is the administrator's (systemd's Delegate=, or made by hand): we
+ * only enable the memory controller for its children and make a leaf
+ * per script in it. Without it scripts still get their rlimits. */
+void	cgiCgroupStart(const std::string &dir)
+{
+	if (dir == g_cgroup)
+		return ;
+	g_cgroup.clear();
+	if (dir.empty())
+		return ;
+#ifdef __linux__
+	if (access((dir + "/cgroup.controllers").c_str(), F_OK) != 0)
+	{
+		logError("cgi_cgroup: " + dir + " is not a cgroup v2 directory");
+		return ;
+	}
+	if (!writeFile(dir + "/cgroup.subtree_control", "+memory"))
+	{
+		logError("cgi_cgroup: cannot enable the memory controller in " + dir + ": " + strerror(errno));
+		return ;
+	}
+	g_cgroup = dir;
+	logInfo("cgi_cgroup: scripts with cgi_max_memory run in leaves of " + dir);
+#else
+	logError("cgi_cgroup: needs Linux, scripts only get rlimits");
+#endif
+}
+
+/* On the way out, once the scripts are gone: the leaves we made, not
+ * the directory */
+void	cgiCgroupStop()
+{
+	for (const auto &leaf : g_leaves)
+	{
+		writeFile(leaf.second + "/cgroup.kill", "1");
+		rmdir(leaf.second.c_str());
+	}
+	g_leaves.clear();
+	g_cgroup.clear();
+}
+
+/* The wrapper spawnCgi() runs in front of the interpreter, as arguments
+ * to prepend, or none if the location sets no limit. A cgi_cgroup leaf
+ * is made for it first, to be handed to applyCgiLimits() after the
+ * spawn. */
+std::vector<std::string>	cgiLimitArgs(const LocationBlock *loc, std::string &leaf)
+{
+	leaf.clear();
+#ifdef __linux__
+	if (loc->cgiMaxMemory == 0 && loc->cgiMaxCpu == 0)
+		return {};
+	if (loc->cgiMaxMemory > 0 && !g_cgroup.empty())
+	{
+		leaf = g_cgroup + "/cgi-" + std::to_string(getpid()) + "-" + std::to_string(++g_leafCount);
+		if (mkdir(leaf.c_str(), 0755) != 0)
+			leaf.clear();
+		else
+		{
+			writeFile(leaf + "/memory.swap.max", "0");
+			if (!writeFile(leaf + "/memory.max", std::to_string(loc->cgiMaxMemory)))
+			{
+				rmdir(leaf.c_str());
+				leaf.clear();
+			}
+		}
+	}
+	return { "/proc/self/exe", CGI_LIMITS_ARG, std::to_string(loc->cgiMaxMemory),
+		std::to_string(loc->cgiMaxCpu), leaf.empty() ? "-" : leaf };
+#else
+	(void)loc;
+	return {};
+#endif
+}
+
+/* After the spawn: the leaf goes once the script is waited for, or now
+ * if it did not start */
+void	applyCgiLimits(pid_t pid, const std::string &leaf)
+{
+	if (leaf.empty())
+		return ;
+	if (pid == 0)
+	{
+		rmdir(leaf.c_str());
+		return ;
+	}
+	g_leaves[pid] = leaf;
+	g_stats.cgroupLeaves++;
+}
+
+/* webserv --cgi-limits <as> <cpu> <leaf> <interpreter> [args], in the
+ * child spawnCgi() started: the limits hold from the interpreter's
+ * first instruction. 0 is no limit, - no leaf. A limit that cannot be
+ * set stops the script from running at all. */
+int	runLimited(int argc, char **argv)
+{
+	if (argc < 6)
+		return (127);
+	rlim_t as = std::strtoull(argv[2], nullptr, 10);
+	rlim_t cpu = std::strtoull(argv[3], nullptr, 10);
+	struct rlimit asLimit = { as, as };
+	/* SIGXCPU at the soft limit, SIGKILL a second later */
+	struct rlimit cpuLimit = { cpu, cpu + 1 };
+	if ((as > 0 && setrlimit(RLIMIT_AS, &asLimit) != 0)
+			|| (cpu > 0 && setrlimit(RLIMIT_CPU, &cpuLimit) != 0))
+	{
+		perror("webserv: setrlimit");
+		return (126);
+	}
+	if (strcmp(argv[4], "-") != 0 && !writeFile(std::string(argv[4]) + "/cgroup.procs", "0"))
+		perror("webserv: cgi_cgroup");
+	execv(argv[5], argv + 5);
+	perror(argv[5]);
+	return (127);
+}
+
+/* The script was waited for: its leaf is empty and can go */
+void	releaseCgiLimits(pid_t pid)
+{
+	auto found = g_leaves.find(pid);
+	if (found == g_leaves.end())
+		return ;
+	rmdir(found->second.c_str());
+	g_leaves.erase(found);
+}
+
+/* Scripts lead their own process group (see spawnCgi()), so whatever
+ * they started goes with them */
+static void	signalCgi(pid_t pid, int sig)
+{
+	auto leaf = g_leaves.find(pid);
+	if (sig == SIGKILL && leaf != g_leaves.end())
+		writeFile(leaf->second + "/cgroup.kill", "1");
+	if (kill(-pid, sig) == -1)
+		kill(pid, sig);
+}
+
+/* Asks a script to stop. It is waited for, and killed if it takes
+ * longer than the grace period, by reapKilledCgis(). */
+void	terminateCgi(pid_t pid)
+{
+	signalCgi(pid, SIGTERM);
+	g_dying.push_back({ pid, now_ms() + CGI_KILL_GRACE_MS });
+	g_stats.terminated++;
+	logDebug("Terminated CGI: %d", pid);
+}
+
+/* Waits for the scripts we stopped, without blocking: they are picked
+ * up on a later turn, and killed once their grace period is over. */
+void	reapKilledCgis()
+{
+	uint64_t now = now_ms();
+	for (size_t i = 0; i < g_dying.size(); )
+	{
+		Dying &d = g_dying[i];
+		if (waitpid(d.pid, nullptr, WNOHANG) == 0)
+		{
+			if (now >= d.killAt_ms)
+			{
+				logDebug("CGI %d ignored SIGTERM, killing it", d.pid);
+				signalCgi(d.pid, SIGKILL);
+				d.killAt_ms = UINT64_MAX;
+				g_stats.killed++;
+			}
+			i++;
+			continue;
+		}
+		releaseCgiLimits(d.pid);
+		d = g_dying.back();
+		g_dying.pop_back();
+	}
+}
+
+/* For other children we are done with, like cgi_pool workers: they are
+ * expected to exit on their own, and killed if they do not */
+void	reapLater(pid_t pid)
+{
+	g_dying.push_back({ pid, now_ms() + CGI_KILL_GRACE_MS });
+}
+
+/* On the way out: no grace period left */
+void	killCgisNow()
+{
+	for (Dying &d : g_dying)
+	{
+		signalCgi(d.pid, SIGKILL);
+		waitpid(d.pid, nullptr, 0);
+		releaseCgiLimits(d.pid);
+	}
+	g_dying.clear();
+}
+
+void	countCgiTimeout() { g_stats.timeouts++; }
+void	countCgiOutputLimit() { g_stats.outputLimits++; }
+
+std::string	cgiLimitStats()
+{
+	std::ostringstream out;
+	out << "cgi_terminated " << g_stats.terminated << "\n"
+		<< "cgi_killed " << g_stats.killed << "\n"
+		<< "cgi_timeouts " << g_stats.timeouts << "\n"
+		<< "cgi_output_limits " << g_stats.outputLimits << "\n"
+		<< "cgi_cgroup_leaves " << g_stats.cgroupLeaves << "\n";
+	return (out.str());
+}
@@ -0,0 +1,182 @@
+#include "Server.hpp"
+#include "CgiQueue.hpp"
+#include "Parser.hpp"
+#include <list>
+#include <map>
+
+struct Waiting {
+	Endpoint	*client;
+	uint64_t	since_ms;
+};
+
+static std::list<Waiting>							g_waiting;
+static std::map<const Configuration *, size_t>		g_runningPerServer;
+static std::map<const LocationBlock *, size_t>		g_runningPerLocation;
+static std::map<const Configuration *, size_t>		g_waitingPerServer;
+static std::map<const LocationBlock *, size_t>		g_waitingPerLocation;
+
+/* Counts go when they reach zero: a server or location of a retired
+ * configuration leaves nothing behind, and one allocated at its
+ * address later starts from nothing */
+template <typename Key>
+static size_t	count(const std::map<Key, size_t> &counts, Key key)
+{
+	auto it = counts.find(key);
+	return (it == counts.end() ? 0 : it->second);
+}
+
+template <typename Key>
+static void	decrement(std::map<Key, size_t> &counts, Key key)
+{
+	auto it = counts.find(key);
+	assert(it != counts.end() && it->second > 0);
+	if (--it->second == 0)
+		counts.erase(it);
+}
+
+static struct {
+	size_t		running;
+	uint64_t	started;
+	uint64_t	shed;
+	uint64_t	queueTimeouts;
+	uint64_t	waited; // Requests that went through the queue
+	uint64_t	waitedTotal_ms;
+	uint64_t	waitedMax_ms;
+} g_stats;
+
+static bool	hasRoom(const Endpoint *client)
+{
+	size_t processMax = client->handler.getConfig()->cgiMaxConcurrent;
+	const Configuration *conf = client->handler.getConf();
+	const LocationBlock *loc = client->handler.getLocationBlock();
+	if (processMax != 0 && g_stats.running >= processMax)
+		return (false);
+	if (conf->getCgiMaxConcurrent() != 0
+			&& count(g_runningPerServer, conf) >= conf->getCgiMaxConcurrent())
+		return (false);
+	return (loc->cgiMaxConcurrent == 0
+			|| count(g_runningPerLocation, loc) < loc->cgiMaxConcurrent);
+}
+
+static void	takeSlot(Endpoint *client)
+{
+	g_runningPerServer[client->handler.getConf()]++;
+	g_runningPerLocation[client->handler.getLocationBlock()]++;
+	g_stats.running++;
+	g_stats.started++;
+	client->cgiSlot = CGI_RUNNING;
+}
+
+/* Takes a slot for the client's script if the process, its server and
+ * its location have room and nobody is queued before it for the same
+ * location: a saturated location does not hold up the others. Otherwise,
+ * if allowed to, the request waits in the queue of its server, unless
+ * that or the location's share of it is full. Returns CGI_NO_SLOT when
+ * the request has to be turned away. */
+CgiSlot	cgiAdmit(Endpoint *client, bool mayWait)
+{
+	assert(client->cgiSlot == CGI_NO_SLOT);
+	const Configuration *conf = client->handler.getConf();
+	const LocationBlock *loc = client->handler.getLocationBlock();
+	if (count(g_waitingPerLocation, loc) == 0 && hasRoom(client))
+	{
+		takeSlot(client);
+		return (CGI_RUNNING);
+	}
+	if (!mayWait)
+		return (CGI_NO_SLOT);
+	if (count(g_waitingPerServer, conf) >= conf->getCgiQueueSize()
+			|| (loc->cgiQueueSize != 0 && count(g_waitingPerLocation, loc) >= loc->cgiQueueSize))
+	{
+		g_stats.shed++;
+		return (CGI_NO_SLOT);
+	}
+	g_waiting.push_back({ client, now_ms() });
+	g_waitingPerServer[conf]++;
+	g_waitingPerLocation[loc]++;
+	client->cgiSlot = CGI_WAITING;
+	return (CGI_WAITING);
+}
+
+static std::list<Waiting>::iterator	leaveQueue(std::list<Waiting>::iterator it)
+{
+	decrement(g_waitingPerServer, it->client->handler.getConf());
+	decrement(g_waitingPerLocation, it->client->handler.getLocationBlock());
+	it->client->cgiSlot = CGI_NO_SLOT;
+	return (g_waiting.erase(it));
+}
+
+/* The script is gone, or the client stopped waiting for one */
+void	cgiRelease(Endpoint *client)
+{
+	if (client->cgiSlot == CGI_RUNNING)
+	{
+		decrement(g_runningPerServer, client->handler.getConf());
+		decrement(g_runningPerLocation, client->handler.getLocationBlock());
+		g_stats.running--;
+	}
+	else if (client->cgiSlot == CGI_WAITING)
+	{
+		for (auto it = g_waiting.begin(); it != g_waiting.end(); it++)
+		{
+			if (it->client == client)
+			{
+				leaveQueue(it);
+				break ;
+			}
+		}
+	}
+	client->cgiSlot = CGI_NO_SLOT;
+}
+
+/* Once per turn of the event loop: starts queued requests, oldest
+ * first, in the slots freed since, and gives up on those that waited
+ * longer than their server's cgi_queue timeout. */
+void	cgiDispatch(int qfd)
+{
+	uint64_t now = now_ms();
+	for (auto it = g_waiting.begin(); it != g_waiting.end(); )
+	{
+		Endpoint *client = it->client;
+		uint64_t waited_ms = now - it->since_ms;
+		if (hasRoom(client))
+		{
+			it = leaveQueue(it);
+			g_stats.waited++;
+			g_stats.waitedTotal_ms += waited_ms;
+			g_stats.waitedMax_ms = std::max(g_stats.waitedMax_ms, waited_ms);
+			takeSlot(client);
+			startQueuedCgi(client, qfd);
+		}
+		else if (waited_ms > client->handler.getConf()->getCgiQueueTimeout() * 1000ULL)
+		{
+			it = leaveQueue(it);
+			g_stats.queueTimeouts++;
+			logDebug("%d waited %llums for a CGI slot", client->sockfd, (unsigned long long)waited_ms);
+			client->handler.setErrorCode(503);
+			client->state = C_SEND_RESPONSE;
+			watch(qfd, client, WRITABLE);
+		}
+		else
+			it++;
+	}
+}
+
+/* Plain text for `stats on;` locations, one counter per line */
+std::string	cgiStats()
+{
+	uint64_t oldest_ms = g_waiting.empty() ? 0 : now_ms() - g_waiting.front().since_ms;
+	std::ostringstream out;
+	out << "cgi_running " << g_stats.running << "\n"
+		<< "cgi_started " << g_stats.started << "\n"
+		<< "cgi_queue_depth " << g_waiting.size() << "\n"
+		<< "cgi_queue_oldest_ms " << oldest_ms << "\n"
+		<< "cgi_queue_waited " << g_stats.waited << "\n"
+		<< "cgi_queue_wait_avg_ms " << (g_stats.waited ? g_stats.waitedTotal_ms / g_stats.waited : 0) << "\n"
+		<< "cgi_queue_wait_max_ms " << g_stats.waitedMax_ms << "\n"
+		<< "cgi_queue_timeouts " << g_stats.queueTimeouts << "\n"
+		<< "cgi_shed " << g_stats.shed << "\n"
+		<< "cgi_counts_tracked " << g_runningPerServer.size() + g_runningPerLocation.size()
+			+ g_waitingPerServer.size() + g_waitingPerLocation.size() << "\n";
+	return (out.str());
+}
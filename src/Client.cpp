@@ -1,111 +1,104 @@
 #include "Server.hpp"
 #include "Queue.hpp"
+#include "Parser.hpp"
+#include "Tls.hpp"
+#include "Http2.hpp"
+#include <sys/wait.h>
 
 void	disconnectClient(Endpoint *client, int qfd);
+static bool	routeRequest(Endpoint *client);
+static bool	startCgi(Endpoint *client, int qfd);
+static void	runCgi(Endpoint *client, int qfd);
+static void	streamBodyToCgi(Endpoint *client, int qfd);
+static void	cgiDone(Endpoint *client, int qfd);
+static void	sendCgiResponse(Endpoint *client, int qfd);
+static void	clientHungUp(Endpoint *client, int qfd);
+static void	watchCgiClient(Endpoint *client, int qfd);
+static void	sendCgiOutput(Endpoint *client, int qfd);
+static bool	overOutputLimit(Endpoint *client, int qfd);
+#ifdef __linux__
+static void	relayCgi(Endpoint *pipe, int qfd);
+#endif
+static void	responseSent(Endpoint *conn, int qfd);
+static void	handshake(Endpoint *client, int qfd);
+static void	readBuffered(Endpoint *client, int qfd);
+static bool	h2Turn(Endpoint *conn, int qfd, queue_event_type event_type);
+static void	h2Watch(Endpoint *conn, int qfd);
 
 void	serveConnection(Endpoint *conn, int qfd, queue_event_type event_type)
 {
+	if (conn->handler.getH2() != nullptr && h2Turn(conn, qfd, event_type))
+		return ;
 	switch (conn->state) {
 		case C_TIMED_OUT:
 			conn->state = C_SEND_RESPONSE;
 			break;
 
+		case C_TLS_HANDSHAKE:
+			handshake(conn, qfd);
+			break;
+
 		case C_RECV_HEADER: assert(event_type == READABLE);
 			receiveHeader(conn, qfd);
+			readBuffered(conn, qfd);
 			conn->last_heard_from_ms = now_ms();
 			break;
 
 		case C_RECV_BODY: assert(event_type == READABLE);
 			receiveBody(conn, qfd);
+			readBuffered(conn, qfd);
 			break;
 
 		case C_SEND_RESPONSE: assert(event_type == WRITABLE);
-			if (conn->handler.getErrorCode() != 0)
+			if (!conn->handler.hasOutput())
 			{
-				/* depending on handler.getfileServ() we already have the whole response
-				 * or we are just sending everything but body */
-				logDebug("Error with %d", conn->sockfd);
-
-				std::string response;
-				if (conn->handler.getResponse().empty()) {
-					response = conn->handler
-					.createErrorResponse(conn->handler.getErrorCode());
-				}
-				else {
-					response = conn->handler.getResponse();
-				}
-				ssize_t sent = send(conn->sockfd, response.c_str(), response.size(), 0);
-				if (sent == -1) {
-					disconnectClient(conn, qfd);
-				}
-				else if(static_cast<size_t>(sent) != response.size()) {
-					conn->handler.setResponse(response.substr(sent));
-					break;
+				/* An error goes out with its page, unless one is written already */
+				if (conn->handler.getErrorCode() != 0)
+				{
+					logDebug("Error with %d", conn->sockfd);
+					if (conn->handler.getResponse().empty())
+						conn->handler.setResponse(conn->handler
+							.createErrorResponse(conn->handler.getErrorCode()));
 				}
-				if (conn->handler.getFileServ())
-					conn->state = C_FILE_SERVE;
 				else
-          conn->state = C_MARKED_FOR_DISCONNECTION;
-			}
-			else
-			{
-				conn->handler.handleRequest();
-				ssize_t sent = send(conn->sockfd, conn->handler.getResponse().c_str(), conn->handler.getResponse().size(), 0);
-				if (sent == -1) {
+					conn->handler.handleRequest();
+				if (!conn->handler.queueResponse()) {
 					disconnectClient(conn, qfd);
-				}
-				else if(static_cast<size_t>(sent) != conn->handler.getResponse().size()) {
-					conn->handler.setResponse(conn->handler.getResponse().substr(sent));
 					break;
 				}
-				if (conn->handler.getFileServ()) {
-					conn->state = C_FILE_SERVE;
-					break;
-				}
-				watch(qfd, conn, READABLE);
-				conn->state = C_RECV_HEADER;
-				conn->handler.resetObject();
-				conn->began_sending_header_ms = now_ms();
 			}
-			break;
-
-		case C_FILE_SERVE: assert(event_type == WRITABLE);
-			 switch(conn->handler.serveFile()) {
-				 case S_Done:
-					 watch(qfd, conn, READABLE);
-					 conn->state = C_RECV_HEADER;
-					 if (conn->handler.getErrorCode() != 0) conn->state = C_MARKED_FOR_DISCONNECTION;
-           else conn->handler.resetObject();
-					 break;
-
-				 case S_Error: conn->state = C_MARKED_FOR_DISCONNECTION;
-					 break;
-
-				 case S_Again: 						break;
-				 case S_ClosedConnection: break;
-				 case S_ReadBody: 				break;
-			 }
-			 break;
+			switch (conn->handler.sendOutput()) {
+				case S_Done:
+					responseSent(conn, qfd);
+					break;
 
-		case C_EXEC_CGI:
-			switch (conn->handler.serveCgi(conn->cgiHandler))
-			{
 				case S_Error:
-                conn->cgiHandler.CgiResetObject();
-					      conn->handler.setErrorCode(500);
-					      conn->handler.setResponse("");
-					      conn->state = C_SEND_RESPONSE;
-					 break;
-				case S_Again: break;
-
-				case S_Done:
-                conn->cgiHandler.CgiResetObject();
-					      conn->state = C_SEND_RESPONSE;
+					disconnectClient(conn, qfd);
 					break;
+
+				case S_Again: break;
 				case S_ClosedConnection: break;
 				case S_ReadBody: break;
 			}
-		break;
+			break;
+
+		case C_EXEC_CGI: /* The script's pipes drive us now, see drainCgi() */
+		case C_FOLLOW_CGI: /* Or its leader's do, see cgiFlightForward() */
+			if (event_type == WRITABLE)
+				sendCgiOutput(conn, qfd);
+			else
+				clientHungUp(conn, qfd);
+			break;
+
+		case C_CGI_QUEUED: assert(event_type == READABLE);
+			clientHungUp(conn, qfd);
+			break;
+
+		case C_DRAIN_BODY: assert(event_type == READABLE);
+			drainBody(conn, qfd);
+			readBuffered(conn, qfd);
+			conn->last_heard_from_ms = now_ms();
+			break;
 
 		case C_DISCONNECTED:
 		  break;
@@ -113,6 +106,8 @@ void	serveConnection(Endpoint *conn, int qfd, queue_event_type event_type)
     case C_MARKED_FOR_DISCONNECTION:
       break;
 	}
+	if (conn->handler.getH2() != nullptr)
+		h2Watch(conn, qfd);
 }
 
 void	receiveHeader(Endpoint *client, int qfd)
@@ -126,22 +121,8 @@ void	receiveHeader(Endpoint *client, int qfd)
       logDebug("Done receiving header");
 			watch(qfd, client, WRITABLE);
 			client->state = C_SEND_RESPONSE;
-			if (client->handler.checkLocation() == true) {
-				if (client->handler.checkCgi() != NONE) {
-					client->cgiHandler.populate(client->handler);
-          if (access(client->cgiHandler._pathToScript.c_str(), F_OK) == 0
-              && access(client->cgiHandler._pathToScript.c_str(), R_OK) == 0)
-          {
-            client->cgiHandler.executeCgi();
-            client->state = C_EXEC_CGI;
-          }
-          else
-          {
-            client->handler.setErrorCode(404);
-            client->state = C_SEND_RESPONSE;
-          }
-				}
-			}
+			if (routeRequest(client) && client->handler.getCgiType() != NONE)
+				runCgi(client, qfd);
 			break;
 		case S_ClosedConnection:
 			client->state = C_MARKED_FOR_DISCONNECTION;
@@ -151,7 +132,21 @@ void	receiveHeader(Endpoint *client, int qfd)
 			client->state = C_SEND_RESPONSE;
 			break;
 		case S_ReadBody:
-			client->state = C_RECV_BODY;
+			if (routeRequest(client)) {
+				client->state = C_RECV_BODY;
+				/* CGI needs CONTENT_LENGTH up front, chunked bodies wait,
+				 * and so do requests that would have to queue for a slot */
+				if (client->handler.getCgiType() == NONE
+						|| !client->handler.getHeaders().count("Content-Length")
+						|| cgiAdmit(client, false) != CGI_RUNNING
+						|| startCgi(client, qfd))
+					break;
+			}
+			/* Answered already, the body is of no use to us */
+			logDebug("Rejected %d before its body", client->sockfd);
+			client->handler.discardBody();
+			watch(qfd, client, WRITABLE);
+			client->state = C_SEND_RESPONSE;
 			break;
 	}
 }
@@ -159,33 +154,27 @@ void	receiveHeader(Endpoint *client, int qfd)
 void	receiveBody(Endpoint *client, int qfd)
 {
 	HandlerStatus status = client->handler.readBody();
+	bool cgiRunning = hasCgiRunning(client);
 	switch (status)
 	{
 		case S_Again:
+			if (cgiRunning)
+				streamBodyToCgi(client, qfd);
 			break;
 		case S_Error:
+			if (cgiRunning)
+				stopCgi(client, qfd);
 			watch(qfd, client, WRITABLE);
 			client->state = C_SEND_RESPONSE;
 			break;
 		case S_Done:
 			watch(qfd, client, WRITABLE);
 			client->state = C_SEND_RESPONSE;
-			if (client->handler.checkLocation() == true && client->handler.checkCgi() != NONE)
-            {
-                client->cgiHandler.populate(client->handler);
-                if (access(client->cgiHandler._pathToScript.c_str(), F_OK) == 0
-                && access(client->cgiHandler._pathToScript.c_str(), R_OK) == 0)
-                {
-                    logDebug("We have all permissions");
-                    client->cgiHandler.executeCgi();
-                    client->state = C_EXEC_CGI;
-                }
-                else
-                {
-                    client->handler.setErrorCode(404);
-                    client->state = C_SEND_RESPONSE;
-                }
-            }
+			if (client->handler.getCgiType() == NONE)
+				break;
+			if (!cgiRunning)
+				client->cgiHandler.setContentLength(client->handler.getBody().size());
+			runCgi(client, qfd);
 			break;
 		case S_ClosedConnection:
 			client->state = C_MARKED_FOR_DISCONNECTION;
@@ -196,21 +185,599 @@ void	receiveBody(Endpoint *client, int qfd)
 	}
 }
 
+void	drainBody(Endpoint *client, int qfd)
+{
+	switch (client->handler.drainBody())
+	{
+		case S_Again:
+			break;
+		case S_Done:
+			responseSent(client, qfd);
+			break;
+		case S_Error:
+		case S_ClosedConnection:
+			client->state = C_MARKED_FOR_DISCONNECTION;
+			break;
+		case S_ReadBody:
+			assert(false); /* Unreachable */
+			break;
+	}
+}
+
+/* Everything that can be decided from the header alone: location, method,
+ * redirect and CGI script. Runs before any body is read, so a request we
+ * are going to refuse never gets its body buffered.
+ * Returns false if the request has been answered (error code or redirect). */
+static bool	routeRequest(Endpoint *client)
+{
+	if (!client->handler.checkLocation())
+		return (false);
+	if (client->handler.getLocationBlock()->stats)
+	{
+		client->handler.setResponse(client->handler.createHttpResponse(200,
+			"config_generation " + std::to_string(client->handler.getConfig()->generation) + "\n"
+			+ cgiStats() + cgiLimitStats() + cgiCacheStats() + cgiFlightStats() + proxyStats() + tlsStats() + h2Stats(),
+			"text/plain"));
+		return (false);
+	}
+	CgiTypes type = client->handler.checkCgi();
+	if (type == NONE)
+		return (true);
+	if (type == PROXY)
+		return (!cgiCacheServe(client->handler));
+	client->cgiHandler.populate(client->handler);
+	const char *script = client->cgiHandler._pathToScript.c_str();
+	if (access(script, F_OK) != 0 || access(script, R_OK) != 0)
+	{
+		client->handler.setErrorCode(404);
+		return (false);
+	}
+	if (cgiCacheServe(client->handler))
+		return (false);
+	return (true);
+}
+
+/* Forks the script and gives its stdin pipe a slot in the event loop. The
+ * body, whatever part of it we have, follows through feedCgi().
+ * Locations with a FastCGI backend or a proxy_pass server send the
+ * request there instead, and Python scripts in a cgi_pool location go
+ * to an idle warm worker. */
+static bool	startCgi(Endpoint *client, int qfd)
+{
+	logDebug("We have all permissions");
+	client->cgiHandler.appendPostData(client->handler.takeBody());
+	unsigned int timeout_s = client->handler.getLocationBlock()->cgiTimeout;
+	client->cgi_deadline_ms = timeout_s > 0 ? now_ms() + timeout_s * 1000 : 0;
+	const string &fastcgiPass = client->handler.getLocationBlock()->fastcgiPass;
+	const string &proxyPass = client->handler.getLocationBlock()->proxyPass;
+	if (!fastcgiPass.empty() || !proxyPass.empty())
+	{
+		if (proxyPass.empty() ? fcgiStart(client, qfd, fastcgiPass)
+				: proxyStart(client, qfd, proxyPass))
+			return (true);
+		cgiRelease(client);
+		client->handler.setErrorCode(502);
+		return (false);
+	}
+	const LocationBlock *loc = client->handler.getLocationBlock();
+	if (loc->cgiPoolSize > 0 && client->handler.getCgiType() == PYTHON
+			&& fcgiStartPooled(client, qfd, loc))
+		return (true);
+	if (!client->cgiHandler.executeCgi())
+	{
+		cgiRelease(client);
+		client->handler.setErrorCode(500);
+		return (false);
+	}
+	int stdinFd = client->cgiHandler.getPipeToCgi()[1];
+	int stdoutFd = client->cgiHandler.getPipeFromCgi()[0];
+	int pidfd = client->cgiHandler.getPidfd();
+	client->cgiStdin = claimEndpoint(qfd, CgiStdin, stdinFd, client, WRITABLE);
+	client->cgiStdout = claimEndpoint(qfd, CgiStdout, stdoutFd, client, READABLE);
+	if (pidfd != -1)
+		client->cgiExit = claimEndpoint(qfd, CgiExit, pidfd, client, READABLE);
+	if (client->cgiStdin == nullptr || client->cgiStdout == nullptr
+			|| (pidfd != -1 && client->cgiExit == nullptr))
+	{
+		stopCgi(client, qfd);
+		client->handler.setErrorCode(503);
+		return (false);
+	}
+	return (true);
+}
+
+/* The whole request is in: hand it all to the script, started now if
+ * it was not early, or once it gets a slot. An identical request whose
+ * script is running already shares its output instead. Whatever fails
+ * leaves the client in C_SEND_RESPONSE with an error to send. */
+static void	runCgi(Endpoint *client, int qfd)
+{
+	if (!hasCgiRunning(client))
+	{
+		if (client->cgiSlot != CGI_RUNNING && cgiFollow(client))
+		{
+			client->state = C_FOLLOW_CGI;
+			watchCgiClient(client, qfd);
+			return ;
+		}
+		if (client->cgiSlot != CGI_RUNNING)
+		{
+			switch (cgiAdmit(client, true))
+			{
+				case CGI_RUNNING:
+					break;
+				case CGI_WAITING:
+					client->state = C_CGI_QUEUED;
+					watch(qfd, client, READABLE); /* For hanging up */
+					return ;
+				case CGI_NO_SLOT:
+					client->handler.setErrorCode(503);
+					return ;
+			}
+		}
+		if (!startCgi(client, qfd))
+			return ;
+		cgiLead(client);
+	}
+	client->cgiHandler.endPostData();
+	streamBodyToCgi(client, qfd);
+	client->state = C_EXEC_CGI;
+	watchCgiClient(client, qfd);
+}
+
+/* Its turn came, see cgiDispatch() */
+void	startQueuedCgi(Endpoint *client, int qfd)
+{
+	client->last_heard_from_ms = now_ms();
+	watch(qfd, client, WRITABLE);
+	client->state = C_SEND_RESPONSE;
+	runCgi(client, qfd);
+}
+
+/* The script this client followed is done, see cgiFlightLand(). It
+ * ends like its leader: the rest of the copy goes out, or an error. */
+void	followedCgiDone(Endpoint *client, int qfd, bool complete, int error)
+{
+	if (error != 0)
+		client->handler.setErrorCode(error);
+	if (!complete)
+		client->handler.setResponse("");
+	else if (client->handler.getResponse().empty())
+	{
+		responseSent(client, qfd); /* Streamed out already */
+		return ;
+	}
+	watch(qfd, client, WRITABLE);
+	client->state = C_SEND_RESPONSE;
+}
+
+/* New body bytes came in while the script runs: queue them and make
+ * sure the pipe gets watched again. */
+static void	streamBodyToCgi(Endpoint *client, int qfd)
+{
+	client->cgiHandler.appendPostData(client->handler.takeBody());
+	if (client->fcgi != nullptr)
+		fcgiSendBody(client, qfd);
+	else if (client->proxy != nullptr)
+		proxySendBody(client, qfd);
+	else if (client->cgiStdin != nullptr)
+		watch(qfd, client->cgiStdin, WRITABLE);
+}
+
+/* The CGI's stdin can take more. Once it has the whole body, or
+ * refuses any more of it, the pipe is closed so the script sees EOF. */
+void	feedCgi(Endpoint *pipe, int qfd)
+{
+	Endpoint *client = pipe->owner;
+	assert(client != nullptr && client->cgiStdin == pipe);
+
+	switch (client->cgiHandler.pumpPostData())
+	{
+		case S_Again:
+			if (!client->cgiHandler.hasPostDataPending())
+				watch(qfd, pipe, IDLE);
+			break;
+		case S_Done:
+		case S_Error:
+			releaseEndpoint(qfd, pipe);
+			client->cgiStdin = nullptr;
+			client->cgiHandler.closeStdin();
+			break;
+		case S_ClosedConnection:
+		case S_ReadBody:
+			assert(false); /* Unreachable */
+			break;
+	}
+}
+
+/* The script wrote something, or closed its stdout. What it wrote goes
+ * out to the client as it comes; a client that reads slower than the
+ * script writes gets the script paused rather than buffered for. */
+void	drainCgi(Endpoint *pipe, int qfd)
+{
+	Endpoint *client = pipe->owner;
+	assert(client != nullptr && client->cgiStdout == pipe);
+
+#ifdef __linux__
+	if (client->state == C_EXEC_CGI && client->handler.canRelayCgiOutput())
+	{
+		relayCgi(pipe, qfd);
+		return ;
+	}
+#endif
+	switch (client->handler.readCgiOutput(client->cgiHandler))
+	{
+		case S_Again:
+			if (cgiProduced(client, qfd)
+					&& client->handler.getResponse().size() > CGI_OUTPUT_HIGH_WATER)
+				watch(qfd, pipe, IDLE);
+			break;
+		case S_Done:
+			releaseEndpoint(qfd, pipe);
+			client->cgiStdout = nullptr;
+			client->cgiHandler.closeStdout();
+			cgiDone(client, qfd);
+			break;
+		case S_Error:
+			cgiFailed(client, qfd, 500);
+			break;
+		case S_ClosedConnection:
+		case S_ReadBody:
+			assert(false); /* Unreachable */
+			break;
+	}
+}
+
+#ifdef __linux__
+/* Body bytes go from the pipe straight to the socket. When the socket
+ * is full the pipe is parked until sendCgiOutput() sees it writable. */
+static void	relayCgi(Endpoint *pipe, int qfd)
+{
+	Endpoint *client = pipe->owner;
+
+	ssize_t n = client->handler.relayCgiOutput(client->cgiHandler);
+	if (n > 0)
+	{
+		client->last_heard_from_ms = now_ms();
+		overOutputLimit(client, qfd);
+		return ;
+	}
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		watch(qfd, pipe, IDLE);
+		watch(qfd, client, WRITABLE);
+		return ;
+	}
+	if (n < 0)
+	{
+		client->state = C_MARKED_FOR_DISCONNECTION;
+		return ;
+	}
+	releaseEndpoint(qfd, pipe);
+	client->cgiStdout = nullptr;
+	client->cgiHandler.closeStdout();
+	cgiDone(client, qfd);
+}
+#endif
+
+/* The script exited: collect it so it does not linger as a zombie. */
+void	reapCgi(Endpoint *pidfd, int qfd)
+{
+	Endpoint *client = pidfd->owner;
+	assert(client != nullptr && client->cgiExit == pidfd);
+
+	if (!client->cgiHandler.reap(false))
+		return ;
+	releaseEndpoint(qfd, pidfd);
+	client->cgiExit = nullptr;
+	client->cgiHandler.closePidfd();
+	cgiDone(client, qfd);
+}
+
+/* Output and exit status can come in either order, the response is
+ * built once we have both. */
+static void	cgiDone(Endpoint *client, int qfd)
+{
+	if (client->cgiStdout != nullptr || client->cgiExit != nullptr)
+		return ;
+	client->cgiHandler.reap(true); /* No-op unless we had no pidfd */
+	int status = client->cgiHandler.getExitStatus();
+	cgiFinished(client, qfd, !WIFEXITED(status) || WEXITSTATUS(status) == EXIT_FAILURE);
+}
+
+bool	hasCgiRunning(const Endpoint *client)
+{
+	return (client->cgiHandler.cgiPid != 0 || client->fcgi != nullptr
+		|| client->proxy != nullptr);
+}
+
+/* cgi_max_output: a script that writes more is stopped, its client
+ * gets a 502 or, if the response started, a cut connection */
+static bool	overOutputLimit(Endpoint *client, int qfd)
+{
+	size_t max = client->handler.getLocationBlock()->cgiMaxOutput;
+	if (max == 0 || client->handler.getCgiOutputBytes() <= max)
+		return (false);
+	logDebug("cgi_max_output: %d", client->sockfd);
+	countCgiOutputLimit();
+	cgiFailed(client, qfd, 502);
+	return (true);
+}
+
+/* New output was framed into the response. Returns false if that was
+ * too much and the script was stopped. */
+bool	cgiProduced(Endpoint *client, int qfd)
+{
+	if (overOutputLimit(client, qfd))
+		return (false);
+	cgiFlightForward(client, qfd);
+	if (client->state == C_EXEC_CGI)
+		watchCgiClient(client, qfd);
+	return (true);
+}
+
+/* The script is done and all its output is in */
+void	cgiFinished(Endpoint *client, int qfd, bool failed)
+{
+	if (client->handler.finishCgiResponse(failed) != S_Done)
+	{
+		cgiFailed(client, qfd, 500);
+		return ;
+	}
+	if (!failed && client->handler.getErrorCode() == 0)
+		cgiCacheStore(client->handler);
+	cgiFlightLand(client, qfd, true, client->handler.getErrorCode());
+	stopCgi(client, qfd);
+	sendCgiResponse(client, qfd);
+}
+
+void	cgiFailed(Endpoint *client, int qfd, int error)
+{
+	cgiFlightLand(client, qfd, false, error);
+	stopCgi(client, qfd);
+	if (client->handler.cgiResponseStarted())
+	{
+		/* The status line is out, cutting the stream is all that is left */
+		client->state = C_MARKED_FOR_DISCONNECTION;
+		return ;
+	}
+	client->handler.setErrorCode(error);
+	client->handler.setResponse("");
+	sendCgiResponse(client, qfd);
+}
+
+/* The script may be done before the client is: the rest of the body
+ * is skipped like for any other early answer. */
+static void	sendCgiResponse(Endpoint *client, int qfd)
+{
+	if (client->state == C_RECV_BODY)
+		client->handler.discardBody();
+	if (client->handler.cgiResponseStarted() && client->handler.getResponse().empty())
+	{
+		responseSent(client, qfd); /* Streamed out already */
+		return ;
+	}
+	watch(qfd, client, WRITABLE);
+	client->state = C_SEND_RESPONSE;
+}
+
+/* While its script runs a client is only watched for going away, so
+ * the script can be killed instead of running for nobody. A pipelined
+ * request waits, parked, for its turn. */
+static void	clientHungUp(Endpoint *client, int qfd)
+{
+	char	c;
+
+	ssize_t n = recv(client->sockfd, &c, 1, MSG_PEEK);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		client->state = C_MARKED_FOR_DISCONNECTION;
+	else if (n > 0)
+		watch(qfd, client, IDLE);
+}
+
+/* Writable while there is script output to send, otherwise only
+ * watched for hanging up. */
+static void	watchCgiClient(Endpoint *client, int qfd)
+{
+	watch(qfd, client, client->handler.getResponse().empty() ? READABLE : WRITABLE);
+}
+
+/* Sends what the script wrote so far. Draining below the low mark
+ * resumes reading a script that drainCgi() paused, and so does a
+ * socket that was too full for relayCgi(). */
+static void	sendCgiOutput(Endpoint *client, int qfd)
+{
+	std::string_view out = client->handler.getResponse();
+	size_t pending = out.size();
+	if (pending == 0)
+	{
+		if (client->cgiStdout != nullptr)
+			watch(qfd, client->cgiStdout, READABLE);
+		watch(qfd, client, READABLE);
+		return ;
+	}
+	ssize_t sent = client->handler.transmit(out.data(), pending);
+	if (sent < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			client->state = C_MARKED_FOR_DISCONNECTION;
+		return ;
+	}
+	client->handler.consumeResponse(sent);
+	client->last_heard_from_ms = now_ms();
+	out = client->handler.getResponse();
+	if (pending >= CGI_OUTPUT_LOW_WATER && out.size() < CGI_OUTPUT_LOW_WATER)
+	{
+		if (client->cgiStdout != nullptr)
+			watch(qfd, client->cgiStdout, READABLE);
+		fcgiResume(client, qfd);
+		proxyResume(client, qfd);
+	}
+	if (out.empty())
+		watch(qfd, client, READABLE);
+}
+
+/* Kills the script if still running and gives back the slots of its
+ * pipes, or walks away from a FastCGI or proxied request. Its place in the CGI
+ * limits goes to the next queued request. */
+void	stopCgi(Endpoint *client, int qfd)
+{
+	cgiFlightLand(client, qfd, false, 502);
+	client->cgi_deadline_ms = 0;
+	cgiRelease(client);
+	cgiCacheRelease(client->handler);
+	if (client->fcgi != nullptr)
+		fcgiAbort(client, qfd);
+	proxyAbort(client, qfd);
+	Endpoint **pipes[] = { &client->cgiStdin, &client->cgiStdout, &client->cgiExit };
+	for (Endpoint **pipe : pipes)
+	{
+		if (*pipe == nullptr)
+			continue ;
+		releaseEndpoint(qfd, *pipe);
+		*pipe = nullptr;
+	}
+	client->cgiHandler.CgiResetObject();
+}
+
+/* The response is out. Either skip what is left of a rejected body,
+ * go back to waiting for the next request, or hang up after an error. */
+static void	responseSent(Endpoint *conn, int qfd)
+{
+	bool keepAlive = conn->handler.canKeepAlive() && !isDraining();
+	H2Conn *h2 = conn->handler.getH2();
+	if (h2 != nullptr) /* Other streams may follow, an unread body is refused */
+		keepAlive = h2StreamDone(h2) && !isDraining();
+	else if (conn->handler.hasPendingBody())
+	{
+		if (!keepAlive)
+			shutdown(conn->sockfd, SHUT_WR);
+		watch(qfd, conn, READABLE);
+		conn->state = C_DRAIN_BODY;
+		return ;
+	}
+	if (!keepAlive)
+	{
+		conn->state = C_MARKED_FOR_DISCONNECTION;
+		return ;
+	}
+	watch(qfd, conn, READABLE);
+	conn->state = C_RECV_HEADER;
+	conn->handler.resetObject();
+	conn->began_sending_header_ms = now_ms();
+	readBuffered(conn, qfd); /* A pipelined request, decrypted already */
+	if (h2 != nullptr)
+		h2Watch(conn, qfd);
+}
+
+/* The TLS handshake of a new connection on an ssl address, then its
+ * first request as on any other */
+static void	handshake(Endpoint *client, int qfd)
+{
+	enum queue_event_type wait = READABLE;
+	switch (tlsHandshake(client->handler.getTls(), &wait))
+	{
+		case S_Done:
+			client->state = C_RECV_HEADER;
+			client->began_sending_header_ms = now_ms();
+			client->last_heard_from_ms = now_ms();
+			watch(qfd, client, READABLE);
+			readBuffered(client, qfd);
+			break;
+		case S_Again:
+			watch(qfd, client, wait);
+			break;
+		case S_Error:
+		case S_ClosedConnection:
+		case S_ReadBody:
+			client->state = C_MARKED_FOR_DISCONNECTION;
+			break;
+	}
+}
+
+static bool	isReceiving(ConnectionState state)
+{
+	return (state == C_RECV_HEADER || state == C_RECV_BODY || state == C_DRAIN_BODY);
+}
+
+/* On an HTTP/2 connection the socket is also wanted the other way round:
+ * writable while receiving, for frames the client is owed (SETTINGS and
+ * PING acks, WINDOW_UPDATE, the end of the last response), and readable
+ * while sending, for the WINDOW_UPDATE a response waits for. Returns true
+ * if the event was for that. */
+static bool	h2Turn(Endpoint *conn, int qfd, queue_event_type event_type)
+{
+	H2Conn *h2 = conn->handler.getH2();
+	if (isReceiving(conn->state) && event_type == WRITABLE)
+	{
+		if (!h2Flush(h2))
+			conn->state = C_MARKED_FOR_DISCONNECTION;
+		else if (!h2Pending(h2))
+			watch(qfd, conn, READABLE);
+		return (true);
+	}
+	if (!isReceiving(conn->state) && event_type == READABLE && h2Blocked(h2))
+	{
+		if (!h2Pump(h2))
+			conn->state = C_MARKED_FOR_DISCONNECTION;
+		else if (!h2Blocked(h2) || h2Behind(h2))
+			watch(qfd, conn, WRITABLE);
+		return (true);
+	}
+	return (false);
+}
+
+static void	h2Watch(Endpoint *conn, int qfd)
+{
+	H2Conn *h2 = conn->handler.getH2();
+	if (conn->state == C_MARKED_FOR_DISCONNECTION || conn->state == C_DISCONNECTED)
+		return ;
+	if (isReceiving(conn->state) && h2Pending(h2))
+		watch(qfd, conn, WRITABLE);
+	else if (!isReceiving(conn->state) && h2Blocked(h2))
+		watch(qfd, conn, READABLE);
+}
+
+/* TLS reads whole records: what did not fit in our buffer stays with
+ * OpenSSL, and the socket will not say readable for it */
+static void	readBuffered(Endpoint *client, int qfd)
+{
+	while (client->handler.hasBufferedInput())
+	{
+		ConnectionState before = client->state;
+		if (before == C_RECV_HEADER)
+			receiveHeader(client, qfd);
+		else if (before == C_RECV_BODY)
+			receiveBody(client, qfd);
+		else if (before == C_DRAIN_BODY)
+			drainBody(client, qfd);
+		else
+			break;
+	}
+}
+
 void	disconnectClient(Endpoint *client, int qfd)
 {
 	assert(client->state != C_DISCONNECTED);
 	logDebug("Disconnecting %d", client->handler.getClientSocket());
 	queue_rem_fd(qfd, client->handler.getClientSocket());
+	if (client->handler.getH2() != nullptr)
+		h2Close(client->handler.getH2());
+	client->handler.setH2(nullptr);
+	if (client->handler.getTls() != nullptr)
+		tlsClose(client->handler.getTls());
+	client->handler.setTls(nullptr);
 	close(client->handler.getClientSocket());
 	client->state = C_DISCONNECTED;
 	client->sockfd = -1;
+	bzero(client->address, LISTEN_ADDRSTRLEN);
 	bzero(client->IP, INET6_ADDRSTRLEN);
-	bzero(client->port, PORT_STRLEN);
 	client->began_sending_header_ms = 0;
 	client->last_heard_from_ms = 0;
+	stopCgi(client, qfd); /* Before the handler forgets its location */
 	client->handler.setClientSocket(-1);
 	client->handler.resetObject();
-	client->cgiHandler.CgiResetObject();
+	client->handler.dropConfig(); /* The next connection in this slot may be for another listener */
 }
 
 bool	isLiveClient(Endpoint *conn)
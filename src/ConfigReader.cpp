@@ -0,0 +1,149 @@
+#include "ConfigReader.hpp"
+#include <stdexcept>
+#include <cctype>
+
+namespace {
+
+class Reader {
+	public:
+		Reader(const char *data, size_t size) : _p(data), _end(data + size) {}
+
+		/* Directives up to the `}` closing the block, or to the end of
+		 * the file at the top level */
+		std::vector<ConfigDirective>	directives(bool inBlock)
+		{
+			std::vector<ConfigDirective> list;
+			while (true)
+			{
+				std::string word;
+				int line;
+				char c = next(word, line);
+				if (c == '\0' && word.empty())
+				{
+					if (inBlock)
+						fail(line, "unexpected end of file, expecting }");
+					return (list);
+				}
+				if (c == '}' && word.empty())
+				{
+					if (!inBlock)
+						fail(line, "unexpected }");
+					return (list);
+				}
+				if (word.empty())
+					fail(line, std::string("unexpected ") + c);
+				ConfigDirective d;
+				d.name = word;
+				d.line = line;
+				while (c == ' ')
+				{
+					c = next(word, line);
+					if (!word.empty())
+						d.args.push_back(word);
+				}
+				if (c == '{')
+				{
+					d.hasBlock = true;
+					d.block = directives(true);
+				}
+				else if (c != ';')
+					fail(d.line, "`" + d.name + "` is not terminated by ;");
+				list.push_back(std::move(d));
+			}
+		}
+
+	private:
+		const char	*_p;
+		const char	*_end;
+		int			_line = 1;
+
+		[[noreturn]] void	fail(int line, const std::string &why) const
+		{
+			throw std::runtime_error("line " + std::to_string(line) + ": " + why);
+		}
+
+		/* Reads one word, and returns what stopped it: ' ' for a blank,
+		 * one of ;{} or '\0' at the end */
+		char	next(std::string &word, int &line)
+		{
+			word.clear();
+			while (_p < _end)
+			{
+				if (*_p == '#')
+					while (_p < _end && *_p != '\n')
+						_p++;
+				else if (std::isspace(static_cast<unsigned char>(*_p)))
+				{
+					if (*_p++ == '\n')
+						_line++;
+				}
+				else
+					break ;
+			}
+			line = _line;
+			const char *start = _p;
+			while (_p < _end && !std::isspace(static_cast<unsigned char>(*_p))
+					&& *_p != ';' && *_p != '{' && *_p != '}' && *_p != '#')
+				_p++;
+			word.assign(start, _p);
+			if (_p == _end)
+				return ('\0');
+			if (*_p == ';' || *_p == '{' || *_p == '}')
+				return (*_p++);
+			return (' ');
+		}
+};
+
+}
+
+std::vector<ConfigDirective>	readConfig(const char *data, size_t size)
+{
+	Reader reader(data, size);
+	return (reader.directives(false));
+}
+
+void	configError(const ConfigDirective &d, const std::string &why)
+{
+	throw std::runtime_error("line " + std::to_string(d.line) + ": `" + d.name + "` " + why);
+}
+
+void	configArgs(const ConfigDirective &d, size_t min, size_t max)
+{
+	if (d.args.size() < min || d.args.size() > max)
+		configError(d, "has the wrong number of arguments");
+	if (d.hasBlock)
+		configError(d, "takes no block");
+}
+
+unsigned long	configNumber(const ConfigDirective &d, const std::string &arg,
+		const std::string &unit, size_t digits)
+{
+	size_t n = 0;
+	while (n < arg.size() && std::isdigit(static_cast<unsigned char>(arg[n])))
+		n++;
+	if (n == 0 || n > digits || arg.compare(n, std::string::npos, unit) != 0)
+		configError(d, "expects a number" + (unit.empty() ? "" : " in " + unit) + ", not " + arg);
+	return (std::stoul(arg.substr(0, n)));
+}
+
+bool	configFlag(const ConfigDirective &d)
+{
+	configArgs(d, 1, 1);
+	if (d.args[0] != "on" && d.args[0] != "off")
+		configError(d, "expects on or off");
+	return (d.args[0] == "on");
+}
+
+bool	configAddress(const std::string &arg)
+{
+	if (arg.compare(0, 6, "unix:/") == 0)
+		return (arg.size() > 6);
+	if (arg.compare(0, 1, "/") == 0)
+		return (arg.size() > 1);
+	size_t colon = arg.rfind(':');
+	if (colon == 0 || colon == std::string::npos || arg.find('/') != std::string::npos)
+		return (false);
+	size_t digits = arg.size() - colon - 1;
+	return (digits >= 1 && digits <= 5
+			&& arg.find_first_not_of("0123456789", colon + 1) == std::string::npos);
+}
@@ -0,0 +1,180 @@
+#include "ConfigSnapshot.hpp"
+#include "Parser.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+
+/* Bump when the fields written below change */
+constexpr char		SNAPSHOT_MAGIC[8] = { 'w', 'e', 'b', 's', 'e', 'r', 'v', '\0' };
+constexpr uint64_t	SNAPSHOT_VERSION = 7;
+
+void	SnapshotWriter::number(uint64_t n)
+{
+	_data.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+void	SnapshotWriter::string(const std::string &s)
+{
+	number(s.size());
+	_data.append(s);
+}
+
+void	SnapshotWriter::strings(const std::vector<std::string> &list)
+{
+	number(list.size());
+	for (const auto &s : list)
+		string(s);
+}
+
+const char	*SnapshotReader::take(size_t n)
+{
+	if (static_cast<size_t>(_end - _p) < n)
+		throw std::runtime_error("Configuration snapshot is truncated");
+	const char *at = _p;
+	_p += n;
+	return (at);
+}
+
+uint64_t	SnapshotReader::number()
+{
+	uint64_t n;
+	memcpy(&n, take(sizeof(n)), sizeof(n));
+	return (n);
+}
+
+/* Of the elements of a list, each at least one number long: checked
+ * against what is left before anything is allocated for them */
+size_t	SnapshotReader::count()
+{
+	uint64_t n = number();
+	if (n > static_cast<size_t>(_end - _p) / sizeof(uint64_t))
+		throw std::runtime_error("Configuration snapshot is corrupt");
+	return (n);
+}
+
+std::string	SnapshotReader::string()
+{
+	uint64_t size = number();
+	return (std::string(take(size), size));
+}
+
+std::vector<std::string>	SnapshotReader::strings()
+{
+	std::vector<std::string> list(count());
+	for (auto &s : list)
+		s = string();
+	return (list);
+}
+
+bool	isSnapshot(const std::string &fileName)
+{
+	char magic[sizeof(SNAPSHOT_MAGIC)];
+	int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (false);
+	ssize_t n = read(fd, magic, sizeof(magic));
+	close(fd);
+	return (n == sizeof(magic) && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0);
+}
+
+void	saveSnapshot(const std::string &fileName, const Config &config)
+{
+	SnapshotWriter out;
+	out.number(SNAPSHOT_VERSION);
+	out.number(config.shutdownTimeout);
+	out.number(config.cgiMaxConcurrent);
+	out.string(config.cgiCgroup);
+	out.number(config.upstreams.size());
+	for (const auto &up : config.upstreams)
+	{
+		out.string(up.name);
+		out.string(up.balance);
+		out.number(up.keepalive);
+		out.number(up.servers.size());
+		for (const auto &server : up.servers)
+		{
+			out.string(server.address);
+			out.number(server.maxFails);
+			out.number(server.failTimeout);
+		}
+	}
+	out.number(config.servers.size());
+	for (const auto &server : config.servers)
+		server.save(out);
+
+	/* Renamed into place, so that a running server never reads half of it */
+	std::string tmp = fileName + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("Cannot write " + tmp + ": " + strerror(errno));
+	const std::string &data = out.data();
+	bool ok = write(fd, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == sizeof(SNAPSHOT_MAGIC)
+		&& write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+	ok = (close(fd) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), fileName.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		throw std::runtime_error("Cannot write " + fileName + ": " + strerror(errno));
+	}
+}
+
+static void	readSnapshot(SnapshotReader &in, Config &config)
+{
+	if (in.number() != SNAPSHOT_VERSION)
+		throw std::runtime_error("Configuration snapshot is from another version of webserv");
+	config.shutdownTimeout = in.number();
+	config.cgiMaxConcurrent = in.number();
+	config.cgiCgroup = in.string();
+	config.upstreams.resize(in.count());
+	for (auto &up : config.upstreams)
+	{
+		up.name = in.string();
+		up.balance = in.string();
+		up.keepalive = in.number();
+		up.servers.resize(in.count());
+		for (auto &server : up.servers)
+		{
+			server.address = in.string();
+			server.maxFails = in.number();
+			server.failTimeout = in.number();
+		}
+	}
+	size_t count = in.count();
+	config.servers.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		config.servers.push_back(Configuration(in));
+	if (!in.atEnd())
+		throw std::runtime_error("Configuration snapshot has trailing data");
+}
+
+void	loadSnapshot(const std::string &fileName, Config &config)
+{
+	int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		throw std::runtime_error("Error opening file");
+	}
+	size_t size = st.st_size;
+	void *map = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("Cannot map " + fileName);
+	const char *data = static_cast<const char *>(map);
+	try {
+		if (size < sizeof(SNAPSHOT_MAGIC) || memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+			throw std::runtime_error(fileName + " is not a configuration snapshot");
+		SnapshotReader in(data + sizeof(SNAPSHOT_MAGIC), size - sizeof(SNAPSHOT_MAGIC));
+		readSnapshot(in, config);
+	}
+	catch (...) {
+		munmap(map, size);
+		throw;
+	}
+	munmap(map, size);
+}
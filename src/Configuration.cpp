@@ -1,4 +1,9 @@
 #include "../include/Configuration.hpp"
+#include "../include/ConfigSnapshot.hpp"
+#include "../include/FastCgi.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 
 
 Configuration::Configuration() {}
@@ -10,15 +15,26 @@ Configuration::Configuration(const Configuration &other)
 	  _errorPages(other._errorPages),
 	  _host(other._host),
 	  _port(other._port),
+	  _listenOptions(other._listenOptions),
 	  _serverNames(other._serverNames),
 	  _index(other._index),
 	  _maxClientBodySize(other._maxClientBodySize),
 	  _maxClientHeaderSize(other._maxClientHeaderSize),
+	  _cgiMaxConcurrent(other._cgiMaxConcurrent),
+	  _cgiQueueSize(other._cgiQueueSize),
+	  _cgiQueueTimeout(other._cgiQueueTimeout),
+	  _sslCertificate(other._sslCertificate),
+	  _sslCertificateKey(other._sslCertificateKey),
+	  _sslSessionCache(other._sslSessionCache),
+	  _sslSessionTimeout(other._sslSessionTimeout),
+	  _sslSessionTickets(other._sslSessionTickets),
+	  _tlsContext(other._tlsContext),
 	  _locationBlocks(other._locationBlocks),
 	  _allPaths(other._allPaths),
-	  _rawBlock(other._rawBlock),
-	  _rawServerBlock(other._rawServerBlock)
-{}
+	  _regexSet(other._regexSet)
+{
+	buildLocationLookups(false);
+}
 
 Configuration &Configuration::operator=(const Configuration &other) {
 	if (this != &other) {
@@ -28,14 +44,24 @@ Configuration &Configuration::operator=(const Configuration &other) {
 		_errorPages = other._errorPages;
 		_host = other._host;
 		_port = other._port;
+		_listenOptions = other._listenOptions;
 		_serverNames = other._serverNames;
 		_index = other._index;
 		_maxClientBodySize = other._maxClientBodySize;
 		_maxClientHeaderSize = other._maxClientHeaderSize;
+		_cgiMaxConcurrent = other._cgiMaxConcurrent;
+		_cgiQueueSize = other._cgiQueueSize;
+		_cgiQueueTimeout = other._cgiQueueTimeout;
+		_sslCertificate = other._sslCertificate;
+		_sslCertificateKey = other._sslCertificateKey;
+		_sslSessionCache = other._sslSessionCache;
+		_sslSessionTimeout = other._sslSessionTimeout;
+		_sslSessionTickets = other._sslSessionTickets;
+		_tlsContext = other._tlsContext;
 		_locationBlocks = other._locationBlocks;
 		_allPaths = other._allPaths;
-		_rawBlock = other._rawBlock;
-		_rawServerBlock = other._rawServerBlock;
+		_regexSet = other._regexSet;
+		buildLocationLookups(false);
 	}
 	return *this;
 }
@@ -53,6 +79,12 @@ void Configuration::printLocationBlock(LocationBlock loc, int level) const {
 	std::cout << std::endl;
 	std::cout << indent << "CGI Path PHP: " << loc.cgiPathPHP << std::endl;
 	std::cout << indent << "CGI Path Python: " << loc.cgiPathPython << std::endl;
+	std::cout << indent << "FastCGI Pass: " << loc.fastcgiPass << std::endl;
+	std::cout << indent << "CGI Pool: " << loc.cgiPoolSize << " (" << loc.cgiPoolMaxRequests << " requests each)" << std::endl;
+	std::cout << indent << "CGI Max Concurrent: " << loc.cgiMaxConcurrent << std::endl;
+	std::cout << indent << "CGI Queue: " << loc.cgiQueueSize << std::endl;
+	std::cout << indent << "Stats: " << (loc.stats ? "on" : "off") << std::endl;
+	std::cout << indent << "CGI Cache: " << loc.cgiCacheValid << "s, " << (loc.cgiCacheSize >> 20) << "M, stale " << loc.cgiCacheStale << "s" << std::endl;
 	std::cout << indent << "Upload Directory: " << loc.uploadDir << std::endl;
 	std::cout << indent << "Return Code: " << loc.returnCode << std::endl;
 	std::cout << indent << "Return URL: " << loc.returnURL << std::endl;
@@ -69,10 +101,13 @@ void Configuration::printServerBlock() const {
 	std::cout << "Server Block:" << std::endl;
 	std::cout << "Port: " << _port << std::endl;
 	std::cout << "Host: " << _host << std::endl;
+	std::cout << "Backlog: " << _listenOptions.backlog << std::endl;
 	std::cout << "Server Names: " << _serverNames << std::endl;
 	std::cout << "Max Client Body Size: " << _maxClientBodySize << std::endl;
 	std::cout << "Max Client Header Size: " << _maxClientHeaderSize << std::endl;
 	std::cout << "Index: " << _index << std::endl;
+	std::cout << "CGI Max Concurrent: " << _cgiMaxConcurrent << std::endl;
+	std::cout << "CGI Queue: " << _cgiQueueSize << " (" << _cgiQueueTimeout << "s)" << std::endl;
 	for (const auto& errorPage : _errorPages) {
 		std::cout << "Error Page [" << errorPage.first << "]: " << errorPage.second << std::endl;
 	}
@@ -90,6 +125,12 @@ void Configuration::createBarebonesBlock() {
 	_port = DEFAULT_LISTEN;
 	_maxClientBodySize = 1048576; // 1MB, nginx default
 	_maxClientHeaderSize = 4000;
+	_cgiMaxConcurrent = 0; // No limit
+	_cgiQueueSize = 0; // Over the limit is over
+	_cgiQueueTimeout = DEFAULT_CGI_QUEUE_TIMEOUT;
+	_sslSessionCache = DEFAULT_SSL_SESSION_CACHE;
+	_sslSessionTimeout = DEFAULT_SSL_SESSION_TIMEOUT;
+	_sslSessionTickets = true;
 	_globalCgiPathPHP = G_CGI_PATH_PHP;
 	_globalCgiPathPython = G_CGI_PATH_PYTHON;
 	_errorPages.emplace(400, "/default-error-pages/400.html");
@@ -105,162 +146,424 @@ void Configuration::createBarebonesBlock() {
 	_errorPages.emplace(431, "/default-error-pages/431.html");
 	_errorPages.emplace(500, "/default-error-pages/500.html");
 	_errorPages.emplace(501, "/default-error-pages/501.html");
+	_errorPages.emplace(502, "/default-error-pages/502.html");
 	_errorPages.emplace(503, "/default-error-pages/503.html");
+	_errorPages.emplace(504, "/default-error-pages/504.html");
 	_errorPages.emplace(505, "/default-error-pages/505.html");
 }
 
-std::vector<std::string> Configuration::generateLocationBlock(std::vector<std::string>::iterator& it, std::vector<std::string>::iterator end) {
-
-	std::vector<std::string> locationBlock;
-	std::string line;
-	int brace = 0;
-	while (it != end) {
-		line = *it;
-		if (line.find('{') != line.npos)
-			brace++;
-		else if (line.find('}') != line.npos) {
-			brace--;
-			if (!brace) {
-				locationBlock.push_back(line);
-				break;
-			}
-		}
-		locationBlock.push_back(line);
-		++it;
+/* `root /a/b/`, the slashes around it are dropped */
+static std::string trimSlashes(const std::string &path) {
+	size_t start = (!path.empty() && path.front() == '/') ? 1 : 0;
+	size_t end = path.size();
+	if (end > start && path[end - 1] == '/')
+		end--;
+	return path.substr(start, end - start);
+}
+
+/* `listen PORT [ssl] [backlog=N] [reuseport] [deferred] [fastopen=N] [rcvbuf=Nk]
+ * [sndbuf=Nk] [busy_poll=N] [tcp_nodelay=on|off] [notsent_lowat=Nk]`, or
+ * `listen unix:/path [mode=0NNN] [backlog=N] [rcvbuf=Nk] [sndbuf=Nk]` */
+static ListenOptions parseListenOptions(const ConfigDirective& d, bool unixSocket) {
+	ListenOptions options;
+
+	if (unixSocket)
+		options.tcpNodelay = false;
+	for (size_t i = 1; i < d.args.size(); i++) {
+		const std::string& param = d.args[i];
+		size_t eq = param.find('=');
+		std::string key = param.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : param.substr(eq + 1);
+		if (key == "reuseport" && eq == std::string::npos)
+			options.reuseport = true;
+		else if (key == "deferred" && eq == std::string::npos)
+			options.deferred = true;
+		else if (key == "ssl" && eq == std::string::npos)
+			options.ssl = true;
+		else if (key == "backlog")
+			options.backlog = configNumber(d, value, "", 5);
+		else if (key == "fastopen")
+			options.fastopen = configNumber(d, value, "", 5);
+		else if (key == "rcvbuf")
+			options.rcvbuf = configNumber(d, value, "k", 6) << 10;
+		else if (key == "sndbuf")
+			options.sndbuf = configNumber(d, value, "k", 6) << 10;
+		else if (key == "busy_poll")
+			options.busyPoll = configNumber(d, value, "", 5);
+		else if (key == "notsent_lowat")
+			options.notsentLowat = configNumber(d, value, "k", 6) << 10;
+		else if (key == "tcp_nodelay" && (value == "on" || value == "off"))
+			options.tcpNodelay = value == "on";
+		else if (key == "mode" && unixSocket && value.size() == 4 && value[0] == '0'
+				&& value.find_first_not_of("01234567") == std::string::npos)
+			options.mode = std::stoi(value, nullptr, 8);
+		else
+			configError(d, "has an unknown parameter " + param);
+		if (unixSocket && key != "mode" && key != "backlog" && key != "rcvbuf" && key != "sndbuf" && key != "ssl")
+			configError(d, "cannot have " + key + " on a unix socket");
+	}
+	options.given = d.args.size() > 1;
+	return options;
+}
+
+/* `cgi_path_php /usr/bin/`: absolute, without the trailing slash */
+static std::string binPath(const ConfigDirective& d) {
+	configArgs(d, 1, 1);
+	if (d.args[0].front() != '/')
+		configError(d, "expects an absolute path");
+	return "/" + trimSlashes(d.args[0]);
+}
+
+LocationBlock Configuration::handleLocationBlock(const ConfigDirective& location) {
+	LocationBlock loc;
+	const std::vector<std::string>& args = location.args;
+
+	if (!location.hasBlock)
+		configError(location, "needs a block");
+	if (args.size() == 2 && (args[0] == "=" || args[0] == "^~" || args[0] == "~" || args[0] == "~*")) {
+		loc.modifier = args[0];
+		loc.path = args[1];
 	}
-	return locationBlock;
-}
-
-LocationBlock Configuration::handleLocationBlock(std::vector<std::string>& locationBlock) {
-    LocationBlock loc;
-	std::regex locationRegex(R"(^location ([^\s]+)\s*$)");
-	std::regex rootRegex(R"(^root /?([^/][^;]*[^/])?/?\s*;$)");
-	std::regex returnRegex(R"(^return 307 (\S+)\s*;$)");
-	std::regex methodsRegex(R"(^methods ([^\s;]+(?: [^\s;]+)*)\s*;$)");
-	std::regex uploadDirRegex(R"(^upload_dir (home/\S+/)\s*;$)");
-	std::regex dirListingRegex(R"(^dir_listing (on|off)\s*;$)");
-	std::regex cgiPathRegexPHP(R"(^cgi_path_php (\/[^/][^;]*[^/])?/?\s*;$)");
-	std::regex cgiPathRegexPython(R"(^cgi_path_python (\/[^/][^;]*[^/])?/?\s*;$)");
-
-	std::smatch match;
-	int brace = 0;
+	else if (args.size() == 1 && args[0] != "=" && args[0] != "^~" && args[0] != "~" && args[0] != "~*")
+		loc.path = args[0];
+	else
+		configError(location, "expects [= | ^~ | ~ | ~*] PATH");
 	loc.returnCode = -1; // Default value for return code
 	loc.returnURL = ""; // Default value for return URL
 	loc.dirListing = false; // Default value for directory listing
-	std::vector<std::string>::iterator it_begin = locationBlock.begin();
-	std::vector<std::string>::iterator it_end = locationBlock.end();
-
-	std::regex_search(*it_begin, match, locationRegex);
-	loc.path = match[1];
-	++it_begin;
-
-	while (it_begin != it_end) {
-		std::string line = *it_begin;
-
-		if (line.find('{') != line.npos)
-			brace++;
-		else if (line.find('}') != line.npos) {
-			brace--;
-			if (!brace)
-				break;
+
+	for (const auto& d : location.block) {
+		const std::string& name = d.name;
+
+		if (name == "location") {
+			loc.nestedLocations.push_back(handleLocationBlock(d));
+			continue;
 		}
-		else if (std::regex_search(line, match, locationRegex)) {
-			// std::cout << "Nested location block found: " << match[1] << std::endl;
-			std::vector<std::string> locationBlockRaw = generateLocationBlock(it_begin, it_end);
-			LocationBlock nestedLoc = handleLocationBlock(locationBlockRaw);
-			loc.nestedLocations.push_back(nestedLoc);
+		if (name == "methods") {
+			configArgs(d, 1, SIZE_MAX);
+			loc.methods = d.args;
+			continue;
 		}
-		else if (std::regex_search(line, match, rootRegex))
-			loc.root = match[1];
-		else if (std::regex_search(line, match, methodsRegex)) {
-			std::string methodsStr = match[1];
-			std::istringstream iss(methodsStr);
-			std::string method;
-			while (iss >> method) {
-				loc.methods.push_back(method);
+		if (name == "cgi_pool") {
+			configArgs(d, 1, 2);
+			loc.cgiPoolSize = configNumber(d, d.args[0], "", 3);
+			loc.cgiPoolMaxRequests = d.args.size() == 2 ? configNumber(d, d.args[1], "", 9) : DEFAULT_CGI_POOL_MAX_REQUESTS;
+			char worker[PATH_MAX];
+			if (realpath(CGI_WORKER_SCRIPT, worker) == nullptr)
+				configError(d, std::string("cannot find ") + CGI_WORKER_SCRIPT);
+			loc.cgiWorkerScript = worker;
+			continue;
+		}
+		if (name == "cgi_cache") {
+			// cgi_cache VALIDs [SIZEM] [stale STALEs]
+			configArgs(d, 1, 4);
+			size_t i = 1;
+			loc.cgiCacheValid = configNumber(d, d.args[0], "s", 5);
+			loc.cgiCacheSize = DEFAULT_CGI_CACHE_SIZE << 20;
+			loc.cgiCacheStale = DEFAULT_CGI_CACHE_STALE;
+			if (i < d.args.size() && d.args[i] != "stale")
+				loc.cgiCacheSize = configNumber(d, d.args[i++], "M", 5) << 20;
+			if (i < d.args.size()) {
+				if (d.args[i] != "stale" || i + 2 != d.args.size())
+					configError(d, "expects VALIDs [SIZEM] [stale STALEs]");
+				loc.cgiCacheStale = configNumber(d, d.args[i + 1], "s", 5);
 			}
+			continue;
 		}
-		else if (std::regex_search(line, match, cgiPathRegexPHP))
-			loc.cgiPathPHP = match[1];
-		else if (std::regex_search(line, match, cgiPathRegexPython))
-			loc.cgiPathPython = match[1];
-		else if (std::regex_search(line, match, uploadDirRegex))
-			loc.uploadDir = match[1];
-		else if (std::regex_search(line, match, returnRegex)) {
+		if (name == "return") {
+			configArgs(d, 2, 2);
+			if (d.args[0] != "307")
+				configError(d, "only supports 307");
 			loc.returnCode = 307;
-			loc.returnURL = match[1];
+			loc.returnURL = d.args[1];
+			continue;
+		}
+
+		configArgs(d, 1, 1);
+		const std::string& arg = d.args[0];
+		if (name == "root")
+			loc.root = trimSlashes(arg);
+		else if (name == "cgi_path_php")
+			loc.cgiPathPHP = binPath(d);
+		else if (name == "cgi_path_python")
+			loc.cgiPathPython = binPath(d);
+		else if (name == "fastcgi_pass") {
+			if (!configAddress(arg))
+				configError(d, "expects unix:/path, /path or host:port");
+			loc.fastcgiPass = arg;
 		}
-		else if (std::regex_search(line, match, dirListingRegex))
-			loc.dirListing = (match[1] == "on");
-		it_begin++;
+		else if (name == "proxy_pass") {
+			std::string target = arg.compare(0, 7, "http://") == 0 ? arg.substr(7) : arg;
+			if (!target.empty() && target.back() == '/')
+				target.pop_back();
+			if (!configAddress(target) && (target.empty()
+					|| target.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-") != target.npos))
+				configError(d, "expects an upstream name or an address");
+			loc.proxyPass = target;
+		}
+		else if (name == "cgi_max_concurrent")
+			loc.cgiMaxConcurrent = configNumber(d, arg, "", 5);
+		else if (name == "cgi_queue")
+			loc.cgiQueueSize = configNumber(d, arg, "", 5);
+		else if (name == "stats")
+			loc.stats = configFlag(d);
+		else if (name == "cgi_coalesce")
+			loc.cgiCoalesce = configFlag(d);
+		else if (name == "cgi_timeout")
+			loc.cgiTimeout = configNumber(d, arg, "s", 5);
+		else if (name == "cgi_max_memory")
+			loc.cgiMaxMemory = configNumber(d, arg, "M", 5) << 20;
+		else if (name == "cgi_max_cpu")
+			loc.cgiMaxCpu = configNumber(d, arg, "s", 5);
+		else if (name == "cgi_max_output")
+			loc.cgiMaxOutput = configNumber(d, arg, "M", 5) << 20;
+		else if (name == "upload_dir") {
+			if (arg.compare(0, 5, "home/") != 0 || arg.size() == 5 || arg.back() != '/')
+				configError(d, "expects a home/.../ directory");
+			loc.uploadDir = arg;
+		}
+		else if (name == "dir_listing")
+			loc.dirListing = configFlag(d);
+		else
+			configError(d, "is unknown in a location");
 	}
-    return loc;
+	return loc;
 }
 
+/* A `server { ... }` directive */
+Configuration::Configuration(const ConfigDirective& server) {
+	static const std::set<int> errorCodes = {400, 403, 404, 405, 408, 409, 411, 413, 414, 415, 431, 500, 501, 502, 503, 504, 505};
 
-Configuration::Configuration(std::vector<std::string> servBlck) : _rawServerBlock(servBlck) {
 	createBarebonesBlock();
+	for (const auto& d : server.block) {
+		const std::string& name = d.name;
 
-	std::regex listenRegex(R"(^listen (\d{1,5})\s*;$)");
-	std::regex hostRegex(R"(^host ([^\s]+)\s*;$)");
-	std::regex serverNamesRegex(R"(^server_name ([^\s;]+(?: [^\s;]+)*)\s*;$)");
-	std::regex maxClientBodyRegex(R"(^max_client_body_size (\d+)\s*;$)");
-	std::regex maxClientHeaderRegex(R"(^max_client_header_size (\d+)\s*;$)");
-	std::regex errorPageRegex(R"(^error_page (400|403|404|405|408|409|411|413|414|415|431|500|501|503|505) (/home/\S+\.html)\s*;$)");
-	std::regex indexRegex(R"(^index ([^\s]+)\s*;$)");
-	std::regex locationRegex(R"(^location ([^\s]+)\s*$)");
-
-	for (std::vector<std::string>::iterator it = servBlck.begin(); it != servBlck.end(); ++it) {
-		std::string line = *it;
-		std::smatch match;
-
-		if (std::regex_search(line, match, maxClientBodyRegex)) {
-			try {
-				unsigned int temp = std::stoul(match[1]);
-				if (temp < _maxClientBodySize)	
-					_maxClientBodySize = temp;
-			}
-			catch (const std::exception& e) {
-				std::cerr << "Invalid max_client_body_size value: " << match[1] << ". Using default value." << std::endl;
-			}
+		if (name == "location") {
+			_locationBlocks.push_back(handleLocationBlock(d));
+			continue;
 		}
-		else if (std::regex_search(line, match, maxClientHeaderRegex)) {
-			try {
-				unsigned int temp = std::stoul(match[1]);
-				if (temp < _maxClientHeaderSize)	
-					_maxClientHeaderSize = temp;
-			}
-			catch (const std::exception& e) {
-				std::cerr << "Invalid max_client_header_size value: " << match[1] << ". Using default value." << std::endl;
-			}
+		if (name == "server_name") {
+			configArgs(d, 1, SIZE_MAX);
+			_serverNames = d.args[0];
+			for (size_t i = 1; i < d.args.size(); i++)
+				_serverNames += " " + d.args[i];
+			continue;
+		}
+		if (name == "error_page") {
+			configArgs(d, 2, 2);
+			const std::string& page = d.args[1];
+			if (!errorCodes.count(configNumber(d, d.args[0], "", 3)))
+				configError(d, "has no page for " + d.args[0]);
+			if (page.compare(0, 6, "/home/") != 0 || page.size() < 12 || page.compare(page.size() - 5, 5, ".html") != 0)
+				configError(d, "expects a /home/....html page");
+			_errorPages.insert_or_assign(std::stoi(d.args[0]), page);
+			continue;
+		}
+		if (name == "ssl_session_tickets") {
+			_sslSessionTickets = configFlag(d);
+			continue;
 		}
-		else if (std::regex_search(line, match, listenRegex)) {
-			unsigned int temp = std::stoul(match[1]);
-			if (temp <= 65535)
-				_port = match[1];
+		if (name == "cgi_queue") {
+			configArgs(d, 1, 2);
+			_cgiQueueSize = configNumber(d, d.args[0], "", 5);
+			if (d.args.size() == 2)
+				_cgiQueueTimeout = configNumber(d, d.args[1], "s", 2);
+			continue;
 		}
-		else if (std::regex_search(line, match, hostRegex))
-			_host = match[1];
-		else if (std::regex_search(line, match, serverNamesRegex))
-			_serverNames = match[1];
-		else if (std::regex_search(line, match, errorPageRegex))
-			_errorPages.insert_or_assign(std::stoi(match[1]), match[2]);
-		else if (std::regex_search(line, match, indexRegex))
-			_index = match[1];
-		else if (std::regex_search(line, match, locationRegex)) {
-
-			std::vector<std::string> locationBlock = generateLocationBlock(it, servBlck.end());
-
-			LocationBlock loc = handleLocationBlock(locationBlock);
-			_locationBlocks.push_back(loc);
+
+		if (name == "listen") {
+			configArgs(d, 1, 10);
+			bool unixSocket = d.args[0].compare(0, 5, "unix:") == 0;
+			if (unixSocket && (d.args[0].size() < 7 || d.args[0][5] != '/'
+					|| d.args[0].size() >= LISTEN_ADDRSTRLEN))
+				configError(d, "expects unix:/path, of up to 107 bytes");
+			if (!unixSocket && configNumber(d, d.args[0], "", 5) > 65535)
+				configError(d, "expects a port up to 65535");
+			_port = d.args[0];
+			_listenOptions = parseListenOptions(d, unixSocket);
+			continue;
+		}
+
+		configArgs(d, 1, 1);
+		const std::string& arg = d.args[0];
+		if (name == "max_client_body_size") {
+			unsigned long size = configNumber(d, arg, "", 10);
+			if (size < _maxClientBodySize)
+				_maxClientBodySize = size;
 		}
+		else if (name == "max_client_header_size") {
+			unsigned long size = configNumber(d, arg, "", 10);
+			if (size < _maxClientHeaderSize)
+				_maxClientHeaderSize = size;
+		}
+		else if (name == "host")
+			_host = arg;
+		else if (name == "index")
+			_index = arg;
+		else if (name == "cgi_max_concurrent")
+			_cgiMaxConcurrent = configNumber(d, arg, "", 5);
+		else if (name == "ssl_certificate")
+			_sslCertificate = arg;
+		else if (name == "ssl_certificate_key")
+			_sslCertificateKey = arg;
+		else if (name == "ssl_session_cache")
+			_sslSessionCache = arg == "off" ? 0 : configNumber(d, arg, "", 7);
+		else if (name == "ssl_session_timeout")
+			_sslSessionTimeout = configNumber(d, arg, "s", 6);
+		else
+			configError(d, "is unknown in a server");
 	}
 
 	for (auto& locationBlock : _locationBlocks)
-		populateMethodsPathsCgi(locationBlock, DEFAULT_METHODS, DEFAULT_CGI_PYTHON, DEFAULT_CGI_PHP);
+		populateMethodsPathsCgi(locationBlock, DEFAULT_METHODS, DEFAULT_CGI_PYTHON, DEFAULT_CGI_PHP, "");
+	buildLocationLookups(true);
+}
+
+static void saveLocation(SnapshotWriter& out, const LocationBlock& loc) {
+	out.string(loc.path);
+	out.string(loc.modifier);
+	out.string(loc.root);
+	out.strings(loc.methods);
+	out.string(loc.cgiPathPHP);
+	out.string(loc.cgiPathPython);
+	out.string(loc.fastcgiPass);
+	out.string(loc.proxyPass);
+	out.number(loc.cgiPoolSize);
+	out.number(loc.cgiPoolMaxRequests);
+	out.string(loc.cgiWorkerScript);
+	out.number(loc.cgiMaxConcurrent);
+	out.number(loc.cgiQueueSize);
+	out.number(loc.stats);
+	out.number(loc.cgiCacheValid);
+	out.number(loc.cgiCacheStale);
+	out.number(loc.cgiCacheSize);
+	out.number(loc.cgiCoalesce);
+	out.number(loc.cgiTimeout);
+	out.number(loc.cgiMaxMemory);
+	out.number(loc.cgiMaxCpu);
+	out.number(loc.cgiMaxOutput);
+	out.string(loc.uploadDir);
+	out.number(static_cast<uint64_t>(loc.returnCode));
+	out.string(loc.returnURL);
+	out.number(loc.dirListing);
+	out.number(loc.nestedLocations.size());
+	for (const auto& nested : loc.nestedLocations)
+		saveLocation(out, nested);
+}
+
+static LocationBlock loadLocation(SnapshotReader& in) {
+	LocationBlock loc;
+	loc.path = in.string();
+	loc.modifier = in.string();
+	loc.root = in.string();
+	loc.methods = in.strings();
+	loc.cgiPathPHP = in.string();
+	loc.cgiPathPython = in.string();
+	loc.fastcgiPass = in.string();
+	loc.proxyPass = in.string();
+	loc.cgiPoolSize = in.number();
+	loc.cgiPoolMaxRequests = in.number();
+	loc.cgiWorkerScript = in.string();
+	loc.cgiMaxConcurrent = in.number();
+	loc.cgiQueueSize = in.number();
+	loc.stats = in.number();
+	loc.cgiCacheValid = in.number();
+	loc.cgiCacheStale = in.number();
+	loc.cgiCacheSize = in.number();
+	loc.cgiCoalesce = in.number();
+	loc.cgiTimeout = in.number();
+	loc.cgiMaxMemory = in.number();
+	loc.cgiMaxCpu = in.number();
+	loc.cgiMaxOutput = in.number();
+	loc.uploadDir = in.string();
+	loc.returnCode = static_cast<int>(in.number());
+	loc.returnURL = in.string();
+	loc.dirListing = in.number();
+	loc.nestedLocations.resize(in.count());
+	for (auto& nested : loc.nestedLocations)
+		nested = loadLocation(in);
+	return loc;
 }
 
-void Configuration::populateMethodsPathsCgi(LocationBlock& locationBlock, std::vector<std::string> inheritedMethods, std::string inheritedCgiPathPython, std::string inheritedCgiPathPHP) {
+void Configuration::save(SnapshotWriter& out) const {
+	out.string(_host);
+	out.string(_port);
+	out.number(_listenOptions.given);
+	out.number(_listenOptions.backlog);
+	out.number(_listenOptions.reuseport);
+	out.number(_listenOptions.deferred);
+	out.number(_listenOptions.fastopen);
+	out.number(_listenOptions.rcvbuf);
+	out.number(_listenOptions.sndbuf);
+	out.number(_listenOptions.busyPoll);
+	out.number(_listenOptions.tcpNodelay);
+	out.number(_listenOptions.notsentLowat);
+	out.string(_serverNames);
+	out.string(_index);
+	out.number(_maxClientBodySize);
+	out.number(_maxClientHeaderSize);
+	out.number(_cgiMaxConcurrent);
+	out.number(_cgiQueueSize);
+	out.number(_cgiQueueTimeout);
+	out.number(_listenOptions.ssl);
+	out.string(_sslCertificate);
+	out.string(_sslCertificateKey);
+	out.number(_sslSessionCache);
+	out.number(_sslSessionTimeout);
+	out.number(_sslSessionTickets);
+	out.number(_errorPages.size());
+	for (const auto& errorPage : _errorPages) {
+		out.number(errorPage.first);
+		out.string(errorPage.second);
+	}
+	out.number(_locationBlocks.size());
+	for (const auto& loc : _locationBlocks)
+		saveLocation(out, loc);
+}
+
+/* Locations were saved with their inherited settings already in, so
+ * populating them again only rebuilds what is derived */
+Configuration::Configuration(SnapshotReader& in) {
+	createBarebonesBlock();
+	_host = in.string();
+	_port = in.string();
+	_listenOptions.given = in.number();
+	_listenOptions.backlog = in.number();
+	_listenOptions.reuseport = in.number();
+	_listenOptions.deferred = in.number();
+	_listenOptions.fastopen = in.number();
+	_listenOptions.rcvbuf = in.number();
+	_listenOptions.sndbuf = in.number();
+	_listenOptions.busyPoll = in.number();
+	_listenOptions.tcpNodelay = in.number();
+	_listenOptions.notsentLowat = in.number();
+	_serverNames = in.string();
+	_index = in.string();
+	_maxClientBodySize = in.number();
+	_maxClientHeaderSize = in.number();
+	_cgiMaxConcurrent = in.number();
+	_cgiQueueSize = in.number();
+	_cgiQueueTimeout = in.number();
+	_listenOptions.ssl = in.number();
+	_sslCertificate = in.string();
+	_sslCertificateKey = in.string();
+	_sslSessionCache = in.number();
+	_sslSessionTimeout = in.number();
+	_sslSessionTickets = in.number();
+	_errorPages.clear();
+	for (size_t n = in.number(); n > 0; n--) {
+		int code = in.number();
+		_errorPages.insert_or_assign(code, in.string());
+	}
+	_locationBlocks.resize(in.count());
+	for (auto& locationBlock : _locationBlocks) {
+		locationBlock = loadLocation(in);
+		populateMethodsPathsCgi(locationBlock, DEFAULT_METHODS, DEFAULT_CGI_PYTHON, DEFAULT_CGI_PHP, "");
+	}
+	buildLocationLookups(true);
+}
+
+void Configuration::populateMethodsPathsCgi(LocationBlock& locationBlock, std::vector<std::string> inheritedMethods, std::string inheritedCgiPathPython, std::string inheritedCgiPathPHP, std::string inheritedFastcgiPass) {
 
 	if (locationBlock.methods.empty())
 		locationBlock.methods.insert(locationBlock.methods.end(), inheritedMethods.begin(), inheritedMethods.end());
@@ -277,18 +580,37 @@ void Configuration::populateMethodsPathsCgi(LocationBlock& locationBlock, std::v
 	else
 		inheritedCgiPathPHP = locationBlock.cgiPathPHP;
 
+	if (locationBlock.fastcgiPass.empty())
+		locationBlock.fastcgiPass = inheritedFastcgiPass;
+	else
+		inheritedFastcgiPass = locationBlock.fastcgiPass;
+
+	locationBlock.cgiInterpreterPython = locationBlock.cgiPathPython + "/python3";
+	locationBlock.cgiInterpreterPHP = locationBlock.cgiPathPHP + "/php-cgi";
+	locationBlock.cgiEnv = {
+		"SERVER_PROTOCOL=HTTP/1.1",
+		"GATEWAY_INTERFACE=CGI/1.1",
+		"REDIRECT_STATUS=200",
+		"SERVER_NAME=" + _serverNames,
+		"SERVER_PORT=" + (isUnixSocket() ? "" : _port),
+	};
+
 	_allPaths.insert(std::make_pair(locationBlock.path, locationBlock));
 	
 	std::vector<LocationBlock> &nestedLocations = locationBlock.nestedLocations;
 
 	for (auto& nestedLocation : nestedLocations)
-		populateMethodsPathsCgi(nestedLocation, inheritedMethods, inheritedCgiPathPython, inheritedCgiPathPHP);
+		populateMethodsPathsCgi(nestedLocation, inheritedMethods, inheritedCgiPathPython, inheritedCgiPathPHP, inheritedFastcgiPass);
 }
 
 std::vector<LocationBlock>& Configuration::getLocationBlocks() {
 	return _locationBlocks;
 }
 
+const std::vector<LocationBlock>& Configuration::getLocationBlocks() const {
+	return _locationBlocks;
+}
+
 std::vector<std::string> Configuration::getGlobalMethods() const {
 	return _globalMethods;
 }
@@ -313,6 +635,51 @@ std::string	Configuration::getPort() const {
 	return _port;
 }
 
+/* Where it listens: "host:port", or "unix:/path" */
+std::string	Configuration::getListenAddress() const {
+	return isUnixSocket() ? _port : _host + ":" + _port;
+}
+
+bool	Configuration::isUnixSocket() const {
+	return _port.compare(0, 5, "unix:") == 0;
+}
+
+const ListenOptions&	Configuration::getListenOptions() const {
+	return _listenOptions;
+}
+
+void	Configuration::setListenOptions(const ListenOptions& options) {
+	_listenOptions = options;
+}
+
+const std::string&	Configuration::getSslCertificate() const {
+	return _sslCertificate;
+}
+
+const std::string&	Configuration::getSslCertificateKey() const {
+	return _sslCertificateKey;
+}
+
+size_t	Configuration::getSslSessionCache() const {
+	return _sslSessionCache;
+}
+
+unsigned int	Configuration::getSslSessionTimeout() const {
+	return _sslSessionTimeout;
+}
+
+bool	Configuration::getSslSessionTickets() const {
+	return _sslSessionTickets;
+}
+
+const std::shared_ptr<SSL_CTX>&	Configuration::getTlsContext() const {
+	return _tlsContext;
+}
+
+void	Configuration::setTlsContext(std::shared_ptr<SSL_CTX> context) {
+	_tlsContext = std::move(context);
+}
+
 std::string	Configuration::getServerNames() const {
 	return _serverNames;
 }
@@ -329,6 +696,78 @@ unsigned int	Configuration::getMaxClientHeaderSize() const {
 	return _maxClientHeaderSize;
 }
 
+size_t	Configuration::getCgiMaxConcurrent() const {
+	return _cgiMaxConcurrent;
+}
+
+size_t	Configuration::getCgiQueueSize() const {
+	return _cgiQueueSize;
+}
+
+unsigned int	Configuration::getCgiQueueTimeout() const {
+	return _cgiQueueTimeout;
+}
+
+/* Collects the exact and regex locations, nested ones included, in the
+ * order they are declared */
+void Configuration::indexLocations(std::vector<LocationBlock> &blocks, std::vector<std::pair<std::string, bool>> *patterns) {
+	for (auto& block : blocks) {
+		if (block.modifier == "=")
+			_exactLocations.emplace(block.path, &block);
+		else if (block.modifier == "~" || block.modifier == "~*") {
+			_regexLocations.push_back(&block);
+			if (patterns)
+				patterns->push_back(std::make_pair(block.path, block.modifier == "~*"));
+		}
+		indexLocations(block.nestedLocations, patterns);
+	}
+}
+
+/* The lookups point into _locationBlocks and are redone for every copy;
+ * the regex DFA only when the server is loaded, and once for all the
+ * servers that declare the same regexes */
+void Configuration::buildLocationLookups(bool compileRegexes) {
+	static std::map<std::vector<std::pair<std::string, bool>>, std::weak_ptr<const RegexSet>> compiled;
+	std::vector<std::pair<std::string, bool>> patterns;
+
+	_exactLocations.clear();
+	_regexLocations.clear();
+	indexLocations(_locationBlocks, compileRegexes ? &patterns : nullptr);
+	_locationTrie.build(_locationBlocks);
+	if (compileRegexes) {
+		std::weak_ptr<const RegexSet> &shared = compiled[patterns];
+		_regexSet = shared.lock();
+		if (!_regexSet) {
+			auto regexSet = std::make_shared<RegexSet>();
+			regexSet->compile(patterns);
+			_regexSet = regexSet;
+			shared = _regexSet;
+		}
+	}
+}
+
+/* Location for a request path, in nginx's order: an exact match, else the
+ * longest prefix if it is ^~, else the first regex that matches, else the
+ * longest prefix. The query string takes no part in it. */
+LocationBlock *Configuration::findLocation(const std::string &path) const {
+	size_t len = std::min(path.find('?'), path.size());
+
+	if (!_exactLocations.empty()) {
+		auto exact = _exactLocations.find(path.substr(0, len));
+		if (exact != _exactLocations.end())
+			return exact->second;
+	}
+	LocationBlock *prefix = _locationTrie.match(path.data(), len);
+	if (prefix && prefix->modifier == "^~")
+		return prefix;
+	if (_regexSet && !_regexSet->empty()) {
+		int regex = _regexSet->match(path.data(), len);
+		if (regex != -1)
+			return _regexLocations[regex];
+	}
+	return prefix;
+}
+
 std::string Configuration::getRootViaLocation(std::string path) const {
 	std::map<std::string, LocationBlock>::const_iterator it = _allPaths.find(path);
 	if (it != _allPaths.end())
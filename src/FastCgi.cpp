@@ -0,0 +1,647 @@
+#include "Server.hpp"
+#include "FastCgi.hpp"
+#include "Parser.hpp"
+#include <signal.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <vector>
+
+enum {
+	FCGI_VERSION_1 = 1,
+
+	FCGI_BEGIN_REQUEST = 1,
+	FCGI_ABORT_REQUEST = 2,
+	FCGI_END_REQUEST = 3,
+	FCGI_PARAMS = 4,
+	FCGI_STDIN = 5,
+	FCGI_STDOUT = 6,
+	FCGI_STDERR = 7,
+	FCGI_GET_VALUES = 9,
+	FCGI_GET_VALUES_RESULT = 10,
+
+	FCGI_RESPONDER = 1,
+	FCGI_KEEP_CONN = 1,
+
+	FCGI_REQUEST_COMPLETE = 0,
+	FCGI_OVERLOADED = 2,
+};
+
+constexpr size_t	FCGI_HEADER_LEN = 8;
+constexpr size_t	FCGI_MAX_CONTENT = 65535;
+
+static std::map<std::string, FcgiBackend>	g_backends;
+static std::map<const LocationBlock *, FcgiBackend>	g_pools;
+static std::vector<FcgiConn *>				g_conns;
+static FcgiConn							*g_reading = nullptr; // parseRecords()'s, not freed under it
+
+static void	closeConn(FcgiConn *c, int qfd, int error);
+
+/* Writes one record, padded to a multiple of 8 bytes like the spec
+ * recommends. */
+static void	putRecord(std::string &out, int type, uint16_t id,
+		const char *data, size_t len)
+{
+	assert(len <= FCGI_MAX_CONTENT);
+	unsigned char pad = (8 - len % 8) % 8;
+	unsigned char header[FCGI_HEADER_LEN] = {
+		FCGI_VERSION_1, static_cast<unsigned char>(type),
+		static_cast<unsigned char>(id >> 8), static_cast<unsigned char>(id),
+		static_cast<unsigned char>(len >> 8), static_cast<unsigned char>(len),
+		pad, 0 };
+	out.append(reinterpret_cast<char *>(header), sizeof(header));
+	out.append(data, len);
+	out.append(pad, '\0');
+}
+
+/* Stream records (PARAMS, STDIN) split in as many records as it takes.
+ * An empty stream record is the end of the stream, callers add it. */
+static void	putStream(std::string &out, int type, uint16_t id, const std::string &data)
+{
+	for (size_t off = 0; off < data.size(); off += FCGI_MAX_CONTENT)
+		putRecord(out, type, id, data.data() + off,
+				std::min(FCGI_MAX_CONTENT, data.size() - off));
+}
+
+static void	putLength(std::string &out, size_t n)
+{
+	if (n < 128)
+	{
+		out.push_back(static_cast<char>(n));
+		return ;
+	}
+	out.push_back(static_cast<char>(((n >> 24) & 0x7f) | 0x80));
+	out.push_back(static_cast<char>(n >> 16));
+	out.push_back(static_cast<char>(n >> 8));
+	out.push_back(static_cast<char>(n));
+}
+
+static void	putPair(std::string &out, const std::string &name, const std::string &value)
+{
+	putLength(out, name.size());
+	putLength(out, value.size());
+	out += name;
+	out += value;
+}
+
+/* Reads one name-value length, false if it runs past the end */
+static bool	getLength(const unsigned char *p, size_t len, size_t &off, size_t &n)
+{
+	if (off >= len)
+		return (false);
+	if (!(p[off] & 0x80))
+	{
+		n = p[off++];
+		return (true);
+	}
+	if (off + 4 > len)
+		return (false);
+	n = (static_cast<size_t>(p[off] & 0x7f) << 24) | (p[off + 1] << 16)
+		| (p[off + 2] << 8) | p[off + 3];
+	off += 4;
+	return (true);
+}
+
+/* Names are looked up once, the first time the backend is used */
+static bool	resolve(FcgiBackend *b)
+{
+	return (b->addrlen != 0 || resolve_address(b->address, &b->addr, &b->addrlen));
+}
+
+static void	updateInterest(FcgiConn *c, int qfd)
+{
+	bool pending = c->outOffset < c->out.size();
+	queue_event_type t;
+	if (!c->connected)
+		t = WRITABLE;
+	else if (c->paused)
+		t = pending ? WRITABLE : IDLE;
+	else
+		t = pending ? READWRITE : READABLE;
+	if (t == c->watching)
+		return ;
+	watch(qfd, c->slot, t);
+	c->watching = t;
+}
+
+static FcgiConn	*openConn(FcgiBackend *b, int qfd, bool probe)
+{
+	int fd = socket(b->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (nullptr);
+	if (socket_set_nonblocking(fd) < 0
+			|| (connect(fd, reinterpret_cast<struct sockaddr *>(&b->addr), b->addrlen) < 0
+				&& errno != EINPROGRESS))
+	{
+		logError("FastCGI: cannot connect to " + b->address);
+		close(fd);
+		return (nullptr);
+	}
+	Endpoint *slot = claimEndpoint(qfd, Fcgi, fd, nullptr, WRITABLE);
+	if (slot == nullptr)
+	{
+		close(fd);
+		return (nullptr);
+	}
+	FcgiConn *c = new FcgiConn;
+	c->backend = b;
+	c->slot = slot;
+	c->fd = fd;
+	c->probe = probe;
+	c->watching = WRITABLE;
+	slot->fcgi = c;
+	g_conns.push_back(c);
+	return (c);
+}
+
+/* Asks a new backend whether it takes several requests per connection.
+ * On its own connection: some backends hang up after answering. */
+static void	probeBackend(FcgiBackend *b, int qfd)
+{
+	b->probed = true;
+	FcgiConn *c = openConn(b, qfd, true);
+	if (c == nullptr)
+		return ;
+	std::string values;
+	putPair(values, "FCGI_MPXS_CONNS", "");
+	putRecord(c->out, FCGI_GET_VALUES, 0, values.data(), values.size());
+}
+
+/* A warm interpreter for a cgi_pool location: the worker script with
+ * its end of a socketpair as stdin, connected from the start. Requests
+ * bring their own CGI environment; of ours it only gets CGI_WORKER_ENV,
+ * and what it prints outside of a request is dropped. */
+static FcgiConn	*spawnWorker(FcgiBackend *b, int qfd)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return (nullptr);
+	int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	std::vector<std::string> env;
+	for (const char *name : CGI_WORKER_ENV)
+		if (const char *value = getenv(name))
+			env.push_back(std::string(name) + "=" + value);
+	std::vector<char *> envp;
+	for (std::string &var : env)
+		envp.push_back(&var[0]);
+	envp.push_back(NULL);
+	char *argv[] = { const_cast<char *>(b->pool->cgiInterpreterPython.c_str()),
+		const_cast<char *>(b->pool->cgiWorkerScript.c_str()), NULL };
+	pid_t pid;
+	if (devnull < 0 || spawnCgi(&pid, argv, envp.data(), sv[1], devnull) != 0)
+	{
+		if (devnull >= 0)
+			close(devnull);
+		close(sv[0]);
+		close(sv[1]);
+		return (nullptr);
+	}
+	close(devnull);
+	close(sv[1]);
+	Endpoint *slot = nullptr;
+	if (socket_set_nonblocking(sv[0]) == 0)
+		slot = claimEndpoint(qfd, Fcgi, sv[0], nullptr, READABLE);
+	if (slot == nullptr)
+	{
+		close(sv[0]);
+		kill(pid, SIGKILL);
+		reapLater(pid);
+		return (nullptr);
+	}
+	FcgiConn *c = new FcgiConn;
+	c->backend = b;
+	c->slot = slot;
+	c->fd = sv[0];
+	c->pid = pid;
+	c->connected = true;
+	c->watching = READABLE;
+	slot->fcgi = c;
+	g_conns.push_back(c);
+	logDebug("Started CGI worker %d for %s", pid, b->address.c_str());
+	return (c);
+}
+
+static size_t	countConns(const FcgiBackend *b)
+{
+	return (std::count_if(g_conns.begin(), g_conns.end(), [b](FcgiConn *c) {
+		return c->backend == b;
+	}));
+}
+
+/* An idle connection, or one with room left if the backend multiplexes.
+ * A pool only grows back to its size: past that the caller forks. */
+static FcgiConn	*pickConn(FcgiBackend *b, int qfd)
+{
+	FcgiConn *shared = nullptr;
+	for (FcgiConn *c : g_conns)
+	{
+		if (c->backend != b || c->probe)
+			continue ;
+		if (c->requests.empty())
+			return (c);
+		if (b->multiplexed && c->requests.size() < FCGI_MAX_REQUESTS_PER_CONN)
+			shared = c;
+	}
+	if (shared != nullptr)
+		return (shared);
+	if (b->pool == nullptr)
+		return (openConn(b, qfd, false));
+	if (!b->retired && countConns(b) < b->pool->cgiPoolSize)
+		return (spawnWorker(b, qfd));
+	return (nullptr);
+}
+
+static bool	flushOut(FcgiConn *c)
+{
+	while (c->outOffset < c->out.size())
+	{
+		ssize_t sent = send(c->fd, c->out.data() + c->outOffset,
+				c->out.size() - c->outOffset, 0);
+		if (sent < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK);
+		c->outOffset += sent;
+	}
+	c->out.clear();
+	c->outOffset = 0;
+	return (true);
+}
+
+/* Sends BEGIN_REQUEST and the CGI environment, then whatever part of
+ * the body we have. */
+static void	startRequest(Endpoint *client, int qfd, FcgiConn *c)
+{
+	uint16_t id = 1;
+	while (c->requests.count(id))
+		id++;
+	c->requests[id] = FcgiRequest{ client, false };
+	client->fcgi = c;
+	client->fcgiId = id;
+
+	const unsigned char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	putRecord(c->out, FCGI_BEGIN_REQUEST, id, reinterpret_cast<const char *>(begin), sizeof(begin));
+	std::string params;
+	for (char *const *env = client->cgiHandler.getEnv(); *env != nullptr; env++)
+	{
+		const char *eq = strchr(*env, '=');
+		if (eq == nullptr)
+			continue ;
+		putPair(params, std::string(*env, eq - *env), eq + 1);
+	}
+	putStream(c->out, FCGI_PARAMS, id, params);
+	putRecord(c->out, FCGI_PARAMS, id, nullptr, 0);
+	fcgiSendBody(client, qfd);
+}
+
+bool	fcgiStart(Endpoint *client, int qfd, const std::string &address)
+{
+	FcgiBackend *b = &g_backends[address];
+	b->address = address;
+	if (!resolve(b))
+	{
+		logError("FastCGI: cannot resolve " + address);
+		return (false);
+	}
+	if (!b->probed)
+		probeBackend(b, qfd);
+	FcgiConn *c = pickConn(b, qfd);
+	if (c == nullptr)
+		return (false);
+	startRequest(client, qfd, c);
+	return (true);
+}
+
+static FcgiBackend	*poolFor(const LocationBlock *loc, const std::shared_ptr<const Config> &config)
+{
+	FcgiBackend *b = &g_pools[loc];
+	if (b->pool == nullptr)
+	{
+		b->pool = loc;
+		b->config = config;
+		b->retired = (config != currentConfig());
+		b->address = "cgi_pool " + loc->path;
+		b->probed = true;
+	}
+	return (b);
+}
+
+/* Runs the script in an idle warm worker of its location.
+ * Returns false when they are all busy. */
+bool	fcgiStartPooled(Endpoint *client, int qfd, const LocationBlock *loc)
+{
+	FcgiBackend *b = poolFor(loc, client->handler.getConfig());
+	FcgiConn *c = pickConn(b, qfd);
+	if (c == nullptr)
+	{
+		if (b->retired && countConns(b) == 0)
+			g_pools.erase(loc);
+		return (false);
+	}
+	startRequest(client, qfd, c);
+	return (true);
+}
+
+static void	startPools(const std::vector<LocationBlock> &locations,
+		const std::shared_ptr<const Config> &config, int qfd)
+{
+	for (const LocationBlock &loc : locations)
+	{
+		if (loc.cgiPoolSize > 0 && loc.fastcgiPass.empty())
+		{
+			FcgiBackend *b = poolFor(&loc, config);
+			while (countConns(b) < loc.cgiPoolSize && spawnWorker(b, qfd) != nullptr)
+				;
+		}
+		startPools(loc.nestedLocations, config, qfd);
+	}
+}
+
+/* Workers are started up front, so the first requests find them warm */
+void	fcgiStartPools(int qfd)
+{
+	std::shared_ptr<const Config> config = currentConfig();
+	for (const Configuration &server : config->servers)
+		startPools(server.getLocationBlocks(), config, qfd);
+}
+
+/* The pools of the previous configuration keep their busy workers until
+ * they answer, requests that started before the reload may still be
+ * routed to them. The idle ones go now, new pools start warm. */
+void	fcgiReload(int qfd)
+{
+	for (auto &[loc, b] : g_pools)
+		b.retired = true;
+	std::vector<FcgiConn *> conns = g_conns;
+	for (FcgiConn *c : conns)
+		if (c->backend->retired && !c->probe && c->requests.empty())
+			closeConn(c, qfd, 0);
+	std::erase_if(g_pools, [](const auto &pool) { return countConns(&pool.second) == 0; });
+	fcgiStartPools(qfd);
+}
+
+/* Moves the body the client sent so far into STDIN records, and ends
+ * the stream once all of it is in. */
+void	fcgiSendBody(Endpoint *client, int qfd)
+{
+	FcgiConn *c = client->fcgi;
+	FcgiRequest &r = c->requests[client->fcgiId];
+	std::string data = client->cgiHandler.takePostData();
+	if (r.stdinDone)
+		return ;
+	putStream(c->out, FCGI_STDIN, client->fcgiId, data);
+	if (client->cgiHandler.isPostDataComplete())
+	{
+		putRecord(c->out, FCGI_STDIN, client->fcgiId, nullptr, 0);
+		r.stdinDone = true;
+	}
+	updateInterest(c, qfd);
+}
+
+/* The client went away. The backend is told to stop, and whatever it
+ * still sends for that id is dropped. */
+void	fcgiAbort(Endpoint *client, int qfd)
+{
+	FcgiConn *c = client->fcgi;
+	client->fcgi = nullptr;
+	auto it = c->requests.find(client->fcgiId);
+	if (it == c->requests.end())
+		return ;
+	it->second.client = nullptr;
+	if (c->pid != 0)
+	{
+		/* Like a forked script, a worker does not outlive its client.
+		 * parseRecords() may be the one telling the client to stop: it
+		 * closes the connection once it is done with it. */
+		kill(c->pid, SIGKILL);
+		if (c == g_reading)
+			c->aborted = true;
+		else
+			closeConn(c, qfd, 0);
+		return ;
+	}
+	putRecord(c->out, FCGI_ABORT_REQUEST, it->first, nullptr, 0);
+	c->paused = false;
+	updateInterest(c, qfd);
+}
+
+/* A client caught up with its output: reading the backend again */
+void	fcgiResume(Endpoint *client, int qfd)
+{
+	FcgiConn *c = client->fcgi;
+	if (c == nullptr || !c->paused)
+		return ;
+	c->paused = false;
+	updateInterest(c, qfd);
+}
+
+static void	onStdout(FcgiConn *c, int qfd, uint16_t id, const char *data, size_t len)
+{
+	auto it = c->requests.find(id);
+	if (it == c->requests.end() || it->second.client == nullptr || len == 0)
+		return ;
+	Endpoint *client = it->second.client;
+	client->handler.feedCgiOutput(data, len);
+	if (!cgiProduced(client, qfd))
+		return ;
+	/* No flow control per request in FastCGI: a slow client holds up
+	 * the whole connection, like a full pipe holds up a script. */
+	if (client->handler.getResponse().size() > CGI_OUTPUT_HIGH_WATER)
+		c->paused = true;
+}
+
+static void	onEndRequest(FcgiConn *c, int qfd, uint16_t id, const unsigned char *body, size_t len)
+{
+	auto it = c->requests.find(id);
+	if (it == c->requests.end())
+		return ;
+	Endpoint *client = it->second.client;
+	c->requests.erase(it);
+	c->served++;
+	if (client == nullptr)
+		return ;
+	client->fcgi = nullptr;
+	c->paused = false;
+	if (len < 8)
+	{
+		cgiFailed(client, qfd, 502);
+		return ;
+	}
+	uint32_t appStatus = (body[0] << 24) | (body[1] << 16) | (body[2] << 8) | body[3];
+	if (body[4] == FCGI_OVERLOADED)
+		cgiFailed(client, qfd, 503);
+	else if (body[4] != FCGI_REQUEST_COMPLETE)
+		cgiFailed(client, qfd, 502);
+	else
+		cgiFinished(client, qfd, appStatus == EXIT_FAILURE);
+}
+
+static void	onValues(FcgiConn *c, const unsigned char *body, size_t len)
+{
+	size_t off = 0;
+	size_t nameLen, valueLen;
+	while (getLength(body, len, off, nameLen) && getLength(body, len, off, valueLen)
+			&& off + nameLen + valueLen <= len)
+	{
+		std::string name(reinterpret_cast<const char *>(body) + off, nameLen);
+		std::string value(reinterpret_cast<const char *>(body) + off + nameLen, valueLen);
+		off += nameLen + valueLen;
+		if (name == "FCGI_MPXS_CONNS")
+			c->backend->multiplexed = (value == "1");
+	}
+	logDebug("FastCGI: %s %s", c->backend->address.c_str(),
+			c->backend->multiplexed ? "multiplexes" : "takes one request per connection");
+}
+
+static size_t	idleConns(FcgiBackend *b)
+{
+	return (std::count_if(g_conns.begin(), g_conns.end(), [b](FcgiConn *c) {
+		return c->backend == b && !c->probe && c->requests.empty();
+	}));
+}
+
+/* Too many idle connections to a backend, or a worker that did its share */
+static bool	isSpare(FcgiConn *c)
+{
+	if (c->probe || !c->requests.empty())
+		return (false);
+	const LocationBlock *pool = c->backend->pool;
+	if (c->backend->retired)
+		return (true);
+	if (pool != nullptr)
+		return (pool->cgiPoolMaxRequests != 0 && c->served >= pool->cgiPoolMaxRequests);
+	return (idleConns(c->backend) > FCGI_MAX_IDLE_CONNS);
+}
+
+/* Handles every complete record in the input buffer.
+ * Returns false if the connection is gone. */
+static bool	parseRecords(FcgiConn *c, int qfd)
+{
+	size_t off = 0;
+	bool answered = false;
+	g_reading = c;
+	while (!c->aborted && c->in.size() - off >= FCGI_HEADER_LEN)
+	{
+		const unsigned char *h = reinterpret_cast<const unsigned char *>(c->in.data()) + off;
+		uint16_t id = (h[2] << 8) | h[3];
+		size_t len = (h[4] << 8) | h[5];
+		size_t total = FCGI_HEADER_LEN + len + h[6];
+		if (h[0] != FCGI_VERSION_1)
+		{
+			logError("FastCGI: bad record from " + c->backend->address);
+			g_reading = nullptr;
+			closeConn(c, qfd, 502);
+			return (false);
+		}
+		if (c->in.size() - off < total)
+			break ;
+		const unsigned char *body = h + FCGI_HEADER_LEN;
+		switch (h[1])
+		{
+			case FCGI_STDOUT:
+				onStdout(c, qfd, id, reinterpret_cast<const char *>(body), len);
+				break ;
+			case FCGI_STDERR:
+				logError("FastCGI: " + std::string(reinterpret_cast<const char *>(body), len));
+				break ;
+			case FCGI_END_REQUEST:
+				onEndRequest(c, qfd, id, body, len);
+				break ;
+			case FCGI_GET_VALUES_RESULT:
+				onValues(c, body, len);
+				answered = true;
+				break ;
+			default:
+				break ;
+		}
+		off += total;
+	}
+	g_reading = nullptr;
+	if (c->aborted)
+	{
+		closeConn(c, qfd, 0);
+		return (false);
+	}
+	c->in.erase(0, off);
+	if ((c->probe && answered) || isSpare(c))
+	{
+		FcgiBackend *b = c->backend;
+		bool replace = b->pool != nullptr && !b->retired;
+		closeConn(c, qfd, 0);
+		if (replace) /* A worker that did its share is replaced, a crashed one on demand */
+			spawnWorker(b, qfd);
+		return (false);
+	}
+	return (true);
+}
+
+/* The backend connection is readable or writable, or done connecting. */
+void	serveFcgiConn(Endpoint *slot, int qfd)
+{
+	FcgiConn *c = slot->fcgi;
+	assert(c != nullptr && c->slot == slot);
+
+	if (!c->connected)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		{
+			logError("FastCGI: cannot connect to " + c->backend->address);
+			closeConn(c, qfd, 502);
+			return ;
+		}
+		c->connected = true;
+	}
+	if (!flushOut(c))
+	{
+		closeConn(c, qfd, 502);
+		return ;
+	}
+	if (!c->paused)
+	{
+		char buffer[FCGI_READ_SIZE];
+		ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			closeConn(c, qfd, 502);
+			return ;
+		}
+		if (n > 0)
+		{
+			c->in.append(buffer, n);
+			if (!parseRecords(c, qfd))
+				return ;
+		}
+	}
+	updateInterest(c, qfd);
+}
+
+/* Requests still on the connection fail with `error`. */
+static void	closeConn(FcgiConn *c, int qfd, int error)
+{
+	for (auto &[id, r] : c->requests)
+	{
+		if (r.client == nullptr)
+			continue ;
+		logError("FastCGI: lost connection to " + c->backend->address);
+		r.client->fcgi = nullptr;
+		cgiFailed(r.client, qfd, error);
+	}
+	releaseEndpoint(qfd, c->slot);
+	close(c->fd);
+	if (c->pid != 0)
+		reapLater(c->pid); /* It exits on EOF, if not dead already */
+	g_conns.erase(std::find(g_conns.begin(), g_conns.end(), c));
+	FcgiBackend *b = c->backend;
+	delete c;
+	if (b->retired && countConns(b) == 0) /* Its configuration may go now */
+		g_pools.erase(b->pool);
+}
+
+void	fcgiCloseAll()
+{
+	for (FcgiConn *c : g_conns)
+	{
+		close(c->fd); /* Workers exit on EOF */
+		delete c;
+	}
+	g_conns.clear();
+}
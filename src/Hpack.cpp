@@ -0,0 +1,265 @@
+#include "Hpack.hpp"
+#include <array>
+
+static const HpackField	STATIC_TABLE[] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+	{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" },
+	{ ":status", "200" }, { ":status", "204" }, { ":status", "206" }, { ":status", "304" },
+	{ ":status", "400" }, { ":status", "404" }, { ":status", "500" },
+	{ "accept-charset", "" }, { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+	{ "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+	{ "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" },
+	{ "content-length", "" }, { "content-location", "" }, { "content-range", "" },
+	{ "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" }, { "expect", "" },
+	{ "expires", "" }, { "from", "" }, { "host", "" }, { "if-match", "" },
+	{ "if-modified-since", "" }, { "if-none-match", "" }, { "if-range", "" },
+	{ "if-unmodified-since", "" }, { "last-modified", "" }, { "link", "" }, { "location", "" },
+	{ "max-forwards", "" }, { "proxy-authenticate", "" }, { "proxy-authorization", "" },
+	{ "range", "" }, { "referer", "" }, { "refresh", "" }, { "retry-after", "" },
+	{ "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+	{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" },
+};
+constexpr size_t	STATIC_COUNT = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+constexpr size_t	ENTRY_OVERHEAD = 32;
+
+/* Code length of each symbol, 256 being EOS (RFC 7541 appendix B). The
+ * code is canonical: the codes themselves follow from the lengths. */
+static const uint8_t	HUFFMAN_LENGTHS[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+constexpr int	HUFFMAN_MAX_LENGTH = 30;
+constexpr int	HUFFMAN_EOS = 256;
+
+/* For each length, its first code and where its symbols start */
+struct HuffmanDecoder {
+	std::array<uint32_t, HUFFMAN_MAX_LENGTH + 1>	first{};
+	std::array<uint32_t, HUFFMAN_MAX_LENGTH + 1>	count{};
+	std::array<uint32_t, HUFFMAN_MAX_LENGTH + 1>	offset{};
+	std::array<uint16_t, 257>						symbols{};
+
+	HuffmanDecoder()
+	{
+		for (int sym = 0; sym <= HUFFMAN_EOS; sym++)
+			count[HUFFMAN_LENGTHS[sym]]++;
+		uint32_t code = 0, at = 0;
+		for (int len = 1; len <= HUFFMAN_MAX_LENGTH; len++)
+		{
+			code = (code + count[len - 1]) << 1;
+			first[len] = code;
+			offset[len] = at;
+			at += count[len];
+		}
+		std::array<uint32_t, HUFFMAN_MAX_LENGTH + 1> next = offset;
+		for (int sym = 0; sym <= HUFFMAN_EOS; sym++)
+			symbols[next[HUFFMAN_LENGTHS[sym]]++] = sym;
+	}
+};
+
+static bool	huffmanDecode(const uint8_t *p, size_t n, std::string &out)
+{
+	static const HuffmanDecoder decoder;
+	uint32_t code = 0;
+	int len = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		for (int bit = 7; bit >= 0; bit--)
+		{
+			code = (code << 1) | ((p[i] >> bit) & 1);
+			len++;
+			if (code - decoder.first[len] < decoder.count[len])
+			{
+				uint16_t sym = decoder.symbols[decoder.offset[len] + code - decoder.first[len]];
+				if (sym == HUFFMAN_EOS)
+					return (false);
+				out += static_cast<char>(sym);
+				code = 0;
+				len = 0;
+			}
+			else if (len == HUFFMAN_MAX_LENGTH)
+				return (false);
+		}
+	}
+	/* Padded with the start of EOS, all ones, less than a byte of it */
+	return (len < 8 && code == (1u << len) - 1);
+}
+
+static bool	decodeInteger(const uint8_t *&p, const uint8_t *end, int prefix, uint32_t &value)
+{
+	if (p == end)
+		return (false);
+	uint32_t mask = (1u << prefix) - 1;
+	value = *p++ & mask;
+	if (value < mask)
+		return (true);
+	for (int shift = 0; p != end && shift <= 21; shift += 7)
+	{
+		uint8_t b = *p++;
+		value += static_cast<uint32_t>(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return (true);
+	}
+	return (false);
+}
+
+static bool	decodeString(const uint8_t *&p, const uint8_t *end, std::string &out)
+{
+	if (p == end)
+		return (false);
+	bool huffman = *p & 0x80;
+	uint32_t n;
+	if (!decodeInteger(p, end, 7, n) || n > static_cast<size_t>(end - p))
+		return (false);
+	out.clear();
+	if (huffman && !huffmanDecode(p, n, out))
+		return (false);
+	if (!huffman)
+		out.assign(reinterpret_cast<const char *>(p), n);
+	p += n;
+	return (true);
+}
+
+static void	evict(HpackTable &table, size_t room)
+{
+	while (!table.entries.empty() && table.size + room > table.maxSize)
+	{
+		const HpackField &last = table.entries.back();
+		table.size -= last.first.size() + last.second.size() + ENTRY_OVERHEAD;
+		table.entries.pop_back();
+	}
+}
+
+static void	insert(HpackTable &table, const HpackField &field)
+{
+	size_t size = field.first.size() + field.second.size() + ENTRY_OVERHEAD;
+	evict(table, size);
+	if (size > table.maxSize)
+		return ; /* Empties the table, and is not kept */
+	table.entries.push_front(field);
+	table.size += size;
+}
+
+static const HpackField	*lookup(const HpackTable &table, uint32_t index)
+{
+	if (index == 0)
+		return (nullptr);
+	if (index <= STATIC_COUNT)
+		return (&STATIC_TABLE[index - 1]);
+	index -= STATIC_COUNT + 1;
+	return (index < table.entries.size() ? &table.entries[index] : nullptr);
+}
+
+/* False on any error, after which the table cannot be trusted: the
+ * connection has to go (COMPRESSION_ERROR). maxListSize bounds what a
+ * small block can expand to, counted as for SETTINGS_MAX_HEADER_LIST_SIZE. */
+bool	hpackDecode(HpackTable &table, const std::string &block,
+			std::vector<HpackField> &fields, size_t maxListSize)
+{
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(block.data());
+	const uint8_t *end = p + block.size();
+	size_t listSize = 0;
+	while (p != end)
+	{
+		uint8_t b = *p;
+		uint32_t index;
+		HpackField field;
+		if (b & 0x80) /* Indexed */
+		{
+			const HpackField *known;
+			if (!decodeInteger(p, end, 7, index) || (known = lookup(table, index)) == nullptr)
+				return (false);
+			field = *known;
+		}
+		else if ((b & 0xe0) == 0x20) /* Dynamic table size update, before any field */
+		{
+			if (!decodeInteger(p, end, 5, index) || index > table.limit || !fields.empty())
+				return (false);
+			table.maxSize = index;
+			evict(table, 0);
+			continue ;
+		}
+		else /* Literal, with incremental indexing (01) or without (0000, 0001) */
+		{
+			bool indexing = (b & 0xc0) == 0x40;
+			if (!decodeInteger(p, end, indexing ? 6 : 4, index))
+				return (false);
+			if (index == 0 && !decodeString(p, end, field.first))
+				return (false);
+			if (index != 0)
+			{
+				const HpackField *known = lookup(table, index);
+				if (known == nullptr)
+					return (false);
+				field.first = known->first;
+			}
+			if (!decodeString(p, end, field.second))
+				return (false);
+			if (indexing)
+				insert(table, field);
+		}
+		listSize += field.first.size() + field.second.size() + ENTRY_OVERHEAD;
+		if (listSize > maxListSize)
+			return (false);
+		fields.push_back(std::move(field));
+	}
+	return (true);
+}
+
+static void	encodeInteger(std::string &out, uint8_t pattern, int prefix, size_t value)
+{
+	size_t mask = (1u << prefix) - 1;
+	if (value < mask)
+	{
+		out += static_cast<char>(pattern | value);
+		return ;
+	}
+	out += static_cast<char>(pattern | mask);
+	for (value -= mask; value >= 0x80; value >>= 7)
+		out += static_cast<char>(0x80 | (value & 0x7f));
+	out += static_cast<char>(value);
+}
+
+static void	encodeString(std::string &out, const std::string &s)
+{
+	encodeInteger(out, 0x00, 7, s.size());
+	out += s;
+}
+
+/* Literal without indexing; the name must be lowercase */
+void	hpackEncode(std::string &out, const std::string &name, const std::string &value)
+{
+	size_t index = 0;
+	for (size_t i = 0; i < STATIC_COUNT && index == 0; i++)
+		if (STATIC_TABLE[i].first == name)
+			index = i + 1;
+	encodeInteger(out, 0x00, 4, index);
+	if (index == 0)
+		encodeString(out, name);
+	encodeString(out, value);
+}
+
+void	hpackEncodeStatus(std::string &out, int status)
+{
+	std::string value = std::to_string(status);
+	for (size_t i = 7; i < 14; i++)
+		if (STATIC_TABLE[i].second == value)
+			return (encodeInteger(out, 0x80, 7, i + 1));
+	hpackEncode(out, ":status", value);
+}
@@ -0,0 +1,911 @@
+#include "Http2.hpp"
+#include "Logger.hpp"
+#include <sys/socket.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+enum H2FrameType {
+	F_DATA,
+	F_HEADERS,
+	F_PRIORITY,
+	F_RST_STREAM,
+	F_SETTINGS,
+	F_PUSH_PROMISE,
+	F_PING,
+	F_GOAWAY,
+	F_WINDOW_UPDATE,
+	F_CONTINUATION,
+};
+
+enum H2Error {
+	H2E_NO_ERROR = 0,
+	H2E_PROTOCOL = 1,
+	H2E_INTERNAL = 2,
+	H2E_FLOW_CONTROL = 3,
+	H2E_STREAM_CLOSED = 5,
+	H2E_FRAME_SIZE = 6,
+	H2E_REFUSED_STREAM = 7,
+	H2E_COMPRESSION = 9,
+};
+
+constexpr uint8_t	END_STREAM = 0x1; // ACK on SETTINGS and PING
+constexpr uint8_t	END_HEADERS = 0x4;
+constexpr uint8_t	PADDED = 0x8;
+constexpr uint8_t	PRIORITY = 0x20;
+
+constexpr size_t	FRAME_HEADER = 9;
+constexpr size_t	FRAME_MAX = 16384; // Ours, SETTINGS_MAX_FRAME_SIZE left at its default
+constexpr uint32_t	DATA_FRAME_MAX = 65536; // Whatever the client allows
+constexpr int64_t	WINDOW = 65535; // Of a stream, SETTINGS_INITIAL_WINDOW_SIZE left at its default
+constexpr int64_t	CONN_WINDOW = H2_MAX_STREAMS * WINDOW; // Never the one that stops a stream
+constexpr int64_t	WINDOW_MAX = 0x7fffffff;
+constexpr size_t	READ_SIZE = 32768;
+
+static struct {
+	uint64_t	connections;
+	uint64_t	upgrades; // Of those, from HTTP/1.1
+	uint64_t	streams;
+	uint64_t	refused; // Past H2_MAX_STREAMS
+} g_stats;
+
+static uint32_t	get32(const uint8_t *p)
+{
+	return (static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16
+		| static_cast<uint32_t>(p[2]) << 8 | p[3]);
+}
+
+static void	put32(std::string &out, uint32_t v)
+{
+	out += static_cast<char>(v >> 24);
+	out += static_cast<char>(v >> 16);
+	out += static_cast<char>(v >> 8);
+	out += static_cast<char>(v);
+}
+
+static void	frame(H2Conn *c, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len)
+{
+	c->out += static_cast<char>(len >> 16);
+	c->out += static_cast<char>(len >> 8);
+	c->out += static_cast<char>(len);
+	c->out += static_cast<char>(type);
+	c->out += static_cast<char>(flags);
+	put32(c->out, id);
+	c->out.append(static_cast<const char *>(payload), len);
+}
+
+static void	frame32(H2Conn *c, uint8_t type, uint32_t id, uint32_t value)
+{
+	std::string payload;
+	put32(payload, value);
+	frame(c, type, 0, id, payload.data(), payload.size());
+}
+
+bool	h2Flush(H2Conn *c)
+{
+	while (c->outOffset < c->out.size())
+	{
+		ssize_t n = send(c->fd, c->out.data() + c->outOffset, c->out.size() - c->outOffset, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+		{
+			c->dead = true;
+			c->out.clear();
+			c->outOffset = 0;
+			return (false);
+		}
+		c->outOffset += n;
+	}
+	if (c->outOffset == c->out.size())
+	{
+		c->out.clear();
+		c->outOffset = 0;
+	}
+	else if (c->outOffset >= H2_OUT_MAX)
+	{
+		c->out.erase(0, c->outOffset);
+		c->outOffset = 0;
+	}
+	return (true);
+}
+
+/* GOAWAY, and nothing more on this connection */
+static bool	connectionError(H2Conn *c, H2Error code)
+{
+	logDebug("HTTP/2 connection error %d on %d", code, c->fd);
+	std::string payload;
+	put32(payload, c->current != 0 ? c->current : c->lastAnswered);
+	put32(payload, code);
+	frame(c, F_GOAWAY, 0, 0, payload.data(), payload.size());
+	h2Flush(c);
+	c->dead = true;
+	return (false);
+}
+
+/* The handler may be reading the current stream: it is kept, marked,
+ * until h2StreamDone() */
+static void	resetStream(H2Conn *c, uint32_t id, H2Error code)
+{
+	frame32(c, F_RST_STREAM, id, code);
+	auto it = c->streams.find(id);
+	if (it != c->streams.end() && id == c->current)
+		it->second.reset = true;
+	else if (it != c->streams.end())
+		c->streams.erase(it);
+}
+
+/* H2E_NO_ERROR, or what was wrong with them */
+static H2Error	applySettings(H2Conn *c, const uint8_t *p, size_t len)
+{
+	for (size_t i = 0; i + 6 <= len; i += 6)
+	{
+		uint16_t key = p[i] << 8 | p[i + 1];
+		uint32_t value = get32(p + i + 2);
+		switch (key)
+		{
+			case 2: /* ENABLE_PUSH, we never push */
+				if (value > 1)
+					return (H2E_PROTOCOL);
+				break;
+			case 4: /* INITIAL_WINDOW_SIZE, applies to the open streams too */
+				if (value > WINDOW_MAX)
+					return (H2E_FLOW_CONTROL);
+				for (auto &entry : c->streams)
+					entry.second.sendWindow += static_cast<int64_t>(value) - c->peerInitialWindow;
+				c->peerInitialWindow = value;
+				c->blocked = false;
+				break;
+			case 5: /* MAX_FRAME_SIZE */
+				if (value < 16384 || value > 16777215)
+					return (H2E_PROTOCOL);
+				c->peerMaxFrame = value;
+				break;
+			default: /* HEADER_TABLE_SIZE: we put nothing in the client's table */
+				break;
+		}
+	}
+	return (H2E_NO_ERROR);
+}
+
+static bool	isConnectionHeader(const std::string &name)
+{
+	return (name == "connection" || name == "keep-alive" || name == "proxy-connection"
+		|| name == "transfer-encoding" || name == "upgrade");
+}
+
+/* content-type -> Content-Type, as the handler looks them up */
+static std::string	canonicalName(const std::string &name)
+{
+	std::string s = name;
+	bool upper = true;
+	for (char &ch : s)
+	{
+		if (upper)
+			ch = std::toupper(static_cast<unsigned char>(ch));
+		upper = (ch == '-');
+	}
+	return (s);
+}
+
+/* The request as it would come on an HTTP/1.1 connection. False if it is
+ * malformed (RFC 9113 8.2, 8.3), for the stream to be reset. */
+static bool	requestHead(const std::vector<HpackField> &fields, bool endStream, H2Stream &s)
+{
+	std::string method, path, authority, headers, cookie;
+	bool regular = false, length = false;
+	for (const auto &[name, value] : fields)
+	{
+		if (name.empty() || value.find_first_of(std::string("\r\n\0", 3)) != std::string::npos)
+			return (false);
+		if (name[0] == ':')
+		{
+			if (regular)
+				return (false);
+			if (name == ":method")
+				method = value;
+			else if (name == ":path")
+				path = value;
+			else if (name == ":authority")
+				authority = value;
+			else if (name != ":scheme")
+				return (false);
+			continue ;
+		}
+		regular = true;
+		if (isConnectionHeader(name) || std::any_of(name.begin(), name.end(), [](unsigned char ch) {
+				return (std::isupper(ch) || ch <= ' ' || ch == ':'); }))
+			return (false);
+		if (name == "te" && value != "trailers")
+			return (false);
+		if (name == "te" || value.empty())
+			continue ;
+		if (name == "cookie") /* May come split, RFC 9113 8.2.3 */
+			cookie += (cookie.empty() ? "" : "; ") + value;
+		else if (name == "host")
+			authority = authority.empty() ? value : authority;
+		else
+			headers += canonicalName(name) + ": " + value + "\r\n";
+		length |= (name == "content-length");
+	}
+	if (method.empty() || path.empty() || method.find(' ') != std::string::npos
+			|| path.find(' ') != std::string::npos)
+		return (false);
+	s.chunked = !endStream && !length;
+	s.request = method + " " + path + " HTTP/1.1\r\n";
+	if (!authority.empty())
+		s.request += "Host: " + authority + "\r\n";
+	s.request += headers;
+	if (!cookie.empty())
+		s.request += "Cookie: " + cookie + "\r\n";
+	if (s.chunked)
+		s.request += "Transfer-Encoding: chunked\r\n";
+	s.request += "\r\n";
+	return (true);
+}
+
+static bool	endHeaders(H2Conn *c, uint32_t id, bool endStream)
+{
+	std::vector<HpackField> fields;
+	bool decoded = hpackDecode(c->decoder, c->headerBlock, fields, H2_MAX_HEADER_LIST);
+	c->headerBlock.clear();
+	if (!decoded)
+		return (connectionError(c, H2E_COMPRESSION));
+	auto it = c->streams.find(id);
+	if (it != c->streams.end()) /* Trailers, which the handler does without */
+	{
+		if (it->second.ended || !endStream)
+			return (connectionError(c, H2E_PROTOCOL));
+		it->second.ended = true;
+		if (it->second.chunked)
+			it->second.request += "0\r\n\r\n";
+		return (true);
+	}
+	if (id <= c->lastStream)
+		return (connectionError(c, H2E_STREAM_CLOSED));
+	c->lastStream = id;
+	if (c->streams.size() >= H2_MAX_STREAMS)
+	{
+		g_stats.refused++;
+		frame32(c, F_RST_STREAM, id, H2E_REFUSED_STREAM);
+		return (true);
+	}
+	H2Stream s;
+	s.id = id;
+	s.ended = endStream;
+	s.sendWindow = c->peerInitialWindow;
+	s.recvWindow = WINDOW;
+	if (!requestHead(fields, endStream, s))
+	{
+		frame32(c, F_RST_STREAM, id, H2E_PROTOCOL);
+		return (true);
+	}
+	g_stats.streams++;
+	c->streams.emplace(id, std::move(s));
+	return (true);
+}
+
+/* Drops the Pad Length byte and the padding */
+static bool	unpad(uint8_t flags, const uint8_t *&p, size_t &len)
+{
+	if (!(flags & PADDED))
+		return (true);
+	if (len < 1 || p[0] >= len)
+		return (false);
+	len -= 1 + p[0];
+	p++;
+	return (true);
+}
+
+static bool	onData(H2Conn *c, uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+	if (id == 0)
+		return (connectionError(c, H2E_PROTOCOL));
+	size_t counted = len; /* Padding included */
+	c->recvWindow -= counted;
+	c->recvCredit += counted;
+	if (c->recvWindow < 0)
+		return (connectionError(c, H2E_FLOW_CONTROL));
+	if (!unpad(flags, p, len))
+		return (connectionError(c, H2E_PROTOCOL));
+	auto it = c->streams.find(id);
+	if (it == c->streams.end())
+		return (id > c->lastStream ? connectionError(c, H2E_PROTOCOL) : true);
+	H2Stream &s = it->second;
+	if (s.ended)
+	{
+		resetStream(c, id, H2E_STREAM_CLOSED);
+		return (true);
+	}
+	s.recvWindow -= counted;
+	s.credit += counted;
+	if (s.recvWindow < 0)
+	{
+		resetStream(c, id, H2E_FLOW_CONTROL);
+		return (true);
+	}
+	if (s.chunked && len > 0)
+	{
+		char size[20];
+		snprintf(size, sizeof(size), "%zx\r\n", len);
+		s.request += size;
+	}
+	s.request.append(reinterpret_cast<const char *>(p), len);
+	if (s.chunked && len > 0)
+		s.request += "\r\n";
+	if (flags & END_STREAM)
+	{
+		s.ended = true;
+		if (s.chunked)
+			s.request += "0\r\n\r\n";
+	}
+	return (true);
+}
+
+static bool	onHeaders(H2Conn *c, uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+	if (id == 0 || id % 2 == 0)
+		return (connectionError(c, H2E_PROTOCOL));
+	if (!unpad(flags, p, len))
+		return (connectionError(c, H2E_PROTOCOL));
+	if (flags & PRIORITY)
+	{
+		if (len < 5)
+			return (connectionError(c, H2E_FRAME_SIZE));
+		p += 5;
+		len -= 5;
+	}
+	c->headerBlock.assign(reinterpret_cast<const char *>(p), len);
+	c->headerEndsStream = flags & END_STREAM;
+	if (!(flags & END_HEADERS))
+	{
+		c->continuing = id;
+		return (true);
+	}
+	return (endHeaders(c, id, c->headerEndsStream));
+}
+
+static bool	onWindowUpdate(H2Conn *c, uint32_t id, const uint8_t *p, size_t len)
+{
+	if (len != 4)
+		return (connectionError(c, H2E_FRAME_SIZE));
+	uint32_t increment = get32(p) & 0x7fffffff;
+	c->blocked = false;
+	if (id == 0)
+	{
+		c->sendWindow += increment;
+		if (increment == 0 || c->sendWindow > WINDOW_MAX)
+			return (connectionError(c, increment == 0 ? H2E_PROTOCOL : H2E_FLOW_CONTROL));
+		return (true);
+	}
+	auto it = c->streams.find(id);
+	if (it == c->streams.end())
+		return (id > c->lastStream ? connectionError(c, H2E_PROTOCOL) : true);
+	it->second.sendWindow += increment;
+	if (increment == 0 || it->second.sendWindow > WINDOW_MAX)
+		resetStream(c, id, increment == 0 ? H2E_PROTOCOL : H2E_FLOW_CONTROL);
+	return (true);
+}
+
+/* False once the connection is in error */
+static bool	onFrame(H2Conn *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+	if (c->continuing != 0 && (type != F_CONTINUATION || id != c->continuing))
+		return (connectionError(c, H2E_PROTOCOL));
+	switch (type)
+	{
+		case F_DATA:
+			return (onData(c, flags, id, p, len));
+		case F_HEADERS:
+			return (onHeaders(c, flags, id, p, len));
+		case F_CONTINUATION:
+			if (c->continuing == 0)
+				return (connectionError(c, H2E_PROTOCOL));
+			c->headerBlock.append(reinterpret_cast<const char *>(p), len);
+			if (c->headerBlock.size() > H2_MAX_HEADER_LIST)
+				return (connectionError(c, H2E_PROTOCOL));
+			if (!(flags & END_HEADERS))
+				return (true);
+			id = c->continuing;
+			c->continuing = 0;
+			return (endHeaders(c, id, c->headerEndsStream));
+		case F_PRIORITY: /* Read, not followed: streams go in order */
+			if (id == 0)
+				return (connectionError(c, H2E_PROTOCOL));
+			if (len != 5)
+				resetStream(c, id, H2E_FRAME_SIZE);
+			return (true);
+		case F_RST_STREAM:
+			if (id == 0 || len != 4)
+				return (connectionError(c, id == 0 ? H2E_PROTOCOL : H2E_FRAME_SIZE));
+			if (id > c->lastStream)
+				return (connectionError(c, H2E_PROTOCOL));
+			if (id == c->current && c->streams.count(id))
+				c->streams[id].reset = true;
+			else
+				c->streams.erase(id);
+			return (true);
+		case F_SETTINGS:
+			if (id != 0)
+				return (connectionError(c, H2E_PROTOCOL));
+			if (flags & END_STREAM) /* ACK of ours */
+				return (len == 0 ? true : connectionError(c, H2E_FRAME_SIZE));
+			if (len % 6 != 0)
+				return (connectionError(c, H2E_FRAME_SIZE));
+			if (H2Error e = applySettings(c, p, len); e != H2E_NO_ERROR)
+				return (connectionError(c, e));
+			frame(c, F_SETTINGS, END_STREAM, 0, nullptr, 0);
+			return (true);
+		case F_PING:
+			if (id != 0 || len != 8)
+				return (connectionError(c, id != 0 ? H2E_PROTOCOL : H2E_FRAME_SIZE));
+			if (!(flags & END_STREAM))
+				frame(c, F_PING, END_STREAM, 0, p, len);
+			return (true);
+		case F_GOAWAY:
+			if (id != 0)
+				return (connectionError(c, H2E_PROTOCOL));
+			c->peerClosed = true;
+			return (true);
+		case F_WINDOW_UPDATE:
+			return (onWindowUpdate(c, id, p, len));
+		case F_PUSH_PROMISE: /* Servers only */
+			return (connectionError(c, H2E_PROTOCOL));
+		default: /* Unknown types are ignored */
+			return (true);
+	}
+}
+
+static void	parse(H2Conn *c)
+{
+	if (!c->prefaceSeen)
+	{
+		size_t n = std::min(c->in.size() - c->inOffset, H2_PREFACE_LEN);
+		if (c->in.compare(c->inOffset, n, H2_PREFACE, n) != 0)
+		{
+			connectionError(c, H2E_PROTOCOL);
+			return ;
+		}
+		if (n < H2_PREFACE_LEN)
+			return ;
+		c->inOffset += H2_PREFACE_LEN;
+		c->prefaceSeen = true;
+	}
+	while (!c->dead && c->in.size() - c->inOffset >= FRAME_HEADER)
+	{
+		const uint8_t *h = reinterpret_cast<const uint8_t *>(c->in.data()) + c->inOffset;
+		size_t len = h[0] << 16 | h[1] << 8 | h[2];
+		if (len > FRAME_MAX)
+		{
+			connectionError(c, H2E_FRAME_SIZE);
+			break ;
+		}
+		if (c->in.size() - c->inOffset < FRAME_HEADER + len)
+			break ;
+		c->inOffset += FRAME_HEADER + len;
+		if (!onFrame(c, h[3], h[4], get32(h + 5) & 0x7fffffff, h + FRAME_HEADER, len))
+			break ;
+	}
+	c->in.erase(0, c->inOffset);
+	c->inOffset = 0;
+	if (c->recvCredit >= CONN_WINDOW / 2)
+	{
+		frame32(c, F_WINDOW_UPDATE, 0, c->recvCredit);
+		c->recvWindow += c->recvCredit;
+		c->recvCredit = 0;
+	}
+}
+
+/* One read off the socket, and the frames it completes. None while the
+ * client is too far behind reading what we owe it: the SETTINGS and PING
+ * acks of what it sends would pile up without bound. */
+static void	fill(H2Conn *c)
+{
+	if (h2Behind(c) && (!h2Flush(c) || h2Behind(c)))
+		return ;
+	char buf[READ_SIZE];
+	ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		c->dead = true;
+	if (n <= 0)
+		return ;
+	c->in.append(buf, n);
+	parse(c);
+	h2Flush(c);
+}
+
+/* The settings of a new connection, and a connection window that does
+ * not get in the way: each stream has its own */
+static H2Conn	*newConnection(int fd)
+{
+	H2Conn *c = new H2Conn;
+	c->fd = fd;
+	std::string settings = { 0, 3 }; /* MAX_CONCURRENT_STREAMS */
+	put32(settings, H2_MAX_STREAMS);
+	settings += std::string("\0\2", 2); /* ENABLE_PUSH */
+	put32(settings, 0);
+	frame(c, F_SETTINGS, 0, 0, settings.data(), settings.size());
+	frame32(c, F_WINDOW_UPDATE, 0, CONN_WINDOW - c->recvWindow);
+	c->recvWindow = CONN_WINDOW;
+	g_stats.connections++;
+	return (c);
+}
+
+/* `early` is what came in so far, the preface first */
+H2Conn	*h2Start(int fd, const std::string &early)
+{
+	H2Conn *c = newConnection(fd);
+	c->in = early;
+	parse(c);
+	h2Flush(c);
+	return (c);
+}
+
+static bool	base64url(const std::string &in, std::string &out)
+{
+	uint32_t bits = 0;
+	int count = 0;
+	for (char ch : in)
+	{
+		int v;
+		if (ch >= 'A' && ch <= 'Z')
+			v = ch - 'A';
+		else if (ch >= 'a' && ch <= 'z')
+			v = ch - 'a' + 26;
+		else if (ch >= '0' && ch <= '9')
+			v = ch - '0' + 52;
+		else if (ch == '-' || ch == '+')
+			v = 62;
+		else if (ch == '_' || ch == '/')
+			v = 63;
+		else if (ch == '=')
+			break ;
+		else
+			return (false);
+		bits = bits << 6 | v;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			out += static_cast<char>(bits >> count);
+		}
+	}
+	return (true);
+}
+
+/* Upgrade: h2c on a request without a body: 101, then its response on
+ * stream 1. nullptr if HTTP2-Settings is not valid, to answer in HTTP/1.1. */
+H2Conn	*h2Upgrade(int fd, const std::string &settings, const std::string &early)
+{
+	std::string payload;
+	if (!base64url(settings, payload) || payload.size() % 6 != 0)
+		return (nullptr);
+	H2Conn *c = newConnection(fd);
+	if (applySettings(c, reinterpret_cast<const uint8_t *>(payload.data()), payload.size()) != H2E_NO_ERROR)
+	{
+		g_stats.connections--;
+		delete c;
+		return (nullptr);
+	}
+	c->out.insert(0, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+	H2Stream s;
+	s.id = 1;
+	s.ended = true;
+	s.sendWindow = c->peerInitialWindow;
+	s.recvWindow = WINDOW;
+	c->streams.emplace(1, s);
+	c->current = 1;
+	c->lastStream = 1;
+	g_stats.upgrades++;
+	g_stats.streams++;
+	c->in = early;
+	parse(c);
+	h2Flush(c);
+	return (c);
+}
+
+static H2Stream	*currentStream(H2Conn *c)
+{
+	if (c->current == 0 && !c->streams.empty())
+		c->current = c->streams.begin()->first;
+	auto it = c->streams.find(c->current);
+	return (it == c->streams.end() ? nullptr : &it->second);
+}
+
+/* Like recv() on an HTTP/1.1 connection carrying the current stream's
+ * request, then the next one's after h2StreamDone(). 0 if the connection
+ * is over, or the client reset a request the handler is still reading. */
+ssize_t	h2Recv(H2Conn *c, void *buf, size_t len)
+{
+	H2Stream *s = currentStream(c);
+	if ((s == nullptr || s->request.empty()) && !c->dead)
+	{
+		fill(c);
+		s = currentStream(c);
+	}
+	if (s != nullptr && s->reset)
+		return (0);
+	if (s != nullptr && !s->request.empty())
+	{
+		size_t n = std::min(len, s->request.size());
+		memcpy(buf, s->request.data(), n);
+		s->request.erase(0, n);
+		if (s->request.empty() && s->credit > 0 && !s->ended)
+		{
+			frame32(c, F_WINDOW_UPDATE, s->id, s->credit);
+			s->recvWindow += s->credit;
+			s->credit = 0;
+			h2Flush(c);
+		}
+		return (n);
+	}
+	if (c->dead || (c->peerClosed && s == nullptr))
+		return (0);
+	errno = EAGAIN;
+	return (-1);
+}
+
+static int64_t	window(const H2Conn *c, const H2Stream &s)
+{
+	return (std::max<int64_t>(0, std::min(c->sendWindow, s.sendWindow)));
+}
+
+static void	sendData(H2Conn *c, H2Stream &s, const char *p, size_t n)
+{
+	size_t most = std::min(c->peerMaxFrame, DATA_FRAME_MAX);
+	c->sendWindow -= n;
+	s.sendWindow -= n;
+	for (size_t k; n > 0; p += k, n -= k)
+	{
+		k = std::min(n, most);
+		frame(c, F_DATA, 0, s.id, p, k);
+	}
+}
+
+/* The handler's status line and header lines, as a HEADERS frame and as
+ * many CONTINUATION frames as its size takes */
+static void	sendHead(H2Conn *c, H2Stream &s)
+{
+	const std::string &head = c->head;
+	int status = head.compare(0, 5, "HTTP/") == 0 && head.size() > 12 ? atoi(head.c_str() + 9) : 500;
+	std::string block;
+	hpackEncodeStatus(block, status);
+	bool chunked = false;
+	for (size_t pos = head.find("\r\n") + 2, next; pos < head.size(); pos = next + 2)
+	{
+		next = head.find("\r\n", pos);
+		size_t colon = head.find(':', pos);
+		if (next == pos || colon >= next)
+			continue ;
+		std::string name = head.substr(pos, colon - pos);
+		std::transform(name.begin(), name.end(), name.begin(),
+			[](unsigned char ch) { return std::tolower(ch); });
+		size_t from = head.find_first_not_of(" \t", colon + 1);
+		std::string value = from < next ? head.substr(from, next - from) : "";
+		if (name == "transfer-encoding")
+			chunked = value.find("chunked") != std::string::npos;
+		if (!isConnectionHeader(name))
+			hpackEncode(block, name, value);
+	}
+	size_t most = c->peerMaxFrame;
+	for (size_t at = 0; at == 0 || at < block.size(); at += most)
+	{
+		size_t n = std::min(most, block.size() - at);
+		uint8_t flags = at + n == block.size() ? END_HEADERS : 0;
+		frame(c, at == 0 ? F_HEADERS : F_CONTINUATION, flags, s.id, block.data() + at, n);
+	}
+	c->head.clear();
+	if (status < 200) /* 1xx, the real head follows */
+		return ;
+	c->headSent = true;
+	c->body = chunked ? H2B_CHUNK_SIZE : H2B_RAW;
+}
+
+/* Up to the end of a line, into c->head; true once it is there */
+static size_t	takeLine(H2Conn *c, const char *p, size_t n, bool &complete)
+{
+	const char *nl = static_cast<const char *>(memchr(p, '\n', n));
+	size_t take = nl != nullptr ? nl - p + 1 : n;
+	c->head.append(p, take);
+	complete = (nl != nullptr);
+	if (c->head.size() > H2_MAX_HEADER_LIST)
+		c->body = H2B_DONE;
+	return (take);
+}
+
+/* Like send() on an HTTP/1.1 connection, for the current stream's
+ * response: takes what the flow control windows let through, -1 with
+ * EAGAIN when that is nothing (h2Blocked() then), or when the socket is
+ * too far behind. A chunked body goes out without its framing. */
+ssize_t	h2Send(H2Conn *c, const void *buf, size_t len)
+{
+	if (c->out.size() - c->outOffset >= H2_OUT_MAX)
+		h2Flush(c);
+	if (c->dead)
+	{
+		errno = EPIPE;
+		return (-1);
+	}
+	if (c->out.size() - c->outOffset >= H2_OUT_MAX)
+	{
+		errno = EAGAIN;
+		return (-1);
+	}
+	auto it = c->streams.find(c->current);
+	if (c->current == 0 || it == c->streams.end() || it->second.reset)
+		return (len); /* Nobody to read it */
+	H2Stream &s = it->second;
+	const char *p = static_cast<const char *>(buf);
+	size_t used = 0;
+	bool stalled = false, complete;
+	while (used < len && !stalled)
+	{
+		size_t n = len - used;
+		switch (c->body)
+		{
+			case H2B_HEAD:
+			{
+				size_t before = c->head.size();
+				c->head.append(p + used, n);
+				size_t end = c->head.find("\r\n\r\n", before < 3 ? 0 : before - 3);
+				if (end == std::string::npos)
+				{
+					used += n;
+					break ;
+				}
+				c->head.resize(end + 4);
+				used += end + 4 - before;
+				sendHead(c, s);
+				break ;
+			}
+			case H2B_RAW:
+				n = std::min<size_t>(n, window(c, s));
+				sendData(c, s, p + used, n);
+				used += n;
+				stalled = (n == 0);
+				break ;
+			case H2B_CHUNK:
+				n = std::min<size_t>(std::min(n, c->chunkLeft), window(c, s));
+				sendData(c, s, p + used, n);
+				used += n;
+				c->chunkLeft -= n;
+				stalled = (n == 0);
+				if (c->chunkLeft == 0)
+					c->body = H2B_CHUNK_END;
+				break ;
+			case H2B_CHUNK_SIZE:
+				used += takeLine(c, p + used, n, complete);
+				if (!complete || c->body == H2B_DONE)
+					break ;
+				c->chunkLeft = strtoul(c->head.c_str(), nullptr, 16);
+				c->body = c->chunkLeft == 0 ? H2B_TRAILERS : H2B_CHUNK;
+				c->head.clear();
+				break ;
+			case H2B_CHUNK_END:
+				used += takeLine(c, p + used, n, complete);
+				if (complete && c->body != H2B_DONE)
+					c->body = H2B_CHUNK_SIZE;
+				if (complete)
+					c->head.clear();
+				break ;
+			case H2B_TRAILERS:
+				used += takeLine(c, p + used, n, complete);
+				if (complete && (c->head == "\r\n" || c->head == "\n"))
+					c->body = H2B_DONE;
+				if (complete)
+					c->head.clear();
+				break ;
+			case H2B_DONE:
+				used = len;
+				break ;
+		}
+	}
+	if (used == 0 && stalled)
+		c->blocked = true;
+	if (!h2Flush(c))
+	{
+		errno = EPIPE;
+		return (-1);
+	}
+	if (used == 0 && stalled)
+	{
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (used);
+}
+
+/* The handler answered the current stream: END_STREAM, and on to the
+ * next one. False if the connection should close: it is in error, the
+ * client is leaving, or there was no stream to answer (a timeout). */
+bool	h2StreamDone(H2Conn *c)
+{
+	auto it = c->streams.find(c->current);
+	if (it != c->streams.end())
+	{
+		H2Stream &s = it->second;
+		if (!s.reset && c->headSent)
+			frame(c, F_DATA, END_STREAM, s.id, nullptr, 0);
+		else if (!s.reset)
+			frame32(c, F_RST_STREAM, s.id, H2E_INTERNAL);
+		if (!s.reset && c->headSent && !s.ended) /* Its body is of no use now */
+			frame32(c, F_RST_STREAM, s.id, H2E_NO_ERROR);
+		c->lastAnswered = s.id;
+		c->streams.erase(it);
+	}
+	bool answered = (c->current != 0);
+	c->current = 0;
+	c->body = H2B_HEAD;
+	c->head.clear();
+	c->chunkLeft = 0;
+	c->headSent = false;
+	c->blocked = false;
+	h2Flush(c);
+	return (answered && !c->dead && !c->peerClosed);
+}
+
+/* A request ready for the handler, which the socket will not say */
+bool	h2HasInput(const H2Conn *c)
+{
+	auto it = c->current != 0 ? c->streams.find(c->current) : c->streams.begin();
+	if (it == c->streams.end())
+		return (false);
+	return (!it->second.request.empty() || (c->current != 0 && it->second.reset));
+}
+
+bool	h2Pending(const H2Conn *c)
+{
+	return (c->outOffset < c->out.size());
+}
+
+bool	h2Blocked(const H2Conn *c)
+{
+	return (c->blocked);
+}
+
+/* Reading waits for the socket to take what is framed */
+bool	h2Behind(const H2Conn *c)
+{
+	return (c->out.size() - c->outOffset > H2_OUT_MAX);
+}
+
+/* Reads frames while a response waits for WINDOW_UPDATE. False once the
+ * connection is over. */
+bool	h2Pump(H2Conn *c)
+{
+	fill(c);
+	return (!c->dead);
+}
+
+/* GOAWAY if it can, then frees it */
+void	h2Close(H2Conn *c)
+{
+	if (!c->dead)
+	{
+		std::string payload;
+		put32(payload, c->current != 0 ? c->current : c->lastAnswered);
+		put32(payload, H2E_NO_ERROR);
+		frame(c, F_GOAWAY, 0, 0, payload.data(), payload.size());
+		h2Flush(c);
+	}
+	delete c;
+}
+
+/* All of it, or the start of it so far */
+bool	isH2Preface(const std::string &data)
+{
+	size_t n = std::min(data.size(), H2_PREFACE_LEN);
+	return (n > 0 && data.compare(0, n, H2_PREFACE, n) == 0);
+}
+
+std::string	h2Stats()
+{
+	return ("h2_connections " + std::to_string(g_stats.connections) + "\n"
+		+ "h2_upgrades " + std::to_string(g_stats.upgrades) + "\n"
+		+ "h2_streams " + std::to_string(g_stats.streams) + "\n"
+		+ "h2_refused " + std::to_string(g_stats.refused) + "\n");
+}
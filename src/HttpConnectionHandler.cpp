@@ -1,14 +1,113 @@
 #include "HttpConnectionHandler.hpp"
 #include "Logger.hpp"
+#include "Server.hpp"
+#include "Tls.hpp"
+#include "Http2.hpp"
+#include <cerrno>
 
 HttpConnectionHandler::HttpConnectionHandler()
 	: method(""), path(""), originalPath(""), httpVersion(""), body(""),
-	clientSocket(-1), filePath(""), queryString(""), extension(""),
+	bodyTaken(0), clientSocket(-1), tls(nullptr), h2(nullptr), filePath(""), queryString(""), extension(""),
 	cgiType(NONE), conf(nullptr), locBlock(nullptr), errorCode(0),
-	PORT("0000"), IP("0000"), response(""), fileServ(false), bSent(0), rawRequest("") {}
+	address(""), remoteAddr(""), response(""), responseSent(0), fileServ(false), fileLength(0),
+	bodyDiscarded(false), discardLeft(0), bDrained(0), cgiHeadersParsed(false), cgiChunked(false),
+	cgiBodyLeft(std::string::npos), cgiOutputBytes(0), cgiTee(nullptr), cgiPrivate(false), rawRequest("") {}
 
 //add socket closing to destructor if needed
-HttpConnectionHandler::~HttpConnectionHandler() {}
+HttpConnectionHandler::~HttpConnectionHandler()
+{
+	outClear(outQueue);
+}
+
+/* recv() and send() on the client's socket, through TLS on an ssl
+ * address, or on a stream of an HTTP/2 connection */
+ssize_t HttpConnectionHandler::receive(void *buf, size_t len)
+{
+	if (h2)
+		return h2Recv(h2, buf, len);
+	return tls ? tlsRecv(tls, buf, len) : recv(clientSocket, buf, len, 0);
+}
+
+ssize_t HttpConnectionHandler::transmit(const void *buf, size_t len)
+{
+	if (h2)
+		return h2Send(h2, buf, len);
+	return tls ? tlsSend(tls, buf, len) : send(clientSocket, buf, len, 0);
+}
+
+/* Decrypted already, or the next HTTP/2 stream: the event loop will not
+ * report it */
+bool HttpConnectionHandler::hasBufferedInput() const
+{
+	return (tls && tlsHasPending(tls)) || (h2 && h2HasInput(h2));
+}
+
+/* sendfile() and splice() can write to the socket themselves */
+bool HttpConnectionHandler::canSendDirectly() const
+{
+	return !h2 && (!tls || tlsKernelSend(tls));
+}
+
+/* Sent of what the CGI, FastCGI or proxy relay wrote: only an offset
+ * moves, the buffer is shifted once half of it is sent, so a long body
+ * is not copied again for every partial write */
+void HttpConnectionHandler::consumeResponse(size_t n)
+{
+	responseSent += n;
+	if (responseSent >= response.size())
+	{
+		response.clear();
+		responseSent = 0;
+	}
+	else if (responseSent > response.size() / 2)
+	{
+		response.erase(0, responseSent);
+		responseSent = 0;
+	}
+}
+
+/* Hands the response just written to the output queue, without copying
+ * it, followed by the file or cached body it announced. False if that
+ * file is gone: its headers promised a length there is no way to keep. */
+bool HttpConnectionHandler::queueResponse()
+{
+	response.erase(0, responseSent);
+	outPush(outQueue, std::move(response));
+	response.clear();
+	responseSent = 0;
+	outPushShared(outQueue, std::move(sharedBody));
+	sharedBody.reset();
+	if (fileServ)
+		logInfo("Serving file: " + path);
+	if (fileServ && !outPushFile(outQueue, path, fileLength))
+	{
+		logError("Failed to open file " + path);
+		return false;
+	}
+	fileServ = false;
+	return true;
+}
+
+/* Until the socket is full or all of it is out. Straight to the socket
+ * where nothing sits in between, otherwise one segment at a time. */
+HandlerStatus HttpConnectionHandler::sendOutput()
+{
+	if (canSendDirectly())
+		return outSend(outQueue, clientSocket);
+	while (hasOutput())
+	{
+		char buf[OUT_FILE_CHUNK];
+		const char *data;
+		size_t n = outPeek(outQueue, data, buf, sizeof(buf));
+		if (n == 0)
+			return S_Error;
+		ssize_t sent = transmit(data, n);
+		if (sent < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? S_Again : S_Error;
+		outConsume(outQueue, sent);
+	}
+	return S_Done;
+}
 
 /* Clears the object
  * current implementation leaves socket and conf as it was
@@ -20,6 +119,7 @@ void HttpConnectionHandler::resetObject()
 	originalPath.clear();
 	httpVersion.clear();
 	body.clear();
+	bodyTaken = 0;
 	headers.clear();
 	filePath.clear();
 	queryString.clear();
@@ -30,8 +130,22 @@ void HttpConnectionHandler::resetObject()
 	rawRequest.clear();
 	chunkRemainder.clear();
 	response.clear();
-	bSent = 0;
+	responseSent = 0;
 	fileServ = false;
+	fileLength = 0;
+	sharedBody.reset();
+	outClear(outQueue);
+	bodyDiscarded = false;
+	discardLeft = 0;
+	bDrained = 0;
+	cgiHeaderBuf.clear();
+	cgiHeadersParsed = false;
+	cgiChunked = false;
+	cgiBodyLeft = string::npos;
+	cgiOutputBytes = 0;
+	cgiCapture = CgiCapture();
+	cgiTee = nullptr;
+	cgiPrivate = false;
 }
 
 std::ostream& operator<<(std::ostream& os, const HttpConnectionHandler& handler)
@@ -44,7 +158,6 @@ std::ostream& operator<<(std::ostream& os, const HttpConnectionHandler& handler)
 	for (const auto& [key, value] : handler.getHeaders())
 		os << key << ": " << value << "\n";
 	os << "--- Body ---\n" << handler.getBody() << "\n";
-	os << "bSent: " << handler.getBSent() << "\n";
 	os << "Body size: " << handler.getBody().size() << "\n";
 	os << "Error Code: " << handler.getErrorCode() << "\n";
 	os << "Client Socket: " << handler.getClientSocket() << "\n";
@@ -82,6 +195,8 @@ serializeResponse(int status, HeadersMap& responseHeaders, const string& respons
 	std::ostringstream	output;
 
 	responseHeaders["Content-Length"] = std::to_string(responseBody.size());
+	if (isDraining())
+		responseHeaders["Connection"] = "close";
 	output << "HTTP/1.1 " << status << " " << getReasonPhrase(status) << "\r\n";
 	for (const auto& [key, value] : responseHeaders)
 		output << key << ": " << value << "\r\n";
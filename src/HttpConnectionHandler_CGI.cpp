@@ -1,9 +1,11 @@
 #include "HttpConnectionHandler.hpp"
 #include "CgiHandler.hpp"
 #include "Logger.hpp"
-#include <sys/wait.h>
-
-static std::string	removePhpCgiHeaders(std::string cgiResponse);
+#include "Server.hpp"
+#ifdef __linux__
+# include <fcntl.h>
+#endif
+#include <cerrno>
 
 CgiTypes HttpConnectionHandler::checkCgi() {
 
@@ -18,7 +20,9 @@ CgiTypes HttpConnectionHandler::checkCgi() {
 		queryString = originalPath.substr(originalPath.find_first_of('?') + 1);
 	}
 
-	if (locBlock->cgiPathPython != "" && filePath.find(".py") != std::string::npos) 
+	if (!locBlock->proxyPass.empty())
+		cgiType = PROXY;
+	else if (locBlock->cgiPathPython != "" && filePath.find(".py") != std::string::npos) 
 		cgiType = PYTHON;
 	else if (locBlock->cgiPathPHP != "" && filePath.find(".php") != std::string::npos)
 		cgiType = PHP;
@@ -26,63 +30,310 @@ CgiTypes HttpConnectionHandler::checkCgi() {
 	return cgiType;
 }
 
-static std::string	getPhpCgiHeaders(std::string cgiResponse);
+/* Reads whatever the script wrote since last time, called when its
+ * stdout is readable. Reading as it comes keeps a chatty script from
+ * blocking on a full pipe. Once the header block is in, everything read
+ * is framed straight into the response so the client gets it while the
+ * script is still running.
+ *
+ * @return S_Again while the pipe is open, S_Done on EOF, S_Error otherwise
+ */
+HandlerStatus HttpConnectionHandler::readCgiOutput(CgiHandler &cgiHandler) {
+	int fromFd = cgiHandler.getPipeFromCgi()[0];
+	char buffer[65536];
+
+	ssize_t n = read(fromFd, buffer, sizeof(buffer));
+	logDebug("Read %d bytes from CGI", n);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? S_Again : S_Error;
+	if (n == 0)
+		return S_Done;
+	feedCgiOutput(buffer, n);
+	return S_Again;
+}
 
-HandlerStatus HttpConnectionHandler::serveCgi(CgiHandler &cgiHandler) {
-	int CgiExitCode = 0;
-	int CgiProcessStatus = 0;
-	CgiProcessStatus = waitpid(cgiHandler.cgiPid, &CgiExitCode, WNOHANG);
-	if (CgiProcessStatus == 0)
-		return S_Again;
-	if (WEXITSTATUS(CgiExitCode) == EXIT_FAILURE)
+/* Script output, from its stdout pipe or a FastCGI backend. */
+void HttpConnectionHandler::feedCgiOutput(const char *data, size_t n) {
+	cgiOutputBytes += n;
+	if (cgiHeadersParsed)
+		appendCgiBody(data, n);
+	else
 	{
-		close(cgiHandler.getPipeFromCgi()[0]);
-		return S_Error;
+		cgiHeaderBuf.append(data, n);
+		parseCgiHeaders();
 	}
-	// cgiHandler.executeCgi();
+}
+
+#ifdef __linux__
+/* Once the headers are out and the script gave a Content-Length, the
+ * rest of its output is moved from the pipe to the socket by the kernel
+ * instead of through our buffers. Chunked output still needs framing
+ * and goes through readCgiOutput().
+ */
+bool HttpConnectionHandler::canRelayCgiOutput() const {
+	return cgiHeadersParsed && !cgiChunked && cgiBodyLeft != 0 && response.empty()
+		&& !cgiCapture.keep && cgiTee == nullptr && canSendDirectly();
+}
+
+/* @return what splice() returned: bytes moved, 0 on EOF, -1 with errno.
+ * The pipe was readable, so EAGAIN means the socket is full. */
+ssize_t HttpConnectionHandler::relayCgiOutput(CgiHandler &cgiHandler) {
 	int fromFd = cgiHandler.getPipeFromCgi()[0];
-	char buffer[8192];
-	bzero(buffer, sizeof(buffer));
-	logDebug("Serving CGI");
+	size_t len = std::min(cgiBodyLeft, static_cast<size_t>(CGI_PIPE_SIZE));
 
-	ssize_t n = read(fromFd, buffer, sizeof(buffer));
-	logDebug("Read %d bytes", n);
-	// Per read man page: "When attempting to read from an empty pipe,
-	// if some process has the pipe open for writing and O_NONBLOCK is set, read() will return -1."
-	// So the following check will lead to false positives in error check when there is nothing to read.
-	// How to fix it?
-	if (n < 0) {
-		close(fromFd);
-		return S_Error;
+	ssize_t n = splice(fromFd, NULL, clientSocket, NULL, len,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	logDebug("Spliced %d bytes from CGI", n);
+	if (n > 0)
+	{
+		cgiBodyLeft -= n;
+		cgiOutputBytes += n;
 	}
-	response.append(buffer, n);
-	if (!n) {
-    string cgiHeaders = "HTTP/1.1 200 OK\r\n";
-    if (cgiType == PHP)
-    {
-      cgiHeaders += getPhpCgiHeaders(response);
-      response = removePhpCgiHeaders(response);
-    }
-    cgiHeaders += "Content-Length: " + std::to_string(response.size()) + "\r\n\r\n";
-		response.insert(0, cgiHeaders);
-		close(fromFd);
+	return n;
+}
+#endif
+
+/* Closes the response once the script is done and all its output is in.
+ * A script that fails before printing its headers still gets a 500;
+ * after that the status line is gone and all we can do is stop.
+ */
+HandlerStatus HttpConnectionHandler::finishCgiResponse(bool failed) {
+	if (!cgiHeadersParsed)
+	{
+		if (failed)
+			return S_Error;
+		// Short output that never looked like headers
+		string out;
+		out.swap(cgiHeaderBuf);
+		HeadersMap h = createDefaultHeaders();
+		emitCgi(serializeResponse(200, h, out));
+		cgiHeadersParsed = true;
+		if (cgiCapture.keep)
+		{
+			cgiCapture.status = "200 OK";
+			cgiCapture.body = out;
+		}
 		return S_Done;
 	}
-	return S_Again;
+	if (cgiChunked)
+		emitCgi("0\r\n\r\n");
+	else if (cgiBodyLeft != 0)
+	{
+		logError("CGI output shorter than its Content-Length");
+		errorCode = 502; // no keep-alive after a short body
+	}
+	return S_Done;
+}
+
+static bool	isCgiHeaderLine(const string &line)
+{
+	size_t colon = line.find(':');
+	if (colon == string::npos || colon == 0)
+		return false;
+	for (size_t i = 0; i < colon; i++)
+		if (!std::isalnum(static_cast<unsigned char>(line[i])) && line[i] != '-' && line[i] != '_')
+			return false;
+	return true;
+}
+
+static string	toLower(string s)
+{
+	for (char &c : s)
+		c = std::tolower(static_cast<unsigned char>(c));
+	return s;
+}
+
+/* Splits the script's header block off cgiHeaderBuf once it is complete
+ * and writes the status line and headers into the response.
+ * Output whose first line is not a header is all body, and so is a
+ * header block that does not end within MAX_CGI_HEADER bytes.
+ *
+ * @return false while more output is needed to decide
+ */
+bool HttpConnectionHandler::parseCgiHeaders()
+{
+	size_t	start = 0;
+	size_t	end = string::npos;
+	bool	headerless = false;
+
+	while (true)
+	{
+		size_t eol = cgiHeaderBuf.find('\n', start);
+		if (eol == string::npos)
+		{
+			if (cgiHeaderBuf.size() < MAX_CGI_HEADER)
+				return false;
+			headerless = true;
+			break;
+		}
+		string line = cgiHeaderBuf.substr(start, eol - start);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		start = eol + 1;
+		if (line.empty())
+		{
+			end = start;
+			break;
+		}
+		if (!isCgiHeaderLine(line))
+		{
+			headerless = true;
+			break;
+		}
+	}
+
+	std::ostringstream	out;
+	string				status;
+	string				contentLength;
+	bool				hasLocation = false;
+
+	start = 0;
+	while (!headerless && start < end)
+	{
+		size_t eol = cgiHeaderBuf.find('\n', start);
+		string line = cgiHeaderBuf.substr(start, eol - start);
+		start = eol + 1;
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			break;
+		size_t colon = line.find(':');
+		string name = line.substr(0, colon);
+		string value = line.substr(colon + 1);
+		value.erase(0, value.find_first_not_of(" \t"));
+		string key = toLower(name);
+		if (key == "cache-control")
+		{
+			cgiCapture.cacheControl = value;
+			string directives = toLower(value);
+			if (directives.find("private") != string::npos || directives.find("no-store") != string::npos)
+				cgiPrivate = true;
+		}
+		if (key == "set-cookie")
+			cgiPrivate = true;
+		if (key == "status")
+			status = value;
+		else if (key == "content-length")
+			contentLength = value;
+		else if (key == "transfer-encoding" || key == "connection" || key == "date")
+			continue;
+		else
+		{
+			if (key == "location")
+				hasLocation = true;
+			out << name << ": " << value << "\r\n";
+		}
+	}
+
+	if (status.empty())
+		status = hasLocation ? "302 Found" : "200 OK";
+	else if (status.find(' ') == string::npos)
+		status += " " + getReasonPhrase(std::atoi(status.c_str()));
+
+	if (cgiPrivate)
+		cgiTee = nullptr; /* Nothing of it goes to followers, see cgiFlightForward() */
+	if (cgiCapture.keep)
+	{
+		cgiCapture.status = status;
+		cgiCapture.headers = out.str();
+	}
+
+	cgiBodyLeft = string::npos;
+	if (!contentLength.empty())
+	{
+		char *endp = nullptr;
+		unsigned long long len = std::strtoull(contentLength.c_str(), &endp, 10);
+		if (endp != contentLength.c_str() && *endp == '\0')
+			cgiBodyLeft = len;
+	}
+	cgiChunked = (cgiBodyLeft == string::npos);
+	if (cgiChunked)
+		out << "Transfer-Encoding: chunked\r\n";
+	else
+		out << "Content-Length: " << cgiBodyLeft << "\r\n";
+
+	emitCgi("HTTP/1.1 " + status + "\r\n"
+		+ "Date: " + getCurrentHttpDate() + "\r\n"
+		+ (isDraining() ? "Connection: close\r\n" : "")
+		+ out.str() + "\r\n");
+	cgiHeadersParsed = true;
+
+	string rest;
+	if (headerless)
+		rest.swap(cgiHeaderBuf);
+	else
+		rest = cgiHeaderBuf.substr(end);
+	cgiHeaderBuf.clear();
+	appendCgiBody(rest.data(), rest.size());
+	return true;
+}
+
+/* Everything framed for the client goes through here, so that the
+ * clients following an identical request get a copy */
+void HttpConnectionHandler::emitCgi(const char *data, size_t n)
+{
+	response.append(data, n);
+	if (cgiTee != nullptr)
+		cgiTee->append(data, n);
+}
+
+void HttpConnectionHandler::emitCgi(const string &data)
+{
+	emitCgi(data.data(), data.size());
+}
+
+/* Frames a piece of script output for the client: one chunk, or as is
+ * up to the Content-Length the script announced.
+ */
+void HttpConnectionHandler::appendCgiBody(const char *data, size_t n)
+{
+	if (n == 0)
+		return;
+	if (cgiCapture.keep)
+	{
+		if (cgiCapture.body.size() + n > cgiCapture.limit)
+		{
+			cgiCapture.keep = false;
+			string().swap(cgiCapture.body);
+		}
+		else
+			cgiCapture.body.append(data, cgiChunked ? n : std::min(n, cgiBodyLeft));
+	}
+	if (cgiChunked)
+	{
+		char size[20];
+		std::snprintf(size, sizeof(size), "%zx\r\n", n);
+		emitCgi(size);
+		emitCgi(data, n);
+		emitCgi("\r\n");
+		return;
+	}
+	n = std::min(n, cgiBodyLeft);
+	emitCgi(data, n);
+	cgiBodyLeft -= n;
 }
 
-static std::string	getPhpCgiHeaders(std::string cgiResponse)
+/* The script's response is to be kept by cgi_cache, unless its body
+ * grows past the limit */
+void HttpConnectionHandler::captureCgiResponse(const string &key, size_t limit)
 {
-  const size_t sep = cgiResponse.find("\r\n\r\n");
-  if (sep == string::npos)
-    return (cgiResponse);
-  return cgiResponse.substr(0, sep + 2);
+	cgiCapture = CgiCapture();
+	cgiCapture.key = key;
+	cgiCapture.keep = true;
+	cgiCapture.limit = limit;
 }
 
-static std::string	removePhpCgiHeaders(std::string cgiResponse)
+/* Answers with a response cgi_cache kept, as if the script just ran.
+ * The body goes out of the cache as it is, shared with it. */
+void HttpConnectionHandler::replayCgiResponse(const string &status, const string &cachedHeaders,
+		const std::shared_ptr<const string> &cachedBody, uint64_t age_s)
 {
-  const size_t sep = cgiResponse.find("\r\n\r\n");
-  if (sep == string::npos)
-    return (cgiResponse);
-  return cgiResponse.substr(sep + 4, cgiResponse.size());
+	response = "HTTP/1.1 " + status + "\r\n";
+	response += "Date: " + getCurrentHttpDate() + "\r\n";
+	response += cachedHeaders;
+	response += "Age: " + std::to_string(age_s) + "\r\n";
+	if (isDraining())
+		response += "Connection: close\r\n";
+	response += "Content-Length: " + std::to_string(cachedBody->size()) + "\r\n\r\n";
+	sharedBody = cachedBody;
 }
@@ -32,7 +32,12 @@ string HttpConnectionHandler::getReasonPhrase(int statusCode)
     static const std::map<int, string> reasonPhrases =
     {
 	    {200, "OK"},
+	    {204, "No Content"},
 	    {301, "Moved Permanently"},
+	    {302, "Found"},
+	    {303, "See Other"},
+	    {304, "Not Modified"},
+	    {307, "Temporary Redirect"},
 	    {400, "Bad Request"},
 	    {401, "Unauthorized"},
 	    {403, "Forbidden"},
@@ -44,7 +49,9 @@ string HttpConnectionHandler::getReasonPhrase(int statusCode)
 	    {413, "Payload Too Large"},
 	    {500, "Internal Server Error"},
 	    {501, "Not Implemented"},
+	    {502, "Bad Gateway"},
 	    {503, "Service Unavailable"},
+	    {504, "Gateway Timeout"},
 	    {505, "HTTP Version not supported"}
 	    // add more when needed!
     };
@@ -174,6 +181,8 @@ string HttpConnectionHandler::createErrorResponse(int error)
 		}
 		h["Allow"] = allowValue;
 	}
+	if (error == 503)
+		h["Retry-After"] = std::to_string(RETRY_AFTER_S);
 
 	if (!conf)
 	{
@@ -209,6 +218,7 @@ string HttpConnectionHandler::createErrorResponse(int error)
 			buffer << "Content-Length: " << conLen << "\r\n";
 			buffer << "\r\n";
 			path = errorPath;
+			fileLength = static_cast<size_t>(conLen);
 			return buffer.str();
 		}
 		else {
@@ -1,5 +1,8 @@
 #include "HttpConnectionHandler.hpp"
 #include "Logger.hpp"
+#include "Parser.hpp"
+#include "Http2.hpp"
+#include <cerrno>
 
 /* 
  * Need to check for missing headers?
@@ -38,12 +41,14 @@ HandlerStatus	HttpConnectionHandler::parseRequest()
 	char		buffer[8192];
 	int		bRead;
 
-	if (!conf)
-		findInitialConfig();
+	if (!conf || (rawRequest.empty() && config != currentConfig()))
+		findInitialConfig(); /* A reload since the last request on this connection */
 	logInfo("Parsing connection on socket " + std::to_string(clientSocket));
-	bRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+	bRead = receive(buffer, sizeof(buffer) - 1);
 	if (bRead == 0)
 		return S_ClosedConnection;
+	if (bRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return S_Again; /* Part of a TLS record */
 	if (bRead < 0) {
 		logError("Reading from the socket");
 		std::cout << clientSocket << std::endl;
@@ -52,6 +57,13 @@ HandlerStatus	HttpConnectionHandler::parseRequest()
 	}
 	buffer[bRead] = '\0';
 	rawRequest.append(buffer, bRead);
+	if (!h2 && !tls && isH2Preface(rawRequest)) {
+		if (rawRequest.size() < H2_PREFACE_LEN)
+			return S_Again;
+		h2 = h2Start(clientSocket, rawRequest); /* Its first request follows through receive() */
+		rawRequest.clear();
+		return S_Again;
+	}
 	if (rawRequest.find("\r\n\r\n") == std::string::npos) {
 		return S_Again;
 	}
@@ -68,6 +80,15 @@ HandlerStatus	HttpConnectionHandler::parseRequest()
 	if (!getHeaders(requestStream)) {
 		return S_Error;
 	}
+	if (!h2 && !tls && headers.count("HTTP2-Settings") && headers.count("Upgrade")
+			&& headers["Upgrade"].find("h2c") != std::string::npos
+			&& !headers.count("Content-Length") && !headers.count("Transfer-Encoding")) {
+		/* Answered on stream 1, after a 101 */
+		size_t headEnd = rawRequest.find("\r\n\r\n") + 4;
+		h2 = h2Upgrade(clientSocket, headers["HTTP2-Settings"], rawRequest.substr(headEnd));
+		if (h2)
+			rawRequest.resize(headEnd);
+	}
 	//if there is body still to be read, read it completely
 	if (headers.count("Content-Length")) {
 		std::string::size_type	bodyStart = rawRequest.find("\r\n\r\n");
@@ -475,9 +496,11 @@ HandlerStatus	HttpConnectionHandler::readBody()
 
 
 	logInfo("Handle body called");
-	bRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+	bRead = receive(buffer, sizeof(buffer) - 1);
 	if (bRead == 0)
 		return S_ClosedConnection;
+	if (bRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return S_Again;
 	if (bRead < 0) {
 		logError("Reading from the socket");
 		errorCode = 400;
@@ -485,7 +508,7 @@ HandlerStatus	HttpConnectionHandler::readBody()
 	}
 	buffer[bRead] = '\0';
 
-	if (conf && bRead + body.size() > conf->getMaxClientBodySize())
+	if (conf && bRead + bodyTaken + body.size() > conf->getMaxClientBodySize())
 	{
 		logError("Request Body size bigger than max client body size");
 		errorCode = 415;
@@ -524,10 +547,10 @@ HandlerStatus	HttpConnectionHandler::readBody()
 		return S_Error;
 	}
 	size_t contentLength = static_cast<size_t>(contentLengthInt);
-	if (body.size() < contentLength) {
+	if (bodyTaken + body.size() < contentLength) {
 		return S_Again;
 	}
-	else if (body.size() > contentLength) {
+	else if (bodyTaken + body.size() > contentLength) {
 		logError("Body size bigger than Content-Length");
 		errorCode = 400;
 		return S_Error;
@@ -536,3 +559,74 @@ HandlerStatus	HttpConnectionHandler::readBody()
 		return S_Done;
 	}
 }
+
+/* Hands over the body received so far, for CGI to stream it while
+ * the rest is still coming. readBody() keeps counting it. */
+std::string	HttpConnectionHandler::takeBody()
+{
+	std::string	taken;
+
+	bodyTaken += body.size();
+	taken.swap(body);
+	return taken;
+}
+
+/* Marks the rest of the request body as unwanted
+ *
+ * called when the request was answered from its header alone (wrong method,
+ * redirect, missing script...). Whatever body came with the header is dropped,
+ * and we remember how much is still on the wire so drainBody() can skip it
+ * without buffering. Chunked bodies have no known length, the connection
+ * gets closed once the client stops sending instead.
+ */
+void	HttpConnectionHandler::discardBody()
+{
+	bodyDiscarded = true;
+	discardLeft = 0;
+	auto it = headers.find("Content-Length");
+	if (it != headers.end()) {
+		try {
+			size_t contentLength = std::stoul(it->second);
+			if (contentLength > bodyTaken + body.size())
+				discardLeft = contentLength - bodyTaken - body.size();
+		}
+		catch (const std::exception &e) {
+			discardLeft = std::string::npos;
+		}
+	}
+	else if (headers.count("Transfer-Encoding"))
+		discardLeft = std::string::npos;
+	body.clear();
+	chunkRemainder.clear();
+}
+
+/* Reads and throws away the body of a request we already answered
+ *
+ * @return HandlerStatus:
+ *   - S_Done: the whole Content-Length was skipped, the connection can be reused
+ *   - S_Again: more to skip
+ *   - S_ClosedConnection: client closed, expected when the length is unknown
+ *   - S_Error: recv failed or the client sent more than we are willing to skip
+ */
+HandlerStatus	HttpConnectionHandler::drainBody()
+{
+	char	buffer[8192];
+	size_t	toRead = std::min(sizeof(buffer), discardLeft);
+
+	ssize_t bRead = receive(buffer, toRead);
+	if (bRead == 0)
+		return S_ClosedConnection;
+	if (bRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return S_Again;
+	if (bRead < 0)
+		return S_Error;
+	bDrained += bRead;
+	if (conf && bDrained > conf->getMaxClientBodySize()) {
+		logError("Discarded body bigger than max client body size");
+		return S_Error;
+	}
+	if (discardLeft == std::string::npos)
+		return S_Again;
+	discardLeft -= bRead;
+	return discardLeft == 0 ? S_Done : S_Again;
+}
@@ -2,6 +2,8 @@
 #include "Configuration.hpp"
 #include "CgiHandler.hpp"
 #include "Logger.hpp"
+#include "Parser.hpp"
+#include "Server.hpp"
 
 /* determines the content type based on the file extension
  *
@@ -45,34 +47,6 @@ std::string HttpConnectionHandler::getContentType(const std::string &filepath)
 	return "application/octet-stream";
 }
 
-/* recursively finds the longest matching location block for path in object
- *
- * starts by checking the top level location blocks and, if it finds a match, recurses into
- * the nested locations and  tries to find a longer
- *
- * @param blocks  The vector of LocationBlock objects to search in.
- * @param current Pointer to the currently longest matched LocationBlock (initialized as nullptr).
- *
- * @return pointer to the longest matching location block struct, null if nothing found(shouldnt happen)
- *
- * Example usage:
- *   LocationBlock *longestBlock = findLocationBlock(conf.getLocationBlocks(), nullptr);
- *   if (!matchedBlock) {
- *       // some error if  needed
- *   }
- */
-LocationBlock *HttpConnectionHandler::findLocationBlock(std::vector<LocationBlock> &blocks, LocationBlock *current)
-{
-	for (LocationBlock &block : blocks) {
-		if (path.compare(0, block.path.length(), block.path) == 0)
-		{
-			current = &block;
-			return (findLocationBlock(block.nestedLocations, current));
-		}
-	}
-	return current;
-}
-
 /* Takes location blocks allowed methods vector and cross references the
  *method currently being executed
  *
@@ -93,7 +67,7 @@ bool	HttpConnectionHandler::isMethodAllowed(LocationBlock *block, std::string &s
 
 /* checks that the location block allows the current method to be executed
  * 
- * first finds longest matching location block form conf file with findLocationBlock()
+ * first finds longest matching location block form conf file with findLocation()
  * checks that the current method is allowed  withing that blocks allowed methods
  * remaps the path according to the root path found  in the block
  * makes sure the true path doesnt try to traverse down with /../ for example
@@ -106,7 +80,7 @@ bool	HttpConnectionHandler::isMethodAllowed(LocationBlock *block, std::string &s
  */
 bool	HttpConnectionHandler::checkLocation()
 {
-	LocationBlock *block = findLocationBlock(conf->getLocationBlocks(), nullptr);
+	LocationBlock *block = conf->findLocation(path);
   logDebug("inside checkLocation");
 	originalPath = path;
 	if (!block) {
@@ -132,7 +106,9 @@ bool	HttpConnectionHandler::checkLocation()
 		return true;
 	}
 
-	std::string relativePath = path.substr(block->path.length());
+	// A regex location has no prefix to strip: the whole path goes under its root
+	bool isRegex = block->modifier == "~" || block->modifier == "~*";
+	std::string relativePath = isRegex ? path : path.substr(block->path.length());
 	path =  "./" + block->root + "/" + relativePath;
 
 	if (path.find("/..") != std::string::npos) {
@@ -143,55 +119,12 @@ bool	HttpConnectionHandler::checkLocation()
 	return true;
 }
 
-HandlerStatus	HttpConnectionHandler::serveFile()
-{
-	logInfo("Serving file: " + path);
-	std::ifstream file(path, std::ios::binary);
-	if (!file.is_open()) {
-		//what to do if file serving fails middle of sending body
-		logError("Failed to open file");
-		return S_Error;
-	} 
-
-	//handle bsize out of scope error, dunno how it would happen
-	file.seekg(0, std::ios::end);
-	std::streamsize fileSize = file.tellg();
-	if (bSent >= fileSize) {
-		logInfo("File already fully sent");
-		return S_Done;
-	}
-
-	file.seekg(bSent);
-	if (!file) {
-		logError("File seek failed");
-		return S_Error;
-	}
-
-	char buffer[8192];
-    	file.read(buffer, sizeof(buffer));
-    	if (!file && !file.eof()) {
-        	logError("File read error");
-        	return S_Error;
-	}
-
-	ssize_t toSend = file.gcount();
-    	ssize_t sent = send(clientSocket, buffer, toSend, 0);
-    	if (sent < 0) {
-		logError("Send failed");
-		return S_Error;
-	}
-	bSent += sent;
-	if (bSent >= fileSize)
-        	return S_Done;
-	return S_Again;
-}
-
 /* function to serve file in GET requested
  *
  * if file is ok to be served, this fucntion is called.
  * checking if it exists and we have permissions if done before this.
- * opens file, checks size for content len, and sends appropriate http response with
- * the file content. sens headers first and then file content in chunks of 8kb
+ * opens file, checks size for content len, and writes the http response headers.
+ * the file content follows them out of the output queue, see queueResponse()
  */
 void	HttpConnectionHandler::checkFileToServe(std::string &str)
 {
@@ -214,11 +147,12 @@ void	HttpConnectionHandler::checkFileToServe(std::string &str)
 	headerStream << "HTTP/1.1 200 OK\r\n";
 	headerStream << "Content-Length: " << fileSize << "\r\n";
 	headerStream << "Content-Type: " << contentType << "\r\n";
-	headerStream << "Connection: Keep-Alive\r\n";
+	headerStream << "Connection: " << (isDraining() ? "close" : "Keep-Alive") << "\r\n";
 	headerStream << "\r\n";
 
 	response = headerStream.str();
 	fileServ = true;
+	fileLength = static_cast<size_t>(fileSize);
 	path = str;
 	file.close();
 }
@@ -482,126 +416,26 @@ void	HttpConnectionHandler::handleDeleteRequest()
 	response = createHttpResponse(200, "<h1>File Deleted Successfully</h1>", "text/html");
 }
 
-/* checks for name matches in the following priority:
- * 1. Exact match
- * 2. Wildcard at the beginning of the pattern ("*.example.com")
- * 3. Wildcard at the end of the pattern ("www.example.*")
- *
- * only a single wildcard at the very beginning or very end is supported.
- * a pattern consisting of only "*" is ambiguous and returns 0
- *
- * @param pattern: the server name fomr configs
- * @param host:    the name form host header
- * @return int match priority value
- * 1: exact match (highest prio)
- * 2: Wildcard match at the beginning (*suffix)
- * 3: Wildcard match at the end (prefix*)
- * 0: No match found
- */
-int	HttpConnectionHandler::matchServerName(const std::string& pattern, const std::string& host)
-{
-    if (host.empty()) {
-	    return 0;
-    }
-    // pattern of just "*" is ambigious at best, returning no match
-    if (pattern == "*") {
-        return 0;
-    }
-    // priority 1: exact match
-    if (pattern == host) {
-        return 1;
-    }
-    // priority 2: wildcard at the beginning (*suffix)
-    if (pattern.length() > 1 && pattern.front() == '*' && pattern.back() != '*') {
-        std::string suffix = pattern.substr(1);
-        if (host.length() >= suffix.length() &&
-            host.compare(host.length() - suffix.length(), suffix.length(), suffix) == 0){
-            return 2;
-        }
-    }
-    // priority 3: wildcard at the end (prefix*)
-    if (pattern.length() > 1 && pattern.back() == '*' && pattern.front() != '*') {
-        std::string prefix = pattern.substr(0, pattern.length() - 1);
-        if (host.length() >= prefix.length() && host.compare(0, prefix.length(), prefix) == 0){
-            return 3;
-        }
-    }
-    return 0;
-}
-
 /* responsible for findings the configuration file
  * current implementation is  called when host header file is found during parsing
- * priority for match from low to high is:
- * 1. IP + PORT match (first found is default until better match is found)
- * 2. full or partial servername match, prio explained in matchServerName() function.
- * 3. fallback if nothing matches is serverMap[0]
- *
- * future improvements: sometimes Host can come in with
- *	trailing dot: example.com.
- *	port: example.com:8080
+ * the lookup itself and its priorities are in Vhosts.cpp
  */
 void	HttpConnectionHandler::findConfig()
 {
-	Configuration	*result = nullptr;
-	std::string	header;
-	int		bestMatch = 4;
-	int		current = 4;
-	try
-	{
-		header = headers.at("Host");
-	}
-	catch(const std::out_of_range &e)
-	{
+	auto host = headers.find("Host");
+	if (host == headers.end())
 		logError("Can't find host header, bug in code with current logic");
-	}
-	for (auto &server : serverMap)
-	{
-		if (IP == server.getHost() && PORT == server.getPort())
-		{
-			//default first match
-			if (!result)
-				result = &server;
-			std::stringstream	ss(server.getServerNames());
-			std::string		token;
-			while (ss >> token)
-			{
-				if ((current = matchServerName(token, header))) {
-					if (current < bestMatch) {
-						bestMatch = current;
-						result = &server;
-					}
-				}
-			}
-		}
-	}
-	if (!result) {
-		logError("No match for request IP:PORT, defaulting to servermap[0]");
-		conf = &serverMap[0];
-	}
-	else {
-		conf = result;
-	}
+	if (!config)
+		config = currentConfig();
+	conf = findVhost(*config, address, host != headers.end() ? host->second : "");
 	logInfo("Final config using server " + conf->getServerNames());
 }
 
 void	HttpConnectionHandler::findInitialConfig()
 {
-	Configuration	*result = nullptr;
-
-	logInfo("Trying to find config before header " + IP + ":" + PORT);
-	for (auto &server : serverMap)
-	{
-		if (IP == server.getHost() && PORT == server.getPort())
-			if (!result)
-				result = &server;
-	}
-	if (!result) {
-		logError("No match for request IP:PORT, defaulting to servermap[0]");
-		conf = &serverMap[0];
-	}
-	else {
-		conf = result;
-	}
+	logInfo("Trying to find config before header " + address);
+	config = currentConfig();
+	conf = findVhost(*config, address, "");
 	logInfo("Final config using server " + conf->getServerNames());
 }
 
@@ -0,0 +1,358 @@
+#include "LocationRegex.hpp"
+#include <bitset>
+#include <map>
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+
+/* The input is framed by two symbols no byte can be, so that ^ and $
+ * are plain transitions */
+constexpr int	SYM_BEGIN = 256;
+constexpr int	SYM_END = 257;
+constexpr int	SYM_COUNT = 258;
+
+typedef std::bitset<SYM_COUNT>	SymSet;
+
+/* Thompson NFA: each state has at most one symbol edge */
+struct NState {
+	std::vector<int>	eps;
+	SymSet				on;
+	int					to = -1;
+	int					accept = -1; // Pattern index
+};
+
+struct Frag {
+	int	start;
+	int	end; // No edges out yet
+};
+
+class RegexParser {
+	public:
+		RegexParser(const std::string &re, bool nocase, std::vector<NState> &nfa)
+			: _re(re), _nocase(nocase), _nfa(nfa) {}
+
+		Frag	parse()
+		{
+			Frag f = alternation();
+			if (_pos != _re.size())
+				fail("unexpected )");
+			return (f);
+		}
+
+	private:
+		const std::string	&_re;
+		size_t				_pos = 0;
+		bool				_nocase;
+		std::vector<NState>	&_nfa;
+
+		[[noreturn]] void	fail(const std::string &why) const
+		{
+			throw std::runtime_error("location ~ " + _re + ": " + why);
+		}
+
+		int	state()
+		{
+			_nfa.emplace_back();
+			return (_nfa.size() - 1);
+		}
+
+		/* ~*: a letter stands for both cases */
+		void	fold(SymSet &on) const
+		{
+			if (!_nocase)
+				return ;
+			for (int c = 'a'; c <= 'z'; c++)
+				if (on[c] || on[std::toupper(c)])
+				{
+					on.set(c);
+					on.set(std::toupper(c));
+				}
+		}
+
+		Frag	symbols(const SymSet &on)
+		{
+			Frag f = { state(), state() };
+			_nfa[f.start].on = on;
+			_nfa[f.start].to = f.end;
+			return (f);
+		}
+
+		Frag	alternation()
+		{
+			Frag f = concatenation();
+			while (_pos < _re.size() && _re[_pos] == '|')
+			{
+				_pos++;
+				Frag g = concatenation();
+				Frag both = { state(), state() };
+				_nfa[both.start].eps = { f.start, g.start };
+				_nfa[f.end].eps.push_back(both.end);
+				_nfa[g.end].eps.push_back(both.end);
+				f = both;
+			}
+			return (f);
+		}
+
+		Frag	concatenation()
+		{
+			int s = state();
+			Frag f = { s, s };
+			while (_pos < _re.size() && _re[_pos] != '|' && _re[_pos] != ')')
+			{
+				Frag g = repetition();
+				_nfa[f.end].eps.push_back(g.start);
+				f.end = g.end;
+			}
+			return (f);
+		}
+
+		Frag	repetition()
+		{
+			Frag f = atom();
+			while (_pos < _re.size() && std::string("*+?").find(_re[_pos]) != std::string::npos)
+			{
+				char op = _re[_pos++];
+				Frag r = { state(), state() };
+				_nfa[r.start].eps.push_back(f.start);
+				if (op != '+')
+					_nfa[r.start].eps.push_back(r.end);
+				if (op != '?')
+					_nfa[f.end].eps.push_back(f.start);
+				_nfa[f.end].eps.push_back(r.end);
+				f = r;
+			}
+			return (f);
+		}
+
+		/* \d \w \s and friends, or the escaped character itself */
+		SymSet	escape()
+		{
+			if (_pos >= _re.size())
+				fail("trailing backslash");
+			char c = _re[_pos++];
+			SymSet on;
+			switch (std::tolower(static_cast<unsigned char>(c)))
+			{
+				case 'd':
+					for (int b = 0; b < 256; b++)
+						on[b] = std::isdigit(b);
+					break ;
+				case 'w':
+					for (int b = 0; b < 256; b++)
+						on[b] = std::isalnum(b) || b == '_';
+					break ;
+				case 's':
+					for (int b = 0; b < 256; b++)
+						on[b] = std::isspace(b);
+					break ;
+				default:
+					on.set(static_cast<unsigned char>(c));
+					return (on);
+			}
+			if (std::isupper(static_cast<unsigned char>(c)))
+				for (int b = 0; b < 256; b++)
+					on.flip(b);
+			return (on);
+		}
+
+		SymSet	bracket()
+		{
+			SymSet on;
+			bool negate = (_pos < _re.size() && _re[_pos] == '^');
+			if (negate)
+				_pos++;
+			bool first = true;
+			while (_pos < _re.size() && (_re[_pos] != ']' || first))
+			{
+				first = false;
+				if (_re[_pos] == '\\')
+				{
+					_pos++;
+					on |= escape();
+					continue ;
+				}
+				unsigned char lo = _re[_pos++];
+				unsigned char hi = lo;
+				if (_pos + 1 < _re.size() && _re[_pos] == '-' && _re[_pos + 1] != ']')
+				{
+					hi = _re[_pos + 1];
+					_pos += 2;
+					if (hi < lo)
+						fail("bad range");
+				}
+				for (int b = lo; b <= hi; b++)
+					on.set(b);
+			}
+			if (_pos >= _re.size())
+				fail("missing ]");
+			_pos++;
+			fold(on);
+			if (negate)
+				for (int b = 0; b < 256; b++)
+					on.flip(b);
+			return (on);
+		}
+
+		Frag	atom()
+		{
+			char c = _re[_pos++];
+			SymSet on;
+			switch (c)
+			{
+				case '(':
+				{
+					if (_re.compare(_pos, 2, "?:") == 0)
+						_pos += 2;
+					Frag f = alternation();
+					if (_pos >= _re.size() || _re[_pos] != ')')
+						fail("missing )");
+					_pos++;
+					return (f);
+				}
+				case '*':
+				case '+':
+				case '?':
+					fail("nothing to repeat");
+				case '[':
+					on = bracket();
+					break ;
+				case '.':
+					for (int b = 0; b < 256; b++)
+						on.set(b);
+					break ;
+				case '^':
+					on.set(SYM_BEGIN);
+					break ;
+				case '$':
+					on.set(SYM_END);
+					break ;
+				case '\\':
+					on = escape();
+					fold(on);
+					break ;
+				default:
+					on.set(static_cast<unsigned char>(c));
+					fold(on);
+			}
+			return (symbols(on));
+		}
+};
+
+static void	closure(const std::vector<NState> &nfa, std::vector<int> &set)
+{
+	std::vector<bool> seen(nfa.size());
+	std::vector<int> todo(set);
+	for (int s : set)
+		seen[s] = true;
+	while (!todo.empty())
+	{
+		int s = todo.back();
+		todo.pop_back();
+		for (int t : nfa[s].eps)
+			if (!seen[t])
+			{
+				seen[t] = true;
+				set.push_back(t);
+				todo.push_back(t);
+			}
+	}
+	std::sort(set.begin(), set.end());
+}
+
+/* Symbols no pattern tells apart share a class, so the DFA table has
+ * one column per class instead of one per byte */
+static size_t	symbolClasses(const std::vector<NState> &nfa, uint16_t *classes)
+{
+	std::map<std::vector<bool>, uint16_t> ids;
+	for (int sym = 0; sym < SYM_COUNT; sym++)
+	{
+		std::vector<bool> signature;
+		for (const NState &s : nfa)
+			if (s.to != -1)
+				signature.push_back(s.on[sym]);
+		classes[sym] = ids.emplace(signature, ids.size()).first->second;
+	}
+	return (ids.size());
+}
+
+void	RegexSet::compile(const std::vector<std::pair<std::string, bool>> &patterns)
+{
+	_next.clear();
+	_hits.clear();
+	if (patterns.empty())
+		return ;
+	if (patterns.size() > REGEX_LOCATIONS_MAX)
+		throw std::runtime_error("too many regex locations in one server");
+
+	/* A state that loops on every symbol restarts all the patterns at
+	 * each position: that is what makes them unanchored */
+	std::vector<NState> nfa(1);
+	nfa[0].on.set();
+	nfa[0].on.reset(SYM_END);
+	nfa[0].to = 0;
+	for (size_t i = 0; i < patterns.size(); i++)
+	{
+		if (patterns[i].first.empty())
+			throw std::runtime_error("empty regex location");
+		RegexParser parser(patterns[i].first, patterns[i].second, nfa);
+		Frag f = parser.parse();
+		nfa[0].eps.push_back(f.start);
+		nfa[f.end].accept = i;
+	}
+	_classCount = symbolClasses(nfa, _classes);
+	std::vector<int> representative(_classCount);
+	for (int sym = SYM_COUNT - 1; sym >= 0; sym--)
+		representative[_classes[sym]] = sym;
+
+	/* Subset construction */
+	std::map<std::vector<int>, uint32_t> ids;
+	std::vector<std::vector<int>> sets;
+	std::vector<int> start = { 0 };
+	closure(nfa, start);
+	ids[start] = 0;
+	sets.push_back(start);
+	for (size_t d = 0; d < sets.size(); d++)
+	{
+		uint64_t hits = 0;
+		for (int s : sets[d])
+			if (nfa[s].accept != -1)
+				hits |= uint64_t(1) << nfa[s].accept;
+		_hits.push_back(hits);
+		for (size_t cls = 0; cls < _classCount; cls++)
+		{
+			std::vector<int> moved;
+			for (int s : sets[d])
+				if (nfa[s].to != -1 && nfa[s].on[representative[cls]])
+					moved.push_back(nfa[s].to);
+			std::sort(moved.begin(), moved.end());
+			moved.erase(std::unique(moved.begin(), moved.end()), moved.end());
+			closure(nfa, moved);
+			auto [it, created] = ids.emplace(moved, sets.size());
+			if (created)
+			{
+				if (sets.size() >= REGEX_DFA_STATES_MAX)
+					throw std::runtime_error("regex locations of one server are too complex");
+				sets.push_back(moved);
+			}
+			_next.push_back(it->second);
+		}
+	}
+}
+
+int	RegexSet::match(const char *s, size_t len) const
+{
+	if (_hits.empty())
+		return (-1);
+	uint32_t state = _next[_classes[SYM_BEGIN]];
+	uint64_t hits = _hits[0] | _hits[state];
+	for (size_t i = 0; i < len; i++)
+	{
+		state = _next[state * _classCount + _classes[static_cast<unsigned char>(s[i])]];
+		hits |= _hits[state];
+	}
+	state = _next[state * _classCount + _classes[SYM_END]];
+	hits |= _hits[state];
+	if (hits == 0)
+		return (-1);
+	return (__builtin_ctzll(hits));
+}
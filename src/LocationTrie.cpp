@@ -0,0 +1,102 @@
+#include "LocationTrie.hpp"
+#include "Configuration.hpp"
+#include <algorithm>
+#include <cstring>
+
+void	LocationTrie::build(std::vector<LocationBlock> &blocks)
+{
+	_nodes.assign(1, Node());
+	add(blocks, 0);
+}
+
+void	LocationTrie::add(std::vector<LocationBlock> &blocks, int depth)
+{
+	for (LocationBlock &block : blocks)
+	{
+		/* Exact and regex locations have their own lookups */
+		if (block.modifier.empty() || block.modifier == "^~")
+			insert(block.path, &block, depth);
+		add(block.nestedLocations, depth + 1);
+	}
+}
+
+/* 0 if there is no edge for that byte: the root is nobody's child */
+uint32_t	LocationTrie::child(uint32_t node, unsigned char c) const
+{
+	const auto &children = _nodes[node].children;
+	auto it = std::lower_bound(children.begin(), children.end(),
+			std::make_pair(c, static_cast<uint32_t>(0)));
+	return (it != children.end() && it->first == c) ? it->second : 0;
+}
+
+void	LocationTrie::insert(const std::string &path, LocationBlock *location, int depth)
+{
+	uint32_t at = 0;
+	size_t i = 0;
+	while (i < path.size())
+	{
+		unsigned char c = path[i];
+		uint32_t next = child(at, c);
+		if (next == 0)
+		{
+			/* New leaf for the rest of the path */
+			Node leaf;
+			leaf.label = path.substr(i);
+			_nodes.push_back(leaf);
+			next = _nodes.size() - 1;
+			auto &children = _nodes[at].children;
+			children.insert(std::upper_bound(children.begin(), children.end(),
+					std::make_pair(c, next)), std::make_pair(c, next));
+			at = next;
+			break ;
+		}
+		const std::string &label = _nodes[next].label;
+		size_t n = 0;
+		while (n < label.size() && i + n < path.size() && label[n] == path[i + n])
+			n++;
+		if (n < label.size())
+		{
+			/* The path leaves the edge halfway: split it there */
+			Node mid;
+			mid.label = label.substr(0, n);
+			mid.children.push_back(std::make_pair(
+					static_cast<unsigned char>(label[n]), next));
+			_nodes[next].label.erase(0, n);
+			_nodes.push_back(mid);
+			uint32_t split = _nodes.size() - 1;
+			for (auto &edge : _nodes[at].children)
+				if (edge.second == next)
+					edge.second = split;
+			next = split;
+		}
+		at = next;
+		i += n;
+	}
+	if (depth > _nodes[at].depth)
+	{
+		_nodes[at].location = location;
+		_nodes[at].depth = depth;
+	}
+}
+
+LocationBlock	*LocationTrie::match(const char *p, size_t left) const
+{
+	if (_nodes.empty())
+		return (nullptr);
+	LocationBlock *best = _nodes[0].location;
+	uint32_t at = 0;
+	while (left > 0)
+	{
+		at = child(at, *p);
+		if (at == 0)
+			break ;
+		const Node &node = _nodes[at];
+		if (node.label.size() > left || memcmp(node.label.data(), p, node.label.size()) != 0)
+			break ;
+		p += node.label.size();
+		left -= node.label.size();
+		if (node.location != nullptr)
+			best = node.location;
+	}
+	return (best);
+}
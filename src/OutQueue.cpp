@@ -0,0 +1,172 @@
+#include "OutQueue.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <algorithm>
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
+
+static size_t	segmentSize(const OutSegment &seg)
+{
+	switch (seg.kind) {
+		case OUT_STRING: return (seg.data.size());
+		case OUT_SHARED: return (seg.shared->size());
+		case OUT_FILE: return (seg.size);
+	}
+	return (0);
+}
+
+static const char	*segmentData(const OutSegment &seg)
+{
+	return (seg.kind == OUT_SHARED ? seg.shared->data() : seg.data.data());
+}
+
+void	outPush(OutQueue &q, std::string data)
+{
+	if (data.empty())
+		return ;
+	q.segments.emplace_back();
+	q.segments.back().data = std::move(data);
+}
+
+void	outPushShared(OutQueue &q, std::shared_ptr<const std::string> blob)
+{
+	if (!blob || blob->empty())
+		return ;
+	q.segments.emplace_back();
+	q.segments.back().kind = OUT_SHARED;
+	q.segments.back().shared = std::move(blob);
+}
+
+/* The first size bytes of the file, the length its headers announced.
+ * A file that grew since is cut there, and one that shrank ends the
+ * connection when its end is reached: the framing is kept either way. */
+bool	outPushFile(OutQueue &q, const std::string &path, size_t size)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (false);
+	if (size == 0)
+	{
+		close(fd);
+		return (true);
+	}
+	q.segments.emplace_back();
+	OutSegment &seg = q.segments.back();
+	seg.kind = OUT_FILE;
+	seg.fd = fd;
+	seg.size = size;
+	return (true);
+}
+
+/* The unsent start of the first segment, read into buf if it is a file.
+ * 0 if the file cannot be read. */
+size_t	outPeek(const OutQueue &q, const char *&data, char *buf, size_t bufSize)
+{
+	const OutSegment &seg = q.segments.front();
+	size_t left = segmentSize(seg) - q.cursor;
+	if (seg.kind != OUT_FILE)
+	{
+		data = segmentData(seg) + q.cursor;
+		return (left);
+	}
+	ssize_t n = pread(seg.fd, buf, std::min(left, bufSize), seg.offset + q.cursor);
+	data = buf;
+	return (n > 0 ? n : 0);
+}
+
+void	outConsume(OutQueue &q, size_t n)
+{
+	while (n > 0 && !q.segments.empty())
+	{
+		OutSegment &seg = q.segments.front();
+		size_t left = segmentSize(seg) - q.cursor;
+		if (n < left)
+		{
+			q.cursor += n;
+			return ;
+		}
+		n -= left;
+		if (seg.fd >= 0)
+			close(seg.fd);
+		q.segments.pop_front();
+		q.cursor = 0;
+	}
+}
+
+/* The strings up to the next file, in one call. Asks for the file to
+ * follow in the same packets where it can. */
+static ssize_t	sendStrings(const OutQueue &q, int sockfd)
+{
+	struct iovec iov[OUT_IOV_MAX];
+	size_t count = 0;
+	bool fileNext = false;
+	for (const OutSegment &seg : q.segments)
+	{
+		if (seg.kind == OUT_FILE)
+		{
+			fileNext = true;
+			break ;
+		}
+		if (count == OUT_IOV_MAX)
+			break ;
+		size_t skip = count == 0 ? q.cursor : 0;
+		iov[count].iov_base = const_cast<char *>(segmentData(seg) + skip);
+		iov[count].iov_len = segmentSize(seg) - skip;
+		count++;
+	}
+	struct msghdr msg = {};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	int flags = 0;
+#ifdef __linux__
+	if (fileNext)
+		flags |= MSG_MORE;
+#else
+	(void)fileNext;
+#endif
+	return (sendmsg(sockfd, &msg, flags));
+}
+
+static ssize_t	sendFile(const OutQueue &q, int sockfd)
+{
+	const OutSegment &seg = q.segments.front();
+#ifdef __linux__
+	/* The kernel copies from the page cache to the socket, and encrypts on
+	 * the way where it does TLS */
+	off_t offset = seg.offset + q.cursor;
+	return (sendfile(sockfd, seg.fd, &offset, seg.size - q.cursor));
+#else
+	char buf[OUT_FILE_CHUNK];
+	ssize_t n = pread(seg.fd, buf, std::min(seg.size - q.cursor, sizeof(buf)), seg.offset + q.cursor);
+	return (n > 0 ? send(sockfd, buf, n, 0) : 0);
+#endif
+}
+
+/* Until the socket is full or the queue is empty. A file that ends
+ * early is an error like any other: its length was promised. */
+HandlerStatus	outSend(OutQueue &q, int sockfd)
+{
+	while (!q.segments.empty())
+	{
+		ssize_t sent = q.segments.front().kind == OUT_FILE ? sendFile(q, sockfd) : sendStrings(q, sockfd);
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return (S_Again);
+		if (sent <= 0)
+			return (S_Error);
+		outConsume(q, sent);
+	}
+	return (S_Done);
+}
+
+void	outClear(OutQueue &q)
+{
+	for (const OutSegment &seg : q.segments)
+		if (seg.fd >= 0)
+			close(seg.fd);
+	q.segments.clear();
+	q.cursor = 0;
+}
@@ -1,98 +1,180 @@
 #include "../include/Parser.hpp"
+#include "../include/ConfigSnapshot.hpp"
+#include "../include/Tls.hpp"
 #include <signal.h>
+#include <atomic>
 
 extern sig_atomic_t g_ShouldStop;
 
-int getRawFile(std::string& fileName, std::vector<std::string>& rawFile) {
-	int brace = 0;
-
-	std::regex confRegex(R"((.+)\.conf$)");
-	if (!std::regex_search(fileName, confRegex))
+static std::string readFile(const std::string& fileName) {
+	if (fileName.size() < 6 || fileName.compare(fileName.size() - 5, 5, ".conf") != 0)
 		throw std::runtime_error("File extension must be .conf");
-	
-	std::ifstream file(fileName);
+
+	std::ifstream file(fileName, std::ios::binary);
 	if (!file)
 		throw std::runtime_error("Error opening file");
-	
-	std::string line;
-	while (std::getline(file, line)) {
-    if (g_ShouldStop == true) return 0;
-		size_t comment = line.find('#');
-		// remove comments
-		if (comment != std::string::npos)
-			line = line.substr(0, comment);
-		// remove leading & trailing whitespaces
-		line = std::regex_replace(line, std::regex("^\\s+|\\s+$"), "");
-		// reduce multiple whitespaces to one
-		line = std::regex_replace(line, std::regex("\\s+"), " ");
-
-		if (line.empty())
-			continue;
-		if (line.find('{') != line.npos)
-			brace++;
-		if (line.find('}') != line.npos)
-			brace--;
-		
-		if (!line.empty())
-			rawFile.push_back(line);
-	}
-	if (brace != 0)
-		throw std::runtime_error("Unmatched braces in file");
-	if (rawFile.empty())
-		throw std::runtime_error("File empty");
-	file.close();
-	return 0;
+	std::ostringstream data;
+	data << file.rdbuf();
+	return data.str();
 }
 
-void populateConfigMap(const std::vector<std::string>& rawFile, std::vector<Configuration>& srvrMap)
+UpstreamBlock handleUpstreamBlock(const ConfigDirective& block)
 {
+	UpstreamBlock up;
 
-	std::vector<std::string> serverBlock;
-	std::string port;
-	int brace = 0;
-	std::regex	listenRegex(R"(^listen (\d+)\s*;$)");
+	if (block.args.size() != 1 || !block.hasBlock)
+		configError(block, "expects NAME { ... }");
+	up.name = block.args[0];
+	for (const auto& d : block.block) {
+		if (d.name == "server") {
+			// server ADDRESS [max_fails=N] [fail_timeout=Ns]
+			configArgs(d, 1, 3);
+			UpstreamServer server;
+			server.address = d.args[0];
+			if (!configAddress(server.address))
+				configError(d, "expects unix:/path, /path or host:port");
+			for (size_t i = 1; i < d.args.size(); i++) {
+				const std::string& param = d.args[i];
+				if (param.compare(0, 10, "max_fails=") == 0)
+					server.maxFails = configNumber(d, param.substr(10), "", 5);
+				else if (param.compare(0, 13, "fail_timeout=") == 0)
+					server.failTimeout = configNumber(d, param.substr(13), "s", 5);
+				else
+					configError(d, "has an unknown parameter " + param);
+			}
+			up.servers.push_back(server);
+		}
+		else if (d.name == "balance") {
+			configArgs(d, 1, 1);
+			if (d.args[0] != "round_robin" && d.args[0] != "least_conn" && d.args[0] != "hash")
+				configError(d, "expects round_robin, least_conn or hash");
+			up.balance = d.args[0];
+		}
+		else if (d.name == "keepalive") {
+			configArgs(d, 1, 1);
+			up.keepalive = configNumber(d, d.args[0], "", 5);
+		}
+		else
+			configError(d, "is unknown in an upstream");
+	}
+	if (up.servers.empty())
+		throw std::runtime_error("upstream " + up.name + " has no server");
+	return up;
+}
 
-	std::regex regex(R"((\w+)\s*:\s*(.+);)");
+static std::atomic<std::shared_ptr<const Config>>	g_config;
 
-	for (const auto& line : rawFile) {
-    if (g_ShouldStop == true) return;
-		std::smatch match;
-		if (regex_search(line, match, std::regex("^server$"))) {
-			serverBlock.push_back(line);
+/* proxy_pass names an upstream block, unless it is an address */
+static void checkProxyPass(const std::vector<LocationBlock>& locations, const std::vector<UpstreamBlock>& upstreamMap)
+{
+	for (const auto& loc : locations) {
+		const std::string &target = loc.proxyPass;
+		if (!target.empty() && target.find_first_of(":/") == target.npos
+				&& std::none_of(upstreamMap.begin(), upstreamMap.end(),
+					[&target](const UpstreamBlock &up) { return up.name == target; }))
+			throw std::runtime_error("proxy_pass to unknown upstream " + target);
+		checkProxyPass(loc.nestedLocations, upstreamMap);
+	}
+}
+
+/* One listening socket per address: the servers that give options for
+ * it, which have to agree, give them for all the others on it */
+static void shareListenOptions(std::vector<Configuration>& servers)
+{
+	std::map<std::string, const Configuration*> giver;
+	for (const auto& server : servers) {
+		if (!server.getListenOptions().given)
 			continue;
+		std::string address = server.getListenAddress();
+		auto [it, first] = giver.emplace(address, &server);
+		if (!first && !(it->second->getListenOptions() == server.getListenOptions()))
+			throw std::runtime_error("listen options for " + address + " differ between servers");
+	}
+	for (auto& server : servers) {
+		auto it = giver.find(server.getListenAddress());
+		if (it != giver.end())
+			server.setListenOptions(it->second->getListenOptions());
+	}
+}
+
+void populateConfigMap(const std::vector<ConfigDirective>& config, Config& out)
+{
+	std::vector<Configuration>& srvrMap = out.servers;
+	srvrMap.reserve(std::count_if(config.begin(), config.end(),
+		[](const ConfigDirective& d) { return d.name == "server"; }));
+	for (const auto& d : config) {
+		if (g_ShouldStop == true) return;
+		if (d.name == "server") {
+			if (!d.args.empty() || !d.hasBlock)
+				configError(d, "expects { ... }");
+			srvrMap.push_back(Configuration(d));
 		}
-		if (regex_search(line, match, listenRegex))
-			port = match[1];
-		if (line.find('{') != line.npos)
-			brace++;
-		else if (line.find('}') != line.npos)
-			brace--;
-		if (!brace) {
-			serverBlock.push_back(line);
-			if (port.empty())
-				port = DEFAULT_LISTEN;
-			srvrMap.push_back(Configuration(serverBlock));
-			serverBlock.clear();
-			port.clear();
+		else if (d.name == "upstream")
+			out.upstreams.push_back(handleUpstreamBlock(d));
+		else if (d.name == "shutdown_timeout") {
+			configArgs(d, 1, 1);
+			out.shutdownTimeout = configNumber(d, d.args[0], "s", 5);
 		}
-		if (!serverBlock.empty())
-			serverBlock.push_back(line);
+		else if (d.name == "cgi_max_concurrent") {
+			configArgs(d, 1, 1);
+			out.cgiMaxConcurrent = configNumber(d, d.args[0], "", 5);
+		}
+		else if (d.name == "cgi_cgroup") {
+			configArgs(d, 1, 1);
+			if (d.args[0].empty() || d.args[0][0] != '/')
+				configError(d, "expects an absolute path");
+			out.cgiCgroup = d.args[0];
+		}
+		else
+			configError(d, "is unknown at the top level");
 	}
+	if (srvrMap.empty())
+		throw std::runtime_error("No server block in file");
+	shareListenOptions(srvrMap);
 }
 
-std::vector<Configuration> parser(std::string fileName) {
-	std::vector<std::string> rawFile;
-	
+/* A .conf file, or a snapshot written by `webserv -c file.conf -o file`.
+ * Touches nothing global, a reload runs it beside the event loop. */
+std::shared_ptr<Config> parser(const std::string &fileName) {
+	auto config = std::make_shared<Config>();
+
+	config->source = fileName;
 	try {
-		getRawFile(fileName, rawFile);
-		populateConfigMap(rawFile, serverMap);
+		if (isSnapshot(fileName))
+			loadSnapshot(fileName, *config);
+		else {
+			std::string data = readFile(fileName);
+			populateConfigMap(readConfig(data.data(), data.size()), *config);
+		}
+		for (auto &server : config->servers) {
+			checkProxyPass(server.getLocationBlocks(), config->upstreams);
+			if (server.getListenOptions().ssl && (server.getSslCertificate().empty() || server.getSslCertificateKey().empty()))
+				throw std::runtime_error("no ssl_certificate and ssl_certificate_key for a server on " + server.getListenAddress() + " ssl");
+			if (server.getListenOptions().ssl)
+				server.setTlsContext(tlsContext(server));
+		}
+		config->vhosts.build(config->servers);
 	}
 	catch (std::exception &e) {
-		throw;
+		throw std::runtime_error(fileName + ": " + e.what());
 	}
-	return serverMap;
+	return config;
+}
+
+/* What new requests start with */
+std::shared_ptr<const Config> currentConfig() {
+	return g_config.load(std::memory_order_acquire);
 }
 
+void publishConfig(std::shared_ptr<Config> config) {
+	std::shared_ptr<const Config> previous = currentConfig();
+	config->generation = previous ? previous->generation + 1 : 1;
+	g_config.store(std::move(config), std::memory_order_release);
+}
+
+const Configuration *findVhost(const Config &config, const std::string &address, const std::string &host) {
+	return &config.servers[config.vhosts.find(address, host)];
+}
 
 void Configuration::printLocationBlockCompact(LocationBlock loc, int level) const
 {
@@ -121,10 +203,12 @@ void Configuration::printLocationBlockCompact(LocationBlock loc, int level) cons
 		pad += (i + 1 < loc.methods.size() ? 1 : 0);
 	}
 	std::cout << "⟩ "
+		<< loc.modifier << (loc.modifier.empty() ? "" : " ")
 		<< loc.path
 		<< (loc.returnCode == 307 ? " ↷ " : " → ")
 		<< (loc.returnCode == 307 ? loc.returnURL : loc.root);
 	pad += 1 + (int)loc.path.length() + 3;
+	pad += loc.modifier.empty() ? 0 : (int)loc.modifier.length() + 1;
 	pad += loc.returnCode == 307 ? (int)loc.returnURL.length() : (int)loc.root.length();
 	printf("%*s", 80 - pad, "");
 	std::cout << " (";
@@ -135,6 +219,22 @@ void Configuration::printLocationBlockCompact(LocationBlock loc, int level) cons
 		std::cout << (!loc.cgiPathPython.empty() ? "●" : "○");
 	std::cout << " py";
 	std::cout << ")";
+	if (!loc.proxyPass.empty())
+		std::cout << " ⇉ " << loc.proxyPass;
+	else if (!loc.fastcgiPass.empty())
+		std::cout << " ⇢ " << loc.fastcgiPass;
+	else if (loc.cgiPoolSize > 0)
+		std::cout << " ⇢ " << loc.cgiPoolSize << " warm py";
+	if (loc.cgiMaxConcurrent > 0)
+		std::cout << " ≤" << loc.cgiMaxConcurrent;
+	if (loc.cgiCacheValid > 0)
+		std::cout << " ⟲ " << loc.cgiCacheValid << "s";
+	if (loc.cgiCoalesce)
+		std::cout << " ⇶ coalesce";
+	if (loc.cgiTimeout > 0)
+		std::cout << " ⏱ " << loc.cgiTimeout << "s";
+	if (loc.stats)
+		std::cout << " ⓘ stats";
 	std::cout << "\n";
 	for (const auto& o : loc.nestedLocations)
 		printLocationBlockCompact(o, level + 1);
@@ -148,7 +248,7 @@ void	Configuration::printCompact() const
 	std::cout
 		<< "⌂ "
 		<< underline
-		<< _serverNames << " @ " << _host << ":" << _port << reset << " "
+		<< _serverNames << " @ " << getListenAddress() << reset << " "
 		<< "(" << "maxbody: " << _maxClientBodySize / 1e6 << "M"
 		<< ", maxheader: " << _maxClientHeaderSize / 1e3 << "K" << ")"
 		<< green << " ✓"  << reset
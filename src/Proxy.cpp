@@ -0,0 +1,693 @@
+#include "Server.hpp"
+#include "Proxy.hpp"
+#include "Parser.hpp"
+#include <algorithm>
+#include <sstream>
+#include <map>
+
+static std::map<std::string, ProxyGroup>	g_groups;
+static std::vector<std::map<std::string, ProxyGroup>::node_type>	g_retired; // Until their last connection closes
+static std::vector<ProxyConn *>				g_conns;
+
+static struct {
+	size_t	requests = 0;
+	size_t	reused = 0; // Went out on a pooled connection
+	size_t	retried = 0; // Sent again to another server
+} g_stats;
+
+static void	closeConn(ProxyConn *c, int qfd);
+
+static std::string	toLower(std::string s)
+{
+	for (char &ch : s)
+		ch = std::tolower(static_cast<unsigned char>(ch));
+	return (s);
+}
+
+/* Meaningful for one connection only, never forwarded either way */
+static bool	isHopByHop(const std::string &key)
+{
+	return (key == "connection" || key == "keep-alive" || key == "proxy-connection"
+		|| key == "te" || key == "trailer" || key == "transfer-encoding"
+		|| key == "upgrade");
+}
+
+static uint32_t	fnv1a(const std::string &s)
+{
+	uint32_t h = 2166136261u;
+	for (unsigned char ch : s)
+	{
+		h ^= ch;
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+/* Built the first time it is used, from its `upstream` block or, for a
+ * plain address, as a group of one. */
+static ProxyGroup	*groupFor(const std::string &target)
+{
+	auto it = g_groups.find(target);
+	if (it != g_groups.end())
+		return (&it->second);
+	ProxyGroup &g = g_groups[target];
+	g.name = target;
+	const std::vector<UpstreamBlock> &upstreams = currentConfig()->upstreams;
+	auto up = std::find_if(upstreams.begin(), upstreams.end(),
+			[&target](const UpstreamBlock &u) { return u.name == target; });
+	if (up == upstreams.end())
+	{
+		g.peers.resize(1);
+		g.peers[0].address = target;
+		return (&g);
+	}
+	g.balance = up->balance;
+	g.keepalive = up->keepalive;
+	for (const UpstreamServer &server : up->servers)
+	{
+		ProxyPeer p;
+		p.address = server.address;
+		p.maxFails = server.maxFails;
+		p.failTimeout = server.failTimeout;
+		g.peers.push_back(p);
+	}
+	if (g.balance == "hash")
+	{
+		/* Each server owns the arcs before its points: adding or losing
+		 * one only moves the URIs on its arcs */
+		for (size_t i = 0; i < g.peers.size(); i++)
+			for (int n = 0; n < PROXY_HASH_POINTS; n++)
+				g.ring.push_back({ fnv1a(g.peers[i].address + "#" + std::to_string(n)), i });
+		std::sort(g.ring.begin(), g.ring.end());
+	}
+	return (&g);
+}
+
+/* A lone server is always tried: there is nothing to fail over to */
+static bool	isUp(const ProxyGroup *g, const ProxyPeer *p)
+{
+	return (g->peers.size() == 1 || p->downUntil_ms <= now_ms());
+}
+
+/* Passive health check: max_fails failures in a row take a server out
+ * of the group for fail_timeout. The next one after that puts it back
+ * out, a success resets the count. */
+static void	peerFailed(ProxyGroup *g, ProxyPeer *p)
+{
+	p->fails++;
+	if (g->peers.size() > 1 && p->fails >= p->maxFails)
+	{
+		p->downUntil_ms = now_ms() + p->failTimeout * 1000;
+		logError("proxy: " + p->address + " of " + g->name + " is down");
+	}
+}
+
+/* The next live server by round_robin, least_conn or hash of the URI.
+ * `avoid` just failed this request. */
+static ProxyPeer	*pickPeer(ProxyGroup *g, const std::string &key, const ProxyPeer *avoid)
+{
+	if (!g->ring.empty())
+	{
+		auto it = std::lower_bound(g->ring.begin(), g->ring.end(),
+				std::make_pair(fnv1a(key), static_cast<size_t>(0)));
+		for (size_t i = 0; i < g->ring.size(); i++, it++)
+		{
+			if (it == g->ring.end())
+				it = g->ring.begin();
+			ProxyPeer *p = &g->peers[it->second];
+			if (p != avoid && isUp(g, p))
+				return (p);
+		}
+		return (nullptr);
+	}
+	size_t n = g->peers.size();
+	ProxyPeer *best = nullptr;
+	for (size_t i = 0; i < n; i++)
+	{
+		ProxyPeer *p = &g->peers[(g->next + i) % n];
+		if (p == avoid || !isUp(g, p))
+			continue ;
+		if (best == nullptr || p->active < best->active)
+			best = p;
+		if (g->balance != "least_conn")
+			break ;
+	}
+	if (best != nullptr)
+		g->next = (best - &g->peers[0] + 1) % n;
+	return (best);
+}
+
+static void	updateInterest(ProxyConn *c, int qfd)
+{
+	bool pending = c->outOffset < c->out.size();
+	queue_event_type t;
+	if (!c->connected)
+		t = WRITABLE;
+	else if (c->paused)
+		t = pending ? WRITABLE : IDLE;
+	else
+		t = pending ? READWRITE : READABLE;
+	if (t == c->watching)
+		return ;
+	watch(qfd, c->slot, t);
+	c->watching = t;
+}
+
+static ProxyConn	*openConn(ProxyGroup *g, ProxyPeer *p, int qfd)
+{
+	if (p->addrlen == 0 && !resolve_address(p->address, &p->addr, &p->addrlen))
+	{
+		logError("proxy: cannot resolve " + p->address);
+		return (nullptr);
+	}
+	int fd = socket(p->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (nullptr);
+	if (socket_set_nonblocking(fd) < 0
+			|| (connect(fd, reinterpret_cast<struct sockaddr *>(&p->addr), p->addrlen) < 0
+				&& errno != EINPROGRESS))
+	{
+		logError("proxy: cannot connect to " + p->address);
+		close(fd);
+		return (nullptr);
+	}
+	Endpoint *slot = claimEndpoint(qfd, Upstream, fd, nullptr, WRITABLE);
+	if (slot == nullptr)
+	{
+		close(fd);
+		return (nullptr);
+	}
+	ProxyConn *c = new ProxyConn;
+	c->group = g;
+	c->peer = p;
+	c->slot = slot;
+	c->fd = fd;
+	c->watching = WRITABLE;
+	slot->proxy = c;
+	g_conns.push_back(c);
+	return (c);
+}
+
+/* A pooled connection the server has not closed in the meantime */
+static ProxyConn	*idleConn(ProxyPeer *p, int qfd)
+{
+	for (size_t i = 0; i < g_conns.size(); i++)
+	{
+		ProxyConn *c = g_conns[i];
+		if (c->peer != p || c->client != nullptr)
+			continue ;
+		char byte;
+		ssize_t n = recv(c->fd, &byte, 1, MSG_PEEK);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return (c);
+		closeConn(c, qfd);
+		i--;
+	}
+	return (nullptr);
+}
+
+static size_t	idleConns(const ProxyPeer *p)
+{
+	return (std::count_if(g_conns.begin(), g_conns.end(), [p](ProxyConn *c) {
+		return c->peer == p && c->client == nullptr;
+	}));
+}
+
+/* Gives the client a connection to a server of the group, trying the
+ * others while they refuse it. */
+static ProxyConn	*attach(Endpoint *client, int qfd, ProxyGroup *g, const ProxyPeer *avoid)
+{
+	const std::string &key = client->handler.getOriginalPath();
+	for (size_t tries = 0; tries < g->peers.size(); tries++)
+	{
+		ProxyPeer *p = pickPeer(g, key, avoid);
+		if (p == nullptr)
+			break ;
+		ProxyConn *c = idleConn(p, qfd);
+		if (c != nullptr)
+			g_stats.reused++;
+		else
+			c = openConn(g, p, qfd);
+		if (c != nullptr)
+		{
+			c->client = client;
+			p->active++;
+			client->proxy = c;
+			return (c);
+		}
+		peerFailed(g, p);
+		avoid = p;
+	}
+	logError("proxy: no server left in " + g->name);
+	return (nullptr);
+}
+
+static void	detach(ProxyConn *c)
+{
+	if (c->client == nullptr)
+		return ;
+	c->client->proxy = nullptr;
+	c->client = nullptr;
+	c->peer->active--;
+}
+
+static bool	flushOut(ProxyConn *c)
+{
+	while (c->outOffset < c->out.size())
+	{
+		ssize_t sent = send(c->fd, c->out.data() + c->outOffset,
+				c->out.size() - c->outOffset, MSG_NOSIGNAL);
+		if (sent < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK);
+		c->outOffset += sent;
+	}
+	c->out.clear();
+	c->outOffset = 0;
+	return (true);
+}
+
+/* The client's request line and headers, minus those about its own
+ * connection. The body length is known by now: chunked bodies are read
+ * whole before the request goes out. */
+static std::string	requestHead(Endpoint *client)
+{
+	const HttpConnectionHandler &h = client->handler;
+	std::ostringstream head;
+	std::string forwardedFor = client->IP;
+	std::string contentLength;
+	bool chunked = false;
+
+	head << h.getMethod() << " " << h.getOriginalPath() << " HTTP/1.1\r\n";
+	for (const auto &[name, value] : h.getHeaders())
+	{
+		std::string key = toLower(name);
+		if (key == "content-length")
+			contentLength = value;
+		else if (key == "transfer-encoding")
+			chunked = true;
+		else if (key == "x-forwarded-for")
+			forwardedFor = value + ", " + forwardedFor;
+		else if (!isHopByHop(key) && key != "expect" && key != "x-forwarded-proto")
+			head << name << ": " << value << "\r\n";
+	}
+	if (chunked)
+		contentLength = std::to_string(client->cgiHandler.getPostData().size());
+	if (!contentLength.empty())
+		head << "Content-Length: " << contentLength << "\r\n";
+	head << "X-Forwarded-For: " << forwardedFor << "\r\n"
+		<< "X-Forwarded-Proto: " << (h.getTls() ? "https" : "http") << "\r\n"
+		<< "Connection: keep-alive\r\n\r\n";
+	return (head.str());
+}
+
+/* Retired groups nobody is connected through anymore */
+static void	sweepRetired()
+{
+	std::erase_if(g_retired, [](const auto &node) {
+		return std::none_of(g_conns.begin(), g_conns.end(),
+			[&node](ProxyConn *c) { return c->group == &node.mapped(); });
+	});
+}
+
+bool	proxyStart(Endpoint *client, int qfd, const std::string &target)
+{
+	if (!g_retired.empty())
+		sweepRetired();
+	ProxyConn *c = attach(client, qfd, groupFor(target), nullptr);
+	if (c == nullptr)
+		return (false);
+	g_stats.requests++;
+	c->out = requestHead(client);
+	c->replay = c->out;
+	proxySendBody(client, qfd);
+	return (true);
+}
+
+/* Moves the body the client sent so far to the server. A copy is kept
+ * for a retry elsewhere as long as it is small. */
+void	proxySendBody(Endpoint *client, int qfd)
+{
+	ProxyConn *c = client->proxy;
+	std::string data = client->cgiHandler.takePostData();
+	c->out += data;
+	if (c->replayable)
+	{
+		c->replay += data;
+		if (c->replay.size() > PROXY_REPLAY_MAX)
+		{
+			c->replayable = false;
+			std::string().swap(c->replay);
+		}
+	}
+	updateInterest(c, qfd);
+}
+
+/* The client went away, or its request failed. The connection is in
+ * the middle of an answer and cannot be reused. */
+void	proxyAbort(Endpoint *client, int qfd)
+{
+	ProxyConn *c = client->proxy;
+	if (c == nullptr)
+		return ;
+	detach(c);
+	closeConn(c, qfd);
+}
+
+/* A client caught up with its output: reading the server again */
+void	proxyResume(Endpoint *client, int qfd)
+{
+	ProxyConn *c = client->proxy;
+	if (c == nullptr || !c->paused)
+		return ;
+	c->paused = false;
+	updateInterest(c, qfd);
+}
+
+/* The connection broke or never came up. Before any answer, the request
+ * goes to another server if we still have all of it and sending it
+ * twice is harmless: it never got there, the server dropped a pooled
+ * connection, or the method is safe. */
+static void	connFailed(ProxyConn *c, int qfd)
+{
+	Endpoint *client = c->client;
+	ProxyGroup *g = c->group;
+	ProxyPeer *p = c->peer;
+	bool reused = c->reused;
+	bool retry = false;
+	std::string replay;
+
+	if (client != nullptr && !c->answered)
+	{
+		const std::string &method = client->handler.getMethod();
+		retry = c->replayable && (!c->connected || reused || method == "GET" || method == "HEAD");
+		if (!reused)
+			peerFailed(g, p);
+		replay.swap(c->replay);
+	}
+	if (client != nullptr)
+		logError("proxy: lost connection to " + p->address);
+	detach(c);
+	closeConn(c, qfd);
+	if (client == nullptr)
+		return ;
+	ProxyConn *next = retry ? attach(client, qfd, g, reused ? nullptr : p) : nullptr;
+	if (next == nullptr)
+	{
+		cgiFailed(client, qfd, 502);
+		return ;
+	}
+	g_stats.retried++;
+	next->out = replay;
+	next->replay = replay;
+	updateInterest(next, qfd);
+}
+
+/* The status line and headers of the answer, handed to the client as a
+ * CGI header block. */
+static HandlerStatus	parseHead(ProxyConn *c)
+{
+	size_t end = c->in.find("\r\n\r\n");
+	if (end == std::string::npos)
+		return (c->in.size() < PROXY_MAX_HEADER ? S_Again : S_Error);
+	std::istringstream lines(c->in.substr(0, end + 2));
+	c->in.erase(0, end + 4);
+
+	std::string line;
+	std::getline(lines, line);
+	if (!line.empty() && line.back() == '\r')
+		line.pop_back();
+	if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0)
+		return (S_Error);
+	int status = std::atoi(line.c_str() + 9);
+	if (status < 100 || status > 599)
+		return (S_Error);
+	if (status < 200)
+		return (parseHead(c)); /* 100 Continue and the like */
+
+	std::ostringstream cgi;
+	std::string contentLength;
+	bool chunked = false;
+	c->keepAlive = (line[7] == '1');
+	cgi << "Status: " << line.substr(9) << "\r\n";
+	while (std::getline(lines, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue ;
+		std::string name = line.substr(0, colon);
+		std::string value = line.substr(colon + 1);
+		value.erase(0, value.find_first_not_of(" \t"));
+		std::string key = toLower(name);
+		if (key == "connection")
+			c->keepAlive = toLower(value).find("close") == std::string::npos;
+		else if (key == "transfer-encoding")
+			chunked = toLower(value).find("chunked") != std::string::npos;
+		else if (key == "content-length")
+			contentLength = value;
+		else if (!isHopByHop(key))
+			cgi << name << ": " << value << "\r\n";
+	}
+	if (status == 204 || status == 304 || c->client->handler.getMethod() == "HEAD")
+	{
+		c->body = PB_NONE;
+		cgi << "Content-Length: 0\r\n";
+	}
+	else if (chunked)
+		c->body = PB_CHUNKED;
+	else if (!contentLength.empty())
+	{
+		c->body = PB_LENGTH;
+		c->bodyLeft = std::strtoull(contentLength.c_str(), nullptr, 10);
+		cgi << "Content-Length: " << c->bodyLeft << "\r\n";
+	}
+	else
+	{
+		c->body = PB_CLOSE;
+		c->keepAlive = false;
+	}
+	cgi << "\r\n";
+	c->client->handler.feedCgiOutput(cgi.str().data(), cgi.str().size());
+	c->peer->fails = 0;
+	return (S_Done);
+}
+
+/* Hands what came in of the body to the client, undoing the chunked
+ * encoding: the client gets its own framing. */
+static HandlerStatus	parseBody(ProxyConn *c)
+{
+	HttpConnectionHandler &h = c->client->handler;
+	while (true)
+	{
+		switch (c->body)
+		{
+			case PB_NONE:
+				return (S_Done);
+			case PB_CLOSE:
+				if (!c->in.empty())
+					h.feedCgiOutput(c->in.data(), c->in.size());
+				c->in.clear();
+				return (S_Again);
+			case PB_LENGTH:
+			case PB_CHUNK:
+			{
+				size_t n = std::min(c->bodyLeft, c->in.size());
+				if (n > 0)
+					h.feedCgiOutput(c->in.data(), n);
+				c->in.erase(0, n);
+				c->bodyLeft -= n;
+				if (c->bodyLeft > 0)
+					return (S_Again);
+				if (c->body == PB_LENGTH)
+					return (S_Done);
+				if (c->in.size() < 2)
+					return (S_Again);
+				if (c->in.compare(0, 2, "\r\n") != 0)
+					return (S_Error);
+				c->in.erase(0, 2);
+				c->body = PB_CHUNKED;
+				break ;
+			}
+			case PB_CHUNKED:
+			case PB_TRAILERS:
+			{
+				size_t eol = c->in.find("\r\n");
+				if (eol == std::string::npos)
+					return (c->in.size() < PROXY_MAX_HEADER ? S_Again : S_Error);
+				if (c->body == PB_TRAILERS)
+				{
+					c->in.erase(0, eol + 2);
+					if (eol == 0)
+						return (S_Done);
+					break ;
+				}
+				char *endp = nullptr;
+				size_t size = std::strtoull(c->in.c_str(), &endp, 16);
+				if (endp == c->in.c_str())
+					return (S_Error);
+				c->in.erase(0, eol + 2);
+				c->bodyLeft = size;
+				c->body = (size == 0) ? PB_TRAILERS : PB_CHUNK;
+				break ;
+			}
+		}
+	}
+}
+
+/* The answer is all in. The connection goes back to the pool if the
+ * server keeps it open and is done reading the request. Either way it
+ * is not ours anymore: the next request may have taken it already. */
+static void	finish(ProxyConn *c, int qfd)
+{
+	Endpoint *client = c->client;
+	detach(c);
+	bool keep = c->keepAlive && c->in.empty() && c->out.empty() && !c->group->retired
+		&& idleConns(c->peer) < c->group->keepalive;
+	c->reused = true;
+	c->paused = false;
+	c->answered = false;
+	c->headerDone = false;
+	c->body = PB_NONE;
+	c->bodyLeft = 0;
+	c->replayable = true;
+	std::string().swap(c->replay);
+	if (keep)
+		updateInterest(c, qfd);
+	else
+		closeConn(c, qfd);
+	cgiFinished(client, qfd, false);
+}
+
+/* Returns false if the connection is gone, or went on to other work */
+static bool	onInput(ProxyConn *c, int qfd, bool eof)
+{
+	Endpoint *client = c->client;
+	size_t before = client->handler.getCgiOutputBytes();
+	HandlerStatus status = c->headerDone ? S_Done : parseHead(c);
+	if (status == S_Done)
+	{
+		c->headerDone = true;
+		status = parseBody(c);
+	}
+	if (status == S_Again && eof)
+		status = (c->headerDone && c->body == PB_CLOSE) ? S_Done : S_Error;
+	if (client->handler.getCgiOutputBytes() != before && !cgiProduced(client, qfd))
+		return (false); /* Stopped, and the connection with it */
+	if (status == S_Error)
+	{
+		connFailed(c, qfd);
+		return (false);
+	}
+	if (status == S_Done)
+	{
+		finish(c, qfd);
+		return (false);
+	}
+	/* Like FastCGI, a slow client holds up its server connection */
+	if (client->handler.getResponse().size() > CGI_OUTPUT_HIGH_WATER)
+		c->paused = true;
+	return (true);
+}
+
+/* The server connection is readable or writable, or done connecting. */
+void	serveProxyConn(Endpoint *slot, int qfd)
+{
+	ProxyConn *c = slot->proxy;
+	assert(c != nullptr && c->slot == slot);
+
+	if (!c->connected)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		{
+			logError("proxy: cannot connect to " + c->peer->address);
+			connFailed(c, qfd);
+			return ;
+		}
+		c->connected = true;
+	}
+	if (!flushOut(c))
+	{
+		connFailed(c, qfd);
+		return ;
+	}
+	if (c->client == nullptr)
+	{
+		/* Pooled: readable means the server closed it */
+		char byte;
+		ssize_t n = recv(c->fd, &byte, 1, MSG_PEEK);
+		if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			closeConn(c, qfd);
+		return ;
+	}
+	if (!c->paused)
+	{
+		char buffer[PROXY_READ_SIZE];
+		ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			connFailed(c, qfd);
+			return ;
+		}
+		if (n > 0)
+		{
+			c->answered = true;
+			c->in.append(buffer, n);
+		}
+		if (n >= 0 && !onInput(c, qfd, n == 0))
+			return ;
+	}
+	updateInterest(c, qfd);
+}
+
+static void	closeConn(ProxyConn *c, int qfd)
+{
+	assert(c->client == nullptr);
+	releaseEndpoint(qfd, c->slot);
+	close(c->fd);
+	g_conns.erase(std::find(g_conns.begin(), g_conns.end(), c));
+	delete c;
+}
+
+/* Groups are built again from the new `upstream` blocks when next used.
+ * Requests on the old ones finish there, the connections are closed
+ * after them instead of pooled. */
+void	proxyReload(int qfd)
+{
+	std::vector<ProxyConn *> conns = g_conns;
+	for (ProxyConn *c : conns)
+		if (c->client == nullptr)
+			closeConn(c, qfd);
+	while (!g_groups.empty())
+	{
+		g_retired.push_back(g_groups.extract(g_groups.begin()));
+		g_retired.back().mapped().retired = true;
+	}
+	sweepRetired();
+}
+
+void	proxyCloseAll()
+{
+	for (ProxyConn *c : g_conns)
+	{
+		close(c->fd);
+		delete c;
+	}
+	g_conns.clear();
+}
+
+std::string	proxyStats()
+{
+	std::ostringstream out;
+	out << "proxy_requests " << g_stats.requests << "\n"
+		<< "proxy_reused " << g_stats.reused << "\n"
+		<< "proxy_retried " << g_stats.retried << "\n";
+	for (const auto &[name, g] : g_groups)
+		for (const ProxyPeer &p : g.peers)
+			out << "upstream " << name << " " << p.address
+				<< (isUp(&g, &p) ? " up" : " down")
+				<< " active " << p.active << " fails " << p.fails << "\n";
+	return (out.str());
+}
@@ -7,7 +7,7 @@ int	queue_create(void)
 	int	qfd;
 
 #ifdef __linux__
-	qfd = epoll_create1(0);
+	qfd = epoll_create1(EPOLL_CLOEXEC);
 	if (qfd < 0)
 	{
 		logDebug("Error: epoll_create1");
@@ -30,7 +30,7 @@ int	queue_add_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 {
 	assert(qfd >= 0);
 	assert(fd >= 0);
-	assert(t == READABLE || t == WRITABLE);
+	assert(t == READABLE || t == WRITABLE || t == IDLE || t == READWRITE);
 
 #ifdef __linux__
 	struct epoll_event	e;
@@ -42,6 +42,11 @@ int	queue_add_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 		case WRITABLE:
 			e.events |= EPOLLOUT;
 			break;
+		case READWRITE:
+			e.events |= EPOLLIN | EPOLLOUT;
+			break;
+		case IDLE:
+			break;
 	}
 	e.data.ptr = (void*) data;
 	if (epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &e) < 0)
@@ -51,18 +56,23 @@ int	queue_add_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 		return (-1);
 	}
 #else
-	struct kevent	e;
-	int events = 0;
+	struct kevent	e[2];
+	int n = 0;
 	switch (t) {
 		case READABLE:
-			events |= EVFILT_READ;
+			EV_SET(&e[n++], fd, EVFILT_READ, EV_ADD, 0, 0, (void *)data);
 			break;
 		case WRITABLE:
-			events |= EVFILT_WRITE;
+			EV_SET(&e[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, (void *)data);
 			break;
+		case READWRITE:
+			EV_SET(&e[n++], fd, EVFILT_READ, EV_ADD, 0, 0, (void *)data);
+			EV_SET(&e[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, (void *)data);
+			break;
+		case IDLE: /* Nothing to register until it is woken up */
+			return (0);
 	}
-	EV_SET(&e, fd, events, EV_ADD, 0, 0, (void *)data);
-	if (kevent(qfd, &e, 1, NULL, 0, NULL) < 0)
+	if (kevent(qfd, e, n, NULL, 0, NULL) < 0)
 	{
 		logError("Error adding kevent");
 		return (-1);
@@ -76,7 +86,7 @@ int	queue_mod_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 {
 	assert(qfd >= 0);
 	assert(fd >= 0);
-	assert(t == READABLE || t == WRITABLE);
+	assert(t == READABLE || t == WRITABLE || t == IDLE || t == READWRITE);
 
 #ifdef __linux__
 	struct epoll_event e;
@@ -90,6 +100,11 @@ int	queue_mod_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 		case WRITABLE:
 			e.events |= EPOLLOUT;
 			break;
+		case READWRITE:
+			e.events |= EPOLLIN | EPOLLOUT;
+			break;
+		case IDLE:
+			break;
 	}
 	e.data.ptr = (void *)data;
 	if (epoll_ctl(qfd, EPOLL_CTL_MOD, fd, &e) < 0)
@@ -110,6 +125,12 @@ int	queue_mod_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 			EV_SET(&ev[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, (void *)data);
 			EV_SET(&ev[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
 			break;
+		case READWRITE:
+			EV_SET(&ev[n++], fd, EVFILT_READ, EV_ADD, 0, 0, (void *)data);
+			EV_SET(&ev[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, (void *)data);
+			break;
+		case IDLE:
+			return (queue_rem_fd(qfd, fd));
 	}
 
 	if (kevent(qfd, ev, n, NULL, 0, NULL) < 0)
@@ -165,7 +186,8 @@ int	queue_wait(int qfd, queue_event *events, int events_count)
 	nready = epoll_wait(qfd, events, events_count, 1000);
 	if (nready < 0)
 	{
-		logDebug("Error: epoll_wait");
+		if (errno != EINTR)
+			logDebug("Error: epoll_wait");
 		return (-1);
 	}
 #else
@@ -0,0 +1,72 @@
+#include "Reload.hpp"
+#include "Parser.hpp"
+#include "Server.hpp"
+#include "CgiLimits.hpp"
+#include <atomic>
+#include <thread>
+
+extern volatile sig_atomic_t g_ShouldReload;
+
+static std::thread				g_worker;
+static std::atomic<bool>		g_parsed(false);
+static std::shared_ptr<Config>	g_next; // Written by the worker before g_parsed
+static std::string				g_error;
+
+static void	parseNext(std::string fileName)
+{
+	try {
+		g_next = parser(fileName);
+	}
+	catch (std::exception &e) {
+		g_error = e.what();
+	}
+	g_parsed.store(true, std::memory_order_release);
+}
+
+static void	apply(std::shared_ptr<Config> next, int qfd)
+{
+	if (!next)
+	{
+		logError("Reload failed, keeping the running configuration: " + g_error);
+		return ;
+	}
+	if (!updateListeners(*next, qfd))
+	{
+		logError("Reload failed, keeping the running configuration");
+		return ;
+	}
+	publishConfig(next);
+	cgiCgroupStart(next->cgiCgroup);
+	fcgiReload(qfd);
+	proxyReload(qfd);
+	cgiCacheFlush();
+	logInfo("Reloaded " + next->source + ", generation " + std::to_string(next->generation));
+}
+
+/* Called once per turn of the event loop */
+void	reloadPoll(int qfd)
+{
+	if (g_worker.joinable() && g_parsed.load(std::memory_order_acquire))
+	{
+		g_worker.join();
+		std::shared_ptr<Config> next = std::move(g_next);
+		g_next.reset();
+		apply(std::move(next), qfd);
+		g_error.clear();
+	}
+	if (g_ShouldReload && !g_worker.joinable())
+	{
+		g_ShouldReload = false;
+		g_parsed.store(false, std::memory_order_relaxed);
+		logInfo("Reloading " + currentConfig()->source);
+		g_worker = std::thread(parseNext, currentConfig()->source);
+	}
+}
+
+/* A parse still running is waited for and thrown away */
+void	reloadStop()
+{
+	if (g_worker.joinable())
+		g_worker.join();
+	g_next.reset();
+}
@@ -1,22 +1,31 @@
 #include "Server.hpp"
 #include "Queue.hpp"
+#include "Parser.hpp"
+#include "Reload.hpp"
+#include "Upgrade.hpp"
+#include "Tls.hpp"
+#include <unordered_set>
 
 extern sig_atomic_t g_ShouldStop;
+extern volatile sig_atomic_t g_ShouldDrain;
 
-static int	start_servers(const std::vector<Configuration>,Endpoint*,int,int*);
+static int	start_servers(const std::vector<Configuration>&,Endpoint*,int*);
 static Endpoint	*connectNewClient(Endpoint *, const Endpoint *, int, int *);
-static void	initEndpoint(int, std::string, std::string, Endpoint *);
-static bool endpointAlreadyBound(Endpoint *, int, std::string, std::string);
+static void	initEndpoint(int, const Configuration &, Endpoint *);
 static bool	isTimedOut(Endpoint *, int);
+static bool	isIdle(Endpoint *);
 
-int	run(const std::vector<Configuration> config)
+/* The endpoint table lives on run()'s stack, these let CGI code
+ * borrow slots from it for its pipes. */
+static Endpoint	*g_endpoints = nullptr;
+static int		*g_max_client_id = nullptr;
+static bool		g_draining = false; // Listeners are closed, we exit after the last client
+static uint64_t	g_drainDeadline_ms = 0; // Or then, at the latest
+
+int	run()
 {
-	assert(!config.empty());
-  if (config.size() > MAX_SERVERS)
-  {
-    std::cerr << "Error: webserv: Too many virtual hosts\n";
-    return 1;
-  }
+	std::shared_ptr<const Config> config = currentConfig();
+	assert(config && !config->servers.empty());
 
 	int	error = 1;
 
@@ -29,10 +38,24 @@ int	run(const std::vector<Configuration> config)
   {
     endpoints[n].state = C_DISCONNECTED;
     endpoints[n].kind = None;
+    endpoints[n].owner = nullptr;
+    endpoints[n].cgiStdin = nullptr;
+    endpoints[n].cgiStdout = nullptr;
+    endpoints[n].cgiExit = nullptr;
+    endpoints[n].fcgi = nullptr;
+    endpoints[n].fcgiId = 0;
+    endpoints[n].proxy = nullptr;
+    endpoints[n].cgiSlot = CGI_NO_SLOT;
+    endpoints[n].flight = nullptr;
+    endpoints[n].cgi_deadline_ms = 0;
   }
 
-	error = start_servers(config, endpoints, config.size(), &servers_num);
+	cgiCgroupStart(config->cgiCgroup);
+	error = start_servers(config->servers, endpoints, &servers_num);
+	config.reset(); /* Requests take theirs from currentConfig() */
 	int max_client_id = servers_num;
+	g_endpoints = endpoints;
+	g_max_client_id = &max_client_id;
 	if (error) goto cleanup;
 
 	/* Register all server sockets for read events */
@@ -45,31 +68,58 @@ int	run(const std::vector<Configuration> config)
 		}
 	}
 
+	fcgiStartPools(qfd);
+	upgradeReady();
+
 	queue_event events[QUEUE_MAX_EVENTS];
 	bzero(events, sizeof(events));
 
   try {
 	while (!g_ShouldStop) {
 		assert(g_ShouldStop == false);
+		if (g_ShouldDrain && !g_draining) {
+			logInfo("Shutting down once the open connections are done");
+			stopAccepting(qfd);
+		}
+		if (!g_draining)
+			reloadPoll(qfd);
+		upgradePoll(qfd);
+		reapKilledCgis();
+		cgiDispatch(qfd);
+		bool	clientsLeft = false;
 		for (Endpoint *conn = endpoints; conn <= endpoints + max_client_id; conn++) {
-      if (conn->state == C_MARKED_FOR_DISCONNECTION) {
+      if (conn->state == C_MARKED_FOR_DISCONNECTION
+          || (g_draining && isLiveClient(conn) && isIdle(conn))) {
         disconnectClient(conn, qfd);
         continue;
       }
+			clientsLeft = clientsLeft || isLiveClient(conn);
 			if (isLiveClient(conn) && isTimedOut(conn, qfd)) {
 				conn->state = C_TIMED_OUT;
 				watch(qfd, conn, WRITABLE);
 			}
 		}
 
+		if (g_draining && !clientsLeft) {
+			logInfo("Last connection done, exiting");
+			break;
+		}
+		if (g_draining && now_ms() >= g_drainDeadline_ms) {
+			logInfo("shutdown_timeout: closing the connections left");
+			break;
+		}
+
 		int nready = queue_wait(qfd, events, QUEUE_MAX_EVENTS);
+		if (nready < 0 && errno == EINTR) continue; /* A signal, the loop checks what it asked for */
 		if ((error = nready < 0) != 0) break;
 
 		for (int id = 0; id < nready; id++) {
 			Endpoint *conn = (Endpoint*)queue_event_get_data(&events[id]);
+			if (conn->kind == None) continue; /* Released earlier in this batch */
 			assert(conn->sockfd > 0);
 
-			if (queue_event_is_error(&events[id])) conn->state = C_MARKED_FOR_DISCONNECTION;
+			if (conn->kind == Client && queue_event_is_error(&events[id]))
+				conn->state = C_MARKED_FOR_DISCONNECTION;
 
 			queue_event_type event_type = queue_event_get_type(&events[id]);
 
@@ -78,6 +128,21 @@ int	run(const std::vector<Configuration> config)
 				case Client: serveConnection(conn, qfd, event_type);
 					break;
 
+				case CgiStdin: feedCgi(conn, qfd);
+					break;
+
+				case CgiStdout: drainCgi(conn, qfd);
+					break;
+
+				case CgiExit: reapCgi(conn, qfd);
+					break;
+
+				case Fcgi: serveFcgiConn(conn, qfd);
+					break;
+
+				case Upstream: serveProxyConn(conn, qfd);
+					break;
+
 				case Server: assert(event_type == READABLE);
 				 {
 					 Endpoint *client = connectNewClient(endpoints, conn, qfd, &max_client_id);
@@ -99,40 +164,61 @@ int	run(const std::vector<Configuration> config)
 cleanup:
   logDebug("⏼ Cleaning up...");
 	for (Endpoint *conn = endpoints; conn <= endpoints + max_client_id; conn++) {
-    if (conn->kind == None) continue;
+    if (conn->kind != Client && conn->kind != Server) continue; /* Pipes belong to their client */
     if (conn->kind == Client) { conn->cgiHandler.CgiResetObject(); }
 		if (conn->kind == Server || conn->state != C_DISCONNECTED ) {
       string kind = conn->kind == Server ? "server" : "client";
-			logDebug("Closing %s socket %s:%s (%d)", kind.c_str(), conn->IP, conn->port, conn->sockfd);
+			logDebug("Closing %s socket %s (%d)", kind.c_str(), conn->address, conn->sockfd);
 			assert(conn->sockfd > 0);
 			close(conn->sockfd);
 		}
 	}
+	reloadStop();
+	fcgiCloseAll();
+	proxyCloseAll();
+	killCgisNow();
+	cgiCgroupStop();
 	close(qfd);
+	g_endpoints = nullptr;
+	g_max_client_id = nullptr;
 	if (error)
 		return (1);
 	return (0);
 }
 
-static int	start_servers(const std::vector<Configuration> servers,
-		Endpoint *endpoints, int count_max, int *count)
+static int	start_servers(const std::vector<Configuration> &servers,
+		Endpoint *endpoints, int *count)
 {
 	assert(servers.size() > 0);
 	assert(endpoints != nullptr);
+	std::unordered_set<std::string>	bound;
 	*count = 0;
-	for (int i = 0; i < count_max; i++)
+	for (size_t i = 0; i < servers.size(); i++)
 	{
 		const std::string host = servers[i].getHost();
 		const std::string port = servers[i].getPort();
-		if (endpointAlreadyBound(endpoints, i, host, port))
+		if (!bound.insert(servers[i].getListenAddress()).second)
     {
       servers[i].printCompact();
       continue;
     }
-		int	sockfd = make_server_socket(host.data(), port.data());
+		if (*count == MAX_LISTENERS)
+		{
+			std::cerr << "Error: webserv: Too many listening addresses\n";
+			return (-1);
+		}
+		const ListenOptions &options = servers[i].getListenOptions();
+		int	sockfd = inheritedListener(servers[i].getListenAddress());
+		if (sockfd >= 0 && tune_listener(sockfd, options) < 0)
+		{
+			close(sockfd);
+			sockfd = -1;
+		}
+		else if (sockfd < 0)
+			sockfd = make_server_socket(host.data(), port.data(), options);
 		if (sockfd <= 0)
 			return (-1);
-		initEndpoint(sockfd, host, port, &endpoints[*count]);
+		initEndpoint(sockfd, servers[i], &endpoints[*count]);
 		servers[i].printCompact();
 		assert(endpoints[*count].kind == Server);
 		*count += 1;
@@ -147,10 +233,9 @@ static Endpoint	*connectNewClient(Endpoint *endpoints,
 	assert(endpoints != nullptr);
 	assert(server->sockfd > 0);
 
-	int i = 0;
-	while (endpoints[i].kind == Server && i < MAXCONNS)
-		i++;
-	while (i < MAXCONNS && endpoints[i].state != C_DISCONNECTED)
+	int i = 0; /* After a reload, listeners may be anywhere in the table */
+	while (i < MAXCONNS && (endpoints[i].kind == Server
+				|| endpoints[i].state != C_DISCONNECTED))
 		i++;
 	if (i == MAXCONNS) /* Uh oh, we need to kick someone out */
 	{
@@ -163,7 +248,7 @@ static Endpoint	*connectNewClient(Endpoint *endpoints,
 				uint64_t recv_header_duration_ms =
 					now_ms() - conn->began_sending_header_ms;
 				bool too_slow = recv_header_duration_ms > RECV_HEADER_TIMEOUT_MS;
-				if (conn->state == C_RECV_HEADER && too_slow)
+				if ((conn->state == C_RECV_HEADER || conn->state == C_TLS_HANDSHAKE) && too_slow)
 				{
 					disconnectClient(conn, qfd);
 					break;
@@ -175,10 +260,11 @@ static Endpoint	*connectNewClient(Endpoint *endpoints,
 	if (i == MAXCONNS) /* We definitely can't make a new connection right now */
 		return nullptr;
 	assert(i < MAXCONNS);
-	struct sockaddr client_addr;
+	struct sockaddr_storage client_addr;
 	socklen_t		client_addr_len = sizeof(client_addr);
 	memset(&client_addr, 0, client_addr_len);
-	int clientSocket = accept(server->sockfd, &client_addr, &client_addr_len);
+	int clientSocket = accept(server->sockfd,
+			reinterpret_cast<struct sockaddr *>(&client_addr), &client_addr_len);
 	if (clientSocket < 0 || socket_set_nonblocking(clientSocket) < 0)
 	{
 		if (clientSocket > 0)
@@ -186,16 +272,28 @@ static Endpoint	*connectNewClient(Endpoint *endpoints,
 		perror("client accept");
 		return nullptr;
 	}
+	tune_client(clientSocket, server->listen);
 	endpoints[i].state = C_RECV_HEADER;
 	endpoints[i].sockfd = clientSocket;
-	memcpy(endpoints[i].IP, server->IP, INET6_ADDRSTRLEN);
-	memcpy(endpoints[i].port, server->port, PORT_STRLEN);
+	memcpy(endpoints[i].address, server->address, LISTEN_ADDRSTRLEN);
+	peer_address(client_addr, endpoints[i].IP);
 	endpoints[i].handler.setClientSocket(clientSocket);
-	endpoints[i].handler.setIP(server->IP);
-	endpoints[i].handler.setPORT(server->port);
+	endpoints[i].handler.setAddress(server->address);
+	endpoints[i].handler.setRemoteAddr(endpoints[i].IP);
 	endpoints[i].began_sending_header_ms = now_ms();
 	endpoints[i].last_heard_from_ms = now_ms();
 	endpoints[i].kind = Client;
+	if (server->listen.ssl)
+	{
+		SSL *tls = tlsAccept(clientSocket, endpoints[i].address);
+		if (tls == nullptr)
+		{
+			disconnectClient(&endpoints[i], qfd);
+			return nullptr;
+		}
+		endpoints[i].handler.setTls(tls);
+		endpoints[i].state = C_TLS_HANDSHAKE;
+	}
 	logDebug("Connected client, socket: %d", clientSocket);
 
 	if (i > *max_client_id)
@@ -208,6 +306,28 @@ static bool	isTimedOut(Endpoint *conn, int qfd)
 	assert(conn->last_heard_from_ms != 0);
 
 	uint64_t idle_duration_ms = now_ms() - conn->last_heard_from_ms;
+	if (conn->state == C_CGI_QUEUED)
+		return (false); /* cgiDispatch() has its own timeout */
+	if (conn->state == C_FOLLOW_CGI)
+		return (false); /* Its leader times out for it */
+	if (conn->cgi_deadline_ms != 0 && now_ms() > conn->cgi_deadline_ms
+			&& hasCgiRunning(conn))
+	{
+		logDebug("cgi_timeout: %d", conn->sockfd);
+		countCgiTimeout();
+		cgiFailed(conn, qfd, 504);
+		return (false);
+	}
+	if (conn->state == C_TLS_HANDSHAKE) {
+		if (idle_duration_ms > CLIENT_TIMEOUT_THRESHOLD_MS)
+			disconnectClient(conn, qfd); /* No request to answer yet */
+		return (false);
+	}
+	if (conn->state == C_DRAIN_BODY) {
+		if (idle_duration_ms > LINGER_TIMEOUT_MS)
+			disconnectClient(conn, qfd);
+		return (false);
+	}
   /* if (idle_duration_ms > 10 * 1000) */
   /*   logDebug("%d idle for %zums, timing out soon", conn->sockfd, idle_duration_ms); */
 
@@ -215,7 +335,18 @@ static bool	isTimedOut(Endpoint *conn, int qfd)
       && conn->handler.getErrorCode() != 500
 			&&  idle_duration_ms > CLIENT_TIMEOUT_THRESHOLD_MS) {
 		conn->handler.setErrorCode(
-        conn->cgiHandler.cgiPid == 0 ? 408 : 500);
+        hasCgiRunning(conn) ? 500 : 408);
+		if (hasCgiRunning(conn))
+		{
+			if (conn->handler.cgiResponseStarted())
+			{
+				/* Too late for an error page, cut the stream instead */
+				disconnectClient(conn, qfd);
+				return (false);
+			}
+			stopCgi(conn, qfd);
+			conn->handler.setResponse(""); /* Drop partial CGI output */
+		}
 		logDebug("Soft timeout: %d", conn->sockfd);
 		return (true);
 	}
@@ -229,44 +360,204 @@ static bool	isTimedOut(Endpoint *conn, int qfd)
 	return (false);
 }
 
-static bool endpointAlreadyBound(Endpoint *endpoints, int count_to_check,
-		std::string IP, std::string port)
+/* Between two requests, or accepted and silent: nothing is lost by
+ * closing it. The wait gives a client that just connected time to send. */
+static bool	isIdle(Endpoint *conn)
 {
-	for (int i = 0; i < count_to_check; i++)
-	{
-		if (strcmp(endpoints[i].IP, IP.data()))
-			continue;
-		if (strcmp(endpoints[i].port, port.data()))
-			continue;
-		return (true);
-	}
-	return (false);
+	return ((conn->state == C_TLS_HANDSHAKE || (conn->state == C_RECV_HEADER
+				&& !conn->handler.hasRequestStarted()))
+		&& now_ms() - conn->last_heard_from_ms > RECV_HEADER_TIMEOUT_MS);
 }
 
 // We run this after creating the server socket,
 // so we already know the endpoint is valid.
-static void	initEndpoint(int sockfd, std::string host, std::string port,
-		Endpoint *endpoint)
+static void	initEndpoint(int sockfd, const Configuration &server, Endpoint *endpoint)
 {
 	assert(endpoint != nullptr);
+	const std::string address = server.getListenAddress();
+	assert(address.size() < LISTEN_ADDRSTRLEN); /* Checked by the parser */
 	endpoint->sockfd = sockfd;
+	endpoint->listen = server.getListenOptions();
 	endpoint->handler = HttpConnectionHandler();
 	endpoint->kind = Server;
-	int i = 0;
-	for (char c : host)
-		endpoint->IP[i++] = c;
-	endpoint->IP[i] = '\0';
-	i = 0;
-	for (char c : port)
-		endpoint->port[i++] = c;
-	endpoint->port[i] = '\0';
+	memcpy(endpoint->address, address.c_str(), address.size() + 1);
 	assert(endpoint->sockfd > 0);
-	assert(strlen(endpoint->port) >= 1);
-	assert(strlen(endpoint->IP) >= 7);
-	assert(strlen(endpoint->IP) <= 16);
+}
+
+static void	closeListener(int qfd, Endpoint *conn)
+{
+	logDebug("Closing server socket %s (%d)", conn->address, conn->sockfd);
+	queue_rem_fd(qfd, conn->sockfd);
+	close(conn->sockfd);
+	conn->sockfd = -1;
+	conn->kind = None;
+	conn->state = C_DISCONNECTED;
+}
+
+/* A reload dropped it: its socket file goes too. Not when we stop
+ * accepting, another process may be listening on it now. */
+static void	removeListener(int qfd, Endpoint *conn)
+{
+	if (strncmp(conn->address, "unix:", 5) == 0)
+		unlink(conn->address + 5);
+	closeListener(qfd, conn);
+}
+
+/* Opens the listeners the next configuration adds and closes those it
+ * drops, leaving the others and every accepted connection alone. All or
+ * nothing: if one cannot be opened, the ones just opened are closed again
+ * and the running configuration stays. Those kept take the new options,
+ * but for reuseport, which only a new socket can have. */
+bool	updateListeners(const Config &next, int qfd)
+{
+	assert(g_endpoints != nullptr);
+
+	std::unordered_map<std::string, const ListenOptions *>	wanted;
+	for (const Configuration &server : next.servers)
+		wanted.emplace(server.getListenAddress(), &server.getListenOptions());
+
+	std::unordered_set<std::string>	open;
+	int								listeners = 0;
+	for (int i = 0; i < MAXCONNS; i++)
+		if (g_endpoints[i].kind == Server)
+		{
+			open.insert(g_endpoints[i].address);
+			listeners += wanted.count(g_endpoints[i].address);
+		}
+
+	std::vector<Endpoint *>	added;
+	int						i = 0;
+	bool					ok = true;
+	for (const Configuration &server : next.servers)
+	{
+		const std::string host = server.getHost();
+		const std::string port = server.getPort();
+		if (!open.insert(server.getListenAddress()).second)
+			continue;
+		while (i < MAXCONNS && (g_endpoints[i].kind == Server
+					|| g_endpoints[i].state != C_DISCONNECTED))
+			i++;
+		if (listeners == MAX_LISTENERS || i == MAXCONNS)
+		{
+			logError("Too many listening addresses");
+			ok = false;
+			break ;
+		}
+		int	sockfd = make_server_socket(host.data(), port.data(), server.getListenOptions());
+		if (sockfd <= 0)
+		{
+			ok = false;
+			break ;
+		}
+		initEndpoint(sockfd, server, &g_endpoints[i]);
+		if (queue_add_fd(qfd, sockfd, READABLE, &g_endpoints[i]) < 0)
+		{
+			close(sockfd);
+			g_endpoints[i].kind = None;
+			ok = false;
+			break ;
+		}
+		added.push_back(&g_endpoints[i]);
+		listeners++;
+		if (i > *g_max_client_id)
+			*g_max_client_id = i;
+	}
+
+	for (int j = 0; j < MAXCONNS; j++)
+	{
+		Endpoint *conn = &g_endpoints[j];
+		if (conn->kind != Server)
+			continue;
+		bool isNew = std::find(added.begin(), added.end(), conn) != added.end();
+		auto want = wanted.find(conn->address);
+		bool dropped = want == wanted.end();
+		if (ok && !dropped && !isNew && !(conn->listen == *want->second))
+		{
+			conn->listen = *want->second;
+			tune_listener(conn->sockfd, conn->listen);
+		}
+		if (ok ? !dropped : !isNew)
+			continue;
+		removeListener(qfd, conn);
+	}
+	return (ok);
+}
+
+std::vector<int>	listeningSockets()
+{
+	std::vector<int>	fds;
+	for (int i = 0; i < MAXCONNS; i++)
+		if (g_endpoints[i].kind == Server)
+			fds.push_back(g_endpoints[i].sockfd);
+	return (fds);
+}
+
+/* Another process listens now, or we are shutting down. Clients between
+ * two requests are let go, the others once they have their response,
+ * or when shutdown_timeout runs out. */
+void	stopAccepting(int qfd)
+{
+	for (int i = 0; i < MAXCONNS; i++)
+	{
+		Endpoint *conn = &g_endpoints[i];
+		if (conn->kind == Server)
+			closeListener(qfd, conn);
+	}
+	g_draining = true;
+	g_drainDeadline_ms = now_ms() + currentConfig()->shutdownTimeout * 1000ULL;
+}
+
+bool	isDraining()
+{
+	return (g_draining);
 }
 
 int		watch(int qfd, Endpoint *conn, enum queue_event_type t)
 {
 	return (queue_mod_fd(qfd, conn->sockfd, t, conn));
 }
+
+/* Hands out a free slot of the endpoint table to a non-socket fd (a CGI
+ * pipe for now) and registers it. The fd stays owned by whoever opened it,
+ * the slot only tells the event loop where to dispatch. */
+Endpoint	*claimEndpoint(int qfd, enum Kind kind, int fd, Endpoint *owner,
+		enum queue_event_type t)
+{
+	assert(g_endpoints != nullptr);
+	assert(kind != Client && kind != Server);
+	assert(fd >= 0);
+
+	int i = 0;
+	while (i < MAXCONNS && (g_endpoints[i].kind == Server
+				|| g_endpoints[i].state != C_DISCONNECTED))
+		i++;
+	if (i == MAXCONNS)
+	{
+		logError("No endpoint left for CGI pipe");
+		return (nullptr);
+	}
+	Endpoint *e = &g_endpoints[i];
+	if (queue_add_fd(qfd, fd, t, e) < 0)
+		return (nullptr);
+	e->kind = kind;
+	e->state = C_EXEC_CGI;
+	e->sockfd = fd;
+	e->owner = owner;
+	e->last_heard_from_ms = now_ms();
+	if (i > *g_max_client_id)
+		*g_max_client_id = i;
+	return (e);
+}
+
+/* Call before closing the fd, the event queue still knows about it. */
+void	releaseEndpoint(int qfd, Endpoint *conn)
+{
+	assert(conn->kind != Client && conn->kind != Server);
+	queue_rem_fd(qfd, conn->sockfd);
+	conn->kind = None;
+	conn->state = C_DISCONNECTED;
+	conn->sockfd = -1;
+	conn->owner = nullptr;
+	conn->fcgi = nullptr;
+	conn->proxy = nullptr;
+}
@@ -1,10 +1,67 @@
 #include "Socket.hpp"
 #include "Logger.hpp"
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
-int	make_server_socket(const char *host, const char *port)
+/* Takes the place of a socket file nobody listens on any more, left by
+ * a server that was killed; one that is alive keeps it, and bind() fails */
+static void	removeStaleSocket(const struct sockaddr_un &addr)
+{
+	struct stat st;
+	if (lstat(addr.sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+		return ;
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe < 0)
+		return ;
+	if (connect(probe, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) < 0
+			&& errno == ECONNREFUSED)
+		unlink(addr.sun_path);
+	close(probe);
+}
+
+static int	make_unix_socket(const char *path, const ListenOptions &options)
+{
+	struct sockaddr_un	addr;
+	memset(&addr, 0, sizeof(addr));
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		logError(std::string("Socket path too long: ") + path);
+		return (-1);
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	removeStaleSocket(addr);
+
+	int insock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (insock < 0)
+	{
+		dprintf(2, "die: socket\n");
+		return (-1);
+	}
+	if (bind(insock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+	{
+		logError(std::string("Error binding to unix:") + path + ": " + strerror(errno));
+		close(insock);
+		return (-1);
+	}
+	if ((options.mode != 0 && chmod(path, options.mode) < 0)
+			|| socket_set_nonblocking(insock) < 0 || tune_listener(insock, options) < 0)
+	{
+		logError(std::string("Error listening on unix:") + path + ": " + strerror(errno));
+		close(insock);
+		unlink(path);
+		return (-1);
+	}
+	return (insock);
+}
+
+int	make_server_socket(const char *host, const char *port,
+		const ListenOptions &options)
 {
 	assert(host != NULL);
 	assert(port != NULL);
+	if (strncmp(port, "unix:", 5) == 0)
+		return (make_unix_socket(port + 5, options));
 
 	const struct addrinfo	hints = {
 		.ai_flags = AI_NUMERICSERV,
@@ -44,6 +101,14 @@ int	make_server_socket(const char *host, const char *port)
 			freeaddrinfo(addr);
 			return (-1);
 		}
+		if (options.reuseport
+				&& setsockopt(insock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+		{
+			dprintf(2, "die: setsockopt SO_REUSEPORT\n");
+			close(insock);
+			freeaddrinfo(addr);
+			return (-1);
+		}
 		if (bind(insock, p->ai_addr, p->ai_addrlen) < 0)
 		{
 			close(insock);
@@ -63,7 +128,7 @@ int	make_server_socket(const char *host, const char *port)
 		dprintf(2, "die: fcntl\n");
 		return (-1);
 	}
-	if (listen(insock, SOMAXCONN) < 0)
+	if (tune_listener(insock, options) < 0)
 	{
 		close(insock);
 		dprintf(2, "die: listen\n");
@@ -73,6 +138,54 @@ int	make_server_socket(const char *host, const char *port)
 	return (insock);
 }
 
+static void	setOption(int sock, int level, int name, int value, const char *what)
+{
+	if (setsockopt(sock, level, name, &value, sizeof(value)) < 0)
+		logError(std::string("setsockopt ") + what + ": " + strerror(errno));
+}
+
+/* Also for a socket that already listens, one inherited or kept over a
+ * reload: listen() again only changes its backlog. An option the system
+ * refuses is logged and left out. */
+int	tune_listener(int sock, const ListenOptions &options)
+{
+	if (options.rcvbuf > 0) /* Before listen(), for the window scale */
+		setOption(sock, SOL_SOCKET, SO_RCVBUF, options.rcvbuf, "SO_RCVBUF");
+	if (options.sndbuf > 0)
+		setOption(sock, SOL_SOCKET, SO_SNDBUF, options.sndbuf, "SO_SNDBUF");
+#ifdef __linux__
+	if (options.deferred)
+		setOption(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, 1, "TCP_DEFER_ACCEPT");
+	if (options.busyPoll > 0)
+		setOption(sock, SOL_SOCKET, SO_BUSY_POLL, options.busyPoll, "SO_BUSY_POLL");
+#endif
+	if (options.fastopen > 0)
+		setOption(sock, IPPROTO_TCP, TCP_FASTOPEN, options.fastopen, "TCP_FASTOPEN");
+	return (listen(sock, options.backlog));
+}
+
+/* Right after accept() */
+void	tune_client(int sock, const ListenOptions &options)
+{
+	if (options.tcpNodelay)
+		setOption(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	if (options.notsentLowat > 0)
+		setOption(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notsentLowat, "TCP_NOTSENT_LOWAT");
+}
+
+/* What accept() gave, as REMOTE_ADDR has it: "unix:" for a unix socket,
+ * as nginx does, which has no address for the client */
+void	peer_address(const struct sockaddr_storage &addr, char *ip)
+{
+	const void *raw = nullptr;
+	if (addr.ss_family == AF_INET)
+		raw = &reinterpret_cast<const struct sockaddr_in *>(&addr)->sin_addr;
+	else if (addr.ss_family == AF_INET6)
+		raw = &reinterpret_cast<const struct sockaddr_in6 *>(&addr)->sin6_addr;
+	if (raw == nullptr || inet_ntop(addr.ss_family, raw, ip, INET6_ADDRSTRLEN) == nullptr)
+		strcpy(ip, "unix:");
+}
+
 void	test_server_socket(int server)
 {
 	assert(server >= 0);
@@ -113,3 +226,40 @@ int	socket_set_nonblocking(int sock)
 		return (-1);
 	return (0);
 }
+
+/* "unix:/path", "/path" or "host:port", for connecting to a backend */
+bool	resolve_address(const std::string &address, struct sockaddr_storage *addr,
+			socklen_t *addrlen)
+{
+	std::string a = address;
+	if (a.compare(0, 5, "unix:") == 0)
+		a.erase(0, 5);
+	if (!a.empty() && a[0] == '/')
+	{
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+		if (a.size() >= sizeof(un.sun_path))
+			return (false);
+		un.sun_family = AF_UNIX;
+		memcpy(un.sun_path, a.c_str(), a.size());
+		memcpy(addr, &un, sizeof(un));
+		*addrlen = sizeof(un);
+		return (true);
+	}
+	size_t colon = a.rfind(':');
+	if (colon == std::string::npos)
+		return (false);
+	std::string host = a.substr(0, colon);
+	std::string port = a.substr(colon + 1);
+	struct addrinfo hints;
+	struct addrinfo *res = nullptr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || res == nullptr)
+		return (false);
+	memcpy(addr, res->ai_addr, res->ai_addrlen);
+	*addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return (true);
+}
@@ -0,0 +1,212 @@
+#include "Tls.hpp"
+#include "Parser.hpp"
+#include "Logger.hpp"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+constexpr unsigned char	SESSION_ID_CONTEXT[] = "webserv"; // Same for every server, SNI may switch
+
+static struct {
+	uint64_t	handshakes;
+	uint64_t	resumed; // From the cache or a ticket
+	uint64_t	failed;
+	uint64_t	kernel; // Handshakes after which the kernel encrypts
+} g_stats;
+
+static std::string	sslError()
+{
+	unsigned long e = ERR_get_error();
+	char buf[256];
+	ERR_error_string_n(e, buf, sizeof(buf));
+	ERR_clear_error();
+	return (e != 0 ? buf : strerror(errno));
+}
+
+/* SNI: the server block named by the client gets to show its certificate */
+static int	pickServer(SSL *ssl, int *alert, void *arg)
+{
+	(void)alert;
+	(void)arg;
+	const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	const char *address = static_cast<const char *>(SSL_get_app_data(ssl));
+	if (name == nullptr || address == nullptr)
+		return (SSL_TLSEXT_ERR_OK);
+	std::shared_ptr<const Config> config = currentConfig();
+	SSL_CTX *ctx = findVhost(*config, address, name)->getTlsContext().get();
+	if (ctx != nullptr && ctx != SSL_get_SSL_CTX(ssl))
+		SSL_set_SSL_CTX(ssl, ctx);
+	return (SSL_TLSEXT_ERR_OK);
+}
+
+/* Throws runtime_error if the certificate or its key cannot be used */
+std::shared_ptr<SSL_CTX>	tlsContext(const Configuration &server)
+{
+	std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+	if (!ctx)
+		throw std::runtime_error("SSL_CTX_new: " + sslError());
+	const std::string &cert = server.getSslCertificate();
+	const std::string &key = server.getSslCertificateKey();
+	if (SSL_CTX_use_certificate_chain_file(ctx.get(), cert.c_str()) != 1)
+		throw std::runtime_error("ssl_certificate " + cert + ": " + sslError());
+	if (SSL_CTX_use_PrivateKey_file(ctx.get(), key.c_str(), SSL_FILETYPE_PEM) != 1
+			|| SSL_CTX_check_private_key(ctx.get()) != 1)
+		throw std::runtime_error("ssl_certificate_key " + key + ": " + sslError());
+
+	SSL_CTX_set_min_proto_version(ctx.get(), TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx.get(), SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION
+		| SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF
+		| (server.getSslSessionTickets() ? 0 : SSL_OP_NO_TICKET));
+	/* What is left of a partial write is sent again from wherever the
+	 * response has moved to since */
+	SSL_CTX_set_mode(ctx.get(), SSL_MODE_ENABLE_PARTIAL_WRITE
+		| SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_session_id_context(ctx.get(), SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+	if (server.getSslSessionCache() == 0)
+		SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_OFF);
+	else
+	{
+		SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx.get(), server.getSslSessionCache());
+	}
+	SSL_CTX_set_timeout(ctx.get(), server.getSslSessionTimeout());
+	SSL_CTX_set_tlsext_servername_callback(ctx.get(), pickServer);
+	return (ctx);
+}
+
+/* A new connection on an ssl address, with the certificate of the
+ * address's first server until SNI says otherwise. `address` must live
+ * as long as the connection. */
+SSL	*tlsAccept(int fd, const char *address)
+{
+	std::shared_ptr<const Config> config = currentConfig();
+	SSL_CTX *ctx = findVhost(*config, address, "")->getTlsContext().get();
+	if (ctx == nullptr)
+	{
+		logError(std::string("No certificate for ") + address);
+		return (nullptr);
+	}
+	SSL *ssl = SSL_new(ctx); /* Holds on to ctx through a reload */
+	if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1)
+	{
+		logError("SSL_new: " + sslError());
+		SSL_free(ssl);
+		return (nullptr);
+	}
+	SSL_set_app_data(ssl, const_cast<char *>(address));
+	SSL_set_accept_state(ssl);
+	return (ssl);
+}
+
+/* S_Again with what to wait for, S_Done, or S_Error */
+HandlerStatus	tlsHandshake(SSL *ssl, enum queue_event_type *wait)
+{
+	ERR_clear_error();
+	int r = SSL_do_handshake(ssl);
+	if (r == 1)
+	{
+		g_stats.handshakes++;
+		g_stats.resumed += SSL_session_reused(ssl);
+		g_stats.kernel += tlsKernelSend(ssl);
+		return (S_Done);
+	}
+	switch (SSL_get_error(ssl, r))
+	{
+		case SSL_ERROR_WANT_READ:
+			*wait = READABLE;
+			return (S_Again);
+		case SSL_ERROR_WANT_WRITE:
+			*wait = WRITABLE;
+			return (S_Again);
+		default:
+			g_stats.failed++;
+			logDebug("TLS handshake failed: %s", sslError().c_str());
+			return (S_Error);
+	}
+}
+
+/* Like recv(): 0 once the client is done, -1 with EAGAIN until a whole
+ * record is in */
+ssize_t	tlsRecv(SSL *ssl, void *buf, size_t len)
+{
+	ERR_clear_error();
+	int n = SSL_read(ssl, buf, static_cast<int>(std::min(len, static_cast<size_t>(INT_MAX))));
+	if (n > 0)
+		return (n);
+	switch (SSL_get_error(ssl, n))
+	{
+		case SSL_ERROR_ZERO_RETURN:
+			return (0);
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return (-1);
+		default:
+			logDebug("SSL_read: %s", sslError().c_str());
+			errno = ECONNRESET;
+			return (-1);
+	}
+}
+
+/* Like send(). After EAGAIN, the same bytes have to be offered again. */
+ssize_t	tlsSend(SSL *ssl, const void *buf, size_t len)
+{
+	if (len == 0)
+		return (0);
+	ERR_clear_error();
+	int n = SSL_write(ssl, buf, static_cast<int>(std::min(len, static_cast<size_t>(INT_MAX))));
+	if (n > 0)
+		return (n);
+	switch (SSL_get_error(ssl, n))
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return (-1);
+		default:
+			logDebug("SSL_write: %s", sslError().c_str());
+			errno = EPIPE;
+			return (-1);
+	}
+}
+
+/* Decrypted but not read by us yet: no event will come for it */
+bool	tlsHasPending(SSL *ssl)
+{
+	return (SSL_pending(ssl) > 0);
+}
+
+/* The socket encrypts what is written to it, see Tls.hpp */
+bool	tlsKernelSend(SSL *ssl)
+{
+#ifndef OPENSSL_NO_KTLS
+	return (BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0);
+#else
+	(void)ssl;
+	return (false);
+#endif
+}
+
+/* Says goodbye if it can without waiting, and frees the connection */
+void	tlsClose(SSL *ssl)
+{
+	if (SSL_is_init_finished(ssl))
+	{
+		ERR_clear_error();
+		SSL_shutdown(ssl);
+	}
+	ERR_clear_error();
+	SSL_free(ssl);
+}
+
+std::string	tlsStats()
+{
+	return ("tls_handshakes " + std::to_string(g_stats.handshakes) + "\n"
+		+ "tls_resumed " + std::to_string(g_stats.resumed) + "\n"
+		+ "tls_failed " + std::to_string(g_stats.failed) + "\n"
+		+ "tls_kernel " + std::to_string(g_stats.kernel) + "\n");
+}
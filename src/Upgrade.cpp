@@ -0,0 +1,211 @@
+#include "Upgrade.hpp"
+#include "Server.hpp"
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+extern volatile sig_atomic_t g_ShouldUpgrade;
+extern char **environ;
+
+static char				**g_argv = nullptr;
+static std::vector<int>	g_inherited; // Not claimed by a listen address yet
+static int				g_notify = -1; // New process: pipe to the old one
+static int				g_pending = -1; // Old process: pipe from the new one, until it listens
+static pid_t			g_child = 0;
+
+/* Takes the sockets of LISTEN_FDS, if they are meant for us */
+void	upgradeInit(char **argv)
+{
+	g_argv = argv;
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	if (pid != nullptr && fds != nullptr && atol(pid) == getpid())
+	{
+		for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + atoi(fds); fd++)
+		{
+			int listening = 0;
+			socklen_t len = sizeof(listening);
+			if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0
+					|| !listening || socket_set_nonblocking(fd) < 0)
+			{
+				logError("LISTEN_FDS: " + std::to_string(fd) + " is not a listening socket");
+				continue ;
+			}
+			g_inherited.push_back(fd);
+		}
+	}
+	const char *notify = getenv("WEBSERV_UPGRADE_FD");
+	if (notify != nullptr && fcntl(atoi(notify), F_SETFD, FD_CLOEXEC) == 0)
+		g_notify = atoi(notify);
+	/* Not for CGI scripts, nor for a later upgrade */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	unsetenv("WEBSERV_UPGRADE_FD");
+}
+
+static bool	sameAddress(const struct sockaddr_storage &a, const struct sockaddr_storage &b)
+{
+	if (a.ss_family != b.ss_family)
+		return (false);
+	if (a.ss_family == AF_INET)
+	{
+		const struct sockaddr_in *x = reinterpret_cast<const struct sockaddr_in *>(&a);
+		const struct sockaddr_in *y = reinterpret_cast<const struct sockaddr_in *>(&b);
+		return (x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr);
+	}
+	if (a.ss_family == AF_UNIX)
+	{
+		const struct sockaddr_un *x = reinterpret_cast<const struct sockaddr_un *>(&a);
+		const struct sockaddr_un *y = reinterpret_cast<const struct sockaddr_un *>(&b);
+		return (strncmp(x->sun_path, y->sun_path, sizeof(x->sun_path)) == 0);
+	}
+	if (a.ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6 *x = reinterpret_cast<const struct sockaddr_in6 *>(&a);
+		const struct sockaddr_in6 *y = reinterpret_cast<const struct sockaddr_in6 *>(&b);
+		return (x->sin6_port == y->sin6_port
+				&& memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0);
+	}
+	return (false);
+}
+
+/* The inherited socket bound to "host:port" or "unix:/path", -1 if
+ * there is none */
+int	inheritedListener(const std::string &address)
+{
+	struct sockaddr_storage	want;
+	socklen_t				wantLen;
+	if (g_inherited.empty() || !resolve_address(address, &want, &wantLen))
+		return (-1);
+	for (auto it = g_inherited.begin(); it != g_inherited.end(); it++)
+	{
+		struct sockaddr_storage	have;
+		socklen_t				haveLen = sizeof(have);
+		if (getsockname(*it, reinterpret_cast<struct sockaddr *>(&have), &haveLen) == 0
+				&& sameAddress(have, want))
+		{
+			int fd = *it;
+			g_inherited.erase(it);
+			logDebug("Adopted socket %d for %s", fd, address.c_str());
+			return (fd);
+		}
+	}
+	return (-1);
+}
+
+/* Every listener is registered: the old process can stop accepting */
+void	upgradeReady()
+{
+	for (int fd : g_inherited)
+	{
+		logError("Closing inherited socket " + std::to_string(fd) + ", no listen address wants it");
+		close(fd);
+	}
+	g_inherited.clear();
+	if (g_notify < 0)
+		return ;
+	if (write(g_notify, "1", 1) != 1)
+		logError("Upgrade: cannot tell the old process");
+	close(g_notify);
+	g_notify = -1;
+}
+
+/* fork() and exec() the executable again, the listeners as fds 3 and up
+ * and the write end of `ready` after them. */
+static void	startUpgrade()
+{
+	if (isDraining())
+	{
+		logError("Upgrade: not while shutting down");
+		return ;
+	}
+	if (g_pending >= 0)
+	{
+		logError("Upgrade: already waiting for pid " + std::to_string(g_child));
+		return ;
+	}
+	int ready[2];
+	if (pipe(ready) < 0)
+		return ;
+	fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+	fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+	std::vector<int> fds = listeningSockets();
+	fds.push_back(ready[1]);
+	int first = LISTEN_FDS_START;
+	int last = first + static_cast<int>(fds.size()) - 1;
+
+	/* Everything the child needs is built before fork(): only system
+	 * calls between fork() and exec() */
+	std::vector<std::string> env;
+	for (char **e = environ; *e != nullptr; e++)
+		if (strncmp(*e, "LISTEN_", 7) != 0 && strncmp(*e, "WEBSERV_UPGRADE_FD=", 19) != 0)
+			env.push_back(*e);
+	env.push_back("LISTEN_FDS=" + std::to_string(fds.size() - 1));
+	env.push_back("WEBSERV_UPGRADE_FD=" + std::to_string(last));
+	char listenPid[32] = "LISTEN_PID=";
+	std::vector<char *> envp;
+	for (std::string &e : env)
+		envp.push_back(e.data());
+	envp.push_back(listenPid);
+	envp.push_back(nullptr);
+	std::vector<int> moved(fds.size());
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		/* Out of the way first, fds 3 and up may be any of them */
+		for (size_t i = 0; i < fds.size(); i++)
+			if ((moved[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, last + 1)) < 0)
+				_exit(127);
+		for (size_t i = 0; i < fds.size(); i++)
+			if (dup2(moved[i], first + i) < 0) /* Without FD_CLOEXEC */
+				_exit(127);
+		char digits[16];
+		int n = 0;
+		for (pid_t self = getpid(); self > 0; self /= 10)
+			digits[n++] = '0' + self % 10;
+		char *p = listenPid + strlen(listenPid);
+		while (n > 0)
+			*p++ = digits[--n];
+		*p = '\0';
+		execve(g_argv[0], g_argv, envp.data());
+		_exit(127);
+	}
+	close(ready[1]);
+	if (pid < 0)
+	{
+		close(ready[0]);
+		logError("Upgrade: fork failed");
+		return ;
+	}
+	fcntl(ready[0], F_SETFL, O_NONBLOCK);
+	g_pending = ready[0];
+	g_child = pid;
+	logInfo("Upgrade: started " + std::string(g_argv[0]) + ", pid " + std::to_string(pid));
+}
+
+/* Called once per turn of the event loop */
+void	upgradePoll(int qfd)
+{
+	if (g_ShouldUpgrade)
+	{
+		g_ShouldUpgrade = false;
+		startUpgrade();
+	}
+	if (g_pending < 0)
+		return ;
+	char c;
+	ssize_t n = read(g_pending, &c, 1);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return ;
+	close(g_pending);
+	g_pending = -1;
+	if (n == 1)
+	{
+		logInfo("Upgrade: pid " + std::to_string(g_child) + " took over, finishing the open connections");
+		stopAccepting(qfd);
+		return ;
+	}
+	logError("Upgrade: pid " + std::to_string(g_child) + " exited before listening, carrying on");
+	reapLater(g_child);
+}
@@ -0,0 +1,119 @@
+#include "Vhosts.hpp"
+#include "Configuration.hpp"
+#include "Logger.hpp"
+#include <sstream>
+#include <algorithm>
+
+void	VhostTrie::insert(const std::string &key, size_t server)
+{
+	uint32_t at = 0;
+	for (char c : key)
+	{
+		auto it = nodes[at].next.find(c);
+		if (it == nodes[at].next.end())
+		{
+			nodes.emplace_back();
+			it = nodes[at].next.emplace(c, nodes.size() - 1).first;
+		}
+		at = it->second;
+	}
+	nodes[at].server = std::min(nodes[at].server, server);
+}
+
+/* Walks `key` forwards (step 1) or backwards (step -1). Every pattern
+ * met on the way matches, the first declared of them wins. */
+size_t	VhostTrie::match(const char *key, size_t len, int step) const
+{
+	size_t best = SIZE_MAX;
+	uint32_t at = 0;
+	const char *c = (step > 0) ? key : key + len - 1;
+	for (size_t i = 0; i < len; i++, c += step)
+	{
+		auto it = nodes[at].next.find(*c);
+		if (it == nodes[at].next.end())
+			break ;
+		at = it->second;
+		best = std::min(best, nodes[at].server);
+	}
+	return (best);
+}
+
+static std::string	lower(std::string name)
+{
+	std::transform(name.begin(), name.end(), name.begin(),
+			[](unsigned char c) { return std::tolower(c); });
+	return (name);
+}
+
+/* Host names are case-insensitive, and "example.com." is the same name
+ * as "example.com" */
+static std::string	normalize(std::string name)
+{
+	name = lower(name);
+	if (name.size() > 1 && name.back() == '.')
+		name.pop_back();
+	return (name);
+}
+
+static void	addName(VhostTable &t, std::string name, size_t server)
+{
+	if (name.size() < 2 || (name.front() == '*' && name.back() == '*'))
+	{
+		if (name != "*" && !name.empty())
+			t.exact.emplace(normalize(name), server);
+		return ;
+	}
+	if (name.front() == '*')
+	{
+		std::string suffix = normalize(name.substr(1));
+		t.suffixes.insert(std::string(suffix.rbegin(), suffix.rend()), server);
+	}
+	else if (name.back() == '*')
+		t.prefixes.insert(lower(name.substr(0, name.size() - 1)), server);
+	else
+		t.exact.emplace(normalize(name), server);
+}
+
+void	VhostIndex::build(const std::vector<Configuration> &servers)
+{
+	_tables.clear();
+	for (size_t i = 0; i < servers.size(); i++)
+	{
+		auto [it, created] = _tables.try_emplace(servers[i].getListenAddress());
+		if (created)
+			it->second.defaultServer = i;
+		std::istringstream names(servers[i].getServerNames());
+		std::string name;
+		while (names >> name)
+			addName(it->second, name, i);
+	}
+}
+
+/* Index of the server block for a request to an address with this Host
+ * header, which may carry a port ("example.com:8080", "[::1]:8080") and
+ * a trailing dot. The first server overall if none listens there. */
+size_t	VhostIndex::find(const std::string &address, const std::string &host) const
+{
+	auto table = _tables.find(address);
+	if (table == _tables.end())
+	{
+		logError("No match for request address " + address + ", defaulting to servermap[0]");
+		return (0);
+	}
+	const VhostTable &t = table->second;
+	size_t end = host.size();
+	size_t colon = host.rfind(':');
+	if (colon != std::string::npos && host.find(']', colon) == std::string::npos)
+		end = colon;
+	std::string name = normalize(host.substr(0, end));
+	if (name.empty())
+		return (t.defaultServer);
+
+	auto exact = t.exact.find(name);
+	if (exact != t.exact.end())
+		return (exact->second);
+	size_t server = t.suffixes.match(name.data(), name.size(), -1);
+	if (server == SIZE_MAX)
+		server = t.prefixes.match(name.data(), name.size(), 1);
+	return (server != SIZE_MAX ? server : t.defaultServer);
+}
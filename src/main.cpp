@@ -14,24 +14,55 @@
 #include "Server.hpp"
 #include "Queue.hpp"
 #include "Logger.hpp"
+#include "ConfigSnapshot.hpp"
+#include "Parser.hpp"
+#include "Upgrade.hpp"
+#include "CgiLimits.hpp"
 
 volatile sig_atomic_t g_ShouldStop = false;
+volatile sig_atomic_t g_ShouldReload = false;
+volatile sig_atomic_t g_ShouldUpgrade = false;
+volatile sig_atomic_t g_ShouldDrain = false;
 static void stop(int sig) { (void)sig; g_ShouldStop = true; }
+/* Finish the open connections first, a second signal does not wait */
+static void drain(int sig) { (void)sig; if (g_ShouldDrain) g_ShouldStop = true; g_ShouldDrain = true; }
+static void reload(int sig) { (void)sig; g_ShouldReload = true; }
+static void upgrade(int sig) { (void)sig; g_ShouldUpgrade = true; }
 static void handlesignals(void(*hdl)(int));
 
-std::vector<Configuration> serverMap;
-
-std::vector<Configuration> parser(std::string fileName);
-
 int	main(int argc, char **argv)
 {
+	/* Started again by spawnCgi() in front of a script, see CgiLimits.hpp */
+	if (argc >= 2 && strcmp(argv[1], CGI_LIMITS_ARG) == 0)
+		return (runLimited(argc, argv));
 	handlesignals(stop);
 
-	string inputConf;
-	argc == 2 ? inputConf = argv[1] : inputConf = "complete.conf";
+	/* webserv [[-c] file] [-o snapshot] */
+	string inputConf = "complete.conf";
+	string snapshot;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:o:")) != -1)
+	{
+		if (opt == 'c')
+			inputConf = optarg;
+		else if (opt == 'o')
+			snapshot = optarg;
+		else
+			return 1;
+	}
+	if (optind < argc)
+		inputConf = argv[optind];
 
 	try {
-		serverMap = parser(inputConf);
+		std::shared_ptr<Config> config = parser(inputConf);
+		if (!snapshot.empty())
+		{
+			saveSnapshot(snapshot, *config);
+			std::cout << "webserv: " << inputConf << " compiled to " << snapshot << std::endl;
+			return 0;
+		}
+		publishConfig(config);
+		upgradeInit(argv);
 	}
 	catch (std::exception &e) {
 		std::cerr << e.what() << std::endl;
@@ -39,7 +70,7 @@ int	main(int argc, char **argv)
 	}
 	
   if (g_ShouldStop) return (0);
-	int status = run(serverMap);
+	int status = run();
 	return (status);
 }
 
@@ -51,8 +82,12 @@ static void handlesignals(void(*hdl)(int))
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = hdl;
 	sigemptyset(&sa.sa_mask);
-	sigaction(SIGTERM, &sa, nullptr);
-	sigaction(SIGHUP, &sa, nullptr);
 	sigaction(SIGINT, &sa, nullptr);
+	sa.sa_handler = drain; /* Graceful, up to shutdown_timeout */
+	sigaction(SIGTERM, &sa, nullptr);
 	sigaction(SIGQUIT, &sa, nullptr);
+	sa.sa_handler = reload; /* Read the configuration again, see Reload.hpp */
+	sigaction(SIGHUP, &sa, nullptr);
+	sa.sa_handler = upgrade; /* Start a new binary on our sockets, see Upgrade.hpp */
+	sigaction(SIGUSR2, &sa, nullptr);
 }
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Tiny FastCGI responder standing in for php-fpm when testing `fastcgi_pass`.
+
+Runs the requested SCRIPT_FILENAME in-process (Python scripts only), with
+the CGI environment in os.environ and the request body on stdin, and sends
+back what it prints. Keeps connections open and, unless --no-mpx is given,
+takes several requests at once on one connection.
+
+Usage:
+    python3 test/fcgi_standin.py 127.0.0.1:9009
+    python3 test/fcgi_standin.py /tmp/webserv-fcgi.sock --no-mpx
+"""
+
+import io
+import os
+import runpy
+import socket
+import struct
+import sys
+import threading
+
+BEGIN_REQUEST, ABORT_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 2, 3, 4, 5, 6
+GET_VALUES, GET_VALUES_RESULT = 9, 10
+KEEP_CONN = 1
+
+script_lock = threading.Lock()  # os.environ and sys.stdout are process-wide
+
+
+def record(kind, req_id, content=b""):
+    out = b""
+    for off in range(0, max(len(content), 1), 65535):
+        chunk = content[off:off + 65535]
+        pad = -len(chunk) % 8
+        out += struct.pack("!BBHHBx", 1, kind, req_id, len(chunk), pad) + chunk + b"\0" * pad
+    return out
+
+
+def pairs(data):
+    out, off = {}, 0
+    while off < len(data):
+        lengths = []
+        for _ in range(2):
+            if data[off] & 0x80:
+                lengths.append(struct.unpack("!I", data[off:off + 4])[0] & 0x7fffffff)
+                off += 4
+            else:
+                lengths.append(data[off])
+                off += 1
+        name = data[off:off + lengths[0]].decode()
+        value = data[off + lengths[0]:off + lengths[0] + lengths[1]].decode()
+        out[name] = value
+        off += lengths[0] + lengths[1]
+    return out
+
+
+def encode_pair(name, value):
+    return bytes([len(name), len(value)]) + name.encode() + value.encode()
+
+
+def run_script(params, body):
+    stdout = io.StringIO()
+    with script_lock:
+        saved = (dict(os.environ), sys.stdout, sys.stdin)
+        os.environ.update(params)
+        sys.stdout = stdout
+        sys.stdin = io.TextIOWrapper(io.BytesIO(body))
+        status = 0
+        try:
+            runpy.run_path(params.get("SCRIPT_FILENAME", ""), run_name="__main__")
+        except SystemExit as e:
+            status = e.code if isinstance(e.code, int) else 1
+        except Exception as e:  # pylint: disable=broad-except
+            print(f"Status: 500\r\n\r\n{e}", file=stdout)
+        finally:
+            os.environ.clear()
+            os.environ.update(saved[0])
+            sys.stdout, sys.stdin = saved[1], saved[2]
+    return stdout.getvalue().encode(), status
+
+
+def serve(conn, multiplex):
+    requests = {}
+    write_lock = threading.Lock()
+    buf = b""
+
+    def respond(req_id, req):
+        output, status = run_script(req["params"], req["stdin"])
+        with write_lock:
+            conn.sendall(record(STDOUT, req_id, output) + record(STDOUT, req_id)
+                         + record(END_REQUEST, req_id, struct.pack("!IB3x", status, 0)))
+            if not req["keep"]:
+                conn.shutdown(socket.SHUT_RDWR)
+
+    while True:
+        data = conn.recv(65536)
+        if not data:
+            break
+        buf += data
+        while len(buf) >= 8:
+            _, kind, req_id, length, pad = struct.unpack("!BBHHBx", buf[:8])
+            if len(buf) < 8 + length + pad:
+                break
+            content, buf = buf[8:8 + length], buf[8 + length + pad:]
+            if kind == GET_VALUES:
+                wanted = pairs(content)
+                reply = b"".join(encode_pair(name, "1" if multiplex else "0")
+                                 for name in wanted if name == "FCGI_MPXS_CONNS")
+                with write_lock:
+                    conn.sendall(record(GET_VALUES_RESULT, 0, reply))
+            elif kind == BEGIN_REQUEST:
+                flags = content[2]
+                requests[req_id] = {"params": b"", "stdin": b"", "keep": flags & KEEP_CONN}
+            elif kind == PARAMS and req_id in requests:
+                if content:
+                    requests[req_id]["params"] += content
+                else:
+                    requests[req_id]["params"] = pairs(requests[req_id]["params"])
+            elif kind == STDIN and req_id in requests:
+                if content:
+                    requests[req_id]["stdin"] += content
+                    continue
+                req = requests.pop(req_id)
+                if multiplex:
+                    threading.Thread(target=respond, args=(req_id, req), daemon=True).start()
+                else:
+                    respond(req_id, req)
+            elif kind == ABORT_REQUEST and req_id in requests:
+                requests.pop(req_id)
+                with write_lock:
+                    conn.sendall(record(END_REQUEST, req_id, struct.pack("!IB3x", 0, 0)))
+    conn.close()
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        sys.exit(1)
+    address, multiplex = sys.argv[1], "--no-mpx" not in sys.argv
+    if address.startswith("unix:"):
+        address = address[5:]
+    if address.startswith("/"):
+        if os.path.exists(address):
+            os.unlink(address)
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        server.bind(address)
+    else:
+        host, port = address.rsplit(":", 1)
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind((host, int(port)))
+    server.listen(64)
+    while True:
+        conn, _ = server.accept()
+        threading.Thread(target=serve, args=(conn, multiplex), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Tiny HTTP/1.1 backend standing in for an app server when testing
+`proxy_pass`.
+
+Answers every request with who it is and what it got: its name, the
+method, the path, X-Forwarded-For and -Proto and the body, over keep-alive
+connections. `?chunked` in the query gets the answer chunked, `?slow`
+gets it after half a second.
+
+Usage:
+    python3 test/http_standin.py 127.0.0.1:9101 [name]
+    python3 test/http_standin.py /tmp/webserv-http.sock [name]
+"""
+
+import os
+import socket
+import socketserver
+import sys
+import time
+from http.server import BaseHTTPRequestHandler
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def answer(self):
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length) if length else b""
+        if "slow" in self.path:
+            time.sleep(0.5)
+        text = (f"backend {self.server.name}\n"
+                f"method {self.command}\n"
+                f"path {self.path}\n"
+                f"forwarded {self.headers.get('X-Forwarded-For', '')}\n"
+                f"proto {self.headers.get('X-Forwarded-Proto', '')}\n"
+                f"length {len(body)}\n").encode() + body
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        if "chunked" in self.path:
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            for off in range(0, len(text), 7):
+                part = text[off:off + 7]
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(part), part))
+            self.wfile.write(b"0\r\n\r\n")
+        else:
+            self.send_header("Content-Length", str(len(text)))
+            self.end_headers()
+            self.wfile.write(text)
+
+    do_GET = do_POST = do_DELETE = answer
+
+    def log_message(self, format, *args):  # pylint: disable=redefined-builtin
+        pass
+
+
+class UnixServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+    def get_request(self):
+        conn, _ = super().get_request()
+        return conn, ("unix", 0)
+
+
+class TcpServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        sys.exit(1)
+    address = sys.argv[1]
+    if address.startswith("unix:"):
+        address = address[5:]
+    if address.startswith("/"):
+        if os.path.exists(address):
+            os.unlink(address)
+        server = UnixServer(address, Handler)
+    else:
+        host, port = address.rsplit(":", 1)
+        server = TcpServer((host, int(port)), Handler)
+        server.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    server.name = sys.argv[2] if len(sys.argv) > 2 else sys.argv[1]
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()